@@ -0,0 +1,493 @@
+//This module implements encrypted archives: many files packed into a single encrypted file, with an index that says
+//where each of them is, so that any member can be extracted on its own without decrypting the others.
+//Every member is encrypted in CTR mode under the round keys of the archive and an IV of its own, so its keystream
+//only depends on its position within the member: members can be written and read at the same time by different
+//threads, and a member is read with a single seek. The index (name, offset, length and IV of every member) is encrypted
+//too, with a fresh IV every time it's written, and it's found from the footer at the end of the file.
+//Like in batch mode, members bigger than BATCH_SPLIT_SIZE are processed one at a time by all the threads, the smaller
+//ones many at a time, one per thread.
+//Adding files to an archive writes them after the end of the file and then writes the new index after them: the old
+//index is left in place until the new one is complete, so an interrupted pack leaves the archive as it was.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/stat.h"
+#include "sys/time.h"
+#include "common.h"
+#include "utils.h"
+#include "block.h"
+#include "feistel.h"
+#include "stats.h"
+#include "batch.h"
+#include "archive.h"
+#include "omp.h"
+
+#define ARCHIVE_HEADER_SIZE (HEADER_BLOCKS * BLOCKSIZE)
+//piece of a member read at a time by the threads that process the small ones
+#define ARCHIVE_PIECE 1048576
+
+char * const * archive_members = NULL;
+int archive_nmembers = 0;
+
+typedef struct archive {
+	int fd;
+	block header[HEADER_BLOCKS];
+	unsigned char round_keys[NROUND][KEYSIZE];
+	archive_entry * entries;
+	unsigned long nentries;
+	//where the members added next are written
+	unsigned long data_end;
+}archive;
+
+//Encrypts (or decrypts, it's the same operation) in place len bytes of a member, which start at block number first of it.
+//The counter of every block is the IV of the member with the block number xored in its left half.
+static void archive_ctr(const archive * ar, const block * iv, unsigned char * buf, const unsigned long len, const unsigned long first)
+{
+	unsigned long nblocks = (len + BLOCKSIZE - 1) / BLOCKSIZE;
+
+	#pragma omp parallel for schedule(static)
+	for (unsigned long i = 0; i < nblocks; i++)
+	{
+		block counter = *iv;
+		unsigned char keystream[BLOCKSIZE];
+		unsigned long n = first + i;
+		unsigned long end = (len - i * BLOCKSIZE < BLOCKSIZE) ? len - i * BLOCKSIZE : BLOCKSIZE;
+
+		for (int j = 0; j < BLOCKSIZE/2; j++)
+			counter.left[j] ^= (n >> (8 * j)) & 0xff;
+		process_block(keystream, counter.left, counter.right, ar->round_keys);
+		for (unsigned long j = 0; j < end; j++)
+			buf[i * BLOCKSIZE + j] ^= keystream[j];
+	}
+}
+
+//Copies the member described by entry from in_fd (starting at in_offset) to out_fd (starting at out_offset) through its
+//keystream, size bytes at a time: from the plaintext file to the archive when packing, the other way round when extracting.
+//buf must be size bytes long, and size a multiple of BLOCKSIZE. Returns -1 in case of error.
+static int archive_copy(const archive * ar, const archive_entry * entry, const int in_fd, const unsigned long in_offset,
+	const int out_fd, const unsigned long out_offset, unsigned char * buf, const unsigned long size)
+{
+	for (unsigned long pos = 0; pos < entry->length; pos += size)
+	{
+		unsigned long n = (entry->length - pos < size) ? entry->length - pos : size;
+
+		if (pread(in_fd, buf, n, in_offset + pos) != n)
+			return -1;
+		archive_ctr(ar, &entry->iv, buf, n, pos / BLOCKSIZE);
+		if (pwrite(out_fd, buf, n, out_offset + pos) != n)
+			return -1;
+	}
+	return 0;
+}
+
+//Creates an empty archive at path (an existing file is replaced). Returns -1 if the file can't be written.
+static int archive_create(archive * ar, const char * path, const char * key)
+{
+	memset(ar, 0, sizeof(archive));
+	create_nonce(&ar->header[0]);
+	create_nonce(&ar->header[1]);
+	create_key_check(&ar->header[2], key, &ar->header[0]);
+	ar->header[2].right[HEADER_FLAGS] |= FLAG_ARCHIVE;
+
+	ar->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (ar->fd == -1)
+		return -1;
+	if (pwrite(ar->fd, ar->header, ARCHIVE_HEADER_SIZE, 0) != ARCHIVE_HEADER_SIZE)
+	{
+		close(ar->fd);
+		return -1;
+	}
+
+	double kdf_start = stats_clock();
+	schedule_key(ar->round_keys, key, (unsigned char *)&ar->header[0], header_iterations(ar->header));
+	stats_record(stage_kdf, kdf_start);
+	ar->data_end = ARCHIVE_HEADER_SIZE;
+	return 0;
+}
+
+static void archive_close(archive * ar)
+{
+	close(ar->fd);
+	free(ar->entries);
+	memset(ar, 0, sizeof(archive));
+}
+
+//Opens the archive at path and reads its index, for reading and writing if writable is true.
+//Returns -1 if it can't be opened, -2 if it's not an archive (or the index is damaged) and -3 if the key is wrong.
+static int archive_open(archive * ar, const char * path, const char * key, const bool writable)
+{
+	struct stat info;
+	block footer[2];
+	unsigned long index_size, index_offset;
+
+	memset(ar, 0, sizeof(archive));
+	ar->fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (ar->fd == -1)
+		return -1;
+
+	if (fstat(ar->fd, &info) == -1 || info.st_size < ARCHIVE_HEADER_SIZE + ARCHIVE_FOOTER_SIZE
+		|| pread(ar->fd, ar->header, ARCHIVE_HEADER_SIZE, 0) != ARCHIVE_HEADER_SIZE || !has_key_check(&ar->header[2])
+		|| !(ar->header[2].right[HEADER_FLAGS] & FLAG_ARCHIVE))
+	{
+		close(ar->fd);
+		return -2;
+	}
+	if (verify_key_check(ar->header, key) == -1)
+	{
+		close(ar->fd);
+		return -3;
+	}
+
+	double kdf_start = stats_clock();
+	schedule_key(ar->round_keys, key, (unsigned char *)&ar->header[0], header_iterations(ar->header));
+	stats_record(stage_kdf, kdf_start);
+
+	//the footer gives the IV and the number of entries of the index, which sits right before it
+	if (pread(ar->fd, footer, ARCHIVE_FOOTER_SIZE, info.st_size - ARCHIVE_FOOTER_SIZE) != ARCHIVE_FOOTER_SIZE
+		|| memcmp(footer[1].right, ARCHIVE_MAGIC, BLOCKSIZE/2) != 0)
+	{
+		archive_close(ar);
+		return -2;
+	}
+	for (int i = BLOCKSIZE/2 - 1; i >= 0; i--)
+		ar->nentries = (ar->nentries << 8) | footer[1].left[i];
+
+	index_size = ar->nentries * sizeof(archive_entry);
+	if (ar->nentries > (info.st_size - ARCHIVE_HEADER_SIZE - ARCHIVE_FOOTER_SIZE) / sizeof(archive_entry))
+	{
+		archive_close(ar);
+		return -2;
+	}
+	index_offset = info.st_size - ARCHIVE_FOOTER_SIZE - index_size;
+
+	ar->entries = malloc(index_size > 0 ? index_size : 1);
+	if (pread(ar->fd, ar->entries, index_size, index_offset) != index_size)
+	{
+		archive_close(ar);
+		return -2;
+	}
+	archive_ctr(ar, &footer[0], (unsigned char *)ar->entries, index_size, 0);
+
+	//a wrong index would send the extraction anywhere in the file
+	for (unsigned long e = 0; e < ar->nentries; e++)
+		if (ar->entries[e].offset < ARCHIVE_HEADER_SIZE || ar->entries[e].offset > index_offset
+			|| ar->entries[e].length > index_offset - ar->entries[e].offset
+			|| memchr(ar->entries[e].name, '\0', ARCHIVE_NAME_SIZE) == NULL)
+		{
+			archive_close(ar);
+			return -2;
+		}
+
+	ar->data_end = info.st_size;
+	return 0;
+}
+
+//Opens the archive, printing the reason if it can't be opened. Returns -1 in case of error.
+static int open_archive(archive * ar, const char * path, const char * key, const bool writable)
+{
+	switch (archive_open(ar, path, key, writable))
+	{
+		case -1:
+			exit_message(1, "Error in opening files!");
+			return -1;
+		case -2:
+			exit_message(1, "The file is not an archive, or its index is damaged!");
+			return -1;
+		case -3:
+			exit_message(1, "Wrong key!");
+			return -1;
+	}
+	return 0;
+}
+
+//Encrypts the index with a new IV and writes it at offset, followed by the footer. Returns -1 in case of error.
+static int archive_write_index(const archive * ar, const unsigned long offset)
+{
+	unsigned long index_size = ar->nentries * sizeof(archive_entry);
+	unsigned char * index = malloc(index_size > 0 ? index_size : 1);
+	block footer[2];
+	int ret = 0;
+
+	create_nonce(&footer[0]);
+	for (int i = 0; i < BLOCKSIZE/2; i++)
+		footer[1].left[i] = (ar->nentries >> (8 * i)) & 0xff;
+	memcpy(footer[1].right, ARCHIVE_MAGIC, BLOCKSIZE/2);
+
+	memcpy(index, ar->entries, index_size);
+	archive_ctr(ar, &footer[0], index, index_size, 0);
+	if (pwrite(ar->fd, index, index_size, offset) != index_size
+		|| pwrite(ar->fd, footer, ARCHIVE_FOOTER_SIZE, offset + index_size) != ARCHIVE_FOOTER_SIZE
+		|| ftruncate(ar->fd, offset + index_size + ARCHIVE_FOOTER_SIZE) == -1)
+		ret = -1;
+
+	free(index);
+	return ret;
+}
+
+//Returns the name a file is stored under: the last component of its path
+static const char * member_name(const char * path)
+{
+	const char * slash = strrchr(path, '/');
+	return slash != NULL ? slash + 1 : path;
+}
+
+//Copies the members listed in selected (indexes into the entries of the archive) between the archive and their files,
+//the big ones one at a time with all the threads, then the small ones in parallel. paths holds the file of every
+//selected member, status receives -1 for the ones that failed. data must be at least BUFSIZE bytes long.
+static void copy_members(const archive * ar, const unsigned long * selected, char * const * paths, int * status,
+	const unsigned long count, const bool packing, unsigned char * data)
+{
+	double kernel_start = stats_clock();
+
+	for (unsigned long m = 0; m < count; m++)
+	{
+		const archive_entry * entry = &ar->entries[selected[m]];
+		if (entry->length < BATCH_SPLIT_SIZE)
+			continue;
+
+		int fd = packing ? open(paths[m], O_RDONLY) : open(paths[m], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+		{
+			status[m] = -1;
+			continue;
+		}
+		if (packing)
+			status[m] = archive_copy(ar, entry, fd, 0, ar->fd, entry->offset, data, BUFSIZE);
+		else
+			status[m] = archive_copy(ar, entry, ar->fd, entry->offset, fd, 0, data, BUFSIZE);
+		close(fd);
+	}
+
+	#pragma omp parallel
+	{
+		unsigned char * piece = malloc(ARCHIVE_PIECE);
+
+		#pragma omp for schedule(dynamic)
+		for (unsigned long m = 0; m < count; m++)
+		{
+			const archive_entry * entry = &ar->entries[selected[m]];
+			if (entry->length >= BATCH_SPLIT_SIZE)
+				continue;
+
+			int fd = packing ? open(paths[m], O_RDONLY) : open(paths[m], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd == -1)
+			{
+				status[m] = -1;
+				continue;
+			}
+			if (packing)
+				status[m] = archive_copy(ar, entry, fd, 0, ar->fd, entry->offset, piece, ARCHIVE_PIECE);
+			else
+				status[m] = archive_copy(ar, entry, ar->fd, entry->offset, fd, 0, piece, ARCHIVE_PIECE);
+			close(fd);
+		}
+
+		free(piece);
+	}
+
+	stats_record(stage_kernel, kernel_start);
+}
+
+//Adds the files in archive_members to the archive at path, creating it if it doesn't exist. A file with the same name
+//as a member already in the archive replaces it.
+static int archive_pack(const char * path, const char * key, unsigned char * data, unsigned long * processed)
+{
+	archive ar;
+	bool existing = access(path, F_OK) == 0;
+	unsigned long old_size;
+	unsigned long * selected;
+	int * status;
+	int ret = 0;
+
+	if (existing && open_archive(&ar, path, key, true) == -1)
+		return -1;
+	if (!existing && archive_create(&ar, path, key) == -1)
+	{
+		exit_message(1, "Error in opening files!");
+		return -1;
+	}
+	old_size = ar.data_end;
+	selected = malloc(archive_nmembers * sizeof(unsigned long));
+	status = calloc(archive_nmembers, sizeof(int));
+	ar.entries = realloc(ar.entries, (ar.nentries + archive_nmembers) * sizeof(archive_entry));
+
+	//The new members are given their place after the end of the file, in the order they were given
+	for (int m = 0; m < archive_nmembers; m++)
+	{
+		struct stat info;
+		const char * name = member_name(archive_members[m]);
+		unsigned long e;
+
+		if (stat(archive_members[m], &info) == -1 || !S_ISREG(info.st_mode) || strlen(name) == 0 || strlen(name) >= ARCHIVE_NAME_SIZE)
+		{
+			fprintf(stderr, "Can't add %s: not a regular file, or its name is too long\n", archive_members[m]);
+			ret = -1;
+			break;
+		}
+
+		for (e = 0; e < ar.nentries; e++)
+			if (strcmp(ar.entries[e].name, name) == 0)
+				break;
+		for (int k = 0; k < m && ret == 0; k++)
+			if (selected[k] == e)
+			{
+				fprintf(stderr, "Can't add %s: another file with the same name is being added\n", archive_members[m]);
+				ret = -1;
+			}
+		if (ret == -1)
+			break;
+		if (e == ar.nentries)
+			ar.nentries++;
+
+		memset(&ar.entries[e], 0, sizeof(archive_entry));
+		strcpy(ar.entries[e].name, name);
+		ar.entries[e].offset = ar.data_end;
+		ar.entries[e].length = info.st_size;
+		create_nonce(&ar.entries[e].iv);
+		ar.data_end += info.st_size;
+		selected[m] = e;
+	}
+
+	if (ret == 0)
+	{
+		copy_members(&ar, selected, archive_members, status, archive_nmembers, true, data);
+		for (int m = 0; m < archive_nmembers; m++)
+			if (status[m] == -1)
+			{
+				fprintf(stderr, "Failed: %s\n", archive_members[m]);
+				ret = -1;
+			}
+			else
+				*processed += ar.entries[selected[m]].length;
+	}
+
+	if (ret == 0 && archive_write_index(&ar, ar.data_end) == -1)
+	{
+		exit_message(1, "Error in writing the archive!");
+		ret = -1;
+	}
+
+	//A failed pack leaves the archive as it was, the old index is still at its end
+	if (ret == -1)
+	{
+		if (existing)
+			ftruncate(ar.fd, old_size);
+		else
+			remove(path);
+	}
+	else
+		stats_add_bytes(*processed);
+
+	archive_close(&ar);
+	free(selected);
+	free(status);
+	return ret;
+}
+
+//Extracts the members named in archive_members from the archive at path (all of them if none is named), into batch_outdir
+//if it's set, into the current directory otherwise
+static int archive_unpack(const char * path, const char * key, unsigned char * data, unsigned long * processed)
+{
+	archive ar;
+	unsigned long count = 0;
+	unsigned long * selected;
+	char ** paths;
+	int * status;
+	int ret = 0;
+
+	if (open_archive(&ar, path, key, false) == -1)
+		return -1;
+
+	count = archive_nmembers > 0 ? archive_nmembers : ar.nentries;
+	selected = malloc((count > 0 ? count : 1) * sizeof(unsigned long));
+	paths = calloc(count > 0 ? count : 1, sizeof(char *));
+	status = calloc(count > 0 ? count : 1, sizeof(int));
+
+	for (unsigned long m = 0; m < count; m++)
+	{
+		if (archive_nmembers > 0)
+		{
+			for (selected[m] = 0; selected[m] < ar.nentries; selected[m]++)
+				if (strcmp(ar.entries[selected[m]].name, member_name(archive_members[m])) == 0)
+					break;
+			if (selected[m] == ar.nentries)
+			{
+				fprintf(stderr, "No member named %s in the archive\n", archive_members[m]);
+				ret = -1;
+				count = m;
+				break;
+			}
+		}
+		else
+			selected[m] = m;
+
+		const char * name = ar.entries[selected[m]].name;
+		paths[m] = malloc((batch_outdir != NULL ? strlen(batch_outdir) + 1 : 0) + strlen(name) + 1);
+		paths[m][0] = '\0';
+		if (batch_outdir != NULL)
+		{
+			strcpy(paths[m], batch_outdir);
+			strcat(paths[m], "/");
+		}
+		//names come from the index, a member is never written outside of the output directory
+		strcat(paths[m], member_name(name));
+	}
+
+	if (ret == 0)
+	{
+		copy_members(&ar, selected, paths, status, count, false, data);
+		for (unsigned long m = 0; m < count; m++)
+			if (status[m] == -1)
+			{
+				fprintf(stderr, "Failed: %s\n", paths[m]);
+				ret = -1;
+			}
+			else
+				*processed += ar.entries[selected[m]].length;
+		stats_add_bytes(*processed);
+	}
+
+	for (unsigned long m = 0; m < count; m++)
+		free(paths[m]);
+	free(paths);
+	free(selected);
+	free(status);
+	archive_close(&ar);
+	return ret;
+}
+
+//Prints the size and the name of every member of the archive at path
+static int archive_list(const char * path, const char * key)
+{
+	archive ar;
+
+	if (open_archive(&ar, path, key, false) == -1)
+		return -1;
+	for (unsigned long e = 0; e < ar.nentries; e++)
+		printf("%12lu  %s\n", ar.entries[e].length, ar.entries[e].name);
+
+	archive_close(&ar);
+	return 0;
+}
+
+//Runs op on an archive: pack adds the files in archive_members to the archive outfile, unpack extracts them (or all the
+//members) from the archive infile, contents lists the members of infile. data must be at least BUFSIZE bytes long.
+//Saves in processed the size of the members packed or extracted, returns -1 in case of error.
+int archive_run(const enum operation op, const char * infile, const char * outfile, const char * key,
+	unsigned char * data, unsigned long * processed)
+{
+	*processed = 0;
+	gettimeofday(&start_time, NULL);
+	//the members are processed many at a time, there's no single file to show the progress of
+	progress_enabled = false;
+
+	if (op == pack)
+		return archive_pack(outfile, key, data, processed);
+	else if (op == unpack)
+		return archive_unpack(infile, key, data, processed);
+	return archive_list(infile, key);
+}
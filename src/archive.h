@@ -0,0 +1,22 @@
+//Encrypted archives of many files, written by pack and read by unpack and list, see archive.c
+//An archive is the header (with FLAG_ARCHIVE set), the members one after the other, the encrypted index (one
+//archive_entry per member) and a footer: the IV of the index, then a block holding the number of entries and the magic.
+#define ARCHIVE_MAGIC "CFARCH01"
+#define ARCHIVE_NAME_SIZE 256
+#define ARCHIVE_FOOTER_SIZE (2 * BLOCKSIZE)
+
+//files given after pack, unpack and list on the command line
+extern char * const * archive_members;
+extern int archive_nmembers;
+
+typedef struct archive_entry {
+	//where the member starts in the archive, and its size
+	unsigned long offset;
+	unsigned long length;
+	//every member is encrypted in CTR mode with its own IV
+	block iv;
+	char name[ARCHIVE_NAME_SIZE];
+}archive_entry;
+
+int archive_run(const enum operation op, const char * infile, const char * outfile, const char * key,
+	unsigned char * data, unsigned long * processed);
@@ -0,0 +1,239 @@
+//This module authenticates the ciphertext in the same run that produces (or consumes) it, so that no separate
+//hashing pass over the file is needed. Every BUFSIZE bytes of ciphertext get a tag computed Wegman-Carter style:
+//a polynomial hash modulo 2^61-1 keyed with a secret point (evaluated in parallel on the chunk while it's still in memory)
+//is encrypted together with the chunk index and a final chunk flag, using round keys derived with a separate salt.
+//Binding the index and the final flag into the tag means that reordered, dropped or truncated chunks fail the check.
+//The header is hashed into every tag too, so a changed salt, IV or flags byte fails the check of the first chunk.
+//In decryption every chunk is verified before it gets decrypted, so no unauthenticated plaintext is ever written.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "common.h"
+#include "feistel.h"
+#include "block.h"
+#include "stats.h"
+#include "tiling.h"
+#include "auth.h"
+#include "omp.h"
+
+#define PRIME61 ((1UL << 61) - 1)
+#define WORDSIZE 4
+
+bool auth_enabled = false;
+
+//Both factors must already be reduced modulo 2^61-1
+static uint64_t mul_mod61(const uint64_t a, const uint64_t b)
+{
+	unsigned __int128 product = (unsigned __int128)a * b;
+	uint64_t sum = ((uint64_t)product & PRIME61) + (uint64_t)(product >> 61);
+
+	return sum >= PRIME61 ? sum - PRIME61 : sum;
+}
+
+static uint64_t pow_mod61(uint64_t base, unsigned long exponent)
+{
+	uint64_t power = 1;
+
+	while (exponent > 0)
+	{
+		if (exponent & 1)
+			power = mul_mod61(power, base);
+		base = mul_mod61(base, base);
+		exponent >>= 1;
+	}
+
+	return power;
+}
+
+//Hashes the 4 byte little endian words of data, zero padding the last one: every thread evaluates the polynomial
+//on its own slice with Horner's rule, then the partial results are shifted into place by the right power of the point
+static uint64_t poly_hash(const uint64_t hash_point, const unsigned char * data, const unsigned long len)
+{
+	unsigned long nwords = (len + WORDSIZE - 1) / WORDSIZE;
+	unsigned long nblocks = (len + BLOCKSIZE - 1) / BLOCKSIZE;
+	uint64_t hash = 0;
+
+	#pragma omp parallel
+	{
+		unsigned long begin, end;
+		uint64_t partial = 0;
+
+		tile_thread_range(nblocks, &begin, &end);
+		begin *= BLOCKSIZE / WORDSIZE;
+		end *= BLOCKSIZE / WORDSIZE;
+		if (end > nwords) end = nwords;
+		if (begin > end) begin = end;
+
+		for (unsigned long w = begin; w < end; w++)
+		{
+			uint64_t word = 0;
+			for (int i = 0; i < WORDSIZE && w * WORDSIZE + i < len; i++)
+				word |= (uint64_t)data[w * WORDSIZE + i] << (8 * i);
+
+			partial += word;
+			if (partial >= PRIME61) partial -= PRIME61;
+			partial = mul_mod61(partial, hash_point);
+		}
+
+		partial = mul_mod61(partial, pow_mod61(hash_point, nwords - end));
+
+		#pragma omp critical(auth_hash)
+		{
+			hash += partial;
+			if (hash >= PRIME61) hash -= PRIME61;
+		}
+	}
+
+	//the length is added so that messages differing only by trailing zero bytes don't collide
+	hash += len % PRIME61;
+	return hash >= PRIME61 ? hash - PRIME61 : hash;
+}
+
+//Computes the tag of a single piece of ciphertext of at most BUFSIZE bytes
+static void compute_tag(const auth_state * state, block * tag, const unsigned char * ciphertext, const unsigned long len, const unsigned long index, const bool final_chunk)
+{
+	block input;
+	double mac_start = stats_clock();
+	uint64_t hash = poly_hash(state->hash_point, ciphertext, len);
+
+	//the header is hashed as if it came before the chunk, in the terms of higher degree
+	hash += mul_mod61(state->header_hash, pow_mod61(state->hash_point, (len + WORDSIZE - 1) / WORDSIZE + 1));
+	if (hash >= PRIME61) hash -= PRIME61;
+
+	for (int i = 0; i < BLOCKSIZE/2; i++)
+		input.left[i] = (hash >> (8 * i)) & 0xFF;
+	for (int i = 0; i < BLOCKSIZE/2 - 1; i++)
+		input.right[i] = (index >> (8 * i)) & 0xFF;
+	input.right[BLOCKSIZE/2 - 1] = final_chunk ? 1 : 0;
+
+	process_block((unsigned char *)tag, input.left, input.right, state->mac_keys);
+	stats_record(stage_mac, mac_start);
+}
+
+//Computes the salt of the authentication keys, a variation of the header salt
+void auth_mac_salt(unsigned char mac_salt[BLOCKSIZE], const block * salt)
+{
+	memcpy(mac_salt, salt, BLOCKSIZE);
+	for (int i = 0; i < BLOCKSIZE; i++)
+		mac_salt[i] ^= 0x5c;
+}
+
+//Derives the authentication round keys and the hash point from the key, and hashes the header, which must be complete
+//(flags included) by then
+void auth_init(auth_state * state, const char * key, const block header[HEADER_BLOCKS])
+{
+	unsigned char mac_salt[BLOCKSIZE];
+	block point;
+
+	memset(state, 0, sizeof(auth_state));
+	auth_mac_salt(mac_salt, &header[0]);
+
+	double kdf_start = stats_clock();
+	schedule_key(state->mac_keys, key, mac_salt, header_iterations(header));
+	stats_record(stage_kdf, kdf_start);
+
+	memset(&point, 0, sizeof(block));
+	process_block((unsigned char *)&point, point.left, point.right, state->mac_keys);
+	for (int i = 0; i < BLOCKSIZE/2; i++)
+		state->hash_point |= (uint64_t)point.left[i] << (8 * i);
+	state->hash_point &= PRIME61;
+	if (state->hash_point == PRIME61 || state->hash_point < 2)
+		state->hash_point = 2;
+
+	state->header_hash = poly_hash(state->hash_point, (const unsigned char *)header, HEADER_BLOCKS * BLOCKSIZE);
+}
+
+//Frees the tags of a file
+void auth_release(auth_state * state)
+{
+	free(state->tags);
+	state->tags = NULL;
+	state->ntags = state->tags_capacity = 0;
+}
+
+//Tags the ciphertext of an encrypted chunk. The output of the last chunk can go one block over BUFSIZE,
+//so it's split into BUFSIZE pieces to match the chunks that decryption will read back.
+void auth_tag_output(auth_state * state, const unsigned char * ciphertext, const unsigned long len, const bool final_chunk)
+{
+	for (unsigned long offset = 0; offset < len; offset += BUFSIZE)
+	{
+		unsigned long piece = (len - offset < BUFSIZE) ? len - offset : BUFSIZE;
+
+		if (state->ntags == state->tags_capacity)
+		{
+			state->tags_capacity = state->tags_capacity == 0 ? 64 : state->tags_capacity * 2;
+			state->tags = realloc(state->tags, state->tags_capacity * sizeof(block));
+		}
+
+		compute_tag(state, &state->tags[state->ntags], ciphertext + offset, piece, state->next_tag, final_chunk && offset + piece == len);
+		state->ntags++;
+		state->next_tag++;
+	}
+}
+
+//Verifies a chunk of ciphertext against the tag read from the trailer.
+//Returns -1 if the chunk is not authentic, or if the chunks don't end where the trailer says they should.
+int auth_verify_chunk(auth_state * state, const unsigned char * ciphertext, const unsigned long len, const bool final_chunk)
+{
+	block tag;
+
+	if (state->next_tag >= state->ntags || final_chunk != (state->next_tag == state->ntags - 1))
+		return -1;
+
+	compute_tag(state, &tag, ciphertext, len, state->next_tag, final_chunk);
+	if (memcmp(&tag, &state->tags[state->next_tag], sizeof(block)) != 0)
+		return -1;
+
+	state->next_tag++;
+	return 0;
+}
+
+//Appends the tags and the footer block to the ciphertext
+int auth_write_trailer(auth_state * state, FILE * write_file)
+{
+	block footer;
+
+	for (int i = 0; i < BLOCKSIZE/2; i++)
+		footer.left[i] = (state->ntags >> (8 * i)) & 0xFF;
+	memcpy(footer.right, AUTH_MAGIC, BLOCKSIZE/2);
+
+	if (state->ntags > 0 && fwrite(state->tags, sizeof(block), state->ntags, write_file) != state->ntags)
+		return -1;
+	if (fwrite(&footer, sizeof(block), 1, write_file) != 1)
+		return -1;
+
+	return 0;
+}
+
+//Loads the tags from the end of the payload that starts at offset and removes the trailer size from payload_size.
+//The position in read_file is not preserved. Returns -1 if the file has no valid trailer.
+int auth_read_trailer(auth_state * state, FILE * read_file, const unsigned long offset, unsigned long * payload_size)
+{
+	block footer;
+	unsigned long count = 0;
+
+	if (*payload_size < BLOCKSIZE)
+		return -1;
+
+	fseek(read_file, offset + *payload_size - BLOCKSIZE, SEEK_SET);
+	if (fread(&footer, sizeof(block), 1, read_file) != 1 || memcmp(footer.right, AUTH_MAGIC, BLOCKSIZE/2) != 0)
+		return -1;
+
+	for (int i = 0; i < BLOCKSIZE/2; i++)
+		count |= (unsigned long)footer.left[i] << (8 * i);
+	if (count == 0 || count > *payload_size / BLOCKSIZE - 1)
+		return -1;
+
+	state->tags = realloc(state->tags, count * sizeof(block));
+	state->tags_capacity = state->ntags = count;
+	state->next_tag = 0;
+	fseek(read_file, offset + *payload_size - (count + 1) * BLOCKSIZE, SEEK_SET);
+	if (fread(state->tags, sizeof(block), count, read_file) != count)
+		return -1;
+
+	*payload_size -= (count + 1) * BLOCKSIZE;
+	return 0;
+}
@@ -0,0 +1,27 @@
+//Chunk authentication, enabled with --auth
+//The trailer is formed by one tag block per BUFSIZE bytes of ciphertext, followed by a footer block
+//holding the number of tags and a magic string
+#define AUTH_MAGIC "CFAUTH1"
+
+extern bool auth_enabled;
+
+//authentication keys and tags of the file being processed
+typedef struct auth_state {
+	unsigned char mac_keys[NROUND][KEYSIZE];
+	unsigned long hash_point;
+	//hash of the header (salt, IV and key check block with the flags), which goes into every tag
+	unsigned long header_hash;
+	block * tags;
+	unsigned long ntags;
+	unsigned long tags_capacity;
+	//index of the next chunk to be tagged or verified
+	unsigned long next_tag;
+}auth_state;
+
+void auth_mac_salt(unsigned char mac_salt[BLOCKSIZE], const block * salt);
+void auth_init(auth_state * state, const char * key, const block header[HEADER_BLOCKS]);
+void auth_release(auth_state * state);
+void auth_tag_output(auth_state * state, const unsigned char * ciphertext, const unsigned long len, const bool final_chunk);
+int auth_verify_chunk(auth_state * state, const unsigned char * ciphertext, const unsigned long len, const bool final_chunk);
+int auth_write_trailer(auth_state * state, FILE * write_file);
+int auth_read_trailer(auth_state * state, FILE * read_file, const unsigned long offset, unsigned long * payload_size);
@@ -0,0 +1,387 @@
+//This module processes a whole list of files in a single run, so that process startup, thread creation,
+//buffer allocation and page faulting are paid once instead of once per file.
+//The list comes from a directory, from a manifest file or from a manifest on stdin (one input path per line,
+//optionally followed by a tab and the output path).
+//Big files are split across all the threads, one file at a time, exactly like in single-file mode.
+//Small files can't keep many threads busy, so each of them is processed by a single thread (the kernels' parallel
+//regions run with one thread when nested) and many of them are processed at the same time: they are dealt to one
+//deque per thread, every thread works through its own deque and steals from the others when it runs out.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "dirent.h"
+#include "sys/stat.h"
+#include "sys/time.h"
+#include "common.h"
+#include "utils.h"
+#include "stats.h"
+#include "bufpool.h"
+#include "block.h"
+#include "auth.h"
+#include "kdf.h"
+#include "pipeline.h"
+#include "batch.h"
+#include "omp.h"
+
+#define MANIFEST_LINE 4096
+
+typedef struct batch_job {
+	char * infile;
+	char * outfile;
+	unsigned long size;
+	unsigned long processed;
+	//key derivation salt, generated in advance in encryption
+	block salt;
+	int status;
+}batch_job;
+
+//Jobs dealt to a worker: the owner takes them from the head (the biggest first, since jobs are dealt in decreasing size),
+//thieves take them from the tail, so what's left to steal at the end of the run are the smallest ones
+typedef struct job_deque {
+	batch_job ** jobs;
+	unsigned long head;
+	unsigned long tail;
+	omp_lock_t lock;
+}job_deque;
+
+char * batch_source = NULL;
+char * batch_outdir = NULL;
+
+static batch_job * jobs = NULL;
+static unsigned long njobs = 0;
+static unsigned long jobs_capacity = 0;
+
+//Computes the output path of infile when the manifest doesn't give one: the input path with .enc appended in encryption
+//(or removed in decryption, .dec is appended if it's not there), moved to the output directory if there is one
+static char * output_name(const char * infile, const enum operation op)
+{
+	const char * name = infile;
+	const char * slash = strrchr(infile, '/');
+	unsigned long len;
+	char * outfile;
+
+	if (batch_outdir != NULL && slash != NULL)
+		name = slash + 1;
+
+	len = strlen(name);
+	outfile = malloc((batch_outdir != NULL ? strlen(batch_outdir) + 1 : 0) + len + 5);
+	outfile[0] = '\0';
+	if (batch_outdir != NULL)
+	{
+		strcpy(outfile, batch_outdir);
+		strcat(outfile, "/");
+	}
+
+	if (op == dec && len > 4 && strcmp(name + len - 4, ".enc") == 0)
+		strncat(outfile, name, len - 4);
+	else
+	{
+		strcat(outfile, name);
+		strcat(outfile, op == enc ? ".enc" : ".dec");
+	}
+
+	return outfile;
+}
+
+static void add_job(const char * infile, const char * outfile, const enum operation op)
+{
+	struct stat info;
+
+	if (stat(infile, &info) == -1 || !S_ISREG(info.st_mode))
+	{
+		fprintf(stderr, "Skipping %s: not a regular file\n", infile);
+		return;
+	}
+
+	if (njobs == jobs_capacity)
+	{
+		jobs_capacity = jobs_capacity == 0 ? 256 : jobs_capacity * 2;
+		jobs = realloc(jobs, jobs_capacity * sizeof(batch_job));
+	}
+
+	jobs[njobs].infile = strdup(infile);
+	jobs[njobs].outfile = outfile != NULL ? strdup(outfile) : output_name(infile, op);
+	jobs[njobs].size = info.st_size;
+	jobs[njobs].processed = 0;
+	jobs[njobs].status = 0;
+	njobs++;
+}
+
+//Reads a manifest: one input path per line, optionally followed by a tab and the output path.
+//Empty lines and lines starting with # are ignored.
+static void read_manifest(FILE * manifest, const enum operation op)
+{
+	char line[MANIFEST_LINE];
+
+	while (fgets(line, sizeof(line), manifest) != NULL)
+	{
+		char * outfile;
+
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		outfile = strchr(line, '\t');
+		if (outfile != NULL)
+			*outfile++ = '\0';
+
+		add_job(line, outfile, op);
+	}
+}
+
+//Adds every regular file in the directory (subdirectories are not visited)
+static int read_directory(const char * path, const enum operation op)
+{
+	DIR * dir = opendir(path);
+	struct dirent * entry;
+
+	if (dir == NULL)
+		return -1;
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		char * infile;
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		infile = malloc(strlen(path) + strlen(entry->d_name) + 2);
+		sprintf(infile, "%s/%s", path, entry->d_name);
+		add_job(infile, NULL, op);
+		free(infile);
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+static int compare_jobs(const void * first, const void * second)
+{
+	const batch_job * a = first;
+	const batch_job * b = second;
+
+	if (a->size == b->size)
+		return 0;
+	return a->size > b->size ? -1 : 1;
+}
+
+//Returns the next job for worker self: from its own deque if possible, otherwise stolen from the others.
+//No jobs are added once the workers have started, so when every deque is empty the run is over.
+static batch_job * next_job(job_deque * deques, const int nworkers, const int self)
+{
+	batch_job * job = NULL;
+
+	omp_set_lock(&deques[self].lock);
+	if (deques[self].head < deques[self].tail)
+		job = deques[self].jobs[deques[self].head++];
+	omp_unset_lock(&deques[self].lock);
+
+	for (int i = 1; i < nworkers && job == NULL; i++)
+	{
+		job_deque * victim = &deques[(self + i) % nworkers];
+
+		omp_set_lock(&victim->lock);
+		if (victim->head < victim->tail)
+			job = victim->jobs[--victim->tail];
+		omp_unset_lock(&victim->lock);
+	}
+
+	return job;
+}
+
+//Derives the keys of all the files at once (see kdf.c), instead of one at a time when each file is processed.
+//In encryption the salts are generated here, in decryption they are read from the headers.
+static void prefetch_keys(const enum operation op, const char * key)
+{
+	kdf_request * requests = malloc(2 * njobs * sizeof(kdf_request));
+	unsigned long nrequests = 0;
+
+	for (unsigned long j = 0; j < njobs; j++)
+	{
+		block header[HEADER_BLOCKS];
+
+		memset(header, 0, sizeof(header));
+		if (op == enc)
+		{
+			create_nonce(&jobs[j].salt);
+			header[0] = jobs[j].salt;
+		}
+		else
+		{
+			FILE * read_file = fopen(jobs[j].infile, "rb");
+			if (read_file == NULL)
+				continue;
+			unsigned long read = fread(header, BLOCKSIZE, HEADER_BLOCKS, read_file);
+			fclose(read_file);
+			if (read != HEADER_BLOCKS)
+				continue;
+		}
+
+		//new files store kdf_iterations, the key check block is created later
+		memcpy(requests[nrequests].salt, &header[0], BLOCKSIZE);
+		requests[nrequests].iterations = op == enc ? kdf_iterations : header_iterations(header);
+		nrequests++;
+
+		if (auth_enabled)
+		{
+			auth_mac_salt(requests[nrequests].salt, &header[0]);
+			requests[nrequests].iterations = requests[nrequests - 1].iterations;
+			nrequests++;
+		}
+	}
+
+	double kdf_start = stats_clock();
+	kdf_prefetch(key, requests, nrequests);
+	stats_record(stage_kdf, kdf_start);
+	free(requests);
+}
+
+//Processes the small jobs [first, njobs) on a work stealing pool with one worker per thread
+static void run_small_jobs(const unsigned long first, const enum operation op, const enum mode opmode, const char * key)
+{
+	int nworkers = omp_get_max_threads();
+	job_deque * deques = calloc(nworkers, sizeof(job_deque));
+
+	//dealing the jobs round-robin in decreasing size, so every worker starts with about the same amount of work
+	for (int w = 0; w < nworkers; w++)
+	{
+		deques[w].jobs = malloc(((njobs - first) / nworkers + 1) * sizeof(batch_job *));
+		omp_init_lock(&deques[w].lock);
+	}
+	for (unsigned long j = first; j < njobs; j++)
+	{
+		job_deque * deque = &deques[(j - first) % nworkers];
+		deque->jobs[deque->tail++] = &jobs[j];
+	}
+
+	//the kernels must run on the calling worker only
+	omp_set_max_active_levels(1);
+
+	#pragma omp parallel num_threads(nworkers)
+	{
+		int self = omp_get_thread_num();
+		unsigned char * data = NULL;
+		unsigned char * result = NULL;
+		unsigned long capacity = 0;
+		batch_job * job;
+
+		while ((job = next_job(deques, nworkers, self)) != NULL)
+		{
+			//the buffers of a worker are only replaced when a file doesn't fit in them
+			unsigned long needed = pipeline_buffer_size(job->size);
+			if (needed > capacity)
+			{
+				bufpool_put(data);
+				bufpool_put(result);
+				data = bufpool_get(needed);
+				result = bufpool_get(needed);
+				capacity = needed;
+			}
+
+			job->status = process_file(job->infile, job->outfile, op, opmode, key, op == enc ? &job->salt : NULL, data, result, &job->processed);
+		}
+
+		bufpool_put(data);
+		bufpool_put(result);
+	}
+
+	for (int w = 0; w < nworkers; w++)
+	{
+		omp_destroy_lock(&deques[w].lock);
+		free(deques[w].jobs);
+	}
+	free(deques);
+}
+
+//Processes every file listed by batch_source (a directory, a manifest file, or - for a manifest on stdin).
+//Returns -1 if the list can't be read or if any of the files failed.
+int batch_run(const enum operation op, const enum mode opmode, const char * key)
+{
+	struct stat info;
+	struct timeval batch_start, batch_end;
+	unsigned long first_small = 0;
+	unsigned long total = 0;
+	unsigned long failed = 0;
+
+	if (strcmp(batch_source, "-") == 0)
+		read_manifest(stdin, op);
+	else if (stat(batch_source, &info) == 0 && S_ISDIR(info.st_mode))
+		read_directory(batch_source, op);
+	else
+	{
+		FILE * manifest = fopen(batch_source, "r");
+		if (manifest == NULL)
+		{
+			exit_message(1, "Error in opening the batch list!");
+			return -1;
+		}
+		read_manifest(manifest, op);
+		fclose(manifest);
+	}
+
+	if (njobs == 0)
+	{
+		exit_message(1, "No files to process!");
+		return -1;
+	}
+
+	//the progress of a single file is meaningless when many are processed at the same time
+	progress_enabled = false;
+	qsort(jobs, njobs, sizeof(batch_job), compare_jobs);
+	gettimeofday(&batch_start, NULL);
+
+	//verification doesn't need the key
+	if (op != verify)
+		prefetch_keys(op, key);
+
+	//Big files first, each one split across all the threads
+	if (jobs[0].size > BATCH_SPLIT_SIZE)
+	{
+		unsigned char * data = bufpool_get(pipeline_buffer_size(BUFSIZE));
+		unsigned char * result = bufpool_get(pipeline_buffer_size(BUFSIZE));
+
+		for (; first_small < njobs && jobs[first_small].size > BATCH_SPLIT_SIZE; first_small++)
+		{
+			batch_job * job = &jobs[first_small];
+			job->status = process_file(job->infile, job->outfile, op, opmode, key, op == enc ? &job->salt : NULL, data, result, &job->processed);
+		}
+
+		bufpool_put(data);
+		bufpool_put(result);
+	}
+
+	if (first_small < njobs)
+		run_small_jobs(first_small, op, opmode, key);
+
+	gettimeofday(&batch_end, NULL);
+	kdf_release();
+
+	for (unsigned long j = 0; j < njobs; j++)
+	{
+		if (jobs[j].status == -1)
+		{
+			fprintf(stderr, "Failed: %s\n", jobs[j].infile);
+			failed++;
+		}
+		total += jobs[j].processed;
+		free(jobs[j].infile);
+		free(jobs[j].outfile);
+	}
+
+	char files[100];
+	char speed[100];
+	char time[100];
+	double time_diff = timeval_diff_seconds(batch_start, batch_end);
+	snprintf(files, sizeof(files), "\nFiles processed: %lu (%lu failed)", njobs, failed);
+	snprintf(speed, sizeof(speed), "Avg processing speed: %.2f MB/s", estimate_speed(batch_end, batch_start, total/BLOCKSIZE));
+	snprintf(time, sizeof(time), "Time elapsed: %.2f s", time_diff);
+	exit_message(4, "Batch complete!\n", files, speed, time);
+
+	free(jobs);
+	jobs = NULL;
+	njobs = jobs_capacity = 0;
+
+	return failed > 0 ? -1 : 0;
+}
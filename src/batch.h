@@ -0,0 +1,8 @@
+//Batch processing of many files in one run, enabled with --batch
+//Files bigger than BATCH_SPLIT_SIZE are processed one at a time by all the threads, the smaller ones are packed many per thread
+#define BATCH_SPLIT_SIZE 16777216
+
+extern char * batch_source;
+extern char * batch_outdir;
+
+int batch_run(const enum operation op, const enum mode opmode, const char * key);
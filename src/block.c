@@ -8,31 +8,22 @@
 #include "utils.h"
 #include "feistel.h"
 #include "opmodes.h"
+#include "stats.h"
+#include "kdf.h"
 #include "omp.h"
 #include "openssl/evp.h"
 #include "openssl/hmac.h"
 
 //Schedules the round keys by compressing (or expanding, if smaller) the input key into and 8 byte master key  
 //and then using it to derive one subkey for every round of the Feistel cipher
-void schedule_key(unsigned char round_keys[NROUND][KEYSIZE], const char * key, const unsigned char * salt)
+void schedule_key(unsigned char round_keys[NROUND][KEYSIZE], const char * key, const unsigned char * salt, const unsigned long iterations)
 {
 	unsigned char left_part;
 	unsigned char right_part;
-	unsigned char * master_key = malloc(KEYSIZE * sizeof(unsigned char));
-
-    // Use PBKDF2 to derive a key
-    int ret = PKCS5_PBKDF2_HMAC
-	(
-        key,
-        strlen(key),
-		salt,
-        BLOCKSIZE,
-        1000,
-        EVP_sha256(), 
-        KEYSIZE,
-        master_key
-    );
+	unsigned char master_key[KEYSIZE];
 
+	//PBKDF2 derivation of the master key, see kdf.c
+	kdf_derive(master_key, key, salt, iterations);
 
 	memcpy(round_keys[0], master_key, KEYSIZE);
 
@@ -50,98 +41,140 @@ void schedule_key(unsigned char round_keys[NROUND][KEYSIZE], const char * key, c
 		//the final result is an extended key stored in the round_keys matrix
 		memcpy(round_keys[j], master_key, KEYSIZE);
 	}
-
-	free(master_key);
 }
 
-//Receives and organizes input data, takes the length of the chunk (as a pointer), the number of the current chunk, the input key,
-//the header block array and the chosen operation mode enum value. 
-//Returns the result of the encryption as a pointer to unsigned char, or NULL if an error is encountered.
-//In case it has to add padding and/or an accounting block, it uses the chunk_size pointer to update the chunk size
-void encrypt_blocks(unsigned char * result, unsigned char * data, const unsigned long chunk_size, int nchunk, const char * key, const block header[2], enum mode opmode)
-{	
-	char buffer[BLOCKSIZE];
+//Computes the key check value: a digest of the round keys, truncated to KCV_SIZE bytes.
+//Since it's only a few bytes of a one-way function of the round keys, it can't be used to recover them.
+static void compute_key_check(unsigned char kcv[KCV_SIZE], const char * key, const block * salt, const unsigned long iterations)
+{
 	unsigned char round_keys[NROUND][KEYSIZE];
-	unsigned long i=0;
-	unsigned long bcount=0;
+	unsigned char digest[EVP_MAX_MD_SIZE];
 
-	//scheduling the round keys starting from the master key given
-	schedule_key(round_keys, key, (unsigned char *)&header[0]);	//see the function schedule_key for info
+	double kdf_start = stats_clock();
+	schedule_key(round_keys, key, (const unsigned char *)salt, iterations);
+	stats_record(stage_kdf, kdf_start);
 
-   	//if the size of the last chunk is not multiple of the block size,
-	//remainder will be the number of leftover bytes that will go into the padded block
+	EVP_Digest(round_keys, sizeof(round_keys), digest, NULL, EVP_sha256(), NULL);
+	memcpy(kcv, digest, KCV_SIZE);
+}
+
+//Fills the key check block of the header: the left half holds HEADER_MAGIC, the right half starts with the key check value
+//followed by the PBKDF2 iteration count and the flags byte (set by the caller, it's not covered by the key check value)
+void create_key_check(block * check, const char * key, const block * salt)
+{
+	memset(check, 0, sizeof(block));
+	memcpy(check->left, HEADER_MAGIC, BLOCKSIZE/2);
+	for (int i = 0; i < ITERATIONS_SIZE; i++)
+		check->right[KCV_SIZE + i] = (kdf_iterations >> (8 * i)) & 0xFF;
+	compute_key_check(check->right, key, salt, kdf_iterations);
+}
+
+//Returns true if the block is a key check block, files written before it was introduced only have salt and IV in the header
+bool has_key_check(const block * check)
+{
+	return memcmp(check->left, HEADER_MAGIC, BLOCKSIZE/2) == 0;
+}
+
+//Returns the PBKDF2 iteration count of the file, files that don't store it were all written with the default one
+unsigned long header_iterations(const block header[HEADER_BLOCKS])
+{
+	unsigned long iterations = 0;
+
+	if (!has_key_check(&header[2]))
+		return KDF_DEFAULT_ITERATIONS;
+
+	for (int i = 0; i < ITERATIONS_SIZE; i++)
+		iterations |= (unsigned long)header[2].right[KCV_SIZE + i] << (8 * i);
+	return iterations != 0 ? iterations : KDF_DEFAULT_ITERATIONS;
+}
+
+//Returns -1 if the key doesn't match the key check value stored in the header
+int verify_key_check(const block header[HEADER_BLOCKS], const char * key)
+{
+	unsigned char kcv[KCV_SIZE];
+
+	compute_key_check(kcv, key, &header[0], header_iterations(header));
+	return memcmp(kcv, header[2].right, KCV_SIZE) == 0 ? 0 : -1;
+}
+
+//Pads the last chunk of a file for the modes of operation that need it. tail points to the block where the data of the
+//chunk ends (the partial block, or the one right after the data if it ends on a block boundary), and there must be
+//room for two blocks there.
+//It's a pretty naive padding scheme, but it works on any mode of operation so it simplifies coding.
+//I just 0-pad the last block if data length is not multiple of blocksize and use a size accounting block
+//to know how much of the last block is 0-padding to properly decrypt.
+void pad_last_chunk(block * tail, const unsigned long chunk_size)
+{
+	char buffer[BLOCKSIZE];
 	unsigned int remainder = chunk_size % BLOCKSIZE;
+	block * accounting = remainder > 0 ? &tail[1] : &tail[0];
 
-	//Figuring how much space we need for the blocks.
-	//We only need extra blocks if we're at the last chunk of input data, because only in that case we have to append the data size and eventually add padding.
-	//We understand that it's the last chunk when there's less data than the input buffer can contain.
-	if (chunk_size == BUFSIZE)	//full buffer worth of data means it's not the last chunk of data, so we won't need to add extra blocks
-		bcount = (chunk_size * sizeof(char)) / BLOCKSIZE;	
-	else if (chunk_size < BUFSIZE && remainder == 0)		//last block: data size is multiple of the blocksize, we need an extra block
-		bcount = ((chunk_size * sizeof(char)) / BLOCKSIZE) + 1;
-	else if (chunk_size < BUFSIZE && remainder > 0)		//last block: data size is not multiple of the blocksize, we need two extra blocks
-		bcount = ((chunk_size * sizeof(char)) / BLOCKSIZE) + 2;
-	
-	//Reallocating the data pointer as a block pointer with the new size
-	block * b = (block *) data;
+    if (remainder>0)	//forming the last padded block, if there's leftover data
+    {
+    	for (int z=0; z<BLOCKSIZE; z++)	
+    	{
+    		if (z < remainder)	//there's still leftover data
+    			buffer[z] = ((unsigned char *)tail)[z];
+    		else	//no more leftover data, proceed with the padding
+    			buffer[z] = '0';
+    	}
 
-    //Padding shenanigans: they apply only if it's the last chunk of data read and we're not using a stream-like cipher.
-    //It's a pretty naive padding scheme, but it works on any mode of operation so it simplifies coding.
-    //I just 0-pad the last block if data length is not multiple of blocksize and use a size accounting block
-    //to know how much of the last block is 0-padding to properly decrypt.
-    if (chunk_size<BUFSIZE && is_stream_mode(opmode) == false)	
-    {	
-	    if (remainder>0)	//forming the last padded block, if there's leftover data
-	    {
-	    	for (int z=0; z<BLOCKSIZE; z++)	
-	    	{
-	    		if (z < remainder)	//there's still leftover data
-	    			buffer[z] = data[((bcount-2) * BLOCKSIZE) + z];
-	    		else	//no more leftover data, proceed with the padding
-	    			buffer[z] = '0';
-	    	}
-
-			for (int y=0; y<BLOCKSIZE/2; y++)	//copying the buffered data on the padded block
-			{
-				b[bcount - 2].left[y] = buffer[y];
-				b[bcount - 2].right[y] = buffer[y+8];
-			}
-	    }
-
-	    //appending a final block to store the real(unpadded) size of the encrypted data
-		block last_block;
-		snprintf((char *)&last_block, BLOCKSIZE, "%lu", chunk_size);
-	    int flag = 0;
-	   	memcpy(&b[bcount-1], &last_block, sizeof(block));
-	   	for (int i=0; i<BLOCKSIZE; i++)
-	   	{
-	   		if (flag == 1)
-	   			b[bcount-1].left[i]='#';
-	   		
-	   		if (flag==0 && b[bcount-1].left[i] == '\0')
-	   			flag = 1;
-	   	}
-	}
+		for (int y=0; y<BLOCKSIZE/2; y++)	//copying the buffered data on the padded block
+		{
+			tail->left[y] = buffer[y];
+			tail->right[y] = buffer[y+8];
+		}
+    }
+
+    //appending a final block to store the real(unpadded) size of the encrypted data
+	block last_block;
+	snprintf((char *)&last_block, BLOCKSIZE, "%lu", chunk_size);
+    int flag = 0;
+   	memcpy(accounting, &last_block, sizeof(block));
+   	for (int i=0; i<BLOCKSIZE; i++)
+   	{
+   		if (flag == 1)
+   			accounting->left[i]='#';
+   		
+   		if (flag==0 && accounting->left[i] == '\0')
+   			flag = 1;
+   	}
+}
 
+//Inverts the sequence of the round keys, decryption of the block-oriented modes uses them in reverse order
+void invert_round_keys(unsigned char round_keys[NROUND][KEYSIZE])
+{
+	unsigned char temp[NROUND][KEYSIZE];
+
+	memcpy(temp, round_keys, NROUND * KEYSIZE);
+	for (int i=0; i<NROUND; i++)
+		memcpy(round_keys[i], temp[NROUND - 1 - i], KEYSIZE);
+}
+
+//Encrypts bcount blocks (len bytes for the stream-like modes) with round keys that have already been scheduled,
+//without any padding: the data must already be padded if it's the end of a file
+void encrypt_scheduled(unsigned char * result, block * b, const unsigned long bcount, const unsigned long len,
+	const unsigned char round_keys[NROUND][KEYSIZE], const block iv, enum mode opmode, mode_state * state)
+{
 	switch (opmode) 
 	{
         case cbc:
-            encrypt_cbc_mode(result, b, bcount, round_keys, header[1]);
+            encrypt_cbc_mode(result, b, bcount, round_keys, iv, state);
             break;
         case cfb:
-            encrypt_cfb_mode(result, b, chunk_size, round_keys, header[1]);
+            encrypt_cfb_mode(result, b, len, round_keys, iv, state);
             break;
         case pcbc:
-            encrypt_pcbc_mode(result, b, bcount, round_keys, header[1]);
+            encrypt_pcbc_mode(result, b, bcount, round_keys, iv, state);
             break;
         case ecb:
-            operate_ecb_mode(result, b, bcount, round_keys);
+            operate_ecb_mode(result, b, bcount, round_keys, state);
             break;
         case ctr:
-            operate_ctr_mode(result, b, chunk_size, round_keys, header[1]);
+            operate_ctr_mode(result, b, len, round_keys, iv, state);
             break;
         case ofb:
-            operate_ofb_mode(result, b, chunk_size, round_keys, header[1]);
+            operate_ofb_mode(result, b, len, round_keys, iv, state);
             break;
         default:
             return;
@@ -149,52 +182,30 @@ void encrypt_blocks(unsigned char * result, unsigned char * data, const unsigned
     }
 }
 
-//Receives and organizes input data, takes the length of the chunk, the number of the current chunk, the input key,
-//the header block array and the chosen operation mode enum value. 
-//Returns the result of the decryption as a pointer to unsigned char, or NULL if an error is encountered.
-void decrypt_blocks(unsigned char * result, unsigned char * data, unsigned long data_len, int nchunk, const char * key, const block header[2], enum mode opmode)
+//Decrypts bcount blocks (len bytes for the stream-like modes) with round keys that have already been scheduled
+//(and inverted for the block-oriented modes, see invert_round_keys)
+void decrypt_scheduled(unsigned char * result, block * b, const unsigned long bcount, const unsigned long len,
+	const unsigned char round_keys[NROUND][KEYSIZE], const block iv, enum mode opmode, mode_state * state)
 {
-	unsigned char buffer[BLOCKSIZE];
-	unsigned char round_keys[NROUND][KEYSIZE];
-	unsigned char temp[NROUND][KEYSIZE];
-	unsigned long i=0;
-	unsigned long bcount=0;
-
-	//scheduling the round keys starting from the master key given
-	schedule_key(round_keys, key, (unsigned char *)&header[0]);	//see the function schedule_key for info
-	if (!is_stream_mode(opmode)) //round keys sequence has to be inverted for decryption, except for stream-like modes
-	{
-		memcpy(temp, round_keys, NROUND * KEYSIZE);
-		int j=NROUND-1;
-
-		for (int i=0; i<NROUND; i++)
-		{
-			memcpy(round_keys[i], temp[j], NROUND);
-			j--;
-		}
-	}
-
-	bcount = (data_len * sizeof(char)) / BLOCKSIZE;
-
 	switch (opmode) 
 	{
         case cbc:
-            decrypt_cbc_mode(result, (block *)data, bcount, round_keys, header[1]);
+            decrypt_cbc_mode(result, b, bcount, round_keys, iv, state);
             break;
         case cfb:
-            decrypt_cfb_mode(result, (block *)data, data_len, round_keys, header[1]);
+            decrypt_cfb_mode(result, b, len, round_keys, iv, state);
             break;
         case pcbc:
-            decrypt_pcbc_mode(result, (block *)data, bcount, round_keys, header[1]);
+            decrypt_pcbc_mode(result, b, bcount, round_keys, iv, state);
             break;
         case ecb:
-            operate_ecb_mode(result, (block *) data, bcount, round_keys);
+            operate_ecb_mode(result, b, bcount, round_keys, state);
             break;
         case ctr:
-            operate_ctr_mode(result, (block *)data, data_len, round_keys, header[1]);
+            operate_ctr_mode(result, b, len, round_keys, iv, state);
             break;
         case ofb:
-            operate_ofb_mode(result, (block *)data, data_len, round_keys, header[1]);
+            operate_ofb_mode(result, b, len, round_keys, iv, state);
             break;
         default:
             return;
@@ -202,3 +213,75 @@ void decrypt_blocks(unsigned char * result, unsigned char * data, unsigned long
     }
 }
 
+//Adds the padding and the accounting block to the last chunk of a file (one that's shorter than BUFSIZE) in the modes that
+//need them, and returns the number of blocks of the chunk that go through the cipher
+unsigned long pad_chunk(block * b, const unsigned long chunk_size, enum mode opmode)
+{
+	unsigned long bcount=0;
+
+   	//if the size of the last chunk is not multiple of the block size,
+	//remainder will be the number of leftover bytes that will go into the padded block
+	unsigned int remainder = chunk_size % BLOCKSIZE;
+
+	//Figuring how much space we need for the blocks.
+	//We only need extra blocks if we're at the last chunk of input data, because only in that case we have to append the data size and eventually add padding.
+	//We understand that it's the last chunk when there's less data than the input buffer can contain.
+	if (chunk_size == BUFSIZE)	//full buffer worth of data means it's not the last chunk of data, so we won't need to add extra blocks
+		bcount = (chunk_size * sizeof(char)) / BLOCKSIZE;	
+	else if (chunk_size < BUFSIZE && remainder == 0)		//last block: data size is multiple of the blocksize, we need an extra block
+		bcount = ((chunk_size * sizeof(char)) / BLOCKSIZE) + 1;
+	else if (chunk_size < BUFSIZE && remainder > 0)		//last block: data size is not multiple of the blocksize, we need two extra blocks
+		bcount = ((chunk_size * sizeof(char)) / BLOCKSIZE) + 2;
+	
+    //Padding shenanigans: they apply only if it's the last chunk of data read and we're not using a stream-like cipher.
+    if (chunk_size<BUFSIZE && is_stream_mode(opmode) == false)	
+    {	
+		double padding_start = stats_clock();
+		pad_last_chunk(&b[chunk_size / BLOCKSIZE], chunk_size);
+		stats_record(stage_padding, padding_start);
+	}
+
+	return bcount;
+}
+
+//Receives and organizes input data, takes the length of the chunk (as a pointer), the number of the current chunk, the input key,
+//the header block array, the chosen operation mode enum value and the chaining state of the file. 
+//Returns the result of the encryption as a pointer to unsigned char, or NULL if an error is encountered.
+//In case it has to add padding and/or an accounting block, it uses the chunk_size pointer to update the chunk size
+void encrypt_blocks(unsigned char * result, unsigned char * data, const unsigned long chunk_size, int nchunk, const char * key, const block header[HEADER_BLOCKS], enum mode opmode, mode_state * state)
+{	
+	unsigned char round_keys[NROUND][KEYSIZE];
+	unsigned long bcount=0;
+
+	//scheduling the round keys starting from the master key given
+	double kdf_start = stats_clock();
+	schedule_key(round_keys, key, (unsigned char *)&header[0], header_iterations(header));	//see the function schedule_key for info
+	stats_record(stage_kdf, kdf_start);
+
+	//Reallocating the data pointer as a block pointer with the new size
+	block * b = (block *) data;
+	bcount = pad_chunk(b, chunk_size, opmode);
+
+	encrypt_scheduled(result, b, bcount, chunk_size, round_keys, header[1], opmode, state);
+}
+
+//Receives and organizes input data, takes the length of the chunk, the number of the current chunk, the input key,
+//the header block array, the chosen operation mode enum value and the chaining state of the file. 
+//Returns the result of the decryption as a pointer to unsigned char, or NULL if an error is encountered.
+void decrypt_blocks(unsigned char * result, unsigned char * data, unsigned long data_len, int nchunk, const char * key, const block header[HEADER_BLOCKS], enum mode opmode, mode_state * state)
+{
+	unsigned char round_keys[NROUND][KEYSIZE];
+	unsigned long bcount=0;
+
+	//scheduling the round keys starting from the master key given
+	double kdf_start = stats_clock();
+	schedule_key(round_keys, key, (unsigned char *)&header[0], header_iterations(header));	//see the function schedule_key for info
+	stats_record(stage_kdf, kdf_start);
+	if (!is_stream_mode(opmode)) //round keys sequence has to be inverted for decryption, except for stream-like modes
+		invert_round_keys(round_keys);
+
+	bcount = (data_len * sizeof(char)) / BLOCKSIZE;
+
+	decrypt_scheduled(result, (block *)data, bcount, data_len, round_keys, header[1], opmode, state);
+}
+
@@ -1,2 +1,13 @@
-void decrypt_blocks(unsigned char * result, unsigned char * data, unsigned long data_len, int nchunk, const char * key, const block header[2], enum mode opmode);
-void encrypt_blocks(unsigned char * result, unsigned char * data, const unsigned long chunk_size, int nchunk, const char * key, const block header[2], enum mode opmode);
\ No newline at end of file
+void create_key_check(block * check, const char * key, const block * salt);
+int verify_key_check(const block header[HEADER_BLOCKS], const char * key);
+bool has_key_check(const block * check);
+unsigned long header_iterations(const block header[HEADER_BLOCKS]);
+void schedule_key(unsigned char round_keys[NROUND][KEYSIZE], const char * key, const unsigned char * salt, const unsigned long iterations);
+void decrypt_blocks(unsigned char * result, unsigned char * data, unsigned long data_len, int nchunk, const char * key, const block header[HEADER_BLOCKS], enum mode opmode, mode_state * state);
+void encrypt_blocks(unsigned char * result, unsigned char * data, const unsigned long chunk_size, int nchunk, const char * key, const block header[HEADER_BLOCKS], enum mode opmode, mode_state * state);void pad_last_chunk(block * tail, const unsigned long chunk_size);
+unsigned long pad_chunk(block * b, const unsigned long chunk_size, enum mode opmode);
+void invert_round_keys(unsigned char round_keys[NROUND][KEYSIZE]);
+void encrypt_scheduled(unsigned char * result, block * b, const unsigned long bcount, const unsigned long len,
+	const unsigned char round_keys[NROUND][KEYSIZE], const block iv, enum mode opmode, mode_state * state);
+void decrypt_scheduled(unsigned char * result, block * b, const unsigned long bcount, const unsigned long len,
+	const unsigned char round_keys[NROUND][KEYSIZE], const block iv, enum mode opmode, mode_state * state);
@@ -0,0 +1,118 @@
+//This module manages a pool of chunk-sized buffers that are allocated and pre-faulted once per run,
+//so that the chunk loop and the modes of operation can check them out and give them back without
+//paying for page faults, zeroing or allocator calls on every chunk.
+//The pool is a single anonymous mapping, backed by explicit huge pages when --hugepages is given
+//(falling back to transparent huge pages when none are reserved).
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "sys/mman.h"
+#include "common.h"
+#include "numa.h"
+#include "bufpool.h"
+#include "omp.h"
+
+#define FAULT_PAGESIZE 4096
+
+bool bufpool_hugepages = false;
+
+static unsigned char * region = NULL;
+static unsigned long region_size = 0;
+static unsigned char ** free_list = NULL;
+static unsigned int free_count = 0;
+
+//Maps and pre-faults count buffers of POOL_BUFSIZE bytes. Returns -1 if the mapping fails,
+//in which case bufpool_get will keep working by falling back to regular aligned allocations.
+int bufpool_init(const unsigned int count)
+{
+	region_size = (unsigned long)count * POOL_BUFSIZE;
+
+	if (bufpool_hugepages)
+	{
+		region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (region == MAP_FAILED)
+		{
+			fprintf(stderr, "\nNo huge pages available, falling back to transparent huge pages\n");
+			region = NULL;
+		}
+	}
+
+	if (region == NULL)
+	{
+		region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (region == MAP_FAILED)
+		{
+			region = NULL;
+			region_size = 0;
+			return -1;
+		}
+		madvise(region, region_size, MADV_HUGEPAGE);
+	}
+
+	free_list = malloc(count * sizeof(unsigned char *));
+	free_count = count;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		free_list[i] = region + (unsigned long)i * POOL_BUFSIZE;
+
+		//faulting the pages in now: with NUMA placement every slice is touched by the threads that will process it
+		if (numa_enabled)
+			numa_first_touch(free_list[i], POOL_BUFSIZE);
+		else
+			for (unsigned long p = 0; p < POOL_BUFSIZE; p += FAULT_PAGESIZE)
+				free_list[i][p] = 0;
+	}
+
+	return 0;
+}
+
+//Checks out a buffer of at least size bytes, aligned to POOL_ALIGNMENT.
+//If the pool is empty (or the request is bigger than a pool buffer) a new buffer is allocated instead.
+unsigned char * bufpool_get(const unsigned long size)
+{
+	unsigned char * buffer = NULL;
+
+	if (size <= POOL_BUFSIZE)
+	{
+		#pragma omp critical(bufpool)
+		{
+			if (free_count > 0)
+				buffer = free_list[--free_count];
+		}
+	}
+
+	if (buffer == NULL)
+		buffer = aligned_alloc(POOL_ALIGNMENT, ((size + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT) * POOL_ALIGNMENT);
+
+	return buffer;
+}
+
+//Gives a buffer back to the pool, or frees it if it didn't come from the pool
+void bufpool_put(unsigned char * buffer)
+{
+	if (buffer == NULL)
+		return;
+
+	if (buffer >= region && buffer < region + region_size)
+	{
+		#pragma omp critical(bufpool)
+		free_list[free_count++] = buffer;
+	}
+	else
+		free(buffer);
+}
+
+//Unmaps the pool, every buffer must have been given back before calling this
+void bufpool_destroy(void)
+{
+	if (region != NULL)
+		munmap(region, region_size);
+	free(free_list);
+
+	region = NULL;
+	region_size = 0;
+	free_list = NULL;
+	free_count = 0;
+}
@@ -0,0 +1,12 @@
+//Pool of reusable chunk-sized buffers, created once per run
+//Every buffer has room for a full chunk plus the padding and accounting blocks, rounded up to a 2MB huge page
+#define POOL_PAGESIZE 2097152
+#define POOL_BUFSIZE ((((BUFSIZE + 4 * BLOCKSIZE) + POOL_PAGESIZE - 1) / POOL_PAGESIZE) * POOL_PAGESIZE)
+#define POOL_ALIGNMENT 64
+
+extern bool bufpool_hugepages;
+
+int bufpool_init(const unsigned int count);
+unsigned char * bufpool_get(const unsigned long size);
+void bufpool_put(unsigned char * buffer);
+void bufpool_destroy(void);
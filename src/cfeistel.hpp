@@ -0,0 +1,219 @@
+//Header-only C++20 layer for services that embed cfeistel, over the incremental API of stream.h:
+//cfeistel::cipher encrypts or decrypts std::span buffers with update/final, cfeistel::cipherbuf is a std::streambuf that
+//encrypts or decrypts what is written to it into another streambuf, or what is read through it from another streambuf.
+//Data is processed at block granularity as it flows, large writes go from the caller's buffer to the cipher without
+//being copied. Build the library with make libcfeistel.a and link with libcfeistel.a -fopenmp -lssl -lcrypto.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "stdbool.h"
+#include "sys/time.h"
+#include "common.h"
+#include "stream.h"
+}
+
+namespace cfeistel {
+
+class cipher {
+public:
+	//bytes of header that go before the ciphertext
+	static constexpr std::size_t header_size = STREAM_HEADER_SIZE;
+	//room that update and final need in their output beyond the size of their input
+	static constexpr std::size_t slack = STREAM_SLACK;
+
+	cipher(enum operation op, enum mode opmode, const std::string & key)
+	{
+		if (stream_init(&state, op, opmode, key.c_str()) == -1)
+			throw std::invalid_argument("cfeistel: the operation must be enc or dec");
+	}
+	~cipher() { stream_release(&state); }
+	cipher(const cipher &) = delete;
+	cipher & operator=(const cipher &) = delete;
+
+	enum operation operation() const { return state.op; }
+
+	//Header to write before the ciphertext, in encryption. In decryption it's read by update from the first bytes.
+	std::span<const unsigned char> header() const { return { stream_header(&state), header_size }; }
+
+	//Keeps up to budget bytes of keystream generated ahead of time by a worker thread (ctr and ofb only), so that update
+	//only has to XOR the data with it. Call it before update for the lowest latency on the first messages.
+	void reserve(std::size_t budget)
+	{
+		if (stream_reserve(&state, budget) == -1)
+			throw std::invalid_argument("cfeistel: keystream can only be reserved once, in ctr and ofb mode");
+	}
+
+	//Encrypts or decrypts in into out, which needs room for in.size() + slack bytes. Returns the size of the output.
+	std::size_t update(std::span<const unsigned char> in, std::span<unsigned char> out)
+	{
+		if (out.size() < in.size() + slack)
+			throw std::length_error("cfeistel: output buffer too small");
+		long written = stream_update(&state, out.data(), in.data(), in.size());
+		if (written == -1)
+			throw std::runtime_error("cfeistel: wrong key, or compressed file");
+		return written;
+	}
+
+	//Writes the end of the stream into out, which needs room for slack bytes. Returns the size of the output.
+	std::size_t final(std::span<unsigned char> out)
+	{
+		if (out.size() < slack)
+			throw std::length_error("cfeistel: output buffer too small");
+		long written = stream_final(&state, out.data());
+		if (written == -1)
+			throw std::runtime_error("cfeistel: truncated ciphertext");
+		return written;
+	}
+
+private:
+	stream_state state;
+};
+
+//A cipherbuf is used either for writing or for reading, not both. A written stream is complete only once finish has been called
+//(the destructor calls it too), since the last block and the padding can't be written before the end is known.
+class cipherbuf : public std::streambuf {
+public:
+	cipherbuf(std::streambuf * target, enum operation op, enum mode opmode, const std::string & key, std::size_t buffer_size = 65536)
+		: target(target), engine(op, opmode, key), buffer_size(buffer_size), pending(buffer_size),
+		output(buffer_size + cipher::header_size + cipher::slack)
+	{
+		setp(pending.data(), pending.data() + pending.size());
+	}
+	~cipherbuf() override
+	{
+		try { finish(); } catch (...) {}
+	}
+
+	void finish()
+	{
+		if (finished || reading)
+			return;
+		flush_pending();
+		write_header();
+		finished = true;
+		if (!put_output(engine.final(output_span())))
+			throw std::runtime_error("cfeistel: error in writing the output");
+		target->pubsync();
+	}
+
+protected:
+	int_type overflow(int_type ch) override
+	{
+		if (finished || !flush_pending())
+			return traits_type::eof();
+		if (!traits_type::eq_int_type(ch, traits_type::eof()))
+		{
+			*pptr() = traits_type::to_char_type(ch);
+			pbump(1);
+		}
+		return traits_type::not_eof(ch);
+	}
+
+	std::streamsize xsputn(const char * s, std::streamsize n) override
+	{
+		//small writes are gathered in the put area, large ones are processed straight from the caller's buffer
+		if (n < epptr() - pptr())
+			return std::streambuf::xsputn(s, n);
+		if (finished || !flush_pending() || !write_through(reinterpret_cast<const unsigned char *>(s), n))
+			return 0;
+		return n;
+	}
+
+	//Partial blocks can only be written by finish, sync writes the rest
+	int sync() override
+	{
+		if (!finished && !flush_pending())
+			return -1;
+		return target->pubsync();
+	}
+
+	int_type underflow() override
+	{
+		while (gptr() == egptr())
+		{
+			std::size_t produced = 0;
+			std::streamsize n;
+
+			if (finished)
+				return traits_type::eof();
+			reading = true;
+			if (engine.operation() == enc && !header_written)
+			{
+				std::copy(engine.header().begin(), engine.header().end(), output.begin());
+				produced = cipher::header_size;
+				header_written = true;
+			}
+
+			n = target->sgetn(pending.data(), buffer_size);
+			if (n > 0)
+				produced += engine.update({ reinterpret_cast<const unsigned char *>(pending.data()), (std::size_t)n }, output_span().subspan(produced));
+			else
+			{
+				produced += engine.final(output_span().subspan(produced));
+				finished = true;
+			}
+			setg(output_chars(), output_chars(), output_chars() + produced);
+		}
+		return traits_type::to_int_type(*gptr());
+	}
+
+private:
+	std::span<unsigned char> output_span() { return { output.data(), output.size() }; }
+	char * output_chars() { return reinterpret_cast<char *>(output.data()); }
+
+	bool put_output(std::size_t len)
+	{
+		return target->sputn(output_chars(), len) == (std::streamsize)len;
+	}
+
+	bool write_header()
+	{
+		if (engine.operation() != enc || header_written)
+			return true;
+		header_written = true;
+		return target->sputn(reinterpret_cast<const char *>(engine.header().data()), cipher::header_size) == (std::streamsize)cipher::header_size;
+	}
+
+	bool write_through(const unsigned char * data, std::size_t len)
+	{
+		if (len == 0)
+			return true;
+		if (!write_header())
+			return false;
+		while (len > 0)
+		{
+			std::size_t slice = len < buffer_size ? len : buffer_size;
+			if (!put_output(engine.update({ data, slice }, output_span())))
+				return false;
+			data += slice;
+			len -= slice;
+		}
+		return true;
+	}
+
+	bool flush_pending()
+	{
+		std::size_t len = pptr() - pbase();
+		setp(pending.data(), pending.data() + pending.size());
+		return write_through(reinterpret_cast<const unsigned char *>(pending.data()), len);
+	}
+
+	std::streambuf * target;
+	cipher engine;
+	std::size_t buffer_size;
+	std::vector<char> pending;
+	std::vector<unsigned char> output;
+	bool header_written = false;
+	bool reading = false;
+	bool finished = false;
+};
+
+}
@@ -0,0 +1,486 @@
+//Asynchronous C++20 interface for services that run on an event loop, over cfeistel.hpp: encryption and decryption of
+//a buffer or of a file descriptor are coroutines (cfeistel::task) that process the data in bounded slices of blocks on a
+//shared cfeistel::executor, so the thread that co_awaits them is never blocked by the cipher. After every slice the
+//operation goes back to the end of the executor's queue, so many operations share the threads fairly; a std::stop_token
+//cancels an operation between two slices, and the executor admits a bounded number of operations at a time, suspending
+//the ones that come later until a running one completes. An operation on non-blocking descriptors that aren't ready is
+//suspended until they are, watched by a thread of the executor that runs no slices, so it doesn't hold up the others.
+//The chaining state of the modes of operation is carried from one slice to the next in the mode_state of the stream,
+//so slices of the same operation can run on any thread.
+#pragma once
+
+#include <cerrno>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "poll.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "cfeistel.hpp"
+
+namespace cfeistel {
+
+//bytes processed by an operation before it yields to the others
+constexpr std::size_t default_slice = 1048576;
+
+//Thrown by the operations whose stop_token was triggered
+class cancelled : public std::runtime_error {
+public:
+	cancelled() : std::runtime_error("cfeistel: operation cancelled") {}
+};
+
+//Threads that run the slices of the operations. Every slice is spread across all the cpus by the kernels already,
+//so one thread is enough unless slices are made very small.
+class executor {
+public:
+	explicit executor(unsigned threads = 1, std::size_t max_operations = 64) : max_operations(max_operations)
+	{
+		if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+			throw std::system_error(errno, std::generic_category(), "cfeistel: can't create the executor");
+		for (unsigned i = 0; i < (threads > 0 ? threads : 1); i++)
+			workers.emplace_back([this] { run(); });
+		watcher = std::thread([this] { watch_loop(); });
+	}
+	~executor()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto & worker : workers)
+			worker.join();
+
+		{
+			std::lock_guard<std::mutex> guard(watch_lock);
+			watch_stopping = true;
+		}
+		notify_watcher();
+		watcher.join();
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+	}
+	executor(const executor &) = delete;
+	executor & operator=(const executor &) = delete;
+
+	//Resumes the awaiting coroutine on a thread of the executor, after the slices already queued
+	auto schedule()
+	{
+		struct awaiter {
+			executor & ex;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> caller) { ex.post(caller); }
+			void await_resume() const noexcept {}
+		};
+		return awaiter{ *this };
+	}
+
+	//Resumes the awaiting coroutine on a thread of the executor once fd is ready for events (POLLIN or POLLOUT).
+	//Until then the coroutine is only watched, the threads of the executor run the slices of the other operations.
+	auto ready(int fd, short events)
+	{
+		struct awaiter {
+			executor & ex;
+			int fd;
+			short events;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> caller) { ex.watch(fd, events, caller); }
+			void await_resume() const noexcept {}
+		};
+		return awaiter{ *this, fd, events };
+	}
+
+	//An admitted operation holds its slot until the slot is destroyed
+	class slot {
+	public:
+		explicit slot(executor * ex) : ex(ex) {}
+		slot(slot && other) noexcept : ex(std::exchange(other.ex, nullptr)) {}
+		slot(const slot &) = delete;
+		~slot() { if (ex != nullptr) ex->release(); }
+	private:
+		executor * ex;
+	};
+
+	//Admits the awaiting operation, or suspends it until one of the max_operations running ones completes
+	auto admit()
+	{
+		struct awaiter {
+			executor & ex;
+			bool await_ready()
+			{
+				std::lock_guard<std::mutex> guard(ex.lock);
+				if (ex.running < ex.max_operations)
+				{
+					ex.running++;
+					return true;
+				}
+				return false;
+			}
+			bool await_suspend(std::coroutine_handle<> caller)
+			{
+				std::lock_guard<std::mutex> guard(ex.lock);
+				//a slot could have been freed since await_ready
+				if (ex.running < ex.max_operations)
+				{
+					ex.running++;
+					return false;
+				}
+				ex.waiting.push_back(caller);
+				return true;
+			}
+			slot await_resume() { return slot(&ex); }
+		};
+		return awaiter{ *this };
+	}
+
+private:
+	void post(std::coroutine_handle<> coroutine)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			queue.push_back(coroutine);
+		}
+		wake.notify_one();
+	}
+
+	//The slot of a completed operation goes to the first one waiting, if any
+	void release()
+	{
+		std::coroutine_handle<> next;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (waiting.empty())
+			{
+				running--;
+				return;
+			}
+			next = waiting.front();
+			waiting.pop_front();
+		}
+		post(next);
+	}
+
+	void run()
+	{
+		for (;;)
+		{
+			std::coroutine_handle<> next;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this] { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+				next = queue.front();
+				queue.pop_front();
+			}
+			next.resume();
+		}
+	}
+
+	struct watched {
+		int fd;
+		short events;
+		std::coroutine_handle<> coroutine;
+	};
+
+	void watch(int fd, short events, std::coroutine_handle<> coroutine)
+	{
+		{
+			std::lock_guard<std::mutex> guard(watch_lock);
+			added.push_back({ fd, events, coroutine });
+		}
+		notify_watcher();
+	}
+
+	void notify_watcher()
+	{
+		char wakeup = 0;
+		[[maybe_unused]] ssize_t n = ::write(wake_pipe[1], &wakeup, 1);
+	}
+
+	//Waits for the watched descriptors (and for the pipe that announces new ones) and posts the coroutines of the ones
+	//that are ready, errors and hangups included: the operation finds out about them when it retries
+	void watch_loop()
+	{
+		std::vector<watched> watching;
+		std::vector<pollfd> fds;
+
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> guard(watch_lock);
+				if (watch_stopping)
+					return;
+				watching.insert(watching.end(), added.begin(), added.end());
+				added.clear();
+			}
+
+			fds.assign(1, pollfd{ wake_pipe[0], POLLIN, 0 });
+			for (const auto & entry : watching)
+				fds.push_back(pollfd{ entry.fd, entry.events, 0 });
+			if (poll(fds.data(), fds.size(), -1) == -1)
+				continue;
+
+			if (fds[0].revents != 0)
+			{
+				char drain[64];
+				while (::read(wake_pipe[0], drain, sizeof(drain)) > 0)
+					;
+			}
+			for (std::size_t i = watching.size(); i-- > 0; )
+				if (fds[i + 1].revents != 0)
+				{
+					post(watching[i].coroutine);
+					watching.erase(watching.begin() + i);
+				}
+		}
+	}
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::coroutine_handle<>> queue;
+	std::deque<std::coroutine_handle<>> waiting;
+	std::vector<std::thread> workers;
+	std::size_t max_operations;
+	std::size_t running = 0;
+	bool stopping = false;
+
+	std::mutex watch_lock;
+	std::vector<watched> added;
+	std::thread watcher;
+	int wake_pipe[2];
+	bool watch_stopping = false;
+};
+
+//Lazy coroutine returning a T: it starts when it's co_awaited, and the awaiting coroutine is resumed where it completes
+//(on a thread of the executor for the operations below)
+template <typename T>
+class task {
+public:
+	struct promise_type {
+		std::optional<T> value;
+		std::exception_ptr error;
+		std::coroutine_handle<> continuation;
+
+		task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		auto final_suspend() noexcept
+		{
+			struct awaiter {
+				bool await_ready() const noexcept { return false; }
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> done) noexcept
+				{
+					if (done.promise().continuation)
+						return done.promise().continuation;
+					return std::noop_coroutine();
+				}
+				void await_resume() const noexcept {}
+			};
+			return awaiter{};
+		}
+		void return_value(T result) { value = std::move(result); }
+		void unhandled_exception() { error = std::current_exception(); }
+	};
+
+	task(task && other) noexcept : coroutine(std::exchange(other.coroutine, nullptr)) {}
+	task(const task &) = delete;
+	~task() { if (coroutine) coroutine.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+	{
+		coroutine.promise().continuation = caller;
+		return coroutine;
+	}
+	T await_resume()
+	{
+		if (coroutine.promise().error)
+			std::rethrow_exception(coroutine.promise().error);
+		return std::move(*coroutine.promise().value);
+	}
+
+private:
+	explicit task(std::coroutine_handle<promise_type> coroutine) : coroutine(coroutine) {}
+	std::coroutine_handle<promise_type> coroutine;
+};
+
+namespace detail {
+
+//Coroutine that starts right away and frees itself, used to await a task from code that isn't a coroutine
+struct detached {
+	struct promise_type {
+		detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+template <typename T>
+struct waiter {
+	std::mutex lock;
+	std::condition_variable done_signal;
+	bool done = false;
+	std::optional<T> value;
+	std::exception_ptr error;
+};
+
+template <typename T>
+detached await_into(task<T> & operation, waiter<T> & result)
+{
+	try
+	{
+		result.value.emplace(co_await operation);
+	}
+	catch (...)
+	{
+		result.error = std::current_exception();
+	}
+	std::lock_guard<std::mutex> guard(result.lock);
+	result.done = true;
+	result.done_signal.notify_one();
+}
+
+//Writes the whole of data to fd, suspending the operation while a non-blocking fd can't take more
+inline task<bool> write_all(executor & ex, int fd, const unsigned char * data, std::size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = ::write(fd, data, len);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			co_await ex.ready(fd, POLLOUT);
+		else if (n == -1 && errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "cfeistel: error in writing the output");
+		else if (n > 0)
+		{
+			data += n;
+			len -= n;
+		}
+	}
+	co_return true;
+}
+
+//Reads what is available from fd (0 at its end), suspending the operation while a non-blocking fd has nothing to read
+inline task<std::size_t> read_some(executor & ex, int fd, unsigned char * data, std::size_t len)
+{
+	for (;;)
+	{
+		ssize_t n = ::read(fd, data, len);
+		if (n >= 0)
+			co_return static_cast<std::size_t>(n);
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			co_await ex.ready(fd, POLLIN);
+		else if (errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "cfeistel: error in reading the input");
+	}
+}
+
+}
+
+//Blocks until operation completes and returns its result, for code that isn't a coroutine
+template <typename T>
+T sync_wait(task<T> operation)
+{
+	detail::waiter<T> result;
+	detail::await_into(operation, result);
+
+	std::unique_lock<std::mutex> guard(result.lock);
+	result.done_signal.wait(guard, [&] { return result.done; });
+	if (result.error)
+		std::rethrow_exception(result.error);
+	return std::move(*result.value);
+}
+
+//Encrypts or decrypts in into out, slice bytes at a time, and returns the size of the output. out needs room for
+//in.size() + cipher::header_size + cipher::slack bytes; both buffers must stay valid until the operation completes.
+//Throws cancelled if stop is triggered, and what cipher throws (wrong key, truncated ciphertext).
+inline task<std::size_t> transform(executor & ex, enum operation op, enum mode opmode, std::string key,
+	std::span<const unsigned char> in, std::span<unsigned char> out, std::stop_token stop = {}, std::size_t slice = default_slice)
+{
+	executor::slot admitted = co_await ex.admit();
+	co_await ex.schedule();
+
+	//the keys are derived on the executor too
+	cipher engine(op, opmode, key);
+	std::size_t written = 0;
+
+	if (op == enc)
+	{
+		if (out.size() < cipher::header_size)
+			throw std::length_error("cfeistel: output buffer too small");
+		std::copy(engine.header().begin(), engine.header().end(), out.begin());
+		written = cipher::header_size;
+	}
+
+	for (std::size_t done = 0; done < in.size(); done += slice)
+	{
+		if (stop.stop_requested())
+			throw cancelled();
+		written += engine.update(in.subspan(done, std::min(slice, in.size() - done)), out.subspan(written));
+		co_await ex.schedule();
+	}
+	written += engine.final(out.subspan(written));
+
+	co_return written;
+}
+
+inline task<std::size_t> encrypt(executor & ex, enum mode opmode, std::string key, std::span<const unsigned char> in,
+	std::span<unsigned char> out, std::stop_token stop = {}, std::size_t slice = default_slice)
+{
+	return transform(ex, enc, opmode, std::move(key), in, out, std::move(stop), slice);
+}
+
+inline task<std::size_t> decrypt(executor & ex, enum mode opmode, std::string key, std::span<const unsigned char> in,
+	std::span<unsigned char> out, std::stop_token stop = {}, std::size_t slice = default_slice)
+{
+	return transform(ex, dec, opmode, std::move(key), in, out, std::move(stop), slice);
+}
+
+//Encrypts or decrypts what is read from in_fd until the end of it into out_fd, and returns the bytes written.
+//A slice is read only once the previous one has been written, so a slow output slows the reading down instead of
+//piling up data in memory. Non-blocking descriptors that aren't ready suspend the operation until they are (see
+//executor::ready); a blocking descriptor, like a regular file, holds the executor thread while it waits.
+inline task<unsigned long> transform_fd(executor & ex, enum operation op, enum mode opmode, std::string key,
+	int in_fd, int out_fd, std::stop_token stop = {}, std::size_t slice = default_slice)
+{
+	executor::slot admitted = co_await ex.admit();
+	co_await ex.schedule();
+
+	cipher engine(op, opmode, key);
+	std::vector<unsigned char> input(slice);
+	std::vector<unsigned char> output(slice + cipher::slack);
+	unsigned long written = 0;
+	std::size_t n;
+
+	if (op == enc)
+	{
+		co_await detail::write_all(ex, out_fd, engine.header().data(), cipher::header_size);
+		written = cipher::header_size;
+	}
+
+	while ((n = co_await detail::read_some(ex, in_fd, input.data(), slice)) > 0)
+	{
+		if (stop.stop_requested())
+			throw cancelled();
+		n = engine.update({ input.data(), n }, output);
+		co_await detail::write_all(ex, out_fd, output.data(), n);
+		written += n;
+		co_await ex.schedule();
+	}
+	n = engine.final(output);
+	co_await detail::write_all(ex, out_fd, output.data(), n);
+
+	co_return written + n;
+}
+
+}
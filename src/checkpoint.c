@@ -0,0 +1,226 @@
+//This module lets an interrupted run continue where it stopped instead of starting over from the first byte.
+//With --checkpoint, after every chunk the output is synced to disk and a checkpoint is saved next to it: the number of
+//chunks written, where the next chunk starts in the input and in the output, the chaining state of the mode of
+//operation (the CBC/PCBC chain block, the CTR counter, the OFB feedback block), and in encryption the header and the
+//trailer entries of the chunks written so far. The checkpoint is replaced atomically, so it never describes a chunk
+//that isn't on disk yet.
+//With --resume, the checkpoint is checked against the input and the partial output (the last committed chunk is hashed
+//again), the output is truncated to the last committed chunk and the run continues from the next one.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "unistd.h"
+#include "sys/stat.h"
+#include "common.h"
+#include "auth.h"
+#include "merkle.h"
+#include "checkpoint.h"
+#include "openssl/evp.h"
+
+bool checkpoint_enabled = false;
+bool resume_enabled = false;
+
+void checkpoint_init(checkpoint_state * state, const char * outfile)
+{
+	memset(state, 0, sizeof(checkpoint_state));
+	state->path = malloc(strlen(outfile) + strlen(CHECKPOINT_SUFFIX) + 1);
+	strcpy(state->path, outfile);
+	strcat(state->path, CHECKPOINT_SUFFIX);
+	memcpy(state->saved.magic, CHECKPOINT_MAGIC, sizeof(state->saved.magic));
+}
+
+//Fills the checkpoint with what identifies the run, for a run that starts from the beginning
+void checkpoint_start(checkpoint_state * state, const enum operation op, const enum mode opmode, const block header[HEADER_BLOCKS],
+	const unsigned long header_size, FILE * read_file)
+{
+	struct stat info;
+
+	if (fstat(fileno(read_file), &info) == 0)
+	{
+		state->saved.input_size = info.st_size;
+		state->saved.input_mtime = info.st_mtime;
+	}
+	state->saved.op = op;
+	state->saved.opmode = opmode;
+	state->saved.header_size = header_size;
+	memcpy(state->saved.header, header, sizeof(state->saved.header));
+}
+
+void checkpoint_release(checkpoint_state * state)
+{
+	free(state->path);
+	free(state->tags);
+	free(state->digests);
+	memset(state, 0, sizeof(checkpoint_state));
+}
+
+//Loads the checkpoint of an interrupted run, if there is one. Returns 1 if it was loaded, 0 if there's no checkpoint
+//(the run starts from the beginning) and -1 if it belongs to a different input, operation or mode of operation.
+int checkpoint_load(checkpoint_state * state, const enum operation op, const enum mode opmode, FILE * read_file)
+{
+	checkpoint saved;
+	struct stat info;
+	FILE * ckpt_file = fopen(state->path, "rb");
+
+	if (ckpt_file == NULL)
+		return 0;
+
+	if (fread(&saved, sizeof(checkpoint), 1, ckpt_file) != 1 || memcmp(saved.magic, CHECKPOINT_MAGIC, sizeof(saved.magic)) != 0
+		|| fstat(fileno(read_file), &info) == -1)
+	{
+		fclose(ckpt_file);
+		return -1;
+	}
+
+	if (saved.op != op || saved.opmode != opmode || saved.input_size != info.st_size || saved.input_mtime != info.st_mtime
+		|| saved.nchunk == 0 || saved.last_size == 0 || saved.last_size > saved.output_offset)
+	{
+		fclose(ckpt_file);
+		return -1;
+	}
+
+	state->tags = malloc((saved.ntags > 0 ? saved.ntags : 1) * sizeof(block));
+	state->digests = malloc((saved.ndigests > 0 ? saved.ndigests : 1) * DIGESTSIZE);
+	if (fread(state->tags, sizeof(block), saved.ntags, ckpt_file) != saved.ntags
+		|| fread(state->digests, DIGESTSIZE, saved.ndigests, ckpt_file) != saved.ndigests)
+	{
+		fclose(ckpt_file);
+		return -1;
+	}
+
+	fclose(ckpt_file);
+	state->saved = saved;
+	state->resumed = true;
+	return 1;
+}
+
+//Checks that the partial output is the one described by the checkpoint (in encryption it starts with the same header,
+//and the last committed chunk has the same digest), then drops whatever was written after that chunk.
+//Returns -1 if the output doesn't match.
+int checkpoint_check_output(checkpoint_state * state, FILE * write_file)
+{
+	unsigned char * piece = malloc(1048576);
+	unsigned char digest[DIGESTSIZE];
+	EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+	block header[HEADER_BLOCKS];
+	unsigned long left = state->saved.last_size;
+	int ret = 0;
+
+	fseek(write_file, 0, SEEK_END);
+	if (ftell(write_file) < state->saved.output_offset)
+		ret = -1;
+
+	if (ret == 0 && state->saved.op == enc)
+	{
+		fseek(write_file, 0, SEEK_SET);
+		if (fread(header, BLOCKSIZE, HEADER_BLOCKS, write_file) != HEADER_BLOCKS || memcmp(header, state->saved.header, sizeof(header)) != 0)
+			ret = -1;
+	}
+
+	if (ret == 0)
+	{
+		fseek(write_file, state->saved.output_offset - state->saved.last_size, SEEK_SET);
+		EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+		while (left > 0)
+		{
+			unsigned long len = left < 1048576 ? left : 1048576;
+			if (fread(piece, 1, len, write_file) != len)
+				break;
+			EVP_DigestUpdate(ctx, piece, len);
+			left -= len;
+		}
+		EVP_DigestFinal_ex(ctx, digest, NULL);
+		if (left > 0 || memcmp(digest, state->saved.last_digest, DIGESTSIZE) != 0)
+			ret = -1;
+	}
+
+	EVP_MD_CTX_free(ctx);
+	free(piece);
+	if (ret == -1)
+		return -1;
+
+	fflush(write_file);
+	if (ftruncate(fileno(write_file), state->saved.output_offset) == -1)
+		return -1;
+	fseek(write_file, 0, SEEK_END);
+
+	return 0;
+}
+
+//Brings the trailers up to the last committed chunk: in encryption the tags and digests of the chunks already
+//written are restored, in decryption the chunks already verified are skipped
+void checkpoint_restore(checkpoint_state * state, auth_state * auth, merkle_state * merkle)
+{
+	if (state->saved.op == dec)
+	{
+		auth->next_tag = state->saved.nchunk;
+		merkle->next_digest = state->saved.nchunk;
+		return;
+	}
+
+	if (state->saved.ntags > 0)
+	{
+		auth->tags = realloc(auth->tags, state->saved.ntags * sizeof(block));
+		memcpy(auth->tags, state->tags, state->saved.ntags * sizeof(block));
+		auth->ntags = auth->next_tag = auth->tags_capacity = state->saved.ntags;
+	}
+	if (state->saved.ndigests > 0)
+	{
+		merkle->digests = realloc(merkle->digests, state->saved.ndigests * DIGESTSIZE);
+		memcpy(merkle->digests, state->digests, state->saved.ndigests * DIGESTSIZE);
+		merkle->ndigests = merkle->next_digest = merkle->digests_capacity = state->saved.ndigests;
+	}
+}
+
+//Commits the chunk that has just been written (its bytes of output are passed in output): the output file is
+//synced, then the checkpoint is written to a temporary file that replaces the previous one.
+//The caller fills nchunk, input_offset, mode and last_size of state->saved first. Returns -1 in case of error.
+int checkpoint_commit(checkpoint_state * state, FILE * write_file, const unsigned char * output, const auth_state * auth, const merkle_state * merkle)
+{
+	char * tmp_path = malloc(strlen(state->path) + 5);
+	FILE * ckpt_file;
+	int ret = 0;
+
+	if (fflush(write_file) != 0 || fdatasync(fileno(write_file)) == -1)
+	{
+		free(tmp_path);
+		return -1;
+	}
+
+	state->saved.output_offset = ftell(write_file);
+	EVP_Digest(output, state->saved.last_size, state->saved.last_digest, NULL, EVP_sha256(), NULL);
+	//the trailers of the chunks already decrypted are in the input, only encryption has to save them
+	state->saved.ntags = (auth_enabled && state->saved.op == enc) ? auth->ntags : 0;
+	state->saved.ndigests = (merkle_enabled && state->saved.op == enc) ? merkle->ndigests : 0;
+
+	strcpy(tmp_path, state->path);
+	strcat(tmp_path, ".tmp");
+	ckpt_file = fopen(tmp_path, "wb");
+	if (ckpt_file == NULL)
+	{
+		free(tmp_path);
+		return -1;
+	}
+
+	if (fwrite(&state->saved, sizeof(checkpoint), 1, ckpt_file) != 1
+		|| fwrite(auth->tags, sizeof(block), state->saved.ntags, ckpt_file) != state->saved.ntags
+		|| fwrite(merkle->digests, DIGESTSIZE, state->saved.ndigests, ckpt_file) != state->saved.ndigests
+		|| fflush(ckpt_file) != 0 || fsync(fileno(ckpt_file)) == -1)
+		ret = -1;
+
+	fclose(ckpt_file);
+	if (ret == 0 && rename(tmp_path, state->path) == -1)
+		ret = -1;
+
+	free(tmp_path);
+	return ret;
+}
+
+//Removes the checkpoint once the output is complete
+void checkpoint_finish(checkpoint_state * state)
+{
+	unlink(state->path);
+	checkpoint_release(state);
+}
@@ -0,0 +1,50 @@
+//Checkpoints of long runs, written with --checkpoint and used by --resume
+//The checkpoint of outfile is saved in outfile.ckpt after every chunk that has been written and synced to disk,
+//and removed once the output is complete. It holds a checkpoint followed by the ntags authentication tags and the
+//ndigests chunk digests of the ciphertext written so far (in encryption).
+#define CHECKPOINT_MAGIC "CFCKPT01"
+#define CHECKPOINT_SUFFIX ".ckpt"
+
+extern bool checkpoint_enabled;
+extern bool resume_enabled;
+
+typedef struct checkpoint {
+	char magic[8];
+	unsigned int op;
+	unsigned int opmode;
+	//the input must not change between the interrupted run and the resumed one
+	unsigned long input_size;
+	long input_mtime;
+	unsigned long header_size;
+	block header[HEADER_BLOCKS];
+	//number of chunks committed, and where the next one starts in the payload and in the output file
+	unsigned long nchunk;
+	unsigned long input_offset;
+	unsigned long output_offset;
+	//size and digest of the last committed chunk of output, to check that the partial output is still the one we wrote
+	unsigned long last_size;
+	unsigned char last_digest[DIGESTSIZE];
+	mode_state mode;
+	unsigned long ntags;
+	unsigned long ndigests;
+}checkpoint;
+
+typedef struct checkpoint_state {
+	char * path;
+	checkpoint saved;
+	//trailer entries of the committed chunks, loaded from the checkpoint
+	block * tags;
+	unsigned char (* digests)[DIGESTSIZE];
+	//the run continues an interrupted one
+	bool resumed;
+}checkpoint_state;
+
+void checkpoint_init(checkpoint_state * state, const char * outfile);
+void checkpoint_start(checkpoint_state * state, const enum operation op, const enum mode opmode, const block header[HEADER_BLOCKS],
+	const unsigned long header_size, FILE * read_file);
+void checkpoint_release(checkpoint_state * state);
+int checkpoint_load(checkpoint_state * state, const enum operation op, const enum mode opmode, FILE * read_file);
+int checkpoint_check_output(checkpoint_state * state, FILE * write_file);
+void checkpoint_restore(checkpoint_state * state, auth_state * auth, merkle_state * merkle);
+int checkpoint_commit(checkpoint_state * state, FILE * write_file, const unsigned char * output, const auth_state * auth, const merkle_state * merkle);
+void checkpoint_finish(checkpoint_state * state);
@@ -0,0 +1,171 @@
+//Tiny client for the daemon mode (cfeistel daemon): it opens the input and output files, passes them to the daemon
+//together with the operation, mode and key, and waits for the result. It doesn't link any of the cipher code.
+//Usage: cfeistel-client <enc|dec> [-k key] [-i infile] [-o outfile] [-m mode] [--socket=path]
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/socket.h"
+#include "sys/stat.h"
+#include "sys/un.h"
+#include "getopt.h"
+#include "common.h"
+#include "daemon.h"
+
+//Sends the request with the two file descriptors attached, then the key
+static int send_request(const int conn, const daemon_request * request, const char * key, const int in_fd, const int out_fd)
+{
+	union {
+		char buffer[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {(void *)request, sizeof(daemon_request)};
+	struct msghdr message;
+	struct cmsghdr * cmsg;
+	int fds[2] = {in_fd, out_fd};
+
+	memset(&control, 0, sizeof(control));
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+
+	cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(conn, &message, 0) != sizeof(daemon_request))
+		return -1;
+	if (write(conn, key, request->key_len) != request->key_len)
+		return -1;
+
+	return 0;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s <enc|dec> [-k key] [-i infile] [-o outfile] [-m mode] [--socket=path]\n", name);
+}
+
+int main(int argc, char * argv[])
+{
+	daemon_request request = {DAEMON_MAGIC, enc, DEFAULT_MODE, 0};
+	daemon_response response;
+	struct sockaddr_un address;
+	struct stat info;
+	const char * key = "secretkey";
+	const char * infile = "in";
+	const char * outfile = "out";
+	const char * socket_path = DAEMON_SOCKET;
+	int opt;
+	int conn, in_fd, out_fd;
+
+	static struct option long_options[] =
+	{
+		{"key", required_argument, NULL, 'k'},
+		{"infile", required_argument, NULL, 'i'},
+		{"outfile", required_argument, NULL, 'o'},
+		{"mode", required_argument, NULL, 'm'},
+		{"socket", required_argument, NULL, 'S'},
+		{NULL, 0, NULL, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "k:i:o:m:", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'k':
+				key = optarg;
+				break;
+			case 'i':
+				infile = optarg;
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			case 'S':
+				socket_path = optarg;
+				break;
+			case 'm':
+				if (strcmp(optarg, "ecb") == 0)
+					request.mode = ecb;
+				else if (strcmp(optarg, "cbc") == 0)
+					request.mode = cbc;
+				else if (strcmp(optarg, "ctr") == 0)
+					request.mode = ctr;
+				else if (strcmp(optarg, "ofb") == 0)
+					request.mode = ofb;
+				else if (strcmp(optarg, "pcbc") == 0)
+					request.mode = pcbc;
+				else if (strcmp(optarg, "cfb") == 0)
+					request.mode = cfb;
+				else
+				{
+					usage(argv[0]);
+					return -1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if (optind < argc && strcmp(argv[optind], "dec") == 0)
+		request.op = dec;
+	else if (optind < argc && strcmp(argv[optind], "enc") != 0)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	request.key_len = strlen(key);
+	if (request.key_len == 0 || request.key_len > DAEMON_MAX_KEY || strlen(socket_path) >= sizeof(address.sun_path))
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	in_fd = open(infile, O_RDONLY);
+	out_fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (in_fd == -1 || out_fd == -1)
+	{
+		fprintf(stderr, "Error in opening files!\n");
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	conn = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (conn == -1 || connect(conn, (struct sockaddr *)&address, sizeof(address)) == -1)
+	{
+		fprintf(stderr, "Can't connect to the daemon on %s\n", socket_path);
+		unlink(outfile);
+		return -1;
+	}
+
+	if (send_request(conn, &request, key, in_fd, out_fd) == -1 || read(conn, &response, sizeof(response)) != sizeof(response))
+		response.status = -1;
+	close(conn);
+	close(in_fd);
+
+	if (response.status != 0)
+	{
+		fprintf(stderr, "The request failed, see the daemon output for the reason\n");
+		//nothing is written when the key is wrong, the output of a file that failed authentication halfway is kept
+		if (fstat(out_fd, &info) == 0 && info.st_size == 0)
+			unlink(outfile);
+		close(out_fd);
+		return -1;
+	}
+
+	close(out_fd);
+	return 0;
+}
@@ -5,9 +5,26 @@
 #define BLOCKSIZE 16
 #define KEYSIZE BLOCKSIZE/2
 #define NROUND 10
+//salt, IV and key check blocks
+#define HEADER_BLOCKS 3
+#define HEADER_MAGIC "CFEIST01"
+#define KCV_SIZE 4
+#define ITERATIONS_SIZE 3
+//index in the right half of the key check block of the byte holding the flags of the file
+#define HEADER_FLAGS (KCV_SIZE + ITERATIONS_SIZE)
+#define FLAG_COMPRESSED 0x01
+//sector volume, see sector.c
+#define FLAG_SECTOR 0x02
+//archive of many files, see archive.c
+#define FLAG_ARCHIVE 0x04
+//only the data extents of a sparse file, see sparse.c
+#define FLAG_SPARSE 0x08
+//authentication tags and integrity trailer, see auth.c and merkle.c
+#define FLAG_AUTH 0x10
+#define FLAG_MERKLE 0x20
 
-enum operation{enc, dec};
-enum mode{cbc, ecb, ctr, ofb, pcbc, cfb};
+enum operation{enc, dec, verify, serve, rekey, read_range, write_range, pack, unpack, contents};
+enum mode{cbc, ecb, ctr, ofb, pcbc, cfb, xts};
 enum outmode{specified, replace};
 
 //this structure represents the state of a block throught the rounds
@@ -16,5 +33,14 @@ typedef struct block {
     unsigned char right [BLOCKSIZE/2];
 }block;
 
+//chaining state of a mode of operation, carried over from one chunk of a file to the next
+typedef struct mode_state {
+    bool first_chunk;
+    unsigned long counter;
+    block chain;
+    unsigned long current_block;
+}mode_state;
+
 extern long unsigned total_file_size;
-extern struct timeval start_time;
\ No newline at end of file
+extern struct timeval start_time;
+extern bool progress_enabled;
\ No newline at end of file
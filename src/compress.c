@@ -0,0 +1,386 @@
+//This module compresses the plaintext before encryption (and decompresses it after decryption), for inputs like logs
+//and database dumps where writing the ciphertext of every raw byte would make the run disk-bound.
+//Every chunk is split into frames of COMPRESS_FRAME bytes that are compressed independently, on all threads at once,
+//with a small LZ77 codec in the style of LZ4 (literal runs and back-references of at least MIN_MATCH bytes within
+//MAX_OFFSET bytes). Each frame records its plaintext and compressed lengths, so decompression finds the frame
+//boundaries with a quick scan of the headers and decompresses the frames in parallel too.
+//Frames that don't shrink are stored as they are, so a frame never grows beyond its header.
+//The compressed stream is staged here and handed out to the chunk loop in chunks of BUFSIZE bytes, so the modes of
+//operation, padding, authentication and integrity trailers work on it exactly as they do on uncompressed plaintext.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "common.h"
+#include "stats.h"
+#include "numa.h"
+#include "compress.h"
+#include "omp.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_LOG 14
+//the last bytes of a frame are always literals, so that matches can be extended without bounds checks on every byte
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define RUN_MASK 15
+
+bool compress_enabled = false;
+
+static inline uint32_t read32(const unsigned char * bytes)
+{
+	uint32_t value;
+	memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+static inline void write_le32(unsigned char * bytes, const unsigned long value)
+{
+	for (int i = 0; i < 4; i++)
+		bytes[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static inline unsigned long read_le32(const unsigned char * bytes)
+{
+	return (unsigned long)bytes[0] | (unsigned long)bytes[1] << 8 | (unsigned long)bytes[2] << 16 | (unsigned long)bytes[3] << 24;
+}
+
+//Writes a length that didn't fit in its 4 bits of the token, as a run of 255s and a remainder
+static inline unsigned long write_length(unsigned char * dst, unsigned long op, unsigned long len)
+{
+	for (; len >= 255; len -= 255)
+		dst[op++] = 255;
+	dst[op++] = len;
+	return op;
+}
+
+//Compresses len bytes of src into dst, returns the compressed size or 0 if it wouldn't be smaller than len
+//(dst must have room for len bytes)
+static unsigned long lz_compress(unsigned char * dst, const unsigned char * src, const unsigned long len)
+{
+	//position + 1 of the last occurrence of every hashed 4 byte sequence, 0 if there's none
+	uint32_t table[1 << HASH_LOG];
+	unsigned long ip = 0, anchor = 0, op = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (len > MATCH_LIMIT && ip < len - MATCH_LIMIT)
+	{
+		uint32_t sequence = read32(src + ip);
+		uint32_t hash = (sequence * 2654435761U) >> (32 - HASH_LOG);
+		unsigned long ref = table[hash];
+		table[hash] = ip + 1;
+
+		if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != sequence)
+		{
+			ip++;
+			continue;
+		}
+		ref--;
+
+		unsigned long match = MIN_MATCH;
+		while (ip + match < len - LAST_LITERALS && src[ref + match] == src[ip + match])
+			match++;
+
+		unsigned long literals = ip - anchor;
+		//worst case for this sequence: token, literal length, literals, offset and match length
+		if (op + 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1 >= len)
+			return 0;
+
+		unsigned char * token = &dst[op++];
+		*token = (literals >= RUN_MASK ? RUN_MASK : literals) << 4 | (match - MIN_MATCH >= RUN_MASK ? RUN_MASK : match - MIN_MATCH);
+		if (literals >= RUN_MASK)
+			op = write_length(dst, op, literals - RUN_MASK);
+		memcpy(dst + op, src + anchor, literals);
+		op += literals;
+
+		dst[op++] = (ip - ref) & 0xFF;
+		dst[op++] = (ip - ref) >> 8;
+		if (match - MIN_MATCH >= RUN_MASK)
+			op = write_length(dst, op, match - MIN_MATCH - RUN_MASK);
+
+		ip += match;
+		anchor = ip;
+	}
+
+	//the last sequence only has literals
+	unsigned long literals = len - anchor;
+	if (op + 1 + literals / 255 + 1 + literals >= len)
+		return 0;
+
+	dst[op++] = (literals >= RUN_MASK ? RUN_MASK : literals) << 4;
+	if (literals >= RUN_MASK)
+		op = write_length(dst, op, literals - RUN_MASK);
+	memcpy(dst + op, src + anchor, literals);
+	op += literals;
+
+	return op;
+}
+
+//Reads a length continued after its 4 bits of the token, returns -1 if the input ends first
+static inline int read_length(const unsigned char * src, const unsigned long len, unsigned long * ip, unsigned long * value)
+{
+	unsigned char byte;
+
+	do
+	{
+		if (*ip >= len)
+			return -1;
+		byte = src[(*ip)++];
+		*value += byte;
+	} while (byte == 255);
+
+	return 0;
+}
+
+//Decompresses len bytes of src into exactly out_len bytes of dst. Every length and offset is checked,
+//since the input is only as good as the key that decrypted it: returns -1 if it's not a valid frame.
+static int lz_decompress(unsigned char * dst, const unsigned long out_len, const unsigned char * src, const unsigned long len)
+{
+	unsigned long ip = 0, op = 0;
+
+	while (ip < len)
+	{
+		unsigned char token = src[ip++];
+		unsigned long literals = token >> 4;
+		unsigned long match = token & RUN_MASK;
+		unsigned long offset;
+
+		if (literals == RUN_MASK && read_length(src, len, &ip, &literals) == -1)
+			return -1;
+		if (literals > len - ip || literals > out_len - op)
+			return -1;
+		memcpy(dst + op, src + ip, literals);
+		ip += literals;
+		op += literals;
+
+		//the last sequence ends with its literals
+		if (ip == len)
+			break;
+
+		if (len - ip < 2)
+			return -1;
+		offset = src[ip] | src[ip + 1] << 8;
+		ip += 2;
+		if (match == RUN_MASK && read_length(src, len, &ip, &match) == -1)
+			return -1;
+		match += MIN_MATCH;
+		if (offset == 0 || offset > op || match > out_len - op)
+			return -1;
+
+		//the match can overlap the bytes it's producing, so it's copied one byte at a time
+		for (unsigned long i = 0; i < match; i++, op++)
+			dst[op] = dst[op - offset];
+	}
+
+	return op == out_len ? 0 : -1;
+}
+
+//Writes the frame of len bytes of src to dst (which has room for FRAME_HEADER + len bytes), returns the frame size
+static unsigned long write_frame(unsigned char * dst, const unsigned char * src, const unsigned long len)
+{
+	unsigned long compressed = lz_compress(dst + FRAME_HEADER, src, len);
+
+	//a frame that doesn't shrink is stored, decompression recognizes it by its two lengths being equal
+	if (compressed == 0)
+	{
+		memcpy(dst + FRAME_HEADER, src, len);
+		compressed = len;
+	}
+
+	write_le32(dst, len);
+	write_le32(dst + 4, compressed);
+	return FRAME_HEADER + compressed;
+}
+
+static void grow_staging(compress_state * state, const unsigned long needed)
+{
+	if (needed <= state->staging_capacity)
+		return;
+	state->staging_capacity = needed;
+	state->staging = realloc(state->staging, state->staging_capacity);
+}
+
+void compress_init(compress_state * state)
+{
+	memset(state, 0, sizeof(compress_state));
+}
+
+void compress_release(compress_state * state)
+{
+	free(state->staging);
+	free(state->output);
+	memset(state, 0, sizeof(compress_state));
+}
+
+//Compresses a chunk of plaintext and appends its frames to the staged stream (followed by the final frame for the last chunk)
+void compress_chunk(compress_state * state, const unsigned char * data, const unsigned long len, const bool final_chunk)
+{
+	unsigned long nframes = (len + COMPRESS_FRAME - 1) / COMPRESS_FRAME;
+	unsigned long * sizes = malloc((nframes > 0 ? nframes : 1) * sizeof(unsigned long));
+	unsigned long start = state->staged - state->taken;
+	unsigned char * slots;
+
+	double compress_start = stats_clock();
+
+	//moving what's left from the previous chunk to the front
+	memmove(state->staging, state->staging + state->taken, start);
+	state->staged = start;
+	state->taken = 0;
+	grow_staging(state, start + len + COMPRESS_OVERHEAD(len));
+
+	//every frame is compressed in its own slot, right where it would go if it didn't shrink at all
+	slots = state->staging + start;
+	#pragma omp parallel
+	{
+		unsigned long begin, end;
+		numa_thread_range(nframes, &begin, &end);
+
+		for (unsigned long f = begin; f < end; f++)
+		{
+			unsigned long offset = f * COMPRESS_FRAME;
+			sizes[f] = write_frame(slots + f * (FRAME_HEADER + COMPRESS_FRAME), data + offset,
+				(len - offset < COMPRESS_FRAME) ? len - offset : COMPRESS_FRAME);
+		}
+	}
+
+	//packing the frames together, every one moves back (or stays where it is)
+	for (unsigned long f = 0; f < nframes; f++)
+	{
+		memmove(state->staging + state->staged, slots + f * (FRAME_HEADER + COMPRESS_FRAME), sizes[f]);
+		state->staged += sizes[f];
+	}
+
+	if (final_chunk)
+	{
+		memset(state->staging + state->staged, 0, FRAME_HEADER);
+		state->staged += FRAME_HEADER;
+
+		//A stream that's a multiple of BUFSIZE would end with a full chunk, which the padded modes can't tell apart
+		//from one in the middle: a byte after the final frame (ignored by decompression) avoids it
+		if ((state->total + state->staged - start) % BUFSIZE == 0)
+			state->staging[state->staged++] = 0;
+	}
+
+	state->total += state->staged - start;
+	free(sizes);
+	stats_record(stage_compress, compress_start);
+}
+
+//Copies the next chunk of the compressed stream to chunk: a full BUFSIZE one, or whatever is left once final_input
+//says that all the plaintext has been compressed. Returns its size (0 if there's no chunk ready) and sets final_chunk.
+unsigned long compress_take(compress_state * state, unsigned char * chunk, const bool final_input, bool * final_chunk)
+{
+	unsigned long left = state->staged - state->taken;
+	unsigned long len = left < BUFSIZE ? left : BUFSIZE;
+
+	if (left == 0 || (!final_input && left < BUFSIZE))
+		return 0;
+
+	*final_chunk = final_input && len == left;
+	memcpy(chunk, state->staging + state->taken, len);
+	state->taken += len;
+
+	return len;
+}
+
+//Appends decrypted data to the compressed stream, then decompresses (in parallel) and writes all the complete frames.
+//Whatever comes after the final frame is ignored. Returns -1 if the stream is not valid or can't be written.
+int decompress_output(compress_state * state, const unsigned char * data, const unsigned long len, FILE * write_file)
+{
+	if (state->finished)
+		return 0;
+
+	grow_staging(state, state->staged + len);
+	memcpy(state->staging + state->staged, data, len);
+	state->staged += len;
+
+	double compress_start = stats_clock();
+	while (!state->finished)
+	{
+		//finding the complete frames at the front of the stream, up to BUFSIZE bytes of plaintext at once
+		unsigned long max_frames = state->staged / FRAME_HEADER + 1;
+		unsigned long * frame_start = malloc(max_frames * sizeof(unsigned long));
+		unsigned long * output_start = malloc((max_frames + 1) * sizeof(unsigned long));
+		unsigned long nframes = 0;
+		unsigned long position = 0;
+		unsigned long raw_total = 0;
+		bool invalid = false;
+
+		while (state->staged - position >= FRAME_HEADER)
+		{
+			unsigned long raw = read_le32(state->staging + position);
+			unsigned long compressed = read_le32(state->staging + position + 4);
+
+			if (raw == 0 && compressed == 0)
+			{
+				state->finished = true;
+				break;
+			}
+			if (raw == 0 || raw > COMPRESS_FRAME || compressed > raw)
+			{
+				invalid = true;
+				break;
+			}
+			if (state->staged - position - FRAME_HEADER < compressed || raw_total + raw > BUFSIZE)
+				break;
+
+			frame_start[nframes] = position;
+			output_start[nframes] = raw_total;
+			nframes++;
+			position += FRAME_HEADER + compressed;
+			raw_total += raw;
+		}
+		output_start[nframes] = raw_total;
+
+		if (!invalid && raw_total > state->output_capacity)
+		{
+			state->output_capacity = raw_total;
+			state->output = realloc(state->output, state->output_capacity);
+		}
+
+		//every thread stops at the first invalid frame of its own, the flags of all of them are or'ed at the end
+		if (!invalid)
+		{
+			#pragma omp parallel reduction(||:invalid)
+			{
+				unsigned long begin, end;
+				numa_thread_range(nframes, &begin, &end);
+
+				for (unsigned long f = begin; f < end && !invalid; f++)
+				{
+					const unsigned char * frame = state->staging + frame_start[f];
+					unsigned long raw = output_start[f + 1] - output_start[f];
+					unsigned long compressed = read_le32(frame + 4);
+
+					if (compressed == raw)
+						memcpy(state->output + output_start[f], frame + FRAME_HEADER, raw);
+					else if (lz_decompress(state->output + output_start[f], raw, frame + FRAME_HEADER, compressed) == -1)
+						invalid = true;
+				}
+			}
+		}
+
+		free(frame_start);
+		free(output_start);
+		if (invalid)
+			return -1;
+
+		double write_start = stats_clock();
+		if (raw_total > 0 && fwrite(state->output, raw_total, 1, write_file) != 1)
+			return -1;
+		stats_record(stage_write, write_start);
+
+		memmove(state->staging, state->staging + position, state->staged - position);
+		state->staged -= position;
+
+		//waiting for the rest of an incomplete frame
+		if (nframes == 0)
+			break;
+	}
+	stats_record(stage_compress, compress_start);
+
+	return 0;
+}
@@ -0,0 +1,31 @@
+//Per-chunk compression, enabled with --compress
+//The plaintext is compressed in frames of up to COMPRESS_FRAME bytes, each one preceded by a FRAME_HEADER holding its
+//plaintext and compressed lengths, and terminated by an empty frame. The compressed stream is what gets encrypted.
+#define COMPRESS_FRAME 1048576
+#define FRAME_HEADER 8
+//room needed by the compressed stream of len bytes of plaintext, beyond len itself
+#define COMPRESS_OVERHEAD(len) ((((len) + COMPRESS_FRAME - 1) / COMPRESS_FRAME + 1) * FRAME_HEADER + 1)
+
+extern bool compress_enabled;
+
+//compressed stream of the file being processed, waiting to be encrypted (or decompressed)
+typedef struct compress_state {
+	unsigned char * staging;
+	unsigned long staged;
+	unsigned long staging_capacity;
+	//bytes of staging already handed out for encryption
+	unsigned long taken;
+	//size of the whole compressed stream so far
+	unsigned long total;
+	//decompressed frames waiting to be written
+	unsigned char * output;
+	unsigned long output_capacity;
+	//the final frame has been seen in decompression
+	bool finished;
+}compress_state;
+
+void compress_init(compress_state * state);
+void compress_release(compress_state * state);
+void compress_chunk(compress_state * state, const unsigned char * data, const unsigned long len, const bool final_chunk);
+unsigned long compress_take(compress_state * state, unsigned char * chunk, const bool final_input, bool * final_chunk);
+int decompress_output(compress_state * state, const unsigned char * data, const unsigned long len, FILE * write_file);
@@ -0,0 +1,214 @@
+//This module implements the daemon mode, for small latency-sensitive requests that can't afford the process startup,
+//thread creation and buffer faulting of a new cfeistel process each.
+//Every thread of the team is a worker that accepts connections on the socket and serves them one at a time: the worker
+//pool, its buffers and the derived keys (see kdf_cache_init) stay warm between requests. A request is processed by a
+//single worker with the same code as a file on the command line (the kernels' parallel regions run with one thread
+//when nested), so many requests are served at the same time.
+//Options that change the file format (--auth, --merkle, --iterations, --compress) are given to the daemon and apply to every request.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "signal.h"
+#include "unistd.h"
+#include "sys/socket.h"
+#include "sys/stat.h"
+#include "sys/un.h"
+#include "sys/time.h"
+#include "common.h"
+#include "utils.h"
+#include "bufpool.h"
+#include "kdf.h"
+#include "pipeline.h"
+#include "daemon.h"
+#include "omp.h"
+
+char * daemon_socket = DAEMON_SOCKET;
+
+static int listen_fd = -1;
+static volatile sig_atomic_t stopping = 0;
+
+//Stops the workers: shutting the socket down wakes up the ones waiting in accept
+static void stop_daemon(int signum)
+{
+	stopping = 1;
+	shutdown(listen_fd, SHUT_RDWR);
+}
+
+static int read_full(const int conn, char * buffer, unsigned long len)
+{
+	while (len > 0)
+	{
+		long n = read(conn, buffer, len);
+		if (n <= 0)
+			return -1;
+		buffer += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//Reads a request and its key from conn, saving the attached input and output descriptors in fds
+//(-1 if they're missing). Returns -1 if the request is malformed.
+static int receive_request(const int conn, daemon_request * request, char * key, int fds[2])
+{
+	union {
+		char buffer[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {request, sizeof(daemon_request)};
+	struct msghdr message;
+	struct cmsghdr * cmsg;
+
+	fds[0] = fds[1] = -1;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+
+	long received = recvmsg(conn, &message, MSG_WAITALL);
+
+	//every descriptor received is either kept or closed, a client sending the wrong number of them must not leak them
+	//(the ones that didn't fit in control have already been closed by the kernel, which sets MSG_CTRUNC)
+	for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		unsigned long nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int received_fds[nfds > 0 ? nfds : 1];
+		memcpy(received_fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+
+		if (nfds == 2 && fds[0] == -1 && !(message.msg_flags & MSG_CTRUNC))
+			memcpy(fds, received_fds, 2 * sizeof(int));
+		else
+			for (unsigned long i = 0; i < nfds; i++)
+				close(received_fds[i]);
+	}
+
+	if (received != sizeof(daemon_request) || fds[0] == -1 || fds[1] == -1)
+		return -1;
+	if (request->magic != DAEMON_MAGIC || request->op > dec || request->mode > cfb || request->key_len == 0 || request->key_len > DAEMON_MAX_KEY)
+		return -1;
+
+	if (read_full(conn, key, request->key_len) == -1)
+		return -1;
+	key[request->key_len] = '\0';
+
+	return 0;
+}
+
+//Serves one request, growing the buffers of the worker if the input doesn't fit in them
+static void serve_request(const int conn, unsigned char ** data, unsigned char ** result, unsigned long * capacity)
+{
+	daemon_request request;
+	daemon_response response = {-1, 0};
+	char key[DAEMON_MAX_KEY + 1];
+	int fds[2];
+	struct stat info;
+
+	if (receive_request(conn, &request, key, fds) == -1 || fstat(fds[0], &info) == -1)
+	{
+		exit_message(1, "Malformed request!");
+		if (fds[0] != -1)
+			close(fds[0]);
+		if (fds[1] != -1)
+			close(fds[1]);
+	}
+	else
+	{
+		unsigned long needed = pipeline_buffer_size(info.st_size);
+		if (needed > *capacity)
+		{
+			bufpool_put(*data);
+			bufpool_put(*result);
+			*data = bufpool_get(needed);
+			*result = bufpool_get(needed);
+			*capacity = needed;
+		}
+
+		//process_fds closes both descriptors
+		response.status = process_fds(fds[0], fds[1], request.op, request.mode, key, NULL, *data, *result, &response.processed);
+	}
+
+	memset(key, 0, sizeof(key));
+	write(conn, &response, sizeof(response));
+}
+
+//Listens on daemon_socket and serves requests until SIGINT or SIGTERM is received
+int daemon_run(void)
+{
+	struct sockaddr_un address;
+
+	if (strlen(daemon_socket) >= sizeof(address.sun_path))
+	{
+		exit_message(1, "The socket path is too long!");
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, daemon_socket);
+
+	//a socket left behind by a daemon that didn't stop cleanly would make bind fail, anything else at the path is left alone
+	struct stat info;
+	if (lstat(daemon_socket, &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(daemon_socket);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listen_fd, DAEMON_BACKLOG) == -1)
+	{
+		exit_message(1, "Error in opening the daemon socket!");
+		return -1;
+	}
+
+	signal(SIGINT, stop_daemon);
+	signal(SIGTERM, stop_daemon);
+	//a client that goes away before reading the response must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	//requests are served at the same time, so there's no single progress to show
+	progress_enabled = false;
+	kdf_cache_init(DAEMON_KEY_CACHE);
+	//the kernels must run on the worker that serves the request only
+	omp_set_max_active_levels(1);
+
+	exit_message(2, "Daemon ready, listening on:", daemon_socket);
+
+	#pragma omp parallel
+	{
+		unsigned long capacity = pipeline_buffer_size(DAEMON_BUFSIZE);
+		unsigned char * data = bufpool_get(capacity);
+		unsigned char * result = bufpool_get(capacity);
+
+		//faulting the buffers in before the first request
+		memset(data, 0, capacity);
+		memset(result, 0, capacity);
+
+		while (!stopping)
+		{
+			struct timeval timeout = {DAEMON_TIMEOUT, 0};
+			int conn = accept(listen_fd, NULL, NULL);
+			if (conn == -1)
+				continue;
+
+			//only the request and the response go through the socket, the data goes through the descriptors
+			setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+			serve_request(conn, &data, &result, &capacity);
+			close(conn);
+		}
+
+		bufpool_put(data);
+		bufpool_put(result);
+	}
+
+	close(listen_fd);
+	unlink(daemon_socket);
+	kdf_cache_release();
+	exit_message(1, "Daemon stopped");
+
+	return 0;
+}
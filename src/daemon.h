@@ -0,0 +1,29 @@
+//Daemon mode: a long-running process that serves encryption and decryption requests over a Unix domain socket.
+//A request is a daemon_request followed by key_len bytes of key, with the input and output file descriptors
+//attached to it (SCM_RIGHTS). The daemon answers with a daemon_response once the output has been written.
+#define DAEMON_SOCKET "/tmp/cfeistel.sock"
+#define DAEMON_MAGIC 0x31444643
+#define DAEMON_MAX_KEY 4096
+#define DAEMON_BACKLOG 64
+//number of derived keys kept between requests
+#define DAEMON_KEY_CACHE 4096
+//size of the buffers every worker faults in at startup, bigger requests grow them
+#define DAEMON_BUFSIZE 1048576
+//seconds a client has to send its request and to read the response, a silent client must not hold a worker
+#define DAEMON_TIMEOUT 5
+
+typedef struct daemon_request {
+	unsigned int magic;
+	unsigned int op;
+	unsigned int mode;
+	unsigned int key_len;
+}daemon_request;
+
+typedef struct daemon_response {
+	int status;
+	unsigned long processed;
+}daemon_response;
+
+extern char * daemon_socket;
+
+int daemon_run(void);
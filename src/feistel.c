@@ -13,14 +13,12 @@
 void process_block(unsigned char * target, unsigned char * left, unsigned char * right, const unsigned char round_keys[NROUND][KEYSIZE]) 
 {	
 	//buffer variables to temporarily store the left part of the block during the round execution
-	unsigned char * left_copy;
-	left_copy = malloc(BLOCKSIZE/2);
+	//(kept on the stack: this runs once per block, so it must not call the allocator)
+	unsigned char left_copy[BLOCKSIZE/2];
 	memcpy(left_copy, left, BLOCKSIZE/2);
-	unsigned char * right_copy;
-	right_copy = malloc(BLOCKSIZE/2);
+	unsigned char right_copy[BLOCKSIZE/2];
 	memcpy(right_copy, right, BLOCKSIZE/2);
-	unsigned char * templeft;
-	templeft = malloc(BLOCKSIZE/2);
+	unsigned char templeft[BLOCKSIZE/2];
 	memcpy(templeft, left, BLOCKSIZE/2);
 
 	for (int i=0; i<NROUND; i++)	//execution of NROUND cipher rounds on the block
@@ -39,10 +37,6 @@ void process_block(unsigned char * target, unsigned char * left, unsigned char *
 	//copying to the target variable
 	memcpy(target, left_copy, BLOCKSIZE/2);
 	memcpy(target + BLOCKSIZE/2, right_copy, BLOCKSIZE/2);
-
-	free(left_copy);
-	free(right_copy);
-	free(templeft);
 }
 
 //"f" function of the feistel cipher. Contains a VERY basic SP network. 
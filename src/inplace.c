@@ -0,0 +1,301 @@
+//This module rewrites a file in place in CTR and OFB mode, where the ciphertext has the size of the plaintext: every
+//unit of INPLACE_JOURNAL_UNIT bytes is read, encrypted (or decrypted) and written back where it was through the same
+//descriptor, so the operation needs no room for a second copy of the file. The header, which has no room in the file,
+//is written to file.hdr: file.hdr followed by the file is the same as the output of cfeistel enc.
+//Before a unit is rewritten, its content and the chaining state of the mode at its start are saved in file.journal,
+//so every byte is written twice, once to the journal and once in place. The journal has two slots of one unit that
+//are overwritten in turn, each record checksummed: a record torn by a crash doesn't match its checksum, and the one in
+//the other slot, whose unit was completely rewritten, is still there. The journal never takes more than two units.
+//An interrupted run is continued with --resume: the unit of the last valid record, which may have been partly
+//rewritten, is restored and the run starts again from it.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/stat.h"
+#include "sys/time.h"
+#include "common.h"
+#include "utils.h"
+#include "block.h"
+#include "opmodes.h"
+#include "stats.h"
+#include "auth.h"
+#include "merkle.h"
+#include "checkpoint.h"
+#include "inplace.h"
+#include "openssl/evp.h"
+
+bool inplace_enabled = false;
+
+typedef struct inplace_file {
+	int fd;
+	int journal_fd;
+	char * header_path;
+	char * journal_path;
+	inplace_journal journal;
+	unsigned char round_keys[NROUND][KEYSIZE];
+}inplace_file;
+
+static char * suffixed_path(const char * path, const char * suffix)
+{
+	char * suffixed = malloc(strlen(path) + strlen(suffix) + 1);
+	strcpy(suffixed, path);
+	strcat(suffixed, suffix);
+	return suffixed;
+}
+
+//Closes the file that couldn't be processed, then prints message. The journal is kept, so that the run can be resumed.
+//Always returns -1.
+static int abort_inplace(inplace_file * file, const char * message)
+{
+	if (file->fd >= 0)
+		close(file->fd);
+	if (file->journal_fd >= 0)
+		close(file->journal_fd);
+	free(file->header_path);
+	free(file->journal_path);
+
+	exit_message(1, message);
+	return -1;
+}
+
+//Computes in digest the checksum of the record saved, followed by the content of its unit
+static void journal_digest(const inplace_journal * saved, const unsigned char * content, unsigned char * digest)
+{
+	inplace_journal record = *saved;
+	EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+
+	memset(record.digest, 0, DIGESTSIZE);
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(ctx, &record, sizeof(inplace_journal));
+	EVP_DigestUpdate(ctx, content, saved->length);
+	EVP_DigestFinal_ex(ctx, digest, NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+//Where the record with the given number goes in the journal: the records alternate between two slots
+static off_t journal_slot(const unsigned long sequence)
+{
+	return (off_t)(sequence % 2) * (sizeof(inplace_journal) + INPLACE_JOURNAL_UNIT);
+}
+
+//Writes the record in file->journal, with chunk the content of its unit before the rewrite, over the older of the two
+//in the journal. Returns -1 in case of error.
+static int save_journal(inplace_file * file, const unsigned char * chunk)
+{
+	off_t slot = journal_slot(file->journal.sequence);
+
+	journal_digest(&file->journal, chunk, file->journal.digest);
+	if (pwrite(file->journal_fd, &file->journal, sizeof(inplace_journal), slot) != sizeof(inplace_journal)
+		|| pwrite(file->journal_fd, chunk, file->journal.length, slot + sizeof(inplace_journal)) != file->journal.length
+		|| fdatasync(file->journal_fd) == -1)
+		return -1;
+	return 0;
+}
+
+//Creates the journal with its first record, which describes no unit yet. The journal is written to a temporary file
+//that takes its place, so that a journal that exists always has a valid record. Returns -1 in case of error.
+static int create_journal(inplace_file * file)
+{
+	char * tmp_path = suffixed_path(file->journal_path, ".tmp");
+	int ret = 0;
+
+	file->journal_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (file->journal_fd == -1 || save_journal(file, NULL) == -1 || rename(tmp_path, file->journal_path) == -1)
+		ret = -1;
+
+	free(tmp_path);
+	return ret;
+}
+
+//Reads the record in the given slot of the journal into saved, and the content of its unit into content.
+//Returns -1 if it's torn, or if it doesn't match the file, the operation or the mode of operation.
+static int read_record(const inplace_file * file, const unsigned long slot, const enum operation op,
+	const enum mode opmode, const unsigned long size, inplace_journal * saved, unsigned char * content)
+{
+	unsigned char digest[DIGESTSIZE];
+	off_t position = journal_slot(slot);
+
+	if (pread(file->journal_fd, saved, sizeof(inplace_journal), position) != sizeof(inplace_journal)
+		|| memcmp(saved->magic, INPLACE_MAGIC, 8) != 0 || saved->sequence % 2 != slot
+		|| saved->op != op || saved->opmode != opmode || saved->file_size != size
+		|| saved->length > INPLACE_JOURNAL_UNIT || saved->offset > size || saved->length > size - saved->offset
+		|| pread(file->journal_fd, content, saved->length, position + sizeof(inplace_journal)) != saved->length)
+		return -1;
+
+	journal_digest(saved, content, digest);
+	return memcmp(digest, saved->digest, DIGESTSIZE) == 0 ? 0 : -1;
+}
+
+//Loads the last valid record of the journal of an interrupted run and puts back the content of the unit it describes
+//(data and result must be at least INPLACE_JOURNAL_UNIT bytes long). Returns -1 if no record matches the file, the
+//operation or the mode of operation.
+static int restore_journal(inplace_file * file, const enum operation op, const enum mode opmode, const unsigned long size,
+	unsigned char * data, unsigned char * result)
+{
+	inplace_journal other;
+	bool first_valid, second_valid;
+
+	file->journal_fd = open(file->journal_path, O_RDWR);
+	if (file->journal_fd == -1)
+		return -1;
+
+	first_valid = read_record(file, 0, op, opmode, size, &file->journal, data) == 0;
+	second_valid = read_record(file, 1, op, opmode, size, &other, result) == 0;
+	if (!first_valid && !second_valid)
+		return -1;
+	if (!first_valid || (second_valid && other.sequence > file->journal.sequence))
+	{
+		file->journal = other;
+		memcpy(data, result, other.length);
+	}
+
+	if (file->journal.length > 0
+		&& (pwrite(file->fd, data, file->journal.length, file->journal.offset) != file->journal.length
+		|| fdatasync(file->fd) == -1))
+		return -1;
+	return 0;
+}
+
+//Writes the header to file.hdr. Returns -1 in case of error.
+static int write_header(const inplace_file * file)
+{
+	int fd = open(file->header_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int ret = 0;
+
+	if (fd == -1)
+		return -1;
+	if (write(fd, file->journal.header, HEADER_BLOCKS * BLOCKSIZE) != HEADER_BLOCKS * BLOCKSIZE || fsync(fd) == -1)
+		ret = -1;
+	close(fd);
+	return ret;
+}
+
+//Reads the header from file.hdr. Returns -1 if it's missing, or if it's not the one of a file encrypted in place.
+static int read_header(inplace_file * file)
+{
+	int fd = open(file->header_path, O_RDONLY);
+	int ret = 0;
+
+	if (fd == -1)
+		return -1;
+	if (read(fd, file->journal.header, HEADER_BLOCKS * BLOCKSIZE) != HEADER_BLOCKS * BLOCKSIZE
+		|| !has_key_check(&file->journal.header[2]) || file->journal.header[2].right[HEADER_FLAGS] != 0)
+		ret = -1;
+	close(fd);
+	return ret;
+}
+
+//Encrypts or decrypts the file at path in place, in CTR or OFB mode. Saves in processed the size of the file,
+//returns -1 in case of error.
+int inplace_process(const char * path, const enum operation op, const enum mode opmode, const char * key,
+	unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	inplace_file file;
+	struct stat info;
+	mode_state state;
+	unsigned long size, chunk_size;
+
+	memset(&file, 0, sizeof(inplace_file));
+	file.journal_fd = -1;
+	file.header_path = suffixed_path(path, INPLACE_HEADER_SUFFIX);
+	file.journal_path = suffixed_path(path, INPLACE_JOURNAL_SUFFIX);
+	*processed = 0;
+	gettimeofday(&start_time, NULL);
+
+	file.fd = open(path, O_RDWR);
+	if (file.fd == -1 || fstat(file.fd, &info) == -1)
+		return abort_inplace(&file, "Error in opening files!");
+	size = info.st_size;
+	total_file_size = size;
+	if (size < BLOCKSIZE)
+		progress_enabled = false;
+
+	if (access(file.journal_path, F_OK) == 0)
+	{
+		if (!resume_enabled)
+			return abort_inplace(&file, "An interrupted run left a journal, it's continued with --resume!");
+		if (restore_journal(&file, op, opmode, size, data, result) == -1)
+			return abort_inplace(&file, "The journal doesn't match the file, the operation or the mode of operation!");
+		//a resumed run must use the key of the interrupted one, or the file would be left with two keys
+		if (verify_key_check(file.journal.header, key) == -1)
+			return abort_inplace(&file, "Wrong key!");
+	}
+	else
+	{
+		memcpy(file.journal.magic, INPLACE_MAGIC, 8);
+		file.journal.op = op;
+		file.journal.opmode = opmode;
+		file.journal.file_size = size;
+		init_mode_state(&file.journal.mode);
+
+		if (op == dec && read_header(&file) == -1)
+			return abort_inplace(&file, "The header of the file is missing, it's not encrypted in place!");
+		if (op == dec && verify_key_check(file.journal.header, key) == -1)
+			return abort_inplace(&file, "Wrong key!");
+		if (op == enc)
+		{
+			if (access(file.header_path, F_OK) == 0)
+				return abort_inplace(&file, "The file has already been encrypted in place!");
+			create_nonce(&file.journal.header[0]);
+			create_nonce(&file.journal.header[1]);
+			create_key_check(&file.journal.header[2], key, &file.journal.header[0]);
+		}
+
+		//the journal is there before anything is written, so that any interrupted run can be resumed
+		if (create_journal(&file) == -1)
+			return abort_inplace(&file, "Error in writing the journal!");
+	}
+
+	if (op == enc && write_header(&file) == -1)
+		return abort_inplace(&file, "Error in writing the header!");
+
+	double kdf_start = stats_clock();
+	schedule_key(file.round_keys, key, (unsigned char *)&file.journal.header[0], header_iterations(file.journal.header));
+	stats_record(stage_kdf, kdf_start);
+	state = file.journal.mode;
+
+	for (unsigned long pos = file.journal.offset; pos < size; pos += chunk_size)
+	{
+		chunk_size = (size - pos < INPLACE_JOURNAL_UNIT) ? size - pos : INPLACE_JOURNAL_UNIT;
+
+		double read_start = stats_clock();
+		if (pread(file.fd, data, chunk_size, pos) != chunk_size)
+			return abort_inplace(&file, "Reading/memory error!");
+		stats_record(stage_read, read_start);
+
+		//the unit is journaled as it is before being overwritten, over the record before the last one
+		file.journal.sequence++;
+		file.journal.offset = pos;
+		file.journal.length = chunk_size;
+		file.journal.mode = state;
+		if (save_journal(&file, data) == -1)
+			return abort_inplace(&file, "Error in writing the journal!");
+
+		if (op == enc)
+			encrypt_scheduled(result, (block *)data, (chunk_size + BLOCKSIZE - 1) / BLOCKSIZE, chunk_size, file.round_keys, file.journal.header[1], opmode, &state);
+		else
+			decrypt_scheduled(result, (block *)data, (chunk_size + BLOCKSIZE - 1) / BLOCKSIZE, chunk_size, file.round_keys, file.journal.header[1], opmode, &state);
+
+		double write_start = stats_clock();
+		if (pwrite(file.fd, result, chunk_size, pos) != chunk_size || fdatasync(file.fd) == -1)
+			return abort_inplace(&file, "Error in writing the output file!");
+		stats_record(stage_write, write_start);
+
+		stats_add_bytes(chunk_size);
+		*processed += chunk_size;
+	}
+
+	//a decrypted file has no header, which goes before the journal: in between, the header is still in the journal
+	close(file.fd);
+	close(file.journal_fd);
+	if (op == dec)
+		unlink(file.header_path);
+	unlink(file.journal_path);
+	free(file.header_path);
+	free(file.journal_path);
+	return 0;
+}
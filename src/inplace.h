@@ -0,0 +1,30 @@
+//In-place encryption and decryption (--in-place) in the modes that keep the size of the data, see inplace.c
+//The header of a file encrypted in place is kept in file.hdr, and the unit being rewritten in file.journal.
+#define INPLACE_MAGIC "CFJRNL02"
+#define INPLACE_HEADER_SUFFIX ".hdr"
+#define INPLACE_JOURNAL_SUFFIX ".journal"
+//the file is rewritten and journaled 4MB at a time, the journal holds two records of this size
+#define INPLACE_JOURNAL_UNIT 4194304
+
+extern bool inplace_enabled;
+
+//A record of the journal holds this, followed by the content of the unit being rewritten as it was before
+typedef struct inplace_journal {
+	char magic[8];
+	//SHA-256 of the record (with this field zeroed) and of the content, a torn record doesn't match it
+	unsigned char digest[DIGESTSIZE];
+	//the number of the record, the valid one with the highest number is the last
+	unsigned long sequence;
+	unsigned int op;
+	unsigned int opmode;
+	block header[HEADER_BLOCKS];
+	//the file must not change size between the interrupted run and the resumed one
+	unsigned long file_size;
+	//the unit being rewritten, and the chaining state of the mode of operation at its start
+	unsigned long offset;
+	unsigned long length;
+	mode_state mode;
+}inplace_journal;
+
+int inplace_process(const char * path, const enum operation op, const enum mode opmode, const char * key,
+	unsigned char * data, unsigned char * result, unsigned long * processed);
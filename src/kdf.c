@@ -0,0 +1,368 @@
+//This module derives the master keys with PBKDF2-HMAC-SHA256, producing exactly the same keys as OpenSSL's PKCS5_PBKDF2_HMAC.
+//Every file has its own salt, so when a batch holds many small files the key derivation takes longer than the encryption.
+//Here KDF_LANES derivations run at once on a multi-buffer SHA-256: every lane of a vector holds the state of a different salt,
+//so a single pass of the compression function advances all of them. All the lanes share the same password, so the HMAC pads
+//are hashed once and their midstates are broadcast to every lane.
+//The vector code is compiled for AVX-512 (one register per word), AVX2 and baseline x86-64, the best version is picked at load time.
+//The keys derived in advance are kept in a table that kdf_derive looks up before deriving a key on its own, and the daemon
+//also keeps a cache of the keys derived by its past requests.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "common.h"
+#include "kdf.h"
+#include "omp.h"
+#include "openssl/evp.h"
+
+#define SHA256_BLOCK 64
+#define SHA256_DIGEST 32
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+//one 32 bit word of the SHA-256 state (or of the message schedule) for every lane
+typedef uint32_t lanes __attribute__((vector_size(4 * KDF_LANES)));
+
+typedef struct kdf_entry {
+	unsigned char salt[BLOCKSIZE];
+	unsigned long iterations;
+	unsigned char master_key[KEYSIZE];
+	bool used;
+}kdf_entry;
+
+unsigned long kdf_iterations = KDF_DEFAULT_ITERATIONS;
+
+//a key derived by an earlier request of the daemon, the password is only kept as a digest (its key id)
+typedef struct cached_key {
+	unsigned char key_id[KEY_ID_SIZE];
+	unsigned char salt[BLOCKSIZE];
+	unsigned long iterations;
+	unsigned char master_key[KEYSIZE];
+	bool used;
+}cached_key;
+
+//keys derived in advance by kdf_prefetch, in an open addressing table indexed by salt
+static kdf_entry * table = NULL;
+static unsigned long table_size = 0;
+static char * table_password = NULL;
+
+//recently derived keys, direct mapped on (key id, salt): a new key replaces whatever was in its slot
+static cached_key * cache = NULL;
+static unsigned long cache_size = 0;
+
+static const uint32_t round_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t initial_state[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t load_be32(const unsigned char * bytes)
+{
+	return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+//SHA-256 compression of one message block on every lane, w is used as the message schedule and overwritten.
+//It's always inlined so that it's compiled for the instruction set of each version of derive_lanes.
+static inline __attribute__((always_inline)) void compress_lanes(lanes state[8], lanes w[16])
+{
+	lanes a = state[0], b = state[1], c = state[2], d = state[3];
+	lanes e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (int i = 0; i < 64; i++)
+	{
+		if (i >= 16)
+		{
+			lanes w15 = w[(i - 15) & 15];
+			lanes w2 = w[(i - 2) & 15];
+			w[i & 15] += (ROTR(w15, 7) ^ ROTR(w15, 18) ^ (w15 >> 3)) + w[(i - 7) & 15] + (ROTR(w2, 17) ^ ROTR(w2, 19) ^ (w2 >> 10));
+		}
+
+		lanes t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + round_constants[i] + w[i & 15];
+		lanes t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+//Hashes a 32 byte message (held in digest, one word per lane) starting from the midstate of a 64 byte pad,
+//the result is saved in digest
+static inline __attribute__((always_inline)) void hash_after_pad(lanes digest[8], const lanes midstate[8])
+{
+	lanes w[16];
+
+	for (int i = 0; i < 8; i++)
+		w[i] = digest[i];
+	w[8] = (lanes){} + 0x80000000;
+	for (int i = 9; i < 15; i++)
+		w[i] = (lanes){};
+	w[15] = (lanes){} + (SHA256_BLOCK + SHA256_DIGEST) * 8;
+
+	memcpy(digest, midstate, 8 * sizeof(lanes));
+	compress_lanes(digest, w);
+}
+
+//Derives count (at most KDF_LANES) master keys, one per salt, from the same password (already padded to a SHA-256 block).
+//The makefile doesn't enable optimizations, but without them the lanes would live in memory instead of registers.
+__attribute__((target_clones("avx512f", "avx2", "default"), optimize("O2")))
+static void derive_lanes(unsigned char (* master_keys)[KEYSIZE], const unsigned char padded_password[SHA256_BLOCK],
+	const unsigned char (* salts)[BLOCKSIZE], const unsigned int count, const unsigned long iterations)
+{
+	lanes inner[8], outer[8], u[8], t[8], w[16];
+
+	//midstates of the inner and outer HMAC pads, the same on every lane
+	for (int i = 0; i < 16; i++)
+		w[i] = (lanes){} + (load_be32(padded_password + 4 * i) ^ 0x36363636);
+	for (int i = 0; i < 8; i++)
+		inner[i] = (lanes){} + initial_state[i];
+	compress_lanes(inner, w);
+
+	for (int i = 0; i < 16; i++)
+		w[i] = (lanes){} + (load_be32(padded_password + 4 * i) ^ 0x5c5c5c5c);
+	for (int i = 0; i < 8; i++)
+		outer[i] = (lanes){} + initial_state[i];
+	compress_lanes(outer, w);
+
+	//U1 = HMAC(password, salt || INT(1)), the unused lanes repeat the first salt
+	for (int l = 0; l < KDF_LANES; l++)
+		for (int i = 0; i < BLOCKSIZE/4; i++)
+			w[i][l] = load_be32(salts[l < count ? l : 0] + 4 * i);
+	w[BLOCKSIZE/4] = (lanes){} + 1;
+	w[BLOCKSIZE/4 + 1] = (lanes){} + 0x80000000;
+	for (int i = BLOCKSIZE/4 + 2; i < 15; i++)
+		w[i] = (lanes){};
+	w[15] = (lanes){} + (SHA256_BLOCK + BLOCKSIZE + 4) * 8;
+
+	memcpy(u, inner, sizeof(u));
+	compress_lanes(u, w);
+	hash_after_pad(u, outer);
+	memcpy(t, u, sizeof(t));
+
+	//Ui = HMAC(password, Ui-1), the derived key is the XOR of all of them
+	for (unsigned long it = 1; it < iterations; it++)
+	{
+		hash_after_pad(u, inner);
+		hash_after_pad(u, outer);
+		for (int i = 0; i < 8; i++)
+			t[i] ^= u[i];
+	}
+
+	for (unsigned int l = 0; l < count; l++)
+		for (int i = 0; i < KEYSIZE; i++)
+			master_keys[l][i] = (t[i / 4][l] >> (24 - 8 * (i % 4))) & 0xFF;
+}
+
+//HMAC keys longer than a block are hashed first, shorter ones are padded with zeroes
+static void pad_password(unsigned char padded_password[SHA256_BLOCK], const char * password)
+{
+	unsigned long len = strlen(password);
+
+	memset(padded_password, 0, SHA256_BLOCK);
+	if (len > SHA256_BLOCK)
+		EVP_Digest(password, len, padded_password, NULL, EVP_sha256(), NULL);
+	else
+		memcpy(padded_password, password, len);
+}
+
+static uint64_t salt_hash(const unsigned char * salt, const unsigned long iterations)
+{
+	uint64_t hash = iterations;
+
+	//salts are random, so a few of their bytes are already a good hash
+	for (int i = 0; i < 8; i++)
+		hash = (hash << 8 | hash >> 56) ^ salt[i];
+	return hash;
+}
+
+static unsigned long table_slot(const unsigned char * salt, const unsigned long iterations)
+{
+	return salt_hash(salt, iterations) % table_size;
+}
+
+//Returns the entry of salt in the table, or the empty slot where it should go
+static kdf_entry * table_find(const unsigned char * salt, const unsigned long iterations)
+{
+	unsigned long slot = table_slot(salt, iterations);
+
+	while (table[slot].used && (table[slot].iterations != iterations || memcmp(table[slot].salt, salt, BLOCKSIZE) != 0))
+		slot = (slot + 1) % table_size;
+	return &table[slot];
+}
+
+//Derives the master key of password and salt, taking it from the keys derived by kdf_prefetch or from the cache if possible.
+//Safe to call from many threads at once, as long as kdf_prefetch or kdf_release are not running.
+void kdf_derive(unsigned char master_key[KEYSIZE], const char * password, const unsigned char * salt, const unsigned long iterations)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	cached_key * slot = NULL;
+	bool found = false;
+
+	if (table != NULL && strcmp(password, table_password) == 0)
+	{
+		kdf_entry * entry = table_find(salt, iterations);
+		if (entry->used)
+		{
+			memcpy(master_key, entry->master_key, KEYSIZE);
+			return;
+		}
+	}
+
+	if (cache != NULL)
+	{
+		EVP_Digest(password, strlen(password), digest, NULL, EVP_sha256(), NULL);
+		slot = &cache[(salt_hash(salt, iterations) ^ salt_hash(digest, 0)) % cache_size];
+
+		#pragma omp critical(kdf_cache)
+		{
+			if (slot->used && slot->iterations == iterations && memcmp(slot->salt, salt, BLOCKSIZE) == 0 && memcmp(slot->key_id, digest, KEY_ID_SIZE) == 0)
+			{
+				memcpy(master_key, slot->master_key, KEYSIZE);
+				found = true;
+			}
+		}
+		if (found)
+			return;
+	}
+
+	//a single derivation would leave all the other lanes idle, OpenSSL is faster at that
+	PKCS5_PBKDF2_HMAC(password, strlen(password), salt, BLOCKSIZE, iterations, EVP_sha256(), KEYSIZE, master_key);
+
+	if (slot != NULL)
+	{
+		#pragma omp critical(kdf_cache)
+		{
+			memcpy(slot->key_id, digest, KEY_ID_SIZE);
+			memcpy(slot->salt, salt, BLOCKSIZE);
+			slot->iterations = iterations;
+			memcpy(slot->master_key, master_key, KEYSIZE);
+			slot->used = true;
+		}
+	}
+}
+
+//Keeps the last derived keys (up to entries of them) for the following calls to kdf_derive, used by the daemon
+//so that the chunks of a request, and later requests on the same file, don't derive the same key again
+void kdf_cache_init(const unsigned long entries)
+{
+	kdf_cache_release();
+	cache_size = entries;
+	cache = calloc(cache_size, sizeof(cached_key));
+}
+
+void kdf_cache_release(void)
+{
+	if (cache != NULL)
+		memset(cache, 0, cache_size * sizeof(cached_key));
+	free(cache);
+	cache = NULL;
+	cache_size = 0;
+}
+
+//Derives in advance the master keys of all the requests, KDF_LANES at a time and on all threads,
+//so that the following calls to kdf_derive with the same password and salts don't have to.
+//Replaces the keys of any previous call.
+void kdf_prefetch(const char * password, const kdf_request * requests, const unsigned long count)
+{
+	unsigned char padded_password[SHA256_BLOCK];
+	unsigned long * order;
+	unsigned long ngroups = 0;
+	unsigned long * group_start;
+
+	kdf_release();
+	if (count == 0)
+		return;
+
+	table_size = 2 * count + 1;
+	table = calloc(table_size, sizeof(kdf_entry));
+	table_password = strdup(password);
+	pad_password(padded_password, password);
+
+	//lanes must share the iteration count: requests are grouped by it (usually there's only one),
+	//keeping a single entry for duplicated salts
+	order = malloc(count * sizeof(unsigned long));
+	group_start = malloc((count + 1) * sizeof(unsigned long));
+	for (unsigned long r = 0; r < count; r++)
+	{
+		kdf_entry * entry = table_find(requests[r].salt, requests[r].iterations);
+		if (entry->used)
+			continue;
+		entry->used = true;
+		memcpy(entry->salt, requests[r].salt, BLOCKSIZE);
+		entry->iterations = requests[r].iterations;
+	}
+
+	unsigned long nkeys = 0;
+	for (unsigned long slot = 0; slot < table_size; slot++)
+		if (table[slot].used)
+			order[nkeys++] = slot;
+
+	for (unsigned long k = 0; k < nkeys; )
+	{
+		unsigned long iterations = table[order[k]].iterations;
+		unsigned long lanes_used = 0;
+
+		group_start[ngroups++] = k;
+		for (unsigned long j = k; j < nkeys && lanes_used < KDF_LANES; j++)
+		{
+			if (table[order[j]].iterations != iterations)
+				continue;
+			unsigned long swap = order[k + lanes_used];
+			order[k + lanes_used] = order[j];
+			order[j] = swap;
+			lanes_used++;
+		}
+		k += lanes_used;
+	}
+	group_start[ngroups] = nkeys;
+
+	#pragma omp parallel for schedule(dynamic)
+	for (unsigned long g = 0; g < ngroups; g++)
+	{
+		unsigned char salts[KDF_LANES][BLOCKSIZE];
+		unsigned char master_keys[KDF_LANES][KEYSIZE];
+		unsigned int lanes_used = group_start[g + 1] - group_start[g];
+
+		for (unsigned int l = 0; l < lanes_used; l++)
+			memcpy(salts[l], table[order[group_start[g] + l]].salt, BLOCKSIZE);
+
+		derive_lanes(master_keys, padded_password, (const unsigned char (*)[BLOCKSIZE])salts, lanes_used, table[order[group_start[g]]].iterations);
+
+		for (unsigned int l = 0; l < lanes_used; l++)
+			memcpy(table[order[group_start[g] + l]].master_key, master_keys[l], KEYSIZE);
+	}
+
+	free(order);
+	free(group_start);
+}
+
+//Forgets the keys derived in advance
+void kdf_release(void)
+{
+	if (table_password != NULL)
+		memset(table_password, 0, strlen(table_password));
+	if (table != NULL)
+		memset(table, 0, table_size * sizeof(kdf_entry));
+	free(table);
+	free(table_password);
+	table = NULL;
+	table_password = NULL;
+	table_size = 0;
+}
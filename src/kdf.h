@@ -0,0 +1,20 @@
+//PBKDF2-HMAC-SHA256 key derivation, computing up to KDF_LANES derivations at once
+#define KDF_LANES 16
+#define KDF_DEFAULT_ITERATIONS 1000
+//bytes of the password digest that identify it in the key cache
+#define KEY_ID_SIZE 16
+
+//iteration count used for new files, set with --iterations
+extern unsigned long kdf_iterations;
+
+//a salt whose master key will be needed soon, see kdf_prefetch
+typedef struct kdf_request {
+	unsigned char salt[BLOCKSIZE];
+	unsigned long iterations;
+}kdf_request;
+
+void kdf_derive(unsigned char master_key[KEYSIZE], const char * password, const unsigned char * salt, const unsigned long iterations);
+void kdf_prefetch(const char * password, const kdf_request * requests, const unsigned long count);
+void kdf_release(void);
+void kdf_cache_init(const unsigned long entries);
+void kdf_cache_release(void);
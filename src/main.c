@@ -6,6 +6,24 @@
 #include "utils.h"
 #include "block.h"
 #include "feistel.h"
+#include "perfcount.h"
+#include "stats.h"
+#include "numa.h"
+#include "bufpool.h"
+#include "tiling.h"
+#include "auth.h"
+#include "merkle.h"
+#include "kdf.h"
+#include "pipeline.h"
+#include "batch.h"
+#include "daemon.h"
+#include "compress.h"
+#include "checkpoint.h"
+#include "shard.h"
+#include "sector.h"
+#include "archive.h"
+#include "sparse.h"
+#include "inplace.h"
 #include "unistd.h" 
 #include "fcntl.h"
 #include "sys/time.h"
@@ -13,15 +31,8 @@
 #include "getopt.h"
 #include <bits/getopt_core.h>
 
-//These variables are used in opmodes.c exclusively for logging purposes
-//I decided to use them externally instead of passing them to avoid making inner functions' semantics
-//even heavier than they already are 
-unsigned long total_file_size=0;
-struct timeval start_time;
-
-int command_selection(int argc, char *argv[], char * key, char * infile, char * outfile, enum mode * chosen, enum operation * to_do, enum outmode * output_mode);
-void handle_padded_chunk(unsigned char * result, unsigned char * data, FILE * read_file, FILE * write_file, unsigned long chunk_size,
-	enum mode chosen, enum operation to_do, const char * key, const block header[2], int nchunk);
+int command_selection(int argc, char *argv[], char ** key, char ** infile, char ** outfile, enum mode * chosen, enum operation * to_do, enum outmode * output_mode);
+int parse_mode(const char * name, enum mode * opmode);
 
 int main(int argc, char * argv[]) 
 {
@@ -40,23 +51,11 @@ int main(int argc, char * argv[])
 	strncpy(key, "secretkey", KEYSIZE);
 
 	unsigned char * data;
-	unsigned int final_chunk_flag = 0;
 	unsigned char * result;
-	unsigned long num_blocks;
-	//nchunk will contain the number of chunks that have currently been processed
-	int nchunk = 0;
-	//chunk_size stores the size of the current chunk of data
-	unsigned long chunk_size=0;
-	//padded_chunk_size stores the size of the current chunk of data, adjusted for padding and accounting
-	unsigned long padded_chunk_size=0;
-	//This flag will signal a final chunk that's only formed by the accounting block for the previous chunk
-	//(the last one with actual data)
-	bool acc_only_chunk = false;
-	//2 blocks header that will contain IV and key derivation salt 
-	block header[2];
+	//processed will contain the size of the processed plaintext (or ciphertext), excluding the header and the trailers
+	unsigned long processed = 0;
+	int ret;
 	
-	FILE * read_file;
-	FILE * write_file;
 	int saved_stdout;
 	saved_stdout = dup(1);
 
@@ -64,93 +63,88 @@ int main(int argc, char * argv[])
 		omp_set_num_threads(1);
 	#endif	
 
-	if (command_selection(argc, argv, key, infile, outfile, &opmode, &op, &output_mode) == -1) return -1;
+	if (command_selection(argc, argv, &key, &infile, &outfile, &opmode, &op, &output_mode) == -1) return -1;
 
-	if (output_mode == replace) //Sets up the output filename for replace mode:
-	//at the end of the processing, the provided file will be removed and the new file will take its name
-	{
-		outfile = malloc ((strlen(infile) + 4) * sizeof(char));
-		strcpy(outfile, infile);
-		strncat(outfile, ".enc", 5);
-	}
+	//binding the worker threads to NUMA nodes, this does nothing on single-node machines
+	numa_setup();
+	tiling_setup();
 
-	//opening input and output files
-	read_file = fopen(infile, "rb");
-	write_file = fopen(outfile, "wb"); //clears the file to avoid appending to an already written file
-	write_file = freopen(outfile, "ab", write_file);
+	//the input, output and keystream buffers are allocated and faulted in once for the whole run
+	bufpool_init(3 + fanout_pool_buffers(opmode));
 
-	if (read_file==NULL || write_file==NULL) 
+	if (op == serve) //Serving requests until stopped, see daemon.c
 	{
-		exit_message(1, "Error in opening files!");
-		return -1;
+		ret = daemon_run();
+		bufpool_destroy();
+		perf_report();
+		stats_emit();
+		return ret;
 	}
 
-	if (op == enc) //We need to generate the header and prepend it to the ciphertext
-	{
-		create_nonce(&header[0]);
-		create_nonce(&header[1]);
-		fwrite(&header, BLOCKSIZE, 2, write_file);
-	}
-	else //We need to populate the header with the first two blocks of the ciphertext 
+	if (batch_source != NULL) //Many files in a single run, see batch.c
 	{
-		fread(&header[0], BLOCKSIZE, 1, read_file);
-		fread(&header[1], BLOCKSIZE, 1, read_file);
+		ret = batch_run(op, opmode, key);
+		bufpool_destroy();
+		perf_report();
+		stats_emit();
+		return ret;
 	}
 
-	//calculating the total file size and setting start time 
-	fseek(read_file, 0, SEEK_END);
-	total_file_size = ftell(read_file);
-	rewind(read_file);
-	if (op == dec) //In decryption, we have to ignore the first two blocks (header)
+	if (output_mode == replace) //Sets up the output filename for replace mode:
+	//at the end of the processing, the provided file will be removed and the new file will take its name
 	{
-		fseek(read_file, 2*BLOCKSIZE, SEEK_SET);
-		total_file_size -= 2*BLOCKSIZE;
+		outfile = malloc ((strlen(infile) + 5) * sizeof(char));
+		strcpy(outfile, infile);
+		strncat(outfile, ".enc", 5);
 	}
 
-	gettimeofday(&start_time, NULL);
-
-	//This loop will continue reading from read_file, processing data in chunks of BUFSIZE bytes and writing them to write_file,
-	//until it reaches the last chunk of readable data
-	while (1)
-	{		
-		//Trying to read BUFSIZE characters, saving the number of read characters in chunk_size, allocating the space needed
-		data = malloc(BUFSIZE * sizeof(unsigned char));
-		chunk_size = fread(data, sizeof(unsigned char), BUFSIZE, read_file);
-		result = malloc(chunk_size * sizeof(unsigned char));
-
-		if (chunk_size == 0 || data == NULL || result == NULL)
+	if (shards > 0 && shard_count == 0) //The coordinator of a sharded run only starts the workers, see shard.c
+		ret = shard_run(argc, argv, infile, outfile, op, opmode, key, &processed);
+	else
+	{
+		//Checking out the buffers from the pool, both have room for the padding and accounting blocks
+		data = bufpool_get(pipeline_buffer_size(BUFSIZE));
+		result = bufpool_get(pipeline_buffer_size(BUFSIZE));
+		if (data == NULL || result == NULL)
 		{
 			exit_message(1, "Reading/memory error!");
 			return -1;
 		}
 
-		if (is_stream_mode(opmode))
+		if (op == rekey) //Decryption under the old key and encryption under the new one in a single pass
+			ret = rekey_file(infile, outfile, opmode, key, data, result, &processed);
+		else if (fanout_count > 1) //One input encrypted for many keys in a single pass
+			ret = fanout_file(infile, opmode, data, result, &processed);
+		else if (op == pack || op == unpack || op == contents) //Many files in a single encrypted file, see archive.c
+			ret = archive_run(op, infile, outfile, key, data, &processed);
+		else if (opmode == xts) //Sector volumes, see sector.c
+			ret = sector_process(infile, outfile, op, key, data, &processed);
+		else if (sparse_enabled) //Only the data extents of a sparse file, see sparse.c
+			ret = sparse_process(infile, outfile, op, key, data, result, &processed);
+		else if (inplace_enabled) //The input rewritten chunk by chunk, see inplace.c
+			ret = inplace_process(infile, op, opmode, key, data, result, &processed);
+		else if (shard_count > 0) //One range of the file, written into the output prepared by the coordinator
 		{
-			//starting the correct operation and returning -1 in case there's an error
-			if (op == enc) 
-				encrypt_blocks(result, data, chunk_size, nchunk, key, header, opmode);
-			else if (op == dec) 
-				decrypt_blocks(result, data, chunk_size, nchunk, key, header, opmode);
-
-			//Writing the result to file
-			fwrite(result, chunk_size, 1, write_file);
+			//the workers of a sharded run share the terminal
+			progress_enabled = false;
+			ret = process_shard(infile, outfile, op, opmode, key, shard_index, shard_count, data, result, &processed);
 		}
 		else
-		{
-			//Things are a bit more convoluted in case we're using a mode of operation that needs padding and an accounting block
-			//so the whole charade deserved its own function to improve readability
-			handle_padded_chunk(result, data, read_file, write_file, chunk_size, opmode, op, key, header, nchunk);
-		}
+			ret = process_file(infile, outfile, op, opmode, key, NULL, data, result, &processed);
+
+		bufpool_put(result);
+		bufpool_put(data);
+	}
+	bufpool_destroy();
 
-		free(result);
-		free(data);
+	if (ret == -1)
+		return -1;
 
-		nchunk++;
-		
-		//if we read less than BUFSIZE bytes or there's EOF after the last full block
-		//it means that we processed the last chunk of data
-		if (chunk_size < BUFSIZE || check_end_file(read_file)) 
-			break;
+	//Verification, listing, shard workers and preparation of the output for them don't produce a complete output
+	if (op == verify || op == contents || shard_count > 0 || shard_prepare_only)
+	{
+		stats_emit();
+		return 0;
 	}
 
 	//In-place processing: the output file will take the place of the input file
@@ -160,9 +154,6 @@ int main(int argc, char * argv[])
 		rename(outfile, infile);
 	}
 
-	fclose(read_file);
-	fclose(write_file);
-
 	//Printing some stats
 	struct timeval current_time;
 	gettimeofday(&current_time, NULL);
@@ -170,95 +161,31 @@ int main(int argc, char * argv[])
 	char time[100];
 	char filesize[100];
 	double time_diff = timeval_diff_seconds(start_time, current_time);
-	snprintf(speed, sizeof(speed), "Avg processing speed: %.2f MB/s", estimate_speed(current_time, start_time, total_file_size/BLOCKSIZE));
+	snprintf(speed, sizeof(speed), "Avg processing speed: %.2f MB/s", estimate_speed(current_time, start_time, processed/BLOCKSIZE));
 	snprintf(time, sizeof(time), "Time elapsed: %.2f s", time_diff);
-	snprintf(filesize, sizeof(filesize), "\nTotal file size: %.2f MB", (float)total_file_size / (1000.0 * 1000.0));
+	snprintf(filesize, sizeof(filesize), "\nTotal file size: %.2f MB", (float)processed / (1000.0 * 1000.0));
 	if (op == enc) exit_message(4, "Encryption complete!\n", filesize, speed, time);
+	else if (op == rekey) exit_message(4, "Re-encryption complete!\n", filesize, speed, time);
+	else if (op == read_range) exit_message(4, "Read complete!\n", filesize, speed, time);
+	else if (op == write_range) exit_message(4, "Write complete!\n", filesize, speed, time);
+	else if (op == pack) exit_message(4, "Packing complete!\n", filesize, speed, time);
+	else if (op == dec && verify_plaintext) exit_message(4, "Verification complete!\n", filesize, speed, time);
+	else if (op == unpack) exit_message(4, "Extraction complete!\n", filesize, speed, time);
 	else exit_message(4, "Decryption complete!\n", filesize, speed, time);
+	perf_report();
+	stats_emit();
 
 	return 0;
 }
 
-//This function handles the processing of a single chunk in the case of purely block-oriented modes of operation
-//It takes all necessary data and populates result after the processing
-void handle_padded_chunk(unsigned char * result, unsigned char * data, FILE * read_file, FILE * write_file, unsigned long chunk_size,
-	enum mode opmode, enum operation op, const char * key, const block header[2], int nchunk)
-{
-	unsigned long padded_chunk_size = 0;
-	bool acc_only_chunk = false;
-	bool final_chunk = false;
-	int num_blocks;
-
-	//If we read exactly BLOCKSIZE bytes, then the current chunk only contains the accounting block for the previous one
-	//This only occurs when the actual data size falls within BLOCKSIZE bytes of a BUFSIZE multiple
-	if (op == dec && nchunk > 0 && chunk_size == BLOCKSIZE) acc_only_chunk = true;
-
-	//if we read less than BUFSIZE bytes or there's EOF after the last full block
-	//it means that we are processing the last chunk of data
-	if (chunk_size < BUFSIZE || check_end_file(read_file)) final_chunk = true;
-
-	//Modifying the chunk size in case there's padding and accounting to add, and allocating space for the output accordingly
-	if (op == enc)
-	{
-		calculate_final_size(&padded_chunk_size, chunk_size);
-		
-		//Fringe case: we'll write an extra block in case data ended inside the last block of the chunk
-		//and we need the last chunk to exceptionally go one block over the BUFSIZE to keep the accounting block 
-		if (final_chunk && chunk_size > BUFSIZE - BLOCKSIZE)
-		{
-			padded_chunk_size += BLOCKSIZE;
-		}
-		result = realloc(result, padded_chunk_size * sizeof(unsigned char));
-	}
-	
-	//starting the correct operation and returning -1 in case there's an error
-	if (op == enc) 
-		encrypt_blocks(result, data, chunk_size, nchunk, key, header, opmode);
-	else if (op == dec) 
-		decrypt_blocks(result, data, chunk_size, nchunk, key, header, opmode);
-
-	//In case we're decrypting the last chunk we use the size written in the last block (returned by remove_padding) to determine how much text to write,
-	//and if there's no size written in the last block, it means that the specified decryption key was invalid.
-	if (op == dec && final_chunk)
-	{ 
-		//padding has not been removed yet in decryption
-		//so BLOCKSIZE should be a perfect divisor of chunk_size
-		num_blocks = chunk_size/BLOCKSIZE;
-
-		//Removing padding from this chunk
-		chunk_size = remove_padding(result, num_blocks, opmode, total_file_size);
-
-		//if the last chunk only contains an accounting block saying the chunk has 0 bytes, it means that the last chunk was
-		//completely full and feistel_decrypt didn't detect it as "last chunk". In this case we can just use BUFSIZE as size.
-		//In the same way, if chunk_size was set to -1 by remove_padding it means there was no accounting block, and that means
-		//that the input file's size was a perfect multiple of BUFSIZE
-		if (chunk_size == 0 || chunk_size == -1) chunk_size = BUFSIZE;
-	}
-
-	//Writing the result to file
-	if (op == enc)
-		fwrite(result, padded_chunk_size, 1, write_file);
-	else
-		fwrite(result, chunk_size, 1, write_file);
-
-	if (final_chunk) //it was the last chunk of data, we're done
-	{
-		//This is needed when we are processing a chunk that only contains an accounting block 
-		//In this case we can't directly remove the padding using the chunk size, because the chunk size we have is 
-		//relative to the previous block, so we have to do some maths and truncate the whole file at the correct point
-		if (acc_only_chunk && op == dec)
-		{
-			fseek(write_file, 0, SEEK_SET);
-			ftruncate(fileno(write_file), chunk_size + ((nchunk - 2) * BUFSIZE));
-		}
-	}
-
-	return;
-}
-
-int command_selection(int argc, char *argv[], char * key, char * infile, char * outfile, enum mode * opmode, enum operation * op, enum outmode * output_mode)
+int command_selection(int argc, char *argv[], char ** key, char ** infile, char ** outfile, enum mode * opmode, enum operation * op, enum outmode * output_mode)
 {
     int opt;
+    //without --new-mode, rekey keeps the mode of operation of the input
+    bool new_mode_given = false;
+    //every -k and -o given, more than one -o pair them up for a fan-out encryption
+    int nkeys = 0;
+    int noutfiles = 0;
 
     // Define the options and their arguments
     static struct option long_options[] = 
@@ -267,6 +194,29 @@ int command_selection(int argc, char *argv[], char * key, char * infile, char *
         {"infile", required_argument, NULL, 'i'},
         {"outfile", required_argument, NULL, 'o'},
         {"mode", required_argument, NULL, 'm'},
+        {"perf-counters", no_argument, NULL, 'p'},
+        {"stats", required_argument, NULL, 's'},
+        {"no-numa", no_argument, NULL, 'n'},
+        {"hugepages", no_argument, NULL, 'h'},
+        {"auth", no_argument, NULL, 'a'},
+        {"merkle", no_argument, NULL, 'M'},
+        {"range", required_argument, NULL, 'r'},
+        {"batch", required_argument, NULL, 'b'},
+        {"outdir", required_argument, NULL, 'd'},
+        {"iterations", required_argument, NULL, 'I'},
+        {"socket", required_argument, NULL, 'S'},
+        {"compress", no_argument, NULL, 'z'},
+        {"checkpoint", no_argument, NULL, 'c'},
+        {"resume", no_argument, NULL, 'R'},
+        {"shard", required_argument, NULL, 'x'},
+        {"shards", required_argument, NULL, 'X'},
+        {"prepare", no_argument, NULL, 'P'},
+        {"new-key", required_argument, NULL, 'K'},
+        {"new-mode", required_argument, NULL, 'N'},
+        {"at", required_argument, NULL, 'A'},
+        {"verify", no_argument, NULL, 'V'},
+        {"sparse", no_argument, NULL, 'H'},
+        {"in-place", no_argument, NULL, 'W'},
         {NULL, 0, NULL, 0}
     };
 
@@ -275,40 +225,140 @@ int command_selection(int argc, char *argv[], char * key, char * infile, char *
         switch (opt) 
 		{
             case 'k':
-				key = realloc(key, (strlen(optarg)+1) * sizeof(char));
-                strcpy(key, optarg);
+				*key = realloc(*key, (strlen(optarg)+1) * sizeof(char));
+                strcpy(*key, optarg);
+                fanout_keys = realloc(fanout_keys, (nkeys + 1) * sizeof(char *));
+                fanout_keys[nkeys++] = optarg;
                 break;
             case 'i':
-				infile = realloc(infile, (strlen(optarg)+1) * sizeof(char));
-                strcpy(infile, optarg);
+				*infile = realloc(*infile, (strlen(optarg)+1) * sizeof(char));
+                strcpy(*infile, optarg);
                 break;
             case 'o':
-				outfile = realloc(outfile, (strlen(optarg)+1) * sizeof(char));
-                strcpy(outfile, optarg);
+				*outfile = realloc(*outfile, (strlen(optarg)+1) * sizeof(char));
+                strcpy(*outfile, optarg);
                 *output_mode = specified;
+                fanout_outfiles = realloc(fanout_outfiles, (noutfiles + 1) * sizeof(char *));
+                fanout_outfiles[noutfiles++] = optarg;
                 break;
             case 'm':
-                if (strcmp(optarg, "ecb") == 0)
-                    *opmode = ecb;
-                else if (strcmp(optarg, "cbc") == 0)
-                    *opmode = cbc;
-                else if (strcmp(optarg, "ctr") == 0)
-                    *opmode = ctr;
-                else if (strcmp(optarg, "ofb") == 0)
-                    *opmode = ofb;
-                else if (strcmp(optarg, "pcbc") == 0)
-                    *opmode = pcbc;
-                else if (strcmp(optarg, "cfb") == 0)
-                    *opmode = cfb;
-                else 
+                if (parse_mode(optarg, opmode) == -1)
 				{
                     fprintf(stderr, "\nEnter a valid mode of operation (ecb/cbc/ctr)\n");
-                    fprintf(stderr, "Usage: %s <enc|dec> [-k key] [-i infile] [-o outfile] [-m mode]\n", argv[0]);
+                    fprintf(stderr, "Usage: %s <enc|dec|rekey|read|write|pack|unpack|list|verify|daemon> [-k key] [-i infile] [-o outfile]... [-m mode] [--perf-counters] [--stats=<json|prom>[:file]] [--no-numa] [--hugepages] [--auth] [--merkle] [--range=offset:length] [--batch <dir|list|->] [--outdir dir] [--iterations=n] [--socket=path] [--compress] [--checkpoint] [--resume] [--shards=n [--prepare]] [--shard=i/n] [--new-key=key] [--new-mode=mode] [--at=offset[:length]] [--verify] [--sparse] [--in-place]\n", argv[0]);
+                    return -1;
+                }
+                break;
+            case 'p':
+                perf_counters_enabled = true;
+                break;
+            case 'h':
+                bufpool_hugepages = true;
+                break;
+            case 'a':
+                auth_enabled = true;
+                break;
+            case 'M':
+                merkle_enabled = true;
+                break;
+            case 'z':
+                compress_enabled = true;
+                break;
+            case 'c':
+                checkpoint_enabled = true;
+                break;
+            case 'R':
+                //the resumed run keeps saving checkpoints, it can be interrupted too
+                checkpoint_enabled = true;
+                resume_enabled = true;
+                break;
+            case 'x':
+                if (shard_configure(optarg) == -1)
+                {
+                    fprintf(stderr, "\nEnter a valid shard (<index>/<count>, with index < count)\n");
+                    return -1;
+                }
+                break;
+            case 'X':
+            {
+                char * end;
+                shards = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || shards == 0 || shards > 1024)
+                {
+                    fprintf(stderr, "\nEnter a valid number of shards (1 to 1024)\n");
+                    return -1;
+                }
+                break;
+            }
+            case 'P':
+                shard_prepare_only = true;
+                break;
+            case 'K':
+                rekey_key = optarg;
+                break;
+            case 'N':
+                if (parse_mode(optarg, &rekey_mode) == -1)
+                {
+                    fprintf(stderr, "\nEnter a valid new mode of operation (ecb/cbc/ctr/ofb/pcbc/cfb)\n");
+                    return -1;
+                }
+                new_mode_given = true;
+                break;
+            case 'V':
+                verify_plaintext = true;
+                break;
+            case 'H':
+                sparse_enabled = true;
+                break;
+            case 'W':
+                inplace_enabled = true;
+                break;
+            case 'A':
+                if (sector_configure_at(optarg) == -1)
+                {
+                    fprintf(stderr, "\nEnter a valid offset (<offset>[:<length>])\n");
+                    return -1;
+                }
+                break;
+            case 'r':
+                if (merkle_configure_range(optarg) == -1)
+                {
+                    fprintf(stderr, "\nEnter a valid range (<offset>:<length>)\n");
+                    return -1;
+                }
+                break;
+            case 'S':
+                daemon_socket = optarg;
+                break;
+            case 'b':
+                batch_source = optarg;
+                break;
+            case 'd':
+                batch_outdir = optarg;
+                break;
+            case 'I':
+            {
+                char * end;
+                kdf_iterations = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || kdf_iterations == 0 || kdf_iterations > 0xFFFFFFUL)
+                {
+                    fprintf(stderr, "\nEnter a valid number of key derivation iterations (1 to 16777215)\n");
+                    return -1;
+                }
+                break;
+            }
+            case 'n':
+                numa_enabled = false;
+                break;
+            case 's':
+                if (stats_configure(optarg) == -1)
+                {
+                    fprintf(stderr, "\nEnter a valid stats format (json[:file]/prom[:file])\n");
                     return -1;
                 }
                 break;
             default:
-                fprintf(stderr, "Usage: %s <enc|dec> [-k key] [-i infile] [-o outfile] [-m mode]\n", argv[0]);
+                fprintf(stderr, "Usage: %s <enc|dec|rekey|read|write|pack|unpack|list|verify|daemon> [-k key] [-i infile] [-o outfile]... [-m mode] [--perf-counters] [--stats=<json|prom>[:file]] [--no-numa] [--hugepages] [--auth] [--merkle] [--range=offset:length] [--batch <dir|list|->] [--outdir dir] [--iterations=n] [--socket=path] [--compress] [--checkpoint] [--resume] [--shards=n [--prepare]] [--shard=i/n] [--new-key=key] [--new-mode=mode] [--at=offset[:length]] [--verify] [--sparse] [--in-place]\n", argv[0]);
                 return -1;
         }
     }
@@ -320,6 +370,29 @@ int command_selection(int argc, char *argv[], char * key, char * infile, char *
             *op = enc;
         else if (strcmp(argv[optind], "dec") == 0)
             *op = dec;
+        else if (strcmp(argv[optind], "rekey") == 0)
+            *op = rekey;
+        else if (strcmp(argv[optind], "read") == 0 || strcmp(argv[optind], "write") == 0)
+        {
+            //random access only exists on sector volumes
+            *op = (strcmp(argv[optind], "read") == 0) ? read_range : write_range;
+            *opmode = xts;
+        }
+        else if (strcmp(argv[optind], "pack") == 0 || strcmp(argv[optind], "unpack") == 0 || strcmp(argv[optind], "list") == 0)
+        {
+            *op = (strcmp(argv[optind], "pack") == 0) ? pack : (strcmp(argv[optind], "unpack") == 0) ? unpack : contents;
+            //the files to add or to extract follow the operation
+            archive_members = &argv[optind + 1];
+            archive_nmembers = argc - optind - 1;
+        }
+        else if (strcmp(argv[optind], "daemon") == 0)
+            *op = serve;
+        else if (strcmp(argv[optind], "verify") == 0)
+        {
+            //verification only makes sense on the integrity trailer
+            *op = verify;
+            merkle_enabled = true;
+        }
         else 
 		{
             fprintf(stderr, "Invalid operation: %s\n", argv[optind]);
@@ -327,6 +400,114 @@ int command_selection(int argc, char *argv[], char * key, char * infile, char *
         }
     }
 
+    if (*op == rekey && !new_mode_given)
+        rekey_mode = *opmode;
+
+    //sector volumes are written and read in place, one sector at a time
+    if (*opmode == xts && (*op == verify || *op == serve || *op == rekey || batch_source != NULL || auth_enabled || merkle_enabled
+        || compress_enabled || checkpoint_enabled || shards > 0 || shard_count > 0))
+    {
+        fprintf(stderr, "\nxts only applies to enc, dec, read and write of a single volume, without --auth, --merkle, --compress, --checkpoint or sharding\n");
+        return -1;
+    }
+    //with --verify the plaintext of a single file is hashed, nothing is written
+    if (verify_plaintext && (*op != dec || *opmode == xts || batch_source != NULL || checkpoint_enabled || shards > 0 || shard_count > 0))
+    {
+        fprintf(stderr, "\n--verify only applies to the decryption of a single file, without -m xts, --batch, --checkpoint or sharding\n");
+        return -1;
+    }
+
+    //the extents of a sparse file are encrypted at their position in the plaintext, which only ctr allows
+    if (sparse_enabled && ((*op != enc && *op != dec) || *opmode != ctr || batch_source != NULL || auth_enabled || merkle_enabled
+        || compress_enabled || checkpoint_enabled || verify_plaintext || noutfiles > 1 || shards > 0 || shard_count > 0))
+    {
+        fprintf(stderr, "\n--sparse only applies to enc and dec of a single file in ctr mode, without --auth, --merkle, --compress, --checkpoint, --verify or sharding\n");
+        return -1;
+    }
+
+    //only the modes where the ciphertext has the size of the plaintext fit in the input, the header goes next to it
+    if (inplace_enabled && ((*op != enc && *op != dec) || (*opmode != ctr && *opmode != ofb) || noutfiles > 0
+        || batch_source != NULL || auth_enabled || merkle_enabled || compress_enabled || (checkpoint_enabled && !resume_enabled)
+        || verify_plaintext || sparse_enabled || shards > 0 || shard_count > 0))
+    {
+        fprintf(stderr, "\n--in-place only applies to enc and dec of a single file in ctr or ofb mode, without -o, --auth, --merkle, --compress, --checkpoint, --verify, --sparse or sharding\n");
+        return -1;
+    }
+
+    //a fan-out writes one output per key, each -k goes with the -o in the same position
+    if (noutfiles > 1 && *op != pack)
+    {
+        fanout_count = noutfiles;
+        if (*op != enc || nkeys != noutfiles || *opmode == xts || batch_source != NULL || checkpoint_enabled || shards > 0 || shard_count > 0)
+        {
+            fprintf(stderr, "\nSeveral outputs are only allowed in encryption, with one -k for every -o, without -m xts, --batch, --checkpoint or sharding\n");
+            return -1;
+        }
+    }
+
+    //the members of an archive are always in ctr mode, each one with its own IV
+    if ((*op == pack || *op == unpack || *op == contents) && (*opmode == xts || batch_source != NULL || auth_enabled || merkle_enabled
+        || compress_enabled || checkpoint_enabled || shards > 0 || shard_count > 0 || *output_mode == replace))
+    {
+        fprintf(stderr, "\npack, unpack and list don't take -m xts, --batch, --auth, --merkle, --compress, --checkpoint or sharding\n");
+        return -1;
+    }
+    if (*op == pack && archive_nmembers == 0)
+    {
+        fprintf(stderr, "\npack needs the files to add to the archive: %s pack -o <archive> <file>...\n", argv[0]);
+        return -1;
+    }
+    if (*op == rekey && rekey_mode == xts)
+    {
+        fprintf(stderr, "\nrekey can't write sector volumes\n");
+        return -1;
+    }
+
+    //the compressed stream is re-encrypted as it is, compression can't be turned on or off by rekey
+    if (*op == rekey && (rekey_key == NULL || batch_source != NULL || compress_enabled || checkpoint_enabled || shards > 0 || shard_count > 0))
+    {
+        fprintf(stderr, "\nrekey needs --new-key, and applies to a single file without --batch, --compress, --checkpoint or sharding\n");
+        return -1;
+    }
+
+    //checkpoints are saved next to the output of a single file
+    if (checkpoint_enabled && (*op == verify || *op == serve || batch_source != NULL))
+    {
+        fprintf(stderr, "\n--checkpoint and --resume only apply to the encryption or decryption of a single file\n");
+        return -1;
+    }
+
+    //every shard must be able to start anywhere in the file, and there's nobody to collect the trailers of all of them
+    if ((shards > 0 || shard_count > 0) && (*op == verify || *op == serve || batch_source != NULL || (*opmode != ctr && *opmode != ecb)
+        || auth_enabled || merkle_enabled || compress_enabled || checkpoint_enabled))
+    {
+        fprintf(stderr, "\nSharding only applies to the encryption or decryption of a single file in ctr or ecb mode, without --auth, --merkle, --compress or --checkpoint\n");
+        return -1;
+    }
+
     return 0;
 }
  
+
+//Sets opmode to the mode of operation called name, returns -1 if there's no such mode
+int parse_mode(const char * name, enum mode * opmode)
+{
+    if (strcmp(name, "ecb") == 0)
+        *opmode = ecb;
+    else if (strcmp(name, "cbc") == 0)
+        *opmode = cbc;
+    else if (strcmp(name, "ctr") == 0)
+        *opmode = ctr;
+    else if (strcmp(name, "ofb") == 0)
+        *opmode = ofb;
+    else if (strcmp(name, "pcbc") == 0)
+        *opmode = pcbc;
+    else if (strcmp(name, "cfb") == 0)
+        *opmode = cfb;
+    else if (strcmp(name, "xts") == 0)
+        *opmode = xts;
+    else
+        return -1;
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,293 @@
+//This module keeps a Merkle tree over the ciphertext, to check the integrity of big files without hashing them serially.
+//Every chunk is split into segments of MERKLE_SEGMENT bytes that are hashed with SHA-256 on all threads at once
+//(while the chunk is still in memory, right after the cipher kernel), and the segment digests are reduced to a chunk digest.
+//The chunk digests are the leaves of the tree whose root closes the trailer, so a range of the file can be checked
+//by hashing only the chunks that it touches, against digests that are themselves checked against the root.
+//Leaves and inner nodes are hashed with different prefixes, so that an inner node can't be passed off as a segment.
+//Nothing in the tree depends on the key, so that verify can check a file without it: whoever can change the ciphertext
+//can write a matching trailer too. The root is printed by enc and verify, to be kept apart from the file and compared
+//with the one of a later verify; --auth is what protects the ciphertext against changes.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "common.h"
+#include "stats.h"
+#include "numa.h"
+#include "bufpool.h"
+#include "merkle.h"
+#include "omp.h"
+#include "openssl/evp.h"
+
+#define LEAF_PREFIX 0x00
+#define NODE_PREFIX 0x01
+
+bool merkle_enabled = false;
+
+//range of ciphertext bytes to check in verification, the whole file by default
+static unsigned long range_start = 0;
+static unsigned long range_len = 0;
+
+static void hash_leaf(unsigned char * digest, const unsigned char * data, const unsigned long len)
+{
+	unsigned char prefix = LEAF_PREFIX;
+	EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(ctx, &prefix, 1);
+	EVP_DigestUpdate(ctx, data, len);
+	EVP_DigestFinal_ex(ctx, digest, NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+static void hash_node(unsigned char * digest, const unsigned char * left, const unsigned char * right)
+{
+	unsigned char node[1 + 2 * DIGESTSIZE];
+
+	node[0] = NODE_PREFIX;
+	memcpy(node + 1, left, DIGESTSIZE);
+	memcpy(node + 1 + DIGESTSIZE, right, DIGESTSIZE);
+	EVP_Digest(node, sizeof(node), digest, NULL, EVP_sha256(), NULL);
+}
+
+//Reduces count digests to their root, pairing them level by level (an odd digest is carried up unchanged).
+//The digests array is overwritten.
+static void reduce_tree(unsigned char * root, unsigned char (* level)[DIGESTSIZE], unsigned long count)
+{
+	while (count > 1)
+	{
+		unsigned long next = 0;
+
+		for (unsigned long i = 0; i < count; i += 2, next++)
+		{
+			if (i + 1 < count)
+				hash_node(level[next], level[i], level[i + 1]);
+			else
+				memmove(level[next], level[i], DIGESTSIZE);
+		}
+		count = next;
+	}
+
+	memcpy(root, level[0], DIGESTSIZE);
+}
+
+//Computes the digest of a chunk: the segments are hashed in parallel, every thread taking the segments of its NUMA slice
+static void hash_chunk(unsigned char * digest, const unsigned char * data, const unsigned long len)
+{
+	unsigned long nsegments = (len + MERKLE_SEGMENT - 1) / MERKLE_SEGMENT;
+	unsigned char (* segments)[DIGESTSIZE] = malloc((nsegments > 0 ? nsegments : 1) * DIGESTSIZE);
+	double mac_start = stats_clock();
+
+	if (nsegments == 0)
+		hash_leaf(segments[0], data, 0);
+
+	#pragma omp parallel
+	{
+		unsigned long begin, end;
+		numa_thread_range(nsegments, &begin, &end);
+
+		for (unsigned long s = begin; s < end; s++)
+		{
+			unsigned long start = s * MERKLE_SEGMENT;
+			hash_leaf(segments[s], data + start, (len - start < MERKLE_SEGMENT) ? len - start : MERKLE_SEGMENT);
+		}
+	}
+
+	reduce_tree(digest, segments, nsegments > 0 ? nsegments : 1);
+	free(segments);
+	stats_record(stage_mac, mac_start);
+}
+
+//Parses a range in the form <offset>:<length> (in ciphertext bytes, excluding the header), returns -1 if it's invalid
+int merkle_configure_range(const char * spec)
+{
+	char * end;
+
+	range_start = strtoul(spec, &end, 10);
+	if (end == spec || *end != ':')
+		return -1;
+
+	spec = end + 1;
+	range_len = strtoul(spec, &end, 10);
+	if (end == spec || *end != '\0' || range_len == 0)
+		return -1;
+
+	return 0;
+}
+
+void merkle_init(merkle_state * state)
+{
+	memset(state, 0, sizeof(merkle_state));
+}
+
+//Frees the chunk digests of a file
+void merkle_release(merkle_state * state)
+{
+	free(state->digests);
+	memset(state, 0, sizeof(merkle_state));
+}
+
+//Hashes the ciphertext of an encrypted chunk. Just like the authentication tags, the output of the last chunk
+//is split into BUFSIZE pieces to match the chunks that decryption will read back.
+void merkle_add_output(merkle_state * state, const unsigned char * ciphertext, const unsigned long len)
+{
+	for (unsigned long offset = 0; offset < len; offset += BUFSIZE)
+	{
+		if (state->ndigests == state->digests_capacity)
+		{
+			state->digests_capacity = state->digests_capacity == 0 ? 64 : state->digests_capacity * 2;
+			state->digests = realloc(state->digests, state->digests_capacity * DIGESTSIZE);
+		}
+
+		hash_chunk(state->digests[state->ndigests], ciphertext + offset, (len - offset < BUFSIZE) ? len - offset : BUFSIZE);
+		state->ndigests++;
+		state->next_digest++;
+	}
+}
+
+//Checks a chunk of ciphertext against its digest in the trailer.
+//Returns -1 if it doesn't match, or if the chunks don't end where the trailer says they should.
+int merkle_verify_chunk(merkle_state * state, const unsigned char * ciphertext, const unsigned long len, const bool final_chunk)
+{
+	unsigned char digest[DIGESTSIZE];
+
+	if (state->next_digest >= state->ndigests || final_chunk != (state->next_digest == state->ndigests - 1))
+		return -1;
+
+	hash_chunk(digest, ciphertext, len);
+	if (memcmp(digest, state->digests[state->next_digest], DIGESTSIZE) != 0)
+		return -1;
+
+	state->next_digest++;
+	return 0;
+}
+
+//Appends the chunk digests, the root and the footer block to the ciphertext
+int merkle_write_trailer(merkle_state * state, FILE * write_file)
+{
+	unsigned char (* level)[DIGESTSIZE] = malloc(state->ndigests * DIGESTSIZE);
+	block footer;
+
+	memcpy(level, state->digests, state->ndigests * DIGESTSIZE);
+	reduce_tree(state->root, level, state->ndigests);
+	free(level);
+
+	for (int i = 0; i < BLOCKSIZE/2; i++)
+		footer.left[i] = (state->ndigests >> (8 * i)) & 0xFF;
+	memcpy(footer.right, MERKLE_MAGIC, BLOCKSIZE/2);
+
+	if (fwrite(state->digests, DIGESTSIZE, state->ndigests, write_file) != state->ndigests || fwrite(state->root, DIGESTSIZE, 1, write_file) != 1)
+		return -1;
+	if (fwrite(&footer, sizeof(block), 1, write_file) != 1)
+		return -1;
+
+	return 0;
+}
+
+//Loads the chunk digests from the end of the payload that starts at offset, checks them against the root
+//and removes the trailer size from payload_size. The position in read_file is not preserved.
+//Returns -1 if there's no valid trailer or if the digests don't match the root.
+int merkle_read_trailer(merkle_state * state, FILE * read_file, const unsigned long offset, unsigned long * payload_size)
+{
+	unsigned char stored_root[DIGESTSIZE];
+	unsigned char (* level)[DIGESTSIZE];
+	unsigned long count = 0;
+	block footer;
+
+	if (*payload_size < BLOCKSIZE + DIGESTSIZE)
+		return -1;
+
+	fseek(read_file, offset + *payload_size - BLOCKSIZE, SEEK_SET);
+	if (fread(&footer, sizeof(block), 1, read_file) != 1 || memcmp(footer.right, MERKLE_MAGIC, BLOCKSIZE/2) != 0)
+		return -1;
+
+	for (int i = 0; i < BLOCKSIZE/2; i++)
+		count |= (unsigned long)footer.left[i] << (8 * i);
+	if (count == 0 || count > (*payload_size - BLOCKSIZE) / DIGESTSIZE - 1)
+		return -1;
+
+	state->digests = realloc(state->digests, count * DIGESTSIZE);
+	state->digests_capacity = state->ndigests = count;
+	state->next_digest = 0;
+	fseek(read_file, offset + *payload_size - BLOCKSIZE - (count + 1) * DIGESTSIZE, SEEK_SET);
+	if (fread(state->digests, DIGESTSIZE, count, read_file) != count || fread(stored_root, DIGESTSIZE, 1, read_file) != 1)
+		return -1;
+
+	level = malloc(count * DIGESTSIZE);
+	memcpy(level, state->digests, count * DIGESTSIZE);
+	reduce_tree(state->root, level, count);
+	free(level);
+	if (memcmp(state->root, stored_root, DIGESTSIZE) != 0)
+		return -1;
+
+	*payload_size -= BLOCKSIZE + (count + 1) * DIGESTSIZE;
+	return 0;
+}
+
+//Prints the root of the tree, followed by the name of the file if given, for it to be kept somewhere else than the file
+void merkle_print_root(const merkle_state * state, const char * name)
+{
+	char hex[2 * DIGESTSIZE + 1];
+
+	for (int i = 0; i < DIGESTSIZE; i++)
+		snprintf(&hex[2 * i], 3, "%02x", state->root[i]);
+	//the root goes on the line of the progress display
+	if (progress_enabled)
+		printf("\r%*s\r", 100, "");
+	if (name != NULL)
+		printf("Merkle root: %s  %s\n", hex, name);
+	else
+		printf("Merkle root: %s\n", hex);
+}
+
+//Checks the chunks touched by the configured range (all of them if no range was given) without decrypting anything.
+//Saves in verified the number of chunks that were checked, returns -1 at the first chunk that doesn't match its digest.
+int merkle_verify_range(merkle_state * state, FILE * read_file, const unsigned long offset, const unsigned long payload_size, unsigned long * verified)
+{
+	unsigned long nchunks = (payload_size + BUFSIZE - 1) / BUFSIZE;
+	unsigned long first = 0;
+	unsigned long last = nchunks > 0 ? nchunks - 1 : 0;
+	unsigned char digest[DIGESTSIZE];
+	unsigned char * data;
+
+	*verified = 0;
+	if (nchunks != state->ndigests)
+		return -1;
+
+	if (range_len > 0)
+	{
+		if (range_start >= payload_size)
+			return -1;
+		first = range_start / BUFSIZE;
+		last = (range_start + range_len - 1) / BUFSIZE;
+		if (last >= nchunks) last = nchunks - 1;
+	}
+
+	data = bufpool_get(BUFSIZE);
+	for (unsigned long c = first; c <= last; c++)
+	{
+		unsigned long len = (payload_size - c * BUFSIZE < BUFSIZE) ? payload_size - c * BUFSIZE : BUFSIZE;
+
+		double read_start = stats_clock();
+		fseek(read_file, offset + c * BUFSIZE, SEEK_SET);
+		if (fread(data, 1, len, read_file) != len)
+		{
+			bufpool_put(data);
+			return -1;
+		}
+		stats_record(stage_read, read_start);
+		stats_add_bytes(len);
+
+		hash_chunk(digest, data, len);
+		if (memcmp(digest, state->digests[c], DIGESTSIZE) != 0)
+		{
+			bufpool_put(data);
+			return -1;
+		}
+		(*verified)++;
+	}
+
+	bufpool_put(data);
+	return 0;
+}
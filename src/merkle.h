@@ -0,0 +1,30 @@
+//Merkle tree integrity trailer, enabled with --merkle
+//The trailer is formed by the digest of every BUFSIZE bytes of ciphertext, the root of the tree built over them
+//and a footer block holding the number of chunk digests and a magic string.
+//The root is not keyed: it detects corruption, not deliberate changes (see merkle_print_root).
+#define MERKLE_MAGIC "CFMRKL1"
+#define MERKLE_SEGMENT 1048576
+#define DIGESTSIZE 32
+
+extern bool merkle_enabled;
+
+//chunk digests of the file being processed
+typedef struct merkle_state {
+	unsigned char (* digests)[DIGESTSIZE];
+	unsigned long ndigests;
+	unsigned long digests_capacity;
+	//index of the next chunk to be hashed or verified
+	unsigned long next_digest;
+	//root of the tree, once the trailer has been written or read
+	unsigned char root[DIGESTSIZE];
+}merkle_state;
+
+int merkle_configure_range(const char * spec);
+void merkle_init(merkle_state * state);
+void merkle_release(merkle_state * state);
+void merkle_add_output(merkle_state * state, const unsigned char * ciphertext, const unsigned long len);
+int merkle_verify_chunk(merkle_state * state, const unsigned char * ciphertext, const unsigned long len, const bool final_chunk);
+int merkle_write_trailer(merkle_state * state, FILE * write_file);
+int merkle_read_trailer(merkle_state * state, FILE * read_file, const unsigned long offset, unsigned long * payload_size);
+void merkle_print_root(const merkle_state * state, const char * name);
+int merkle_verify_range(merkle_state * state, FILE * read_file, const unsigned long offset, const unsigned long payload_size, unsigned long * verified);
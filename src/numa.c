@@ -0,0 +1,216 @@
+//This module makes the parallel kernels NUMA-aware without depending on libnuma.
+//The node topology is read from sysfs, every OpenMP thread is bound to a cpu of a node, and the threads bound
+//to the same node form a group. The binding follows the thread number in the current team, and the runtime doesn't
+//promise that a number is the same OS thread in every region (nested teams, teams of another size), so a thread is
+//bound again at the start of every kernel region whenever its number gives it another cpu. A buffer of N elements is split in one contiguous slice per group: the slice
+//is first touched by the threads of the group (so its pages are allocated on their node) and later processed
+//by the same threads, so the kernels never read or write memory across the interconnect.
+//On single-node machines, or when the topology can't be read, everything falls back to an even static split.
+
+#define _GNU_SOURCE
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "sched.h"
+#include "common.h"
+#include "numa.h"
+#include "tiling.h"
+#include "omp.h"
+
+#define MAX_NODES 64
+#define NUMA_PAGE_SIZE 4096
+
+//NUMA placement is used by default on multi-node machines, --no-numa disables it
+bool numa_enabled = true;
+
+static int nnodes = 1;
+static int * node_cpus[MAX_NODES];
+static int node_ncpus[MAX_NODES];
+//cpu the calling thread is bound to, -1 if it hasn't been bound yet
+static __thread int bound_cpu = -1;
+
+//Parses a sysfs list such as "0-3,8-11": every number in it is stored in out (if not NULL), and the count is returned
+static int parse_list(const char * list, int * out, int max)
+{
+	int count = 0;
+	const char * p = list;
+
+	while (*p != '\0' && *p != '\n')
+	{
+		char * next;
+		long first = strtol(p, &next, 10);
+		long last = first;
+		if (next == p)
+			break;
+		if (*next == '-')
+		{
+			p = next + 1;
+			last = strtol(p, &next, 10);
+		}
+		for (long n = first; n <= last && count < max; n++)
+		{
+			if (out != NULL)
+				out[count] = n;
+			count++;
+		}
+		p = (*next == ',') ? next + 1 : next;
+	}
+
+	return count;
+}
+
+//Reads the first line of a sysfs file into buffer, returns -1 if the file can't be read
+static int read_sysfs_line(const char * path, char * buffer, int size)
+{
+	FILE * f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	if (fgets(buffer, size, f) == NULL)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+//Returns the number of groups the current team of threads is split into: one per node, unless there are fewer threads than nodes
+static int group_count(int nthreads)
+{
+	if (!numa_enabled)
+		return 1;
+	return nthreads < nnodes ? nthreads : nnodes;
+}
+
+//Binds the calling thread to the cpu of its node that its number in the current team gives it, round-robin inside the
+//node. Must be called from inside a parallel region, the system call is only made when the cpu changes.
+static void bind_thread(void)
+{
+	int t = omp_get_thread_num();
+	int nthreads = omp_get_num_threads();
+	int groups = group_count(nthreads);
+	int group = (t * groups) / nthreads;
+	int first_thread = (group * nthreads + groups - 1) / groups;
+	int cpu = node_cpus[group][(t - first_thread) % node_ncpus[group]];
+	cpu_set_t mask;
+
+	if (cpu == bound_cpu)
+		return;
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask) == 0)
+		bound_cpu = cpu;
+}
+
+//Reads the node topology and binds every thread of the OpenMP team to a cpu of its node.
+//Returns the number of nodes in use, disabling NUMA placement if there's only one of them.
+int numa_setup(void)
+{
+	char line[4096];
+	char path[128];
+	int nodes[MAX_NODES];
+	cpu_set_t allowed;
+
+	if (!numa_enabled)
+		return 1;
+
+	if (read_sysfs_line("/sys/devices/system/node/online", line, sizeof(line)) == -1 ||
+		sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+	{
+		numa_enabled = false;
+		return 1;
+	}
+
+	int online = parse_list(line, nodes, MAX_NODES);
+	nnodes = 0;
+	for (int n = 0; n < online; n++)
+	{
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[n]);
+		if (read_sysfs_line(path, line, sizeof(line)) == -1)
+			continue;
+
+		int ncpus = parse_list(line, NULL, CPU_SETSIZE);
+		int * cpus = malloc(ncpus * sizeof(int));
+		parse_list(line, cpus, ncpus);
+
+		//only the cpus we're allowed to run on are kept, nodes with none of them (e.g. memory-only nodes) are skipped
+		int usable = 0;
+		for (int c = 0; c < ncpus; c++)
+			if (CPU_ISSET(cpus[c], &allowed))
+				cpus[usable++] = cpus[c];
+
+		if (usable == 0)
+		{
+			free(cpus);
+			continue;
+		}
+		node_cpus[nnodes] = cpus;
+		node_ncpus[nnodes] = usable;
+		nnodes++;
+	}
+
+	if (nnodes < 2)
+	{
+		numa_enabled = false;
+		nnodes = 1;
+		return 1;
+	}
+
+	//binding every thread of the default team before the buffers are first touched
+	#pragma omp parallel
+	bind_thread();
+
+	return nnodes;
+}
+
+//Must be called from inside a parallel region: computes the range [begin, end) of the total elements
+//that the calling thread is going to process. The elements are first split in one slice per node,
+//then every slice is split evenly between the threads bound to that node, which the calling thread is bound to first.
+void numa_thread_range(const unsigned long total, unsigned long * begin, unsigned long * end)
+{
+	//programs linking the library don't call numa_setup, their threads are left where they are
+	if (numa_enabled && nnodes > 1)
+		bind_thread();
+
+	int t = omp_get_thread_num();
+	int nthreads = omp_get_num_threads();
+	int groups = group_count(nthreads);
+	int group = (t * groups) / nthreads;
+
+	//threads of a group are contiguous, so the group's first thread and size can be computed directly
+	int first_thread = (group * nthreads + groups - 1) / groups;
+	int next_first_thread = ((group + 1) * nthreads + groups - 1) / groups;
+	unsigned long group_threads = next_first_thread - first_thread;
+	unsigned long rank = t - first_thread;
+
+	unsigned long slice_begin = (total * group) / groups;
+	unsigned long slice_end = (total * (group + 1)) / groups;
+	unsigned long slice_len = slice_end - slice_begin;
+
+	*begin = slice_begin + (slice_len * rank) / group_threads;
+	*end = slice_begin + (slice_len * (rank + 1)) / group_threads;
+}
+
+//Touches every page of a freshly allocated buffer from the thread that will later process it,
+//so that the kernel allocates the pages on that thread's node. The split is the same one used by the kernels.
+void numa_first_touch(unsigned char * buffer, const unsigned long size)
+{
+	if (!numa_enabled)
+		return;
+
+	#pragma omp parallel
+	{
+		unsigned long begin, end;
+		tile_thread_range(size / BLOCKSIZE, &begin, &end);
+		begin *= BLOCKSIZE;
+		end *= BLOCKSIZE;
+
+		//a page shared by two ranges is placed by the thread owning its first byte
+		for (unsigned long p = ((begin + NUMA_PAGE_SIZE - 1) / NUMA_PAGE_SIZE) * NUMA_PAGE_SIZE; p < end; p += NUMA_PAGE_SIZE)
+			buffer[p] = 0;
+	}
+}
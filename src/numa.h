@@ -0,0 +1,6 @@
+//NUMA-aware thread binding and work placement
+extern bool numa_enabled;
+
+int numa_setup(void);
+void numa_thread_range(const unsigned long total, unsigned long * begin, unsigned long * end);
+void numa_first_touch(unsigned char * buffer, const unsigned long size);
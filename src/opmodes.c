@@ -8,6 +8,11 @@
 #include "common.h"
 #include "utils.h"
 #include "feistel.h"
+#include "perfcount.h"
+#include "stats.h"
+#include "numa.h"
+#include "bufpool.h"
+#include "tiling.h"
 #include "sys/time.h"
 #include "omp.h"
 #include "stdint.h"
@@ -17,58 +22,119 @@
 extern long unsigned total_file_size;
 extern struct timeval start_time;
 
-//Executes the cipher in ECB mode; takes a block array, the total number of blocks and the round keys, populates result.
-void operate_ecb_mode(unsigned char * result, block * b, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE])
+//Adds the blocks of a finished tile to the progress counter of a mode.
+//The counter is only touched once per tile, and progress is printed by the first thread only.
+static void tile_progress(unsigned long * current_block, const unsigned long done)
 {
 	struct timeval current_time;
-	static int current_block = 0;
 
+	#pragma omp atomic
+	*current_block += done;
+
+	if (omp_get_thread_num() == 0)
+	{
+		gettimeofday(&current_time, NULL);
+		show_progress_data(current_time, start_time, total_file_size, *current_block);
+	}
+}
+
+//Resets the chaining state of a mode of operation, must be called before processing the first chunk of a file
+void init_mode_state(mode_state * state)
+{
+	memset(state, 0, sizeof(mode_state));
+	state->first_chunk = true;
+}
+
+//Sets the state of the modes without chaining (ECB and CTR) to start from block first_block of a file instead of its
+//first one, so that any range of chunks can be processed on its own
+void seek_mode_state(mode_state * state, const block * iv, const unsigned long first_block)
+{
+	init_mode_state(state);
+	if (first_block == 0)
+		return;
+
+	state->first_chunk = false;
+	state->counter = derive_number_from_block(iv) + first_block;
+	state->current_block = first_block;
+}
+
+//XORs keystream and data for the blocks [tile, last) of a stream-like mode, without going past data_len.
+//Works on 8 bytes at a time instead of byte by byte, the tail of a partial last block is done bytewise.
+static void xor_tile(unsigned char * result, const unsigned char * keystream, const unsigned char * data, 
+	const unsigned long tile, const unsigned long last, const unsigned long data_len)
+{
+	unsigned long i = tile * BLOCKSIZE;
+	unsigned long stop = last * BLOCKSIZE < data_len ? last * BLOCKSIZE : data_len;
+	uint64_t k, d;
+
+	for (; i + sizeof(uint64_t) <= stop; i += sizeof(uint64_t))
+	{
+		memcpy(&k, &keystream[i], sizeof(uint64_t));
+		memcpy(&d, &data[i], sizeof(uint64_t));
+		k ^= d;
+		memcpy(&result[i], &k, sizeof(uint64_t));
+	}
+
+	for (; i < stop; i++)
+		result[i] = keystream[i] ^ data[i];
+}
+
+//Executes the cipher in ECB mode; takes a block array, the total number of blocks and the round keys, populates result.
+void operate_ecb_mode(unsigned char * result, block * b, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], mode_state * state)
+{
+	double kernel_start = stats_clock();
 	//launching the feistel algorithm on every block, by making the index jump by increments of BLOCKSIZE
-	#pragma omp parallel for
-	for (unsigned long i = 0; i < bnum; ++i) 
+	#pragma omp parallel
 	{
-		//logging (pre-processing)
-		current_block++;
-		if (i % 10000 == 0)
+		perf_sample sample;
+		perf_section_begin(&sample);
+
+		unsigned long begin, end;
+		tile_thread_range(bnum, &begin, &end);
+
+		//every thread walks its own run of blocks one tile at a time
+		for (unsigned long tile = begin; tile < end; tile += tile_blocks)
 		{
-			gettimeofday(&current_time, NULL);
-			show_progress_data(current_time, start_time, total_file_size, current_block);
-		}
-		#pragma omp critical
-		block_logging((unsigned char *)&b[i], "\n----------ECB-------BEFORE-----------", i);
+			unsigned long last = tile_end(tile, end);
 
-		//applying the cipher on the current block
-		process_block(&result[i * BLOCKSIZE], b[i].left, b[i].right, round_keys);
+			for (unsigned long i = tile; i < last; i++) 
+			{
+				//logging (pre-processing)
+				#pragma omp critical
+				block_logging((unsigned char *)&b[i], "\n----------ECB-------BEFORE-----------", i);
+
+				//applying the cipher on the current block
+				process_block(&result[i * BLOCKSIZE], b[i].left, b[i].right, round_keys);
+
+				//logging (post-processing)
+				#pragma omp critical
+				block_logging(&result[i * BLOCKSIZE], "\n----------ECB-------AFTER-----------", i);
+			}
 
-		//logging (post-processing)
-		#pragma omp critical
-		block_logging(&result[i * BLOCKSIZE], "\n----------ECB-------AFTER-----------", i);
+			tile_progress(&state->current_block, last - tile);
+		}
+
+		perf_section_end(&sample, ecb);
 	}
+	stats_record(stage_kernel, kernel_start);
+	perf_account_bytes(ecb, bnum * BLOCKSIZE);
 }
 
 //Executes the cipher in CTR mode; 
 //takes a block array, the length of the chunk, an IV and the round keys, returns processed data by populating result.
-void operate_ctr_mode(unsigned char * result, block * b, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv)
+void operate_ctr_mode(unsigned char * result, block * b, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state)
 {
-	struct timeval current_time;
-	static int current_block = 0;
-
-	static bool first_chunk = true;
-
 	block counter_block;
 	//Casting the block pointer to a char one because it's comfier for stream-like logic
 	unsigned char * data = (unsigned char*)b;
 
-	static unsigned long initial_counter;
-	long unsigned counter = 0;
-	unsigned long next_initial_counter;
-
-	if (first_chunk == true) //Initializing the counter with the IV when it's the first processed chunk
+	if (state->first_chunk == true) //Initializing the counter with the IV when it's the first processed chunk
 	{
-		initial_counter = derive_number_from_block(&iv);
+		state->counter = derive_number_from_block(&iv);
 	}
+	unsigned long initial_counter = state->counter;
 
-	int bnum = 0;
+	unsigned long bnum = 0;
 	if (data_len % BLOCKSIZE == 0) 
 		bnum = data_len/BLOCKSIZE;
 	else 
@@ -77,180 +143,195 @@ void operate_ctr_mode(unsigned char * result, block * b, const unsigned long dat
 	 	bnum = data_len/BLOCKSIZE + 1;
 
 	unsigned char * keystream;
-	keystream = malloc(BLOCKSIZE * bnum * sizeof(unsigned char));
+	keystream = bufpool_get(BLOCKSIZE * bnum * sizeof(unsigned char));
 
+	double kernel_start = stats_clock();
 	//launching the cycle that will create the CTR keystream
-	#pragma omp parallel private (counter, counter_block)
+	#pragma omp parallel private (counter_block)
 	{
-		counter = initial_counter;		
-		//launching the feistel algorithm on every block
-		#pragma omp for schedule(static, 1)
-		for (unsigned long i=0; i<bnum; i++)
-		{
-			counter = initial_counter + i;
+		perf_sample sample;
+		perf_section_begin(&sample);
+
+		unsigned long begin, end;
+		tile_thread_range(bnum, &begin, &end);
 
-			//initializing the counter block for this iteration 
-			derive_block_from_number(counter, &counter_block);
+		//launching the feistel algorithm on every block, one tile at a time
+		for (unsigned long tile = begin; tile < end; tile += tile_blocks)
+		{
+			unsigned long last = tile_end(tile, end);
 
-			//logging (pre-processing)
-			current_block++;
-			if (i % 10000 == 0)
+			for (unsigned long i = tile; i < last; i++)
 			{
-				gettimeofday(&current_time, NULL);
-				show_progress_data(current_time, start_time, total_file_size, current_block);
+				//initializing the counter block for this iteration 
+				derive_block_from_number(initial_counter + i, &counter_block);
+
+				//applying the cipher on the counter block 
+				process_block(&keystream[i*BLOCKSIZE], counter_block.left, counter_block.right, round_keys);
 			}
-			
-			//applying the cipher on the counter block 
-			process_block(&keystream[i*BLOCKSIZE], counter_block.left, counter_block.right, round_keys);
 
-			//It's the last iteration, setting the starting counter for the next chunk
-			if (i == bnum - 1 ) next_initial_counter = counter + 1;
-		}	
+			tile_progress(&state->current_block, last - tile);
+		}
+
+		perf_section_end(&sample, ctr);
 	}
+	stats_record(stage_kernel, kernel_start);
 
+	double xor_start = stats_clock();
 	//launching the cycle that will XOR the keystream and the data to produce the ciphertext
-	#pragma omp parallel for
-	for (size_t i = 0; i < data_len; i++) 
+	#pragma omp parallel
 	{
-		result[i] = keystream[i] ^ data[i];
-		
-		//If i+1 is a multiple of blocksize, it means we just finished XORing a whole block, we can print it
-		if (i > 0 && (i+1) % BLOCKSIZE == 0)
+		perf_sample sample;
+		perf_section_begin(&sample);
+
+		unsigned long begin, end;
+		tile_thread_range(bnum, &begin, &end);
+		for (unsigned long tile = begin; tile < end; tile += tile_blocks)
 		{
-			//The position where we start printing would be i - (b-1) with b=BLOCKSIZE, here's why:
-			//
-			//We're now at iteration i = b*k - 1, where k is a natural multiple of BLOCKSIZE, and we want the index we had at i = b * (k-1),
-			//which is exactly the last multiple of BLOCKSIZE before the current index and therefore the last used block index.
-			//
-			//Again, the current index is i = b*k - 1 because we enter this conditional one position before a multiple of b.
-			//If we subtract (b - 1) to the current index we get i = b*k-1-(b-1) = b*k-1-b+1 = b*k-b = b * (k-1)
-			block_logging(&keystream[(i - (BLOCKSIZE - 1))], "\n----------CTR(ENC)------keystream-----------", (i/BLOCKSIZE));
-			block_logging(&data[(i - (BLOCKSIZE - 1))], "\n----------CTR(ENC)------plaintext-----------", i/BLOCKSIZE);
-			block_logging(&result[(i - (BLOCKSIZE - 1))], "\n----------CTR(ENC)------ciphertext-----------", i/BLOCKSIZE);
+			unsigned long last = tile_end(tile, end);
+			xor_tile(result, keystream, data, tile, last, data_len);
+
+			//logging every whole block of the tile
+			for (unsigned long i = tile; i < last && i < data_len / BLOCKSIZE; i++)
+			{
+				block_logging(&keystream[i*BLOCKSIZE], "\n----------CTR(ENC)------keystream-----------", i);
+				block_logging(&data[i*BLOCKSIZE], "\n----------CTR(ENC)------plaintext-----------", i);
+				block_logging(&result[i*BLOCKSIZE], "\n----------CTR(ENC)------ciphertext-----------", i);
+			}
 		}
-    }
-
-	//I'm using a second variable to save the initial counter for the next chunk during the cycle
-	//Because if I used the one that I access during the parallel for, I would have interleaving issues:
-	//the value would be set by the thread handling the last iteration numerically, not chronologically
-	//and that means some threads might occasionally still be "left behind" processing earlier iterations
-	//with an incorrect value of initial_counter
-	//Here we copy it back to the static variable that will store it for the next chunk
-	initial_counter = next_initial_counter;
+
+		perf_section_end(&sample, ctr);
+	}
+	stats_record(stage_xor, xor_start);
+
+	//Every block i of this chunk used initial_counter + i, so the next chunk starts right after the last one
+	state->counter = initial_counter + bnum;
+	perf_account_bytes(ctr, data_len);
 	
-	free(keystream);
-	first_chunk = false;
+	bufpool_put(keystream);
+	state->first_chunk = false;
 }
 
 //Executes encryption in CBC mode; 
 //takes a block array, the total number of blocks, an IV and the round keys, returns processed data by populating ciphertext.
-void encrypt_cbc_mode(unsigned char * ciphertext, block * plaintext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv)
+void encrypt_cbc_mode(unsigned char * ciphertext, block * plaintext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state)
 {
 	struct timeval current_time;
-	static int current_block = 0;
-
-	static bool first_chunk = true;
 	block xor_result;
 
-	//Copying the IV block to a local variable only if we're operating on the first chunk
-	static block prev_ciphertext;
-	if (first_chunk == true)
+	//The chaining block of the file's state starts from the IV on the first chunk
+	block * prev_ciphertext = &state->chain;
+	if (state->first_chunk == true)
 	{
-		memcpy(&prev_ciphertext, &iv, BLOCKSIZE);
+		memcpy(prev_ciphertext, &iv, BLOCKSIZE);
 	}	
 
-	block_logging((unsigned char *)&prev_ciphertext, "\n----------CBC(ENC)-------IV-----------", 0);
+	block_logging((unsigned char *)prev_ciphertext, "\n----------CBC(ENC)-------IV-----------", 0);
+
+	double kernel_start = stats_clock();
+	perf_sample sample;
+	perf_section_begin(&sample);
 
 	//launching the feistel algorithm on every block
 	for (unsigned long i=0; i<bnum; ++i) 
 	{
 		//logging (pre-encryption)
-		current_block++;
+		state->current_block++;
 		if (i % 10000 == 0)
 		{
 			gettimeofday(&current_time, NULL);
-			show_progress_data(current_time, start_time, total_file_size, current_block);
+			show_progress_data(current_time, start_time, total_file_size, state->current_block);
 		}
 		block_logging((unsigned char *)&plaintext[i], "\n----------CBC(ENC)-------BEFORE-----------", i);
 
 		//XORing the current block x with the ciphertext of the block x-1
-		block_xor(&xor_result, &plaintext[i], &prev_ciphertext);
+		block_xor(&xor_result, &plaintext[i], prev_ciphertext);
 		
 		//executing the encryption on the result of the previous xor and saving the result in prev_ciphertext for use in the next iteration
 		process_block(&ciphertext[i*BLOCKSIZE], xor_result.left, xor_result.right, round_keys);
-		memcpy(&prev_ciphertext, &ciphertext[i*BLOCKSIZE], sizeof(block));
+		memcpy(prev_ciphertext, &ciphertext[i*BLOCKSIZE], sizeof(block));
 
 		//logging (post-encryption)
 		block_logging(&ciphertext[i*BLOCKSIZE], "\n----------CBC(ENC)-------AFTER-----------", i);
 	}
 
-	first_chunk = false;
+	perf_section_end(&sample, cbc);
+	stats_record(stage_kernel, kernel_start);
+	perf_account_bytes(cbc, bnum * BLOCKSIZE);
+
+	state->first_chunk = false;
 }
 
 //Executes decryption in CBC mode; 
 //takes a block array, the total number of blocks, an IV and the round keys, returns processed data by populating plaintext.
-void decrypt_cbc_mode(unsigned char * plaintext, block * ciphertext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv)
+void decrypt_cbc_mode(unsigned char * plaintext, block * ciphertext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state)
 {
-	struct timeval current_time;
-	static int current_block = 0;
-
-	static bool first_chunk = true;
 
 	//This block will hold the result of the feistel cipher on the current ciphertext block
 	//so that we can avoid operating in place on the b chunk, and keep the b[i-1] ciphertext block intact
 	//and available for the final XOR
 	block cur_ciphertext;
 	
-	//Copying the IV block to a local variable only if we're operating on the first chunk
+	//The chaining block of the file's state starts from the IV on the first chunk
 	//In later chunks, current_iv will hold the last keystream block of the previous chunk 
-	static block current_iv;
-	if (first_chunk == true)
+	block * current_iv = &state->chain;
+	if (state->first_chunk == true)
 	{
-		memcpy(&current_iv, &iv, BLOCKSIZE);
+		memcpy(current_iv, &iv, BLOCKSIZE);
 	}	
 
-	block_logging((unsigned char *)&current_iv, "\n----------CBC(DEC)-------IV-----------", 0);
+	block_logging((unsigned char *)current_iv, "\n----------CBC(DEC)-------IV-----------", 0);
 
+	double kernel_start = stats_clock();
 	//launching the feistel algorithm on every block, by making the index jump by increments of BLOCKSIZE
-	#pragma omp parallel for private (cur_ciphertext)
-	for (unsigned long i=0; i<bnum; ++i) 
-	{	
-		//logging (pre-decryption)
-		#pragma omp critical
-		block_logging((unsigned char *)&ciphertext[i], "\n----------CBC(DEC)------BEFORE-----------", i);
-		current_block++;
-		if (i % 10000 == 0)
+	#pragma omp parallel private (cur_ciphertext)
+	{
+		perf_sample sample;
+		perf_section_begin(&sample);
+
+		unsigned long begin, end;
+		tile_thread_range(bnum, &begin, &end);
+		for (unsigned long tile = begin; tile < end; tile += tile_blocks)
 		{
-			gettimeofday(&current_time, NULL);
-			show_progress_data(current_time, start_time, total_file_size, current_block);
-		}
+			unsigned long last = tile_end(tile, end);
+
+			for (unsigned long i = tile; i < last; i++) 
+			{	
+				//logging (pre-decryption)
+				#pragma omp critical
+				block_logging((unsigned char *)&ciphertext[i], "\n----------CBC(DEC)------BEFORE-----------", i);
+
+				//First thing, running feistel on the ciphertext block and storing the result in cur_ciphertext,...
+				process_block((unsigned char *)&cur_ciphertext, ciphertext[i].left, ciphertext[i].right, round_keys);
+
+				if (i == 0) //...if it's the first block, you xor the result with the IV to get the first plaintext block...
+					block_xor((block *)&plaintext[(i*BLOCKSIZE)], &cur_ciphertext, current_iv); 
+				else	//...whereas for every other ciphered block x, you xor the result with ciphertext[x-1] to get plaintext[i]
+					block_xor((block *)&plaintext[(i*BLOCKSIZE)], &cur_ciphertext, &ciphertext[(i)-1]); 			
 
-		//First thing, running feistel on the ciphertext block and storing the result in cur_ciphertext,...
-		process_block((unsigned char *)&cur_ciphertext, ciphertext[i].left, ciphertext[i].right, round_keys);
+				//logging (post-decryption)
+				#pragma omp critical
+				block_logging(&plaintext[i*BLOCKSIZE], "\n----------CBC(DEC)-------AFTER-----------", i);
+			}
 
-		if (i == 0) //...if it's the first block, you xor the result with the IV to get the first plaintext block...
-			block_xor((block *)&plaintext[(i*BLOCKSIZE)], &cur_ciphertext, &current_iv); 
-		else	//...whereas for every other ciphered block x, you xor the result with ciphertext[x-1] to get plaintext[i]
-			block_xor((block *)&plaintext[(i*BLOCKSIZE)], &cur_ciphertext, &ciphertext[(i)-1]); 			
+			tile_progress(&state->current_block, last - tile);
+		}
 
-		//logging (post-decryption)
-		#pragma omp critical
-		block_logging(&plaintext[i*BLOCKSIZE], "\n----------CBC(DEC)-------AFTER-----------", i);
+		perf_section_end(&sample, cbc);
 	}
+	stats_record(stage_kernel, kernel_start);
+	perf_account_bytes(cbc, bnum * BLOCKSIZE);
 
 	//The IV for the next chunk will be the ciphertext of the last decrypted block
-	memcpy(&current_iv, &ciphertext[(bnum)-1], sizeof(block));
+	memcpy(current_iv, &ciphertext[(bnum)-1], sizeof(block));
 
-	first_chunk = false;
+	state->first_chunk = false;
 }
 
 //Executes the cipher in OFB mode; 
 //takes a block array, the total size of the chunk, an IV and the round keys, returns processed data by populating result.
-void operate_ofb_mode (unsigned char * result, block * b, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv)
+void operate_ofb_mode (unsigned char * result, block * b, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state)
 {
 	struct timeval current_time;
-	static int current_block = 0;
-
 	unsigned char * keystream;
 	
 	//Casting the block pointer to a char one because it's comfier for stream-like logic
@@ -264,28 +345,31 @@ void operate_ofb_mode (unsigned char * result, block * b, const unsigned long da
 		//otherwise we wouldn't have the keystream available for the partial block at the end
 	 	bnum = data_len/BLOCKSIZE + 1;
 
-	//Copying the IV block to a local variable only if we're operating on the first chunk
+	//The chaining block of the file's state starts from the IV on the first chunk
 	//In later chunks, current_iv will hold the last keystream block of the previous chunk 
-	static block * current_iv = NULL;
-	if (current_iv == NULL)
+	block * current_iv = &state->chain;
+	if (state->first_chunk == true)
 	{
-		current_iv = malloc(BLOCKSIZE);
 		memcpy(current_iv, &iv, BLOCKSIZE);
 	}	
 
-	keystream = malloc(BLOCKSIZE * bnum * sizeof(unsigned char));
+	keystream = bufpool_get(BLOCKSIZE * bnum * sizeof(unsigned char));
 
 	block_logging((unsigned char *)&iv, "\n----------OFB(ENC)------IV-----------", 0);
 
+	double kernel_start = stats_clock();
+	perf_sample keystream_sample;
+	perf_section_begin(&keystream_sample);
+
 	//launching the cycle that will create the OFB keystream
 	for (unsigned long i=0; i<bnum; ++i) 
 	{
 		//logging (pre-encryption)
-		current_block++;
+		state->current_block++;
 		if (i % 10000 == 0)
 		{
 			gettimeofday(&current_time, NULL);
-			show_progress_data(current_time, start_time, total_file_size, current_block);
+			show_progress_data(current_time, start_time, total_file_size, state->current_block);
 		}
 		
 		//executing the encryption on the last processed keystream block
@@ -295,66 +379,77 @@ void operate_ofb_mode (unsigned char * result, block * b, const unsigned long da
 			process_block(&keystream[i*BLOCKSIZE], &keystream[(i-1)*BLOCKSIZE], &keystream[((i-1)*BLOCKSIZE) + BLOCKSIZE/2], round_keys);
 	}
 
+	perf_section_end(&keystream_sample, ofb);
+	stats_record(stage_kernel, kernel_start);
+
+	double xor_start = stats_clock();
 	//launching the cycle that will XOR the keystream and the plaintext to produce the ciphertext
-	#pragma omp parallel for
-	for (size_t i = 0; i < data_len; i++) 
+	#pragma omp parallel
 	{
-		result[i] = keystream[i] ^ data[i];
-		
-		//If i+1 is a multiple of blocksize, it means we just finished XORing a whole block, we can print it
-		if (i > 0 && (i+1) % BLOCKSIZE == 0)
+		perf_sample sample;
+		perf_section_begin(&sample);
+
+		unsigned long begin, end;
+		tile_thread_range(bnum, &begin, &end);
+		for (unsigned long tile = begin; tile < end; tile += tile_blocks)
 		{
-			//The position where we start printing would be i - (b-1) with b=BLOCKSIZE, here's why:
-			//
-			//We're now at iteration i = b*k - 1, where k is a natural multiple of BLOCKSIZE, and we want the index we had at i = b * (k-1),
-			//which is exactly the last multiple of BLOCKSIZE before the current index and therefore the last used block index.
-			//
-			//Again, the current index is i = b*k - 1 because we enter this conditional one position before a multiple of b.
-			//If we subtract (b - 1) to the current index we get i = b*k-1-(b-1) = b*k-1-b+1 = b*k-b = b * (k-1)
-			block_logging(&keystream[(i - (BLOCKSIZE - 1))], "\n----------OFB(ENC)------keystream-----------", (i/BLOCKSIZE));
-			block_logging(&data[(i - (BLOCKSIZE - 1))], "\n----------OFB(ENC)------plaintext-----------", i/BLOCKSIZE);
-			block_logging(&result[(i - (BLOCKSIZE - 1))], "\n----------OFB(ENC)------ciphertext-----------", i/BLOCKSIZE);
+			unsigned long last = tile_end(tile, end);
+			xor_tile(result, keystream, data, tile, last, data_len);
+
+			//logging every whole block of the tile
+			for (unsigned long i = tile; i < last && i < data_len / BLOCKSIZE; i++)
+			{
+				block_logging(&keystream[i*BLOCKSIZE], "\n----------OFB(ENC)------keystream-----------", i);
+				block_logging(&data[i*BLOCKSIZE], "\n----------OFB(ENC)------plaintext-----------", i);
+				block_logging(&result[i*BLOCKSIZE], "\n----------OFB(ENC)------ciphertext-----------", i);
+			}
 		}
-    }
+
+		perf_section_end(&sample, ofb);
+	}
+	stats_record(stage_xor, xor_start);
 
 	//The iv block for the next chunk will be the last block of the keystream
 	memcpy(current_iv, &keystream[(bnum - 1) * BLOCKSIZE], sizeof(block));
-	free(keystream);
+	perf_account_bytes(ofb, data_len);
+	bufpool_put(keystream);
+	state->first_chunk = false;
 }
 
 //Executes encryption in PCBC mode; 
 //takes a block array, the total number of blocks, an IV and the round keys, returns processed data by populating ciphertext.
-void encrypt_pcbc_mode(unsigned char * ciphertext, block * plaintext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv)
+void encrypt_pcbc_mode(unsigned char * ciphertext, block * plaintext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state)
 {
 	struct timeval current_time;
-	static int current_block = 0;
-
-	static bool first_chunk = true;
 
-	block * prev_ciphertext;
-	prev_ciphertext = malloc(BLOCKSIZE);
+	block prev_ciphertext_block;
+	block * prev_ciphertext = &prev_ciphertext_block;
 
-	block * prev_plaintext;
-	prev_plaintext = malloc(BLOCKSIZE);
+	block prev_plaintext_block;
+	block * prev_plaintext = &prev_plaintext_block;
 
-	//Copying the IV block to a local variable only if we're operating on the first chunk
-	static block xor_result;
-	if (first_chunk == true)
+	//The chaining block of the file's state starts from the IV on the first chunk
+	block * xor_result = &state->chain;
+	if (state->first_chunk == true)
 	{
-		memcpy(&xor_result, &iv, BLOCKSIZE);
+		memcpy(xor_result, &iv, BLOCKSIZE);
 	}
 
-	block_logging((unsigned char *)&xor_result, "\n----------PCBC(ENC)-------IV-----------", 0);
+	block_logging((unsigned char *)xor_result, "\n----------PCBC(ENC)-------IV-----------", 0);
+
+	double kernel_start = stats_clock();
+	perf_sample sample;
+	perf_section_begin(&sample);
 
 	//launching the feistel algorithm on every block
 	for (unsigned long i=0; i<bnum; ++i) 
 	{
 		//logging (pre-encryption)
-		current_block++;
+		state->current_block++;
 		if (i % 10000 == 0)
 		{
 			gettimeofday(&current_time, NULL);
-			show_progress_data(current_time, start_time, total_file_size, current_block);
+			show_progress_data(current_time, start_time, total_file_size, state->current_block);
 		}
 		block_logging((unsigned char *)&plaintext[i], "\n----------PCBC(ENC)-------BEFORE-----------", i);
 
@@ -362,13 +457,13 @@ void encrypt_pcbc_mode(unsigned char * ciphertext, block * plaintext, const unsi
 		if (i>0) memcpy(prev_plaintext, &plaintext[i-1], BLOCKSIZE);
 
 		//First we do plaintext[i-1] XOR ciphertext[i-1]...
-		if (i>0) block_xor(&xor_result, prev_plaintext, prev_ciphertext);
+		if (i>0) block_xor(xor_result, prev_plaintext, prev_ciphertext);
 		//...then we xor the result (or the IV if it's the first block) with the current (i) plaintext...
-		block_xor(&xor_result, &plaintext[i], &xor_result);
+		block_xor(xor_result, &plaintext[i], xor_result);
 		//...and finally we obtain the current ciphertext by encrypting what we got from the last two XOR operations:
 		//c[i] = ENC(p[i] XOR (c[i-1] XOR p[i-1]))
 		//Note that in the first iteration, the IV substitutes the (c[i-1] XOR p[i-1]) result
-		process_block(&ciphertext[i*BLOCKSIZE], xor_result.left, xor_result.right, round_keys);
+		process_block(&ciphertext[i*BLOCKSIZE], xor_result->left, xor_result->right, round_keys);
 
 		//logging (post-encryption)
 		block_logging(&ciphertext[i*BLOCKSIZE], "\n----------PCBC(ENC)-------AFTER-----------", i);
@@ -379,52 +474,57 @@ void encrypt_pcbc_mode(unsigned char * ciphertext, block * plaintext, const unsi
 		//We're encrypting the last block, we store p[i] XOR c[i] to use as IV for the next chunk
 		if (i == bnum - 1)
 		{
-			block_xor(&xor_result, &plaintext[i], (block *)&ciphertext[i*BLOCKSIZE]);
+			block_xor(xor_result, &plaintext[i], (block *)&ciphertext[i*BLOCKSIZE]);
 		}
 	}
 
-	first_chunk = false;
+	perf_section_end(&sample, pcbc);
+	stats_record(stage_kernel, kernel_start);
+	perf_account_bytes(pcbc, bnum * BLOCKSIZE);
+
+	state->first_chunk = false;
 }
 
 //Executes decryption in PCBC mode; 
 //takes a block array, the total number of blocks, an IV and the round keys, returns processed data by populating plaintext.
-void decrypt_pcbc_mode(unsigned char * plaintext, block * ciphertext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv)
+void decrypt_pcbc_mode(unsigned char * plaintext, block * ciphertext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state)
 {
 	struct timeval current_time;
-	static int current_block = 0;
-
-	static bool first_chunk = true;
 
-	block * prev_ciphertext;
-	prev_ciphertext = malloc(BLOCKSIZE);
+	block prev_ciphertext_block;
+	block * prev_ciphertext = &prev_ciphertext_block;
 
-	block * prev_plaintext;
-	prev_plaintext = malloc(BLOCKSIZE);
+	block prev_plaintext_block;
+	block * prev_plaintext = &prev_plaintext_block;
 
-	//Copying the IV block to a local variable only if we're operating on the first chunk
-	static block xor_result;
-	if (first_chunk == true)
+	//The chaining block of the file's state starts from the IV on the first chunk
+	block * xor_result = &state->chain;
+	if (state->first_chunk == true)
 	{
-		memcpy(&xor_result, &iv, BLOCKSIZE);
+		memcpy(xor_result, &iv, BLOCKSIZE);
 	}
 
-	block_logging((unsigned char *)&xor_result, "\n----------PCBC(DEC)-------IV-----------", 0);
+	block_logging((unsigned char *)xor_result, "\n----------PCBC(DEC)-------IV-----------", 0);
+
+	double kernel_start = stats_clock();
+	perf_sample sample;
+	perf_section_begin(&sample);
 
 	//launching the feistel algorithm on every block
 	for (unsigned long i=0; i<bnum; ++i) 
 	{
 		//logging (pre-encryption)
-		current_block++;
+		state->current_block++;
 		if (i % 10000 == 0)
 		{
 			gettimeofday(&current_time, NULL);
-			show_progress_data(current_time, start_time, total_file_size, current_block);
+			show_progress_data(current_time, start_time, total_file_size, state->current_block);
 		}
 		block_logging((unsigned char *)&ciphertext[i], "\n----------PCBC(DEC)-------BEFORE-----------", i);
 
 		//XORing the plaintext and the ciphertext from the last iteration
 		//and saving the current ciphertext to use it in the next iteration
-		if (i>0) block_xor(&xor_result, prev_plaintext, prev_ciphertext);
+		if (i>0) block_xor(xor_result, prev_plaintext, prev_ciphertext);
 		memcpy(prev_ciphertext, &ciphertext[i], BLOCKSIZE);
 		
 		//Decrypting the current ciphertext block in-place (we already saved the original value)
@@ -433,7 +533,7 @@ void decrypt_pcbc_mode(unsigned char * plaintext, block * ciphertext, const unsi
 		//Obtaining the plaintext back by XORing the result of the decryption with the result of the previous XOR:
 		//p[i] = (c[i-1] XOR p[i-1]) XOR DEC(c[i]).
 		//Note that in the first iteration, the IV substitutes the (c[i-1] XOR p[i-1]) result
-		block_xor((block *)&plaintext[i*BLOCKSIZE], &ciphertext[i], &xor_result);
+		block_xor((block *)&plaintext[i*BLOCKSIZE], &ciphertext[i], xor_result);
 
 		//logging (post-encryption)
 		block_logging(&plaintext[i*BLOCKSIZE], "\n----------PCBC(DEC)-------AFTER-----------", i);
@@ -444,28 +544,30 @@ void decrypt_pcbc_mode(unsigned char * plaintext, block * ciphertext, const unsi
 		//We're decrypting the last block, we store p[i] XOR c[i] to use as IV for the next chunk
 		if (i == bnum - 1)
 		{
-			block_xor(&xor_result, prev_ciphertext, (block *)&plaintext[i*BLOCKSIZE]);
+			block_xor(xor_result, prev_ciphertext, (block *)&plaintext[i*BLOCKSIZE]);
 		}	
 	}
 
-	first_chunk = false;
+	perf_section_end(&sample, pcbc);
+	stats_record(stage_kernel, kernel_start);
+	perf_account_bytes(pcbc, bnum * BLOCKSIZE);
+
+	state->first_chunk = false;
 }
 
 //Executes encryption in CFB full-block mode; 
 //takes a block array, the total number of blocks, an IV and the round keys, returns processed data by populating ciphertext.
-void encrypt_cfb_mode(unsigned char * ciphertext, block * plaintext, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv)
+void encrypt_cfb_mode(unsigned char * ciphertext, block * plaintext, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state)
 {
 	struct timeval current_time;
-	static int current_block = 0;
-	static bool first_chunk = true;
 
 	unsigned char * stream_plaintext = (unsigned char *) plaintext;
 
-	//Copying the IV block to a local variable only if we're operating on the first chunk
-	static block prev_ciphertext;
-	if (first_chunk == true)
+	//The chaining block of the file's state starts from the IV on the first chunk
+	block * prev_ciphertext = &state->chain;
+	if (state->first_chunk == true)
 	{
-		memcpy(&prev_ciphertext, &iv, BLOCKSIZE);
+		memcpy(prev_ciphertext, &iv, BLOCKSIZE);
 	}
 
 	int bnum = 0;
@@ -477,24 +579,28 @@ void encrypt_cfb_mode(unsigned char * ciphertext, block * plaintext, const unsig
 	 	bnum = data_len/BLOCKSIZE + 1;
 
 	unsigned char * keystream;
-	keystream = malloc(BLOCKSIZE * bnum * sizeof(unsigned char));
+	keystream = bufpool_get(BLOCKSIZE * bnum * sizeof(unsigned char));
+
+	block_logging((unsigned char *)prev_ciphertext, "\n----------CFB(ENC)-------IV-----------", 0);
 
-	block_logging((unsigned char *)&prev_ciphertext, "\n----------CFB(ENC)-------IV-----------", 0);
+	double kernel_start = stats_clock();
+	perf_sample sample;
+	perf_section_begin(&sample);
 
 	//launching the feistel algorithm on every block
 	for (unsigned long i=0; i<bnum; ++i) 
 	{
 		//logging (pre-encryption)
-		current_block++;
+		state->current_block++;
 		if (i % 10000 == 0)
 		{
 			gettimeofday(&current_time, NULL);
-			show_progress_data(current_time, start_time, total_file_size, current_block);
+			show_progress_data(current_time, start_time, total_file_size, state->current_block);
 		}
 		block_logging((unsigned char *)&plaintext[i], "\n----------CFB(ENC)-------BEFORE-----------", i);
 
 		//Encrypting the previous ciphertext (or the IV if it's the first block) to get a block's worth of keystream
-		process_block(&keystream[i*BLOCKSIZE], prev_ciphertext.left, prev_ciphertext.right, round_keys);
+		process_block(&keystream[i*BLOCKSIZE], prev_ciphertext->left, prev_ciphertext->right, round_keys);
 
 		//Checking if the last block is complete or not
 		//In case it's not, we need to do stop with block-by-block logic one iteration early
@@ -504,7 +610,7 @@ void encrypt_cfb_mode(unsigned char * ciphertext, block * plaintext, const unsig
 		//XORing the result of the encryption with the plaintext to get this iteration's ciphertext
 		block_xor((block *)&ciphertext[i*BLOCKSIZE], (block *)&keystream[i*BLOCKSIZE], &plaintext[i]);
 		//Backing up this iteration's ciphertext to use in next iteration's processing
-		memcpy(&prev_ciphertext, &ciphertext[i*BLOCKSIZE], BLOCKSIZE);
+		memcpy(prev_ciphertext, &ciphertext[i*BLOCKSIZE], BLOCKSIZE);
 
 		//logging (post-encryption)
 		block_logging(&ciphertext[i*BLOCKSIZE], "\n----------CFB(ENC)-------AFTER-----------", i);
@@ -519,29 +625,29 @@ void encrypt_cfb_mode(unsigned char * ciphertext, block * plaintext, const unsig
 		}
 	} 
 
-	free(keystream);
-	first_chunk = false;
+	perf_section_end(&sample, cfb);
+	stats_record(stage_kernel, kernel_start);
+	perf_account_bytes(cfb, data_len);
+
+	bufpool_put(keystream);
+	state->first_chunk = false;
 }
 
 //Executes decryption in CFB full-block mode; 
 //takes a block array, the total number of blocks, an IV and the round keys, returns processed data by populating plaintext.
-void decrypt_cfb_mode(unsigned char * plaintext, block * ciphertext, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv)
+void decrypt_cfb_mode(unsigned char * plaintext, block * ciphertext, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state)
 {
-	struct timeval current_time;
-	static int current_block = 0;
-
-	static bool first_chunk = true;
 	unsigned char * stream_ciphertext = (unsigned char *) ciphertext;
 	
-	//Copying the IV block to a local variable only if we're operating on the first chunk
+	//The chaining block of the file's state starts from the IV on the first chunk
 	//In later chunks, current_iv will hold the last keystream block of the previous chunk 
-	static block cur_iv;
-	if (first_chunk == true)
+	block * cur_iv = &state->chain;
+	if (state->first_chunk == true)
 	{
-		memcpy(&cur_iv, &iv, BLOCKSIZE);
+		memcpy(cur_iv, &iv, BLOCKSIZE);
 	}
 
-	int bnum = 0;
+	unsigned long bnum = 0;
 	if (data_len % BLOCKSIZE == 0) 
 		bnum = data_len/BLOCKSIZE;
 	else 
@@ -550,57 +656,76 @@ void decrypt_cfb_mode(unsigned char * plaintext, block * ciphertext, const unsig
 	 	bnum = data_len/BLOCKSIZE + 1;
 
 	unsigned char * keystream;
-	keystream = malloc(BLOCKSIZE * bnum * sizeof(unsigned char));
+	keystream = bufpool_get(BLOCKSIZE * bnum * sizeof(unsigned char));
 
-	block_logging((unsigned char *)&cur_iv, "\n----------CFB(DEC)-------IV-----------", 0);
+	block_logging((unsigned char *)cur_iv, "\n----------CFB(DEC)-------IV-----------", 0);
 
+	double kernel_start = stats_clock();
 	//launching the feistel algorithm on every block, by making the index jump by increments of BLOCKSIZE
-	#pragma omp parallel for
-	for (unsigned long i=0; i<bnum; ++i) 
-	{	
-		//logging (pre-decryption)
-		#pragma omp critical
-		block_logging((unsigned char *)&ciphertext[i], "\n----------CFB(DEC)------BEFORE(keystream)-----------", i);
-		current_block++;
-		if (i % 10000 == 0)
+	#pragma omp parallel
+	{
+		perf_sample sample;
+		perf_section_begin(&sample);
+
+		unsigned long begin, end;
+		tile_thread_range(bnum, &begin, &end);
+		for (unsigned long tile = begin; tile < end; tile += tile_blocks)
 		{
-			gettimeofday(&current_time, NULL);
-			show_progress_data(current_time, start_time, total_file_size, current_block);
-		}
+			unsigned long last = tile_end(tile, end);
+
+			for (unsigned long i = tile; i < last; i++) 
+			{	
+				//logging (pre-decryption)
+				#pragma omp critical
+				block_logging((unsigned char *)&ciphertext[i], "\n----------CFB(DEC)------BEFORE(keystream)-----------", i);
+
+				if (i==0) //Decrypting the IV to obtain a block worth of keystream
+					process_block(&keystream[i*BLOCKSIZE], cur_iv->left, cur_iv->right, round_keys);
+				else //Decrypting c[i-1] to obtain the block to xor with c[i-1] to obtain p[i]
+				 	process_block(&keystream[i*BLOCKSIZE], (unsigned char *)&ciphertext[i-1].left, (unsigned char *)&ciphertext[i-1].right, round_keys);;
+
+				//logging (post-decryption)
+				#pragma omp critical
+				block_logging(&keystream[i*BLOCKSIZE], "\n----------CFB(DEC)-------AFTER(keystream)-----------", i);
+			}
 
-		if (i==0) //Decrypting the IV to obtain a block worth of keystream
-			process_block(&keystream[i*BLOCKSIZE], (unsigned char *)&cur_iv.left, (unsigned char *)&cur_iv.right, round_keys);
-		else //Decrypting c[i-1] to obtain the block to xor with c[i-1] to obtain p[i]
-		 	process_block(&keystream[i*BLOCKSIZE], (unsigned char *)&ciphertext[i-1].left, (unsigned char *)&ciphertext[i-1].right, round_keys);;
+			tile_progress(&state->current_block, last - tile);
+		}
 
-		//logging (post-decryption)
-		#pragma omp critical
-		block_logging(&keystream[i*BLOCKSIZE], "\n----------CFB(DEC)-------AFTER(keystream)-----------", i);
+		perf_section_end(&sample, cfb);
 	}
+	stats_record(stage_kernel, kernel_start);
 
+	double xor_start = stats_clock();
 	//launching the cycle that will XOR the keystream and the plaintext to produce the ciphertext
-	#pragma omp parallel for
-	for (size_t i = 0; i < data_len; i++) 
+	#pragma omp parallel
 	{
-		plaintext[i] = keystream[i] ^ stream_ciphertext[i];
-		
-		//If i+1 is a multiple of blocksize, it means we just finished XORing a whole block, we can print it
-		if (i > 0 && (i+1) % BLOCKSIZE == 0)
+		perf_sample sample;
+		perf_section_begin(&sample);
+
+		unsigned long begin, end;
+		tile_thread_range(bnum, &begin, &end);
+		for (unsigned long tile = begin; tile < end; tile += tile_blocks)
 		{
-			//The position where we start printing would be i - (b-1) with b=BLOCKSIZE, here's why:
-			//
-			//We're now at iteration i = b*k - 1, where k is a natural multiple of BLOCKSIZE, and we want the index we had at i = b * (k-1),
-			//which is exactly the last multiple of BLOCKSIZE before the current index and therefore the last used block index.
-			//
-			//Again, the current index is i = b*k - 1 because we enter this conditional one position before a multiple of b.
-			//If we subtract (b - 1) to the current index we get i = b*k-1-(b-1) = b*k-1-b+1 = b*k-b = b * (k-1)
-			block_logging(&stream_ciphertext[(i - (BLOCKSIZE - 1))], "\n----------OFB(ENC)------ciphertext-----------", i/BLOCKSIZE);
-			block_logging(&plaintext[(i - (BLOCKSIZE - 1))], "\n----------OFB(ENC)------plaintext-----------", i/BLOCKSIZE);
+			unsigned long last = tile_end(tile, end);
+			xor_tile(plaintext, keystream, stream_ciphertext, tile, last, data_len);
+
+			//logging every whole block of the tile
+			for (unsigned long i = tile; i < last && i < data_len / BLOCKSIZE; i++)
+			{
+				block_logging(&stream_ciphertext[i*BLOCKSIZE], "\n----------CFB(DEC)------ciphertext-----------", i);
+				block_logging(&plaintext[i*BLOCKSIZE], "\n----------CFB(DEC)------plaintext-----------", i);
+			}
 		}
-    }
+
+		perf_section_end(&sample, cfb);
+	}
+	stats_record(stage_xor, xor_start);
 
 	//We'll be using the last block of ciphertext as IV for the next chunk
-	memcpy(&cur_iv, &ciphertext[bnum - 1], BLOCKSIZE);
+	memcpy(cur_iv, &ciphertext[bnum - 1], BLOCKSIZE);
+	perf_account_bytes(cfb, data_len);
+	bufpool_put(keystream);
 
-	first_chunk = false;
+	state->first_chunk = false;
 }
\ No newline at end of file
@@ -1,9 +1,11 @@
-void operate_ecb_mode(unsigned char * result, block * b, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE]);
-void operate_ctr_mode(unsigned char * result, block * b, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv);
-void operate_ofb_mode (unsigned char * result, block * b, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv);
-void encrypt_cbc_mode(unsigned char * ciphertext, block * plaintext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv);
-void decrypt_cbc_mode(unsigned char * plaintext, block * ciphertext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv);
-void encrypt_pcbc_mode(unsigned char * ciphertext, block * plaintext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv);
-void decrypt_pcbc_mode(unsigned char * plaintext, block * ciphertext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv);
-void encrypt_cfb_mode(unsigned char * ciphertext, block * plaintext, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv);
-void decrypt_cfb_mode(unsigned char * plaintext, block * ciphertext, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv);
\ No newline at end of file
+void init_mode_state(mode_state * state);
+void seek_mode_state(mode_state * state, const block * iv, const unsigned long first_block);
+void operate_ecb_mode(unsigned char * result, block * b, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], mode_state * state);
+void operate_ctr_mode(unsigned char * result, block * b, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state);
+void operate_ofb_mode (unsigned char * result, block * b, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state);
+void encrypt_cbc_mode(unsigned char * ciphertext, block * plaintext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state);
+void decrypt_cbc_mode(unsigned char * plaintext, block * ciphertext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state);
+void encrypt_pcbc_mode(unsigned char * ciphertext, block * plaintext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state);
+void decrypt_pcbc_mode(unsigned char * plaintext, block * ciphertext, const unsigned long bnum, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state);
+void encrypt_cfb_mode(unsigned char * ciphertext, block * plaintext, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state);
+void decrypt_cfb_mode(unsigned char * plaintext, block * ciphertext, const unsigned long data_len, const unsigned char round_keys[NROUND][KEYSIZE], const block iv, mode_state * state);
\ No newline at end of file
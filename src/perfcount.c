@@ -0,0 +1,217 @@
+//This module wraps the perf_event_open interface to collect hardware counters around the kernel sections
+//of the operation modes. Counters are opened lazily by every thread that enters a kernel section, and their
+//deltas are accumulated per mode of operation so that a summary can be printed at the end of the run.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "errno.h"
+#include "unistd.h"
+#include "common.h"
+#include "perfcount.h"
+#include "omp.h"
+#include "sys/syscall.h"
+#include <linux/perf_event.h>
+
+#define NMODES (cfb + 1)
+
+bool perf_counters_enabled = false;
+
+//counters of the calling thread: state is 0 if they haven't been opened yet, 1 if opened, -1 if unavailable
+static __thread int thread_state = 0;
+static __thread int thread_fds[perf_nevents];
+
+static unsigned long long totals[NMODES][perf_nevents];
+static unsigned long long processed_bytes[NMODES];
+static bool event_available[perf_nevents];
+static bool warned = false;
+
+static const char * mode_names[NMODES] = {"CBC", "ECB", "CTR", "OFB", "PCBC", "CFB"};
+
+static long perf_event_open(struct perf_event_attr * attr, pid_t pid, int cpu, int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+//Opens a single counter on the calling thread, returns the file descriptor or -1 if the event is not supported
+static int open_counter(enum perf_event_id id)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.disabled = 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	switch (id)
+	{
+		case perf_cycles:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+		case perf_instructions:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+		case perf_l1d_misses:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		case perf_llc_misses:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+			break;
+		case perf_branch_misses:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+			break;
+		default:
+			return -1;
+	}
+
+	return perf_event_open(&attr, 0, -1, -1, 0);
+}
+
+//Opens every counter for the calling thread. If none of them can be opened, the thread is marked as unavailable
+//and a single warning is printed for the whole run.
+static void open_thread_counters()
+{
+	int opened = 0;
+	int saved_errno = 0;
+
+	for (int i = 0; i < perf_nevents; i++)
+	{
+		thread_fds[i] = open_counter(i);
+		if (thread_fds[i] == -1)
+			saved_errno = errno;
+		else
+			opened++;
+	}
+
+	if (opened == 0)
+	{
+		thread_state = -1;
+		#pragma omp critical(perf_counters)
+		{
+			if (!warned)
+				fprintf(stderr, "\nPerformance counters unavailable (%s), continuing without them\n", strerror(saved_errno));
+			warned = true;
+		}
+		return;
+	}
+
+	thread_state = 1;
+}
+
+//Reads the current value of every open counter of the calling thread
+static void read_thread_counters(unsigned long long values[perf_nevents])
+{
+	for (int i = 0; i < perf_nevents; i++)
+	{
+		values[i] = 0;
+		if (thread_fds[i] != -1 && read(thread_fds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+			values[i] = 0;
+	}
+}
+
+//Takes a snapshot of the counters of the calling thread at the beginning of a kernel section
+void perf_section_begin(perf_sample * sample)
+{
+	sample->active = false;
+	if (!perf_counters_enabled)
+		return;
+
+	if (thread_state == 0)
+		open_thread_counters();
+	if (thread_state != 1)
+		return;
+
+	read_thread_counters(sample->values);
+	sample->active = true;
+}
+
+//Reads the counters of the calling thread again and adds the difference from the snapshot to the totals of the given mode
+void perf_section_end(perf_sample * sample, enum mode chosen)
+{
+	unsigned long long now[perf_nevents];
+
+	if (!sample->active)
+		return;
+
+	read_thread_counters(now);
+
+	#pragma omp critical(perf_counters)
+	for (int i = 0; i < perf_nevents; i++)
+	{
+		if (thread_fds[i] == -1)
+			continue;
+		totals[chosen][i] += now[i] - sample->values[i];
+		event_available[i] = true;
+	}
+
+	sample->active = false;
+}
+
+//Adds to the amount of data processed by a mode, used as the denominator of the per-byte figures. Kernels of several
+//files (batch and daemon workers, recipients) can end at the same time, hence the atomic update.
+void perf_account_bytes(enum mode chosen, unsigned long bytes)
+{
+	if (!perf_counters_enabled)
+		return;
+
+	#pragma omp atomic
+	processed_bytes[chosen] += bytes;
+}
+
+//Prints cycles per byte, IPC and miss rates for every mode that processed data during the run
+void perf_report(void)
+{
+	char cycles[32];
+	char ipc[32];
+	char misses[3][32];
+
+	if (!perf_counters_enabled)
+		return;
+
+	bool any_available = false;
+	for (int i = 0; i < perf_nevents; i++)
+		any_available = any_available || event_available[i];
+	if (!any_available)
+	{
+		printf("\nPerformance counters: no data collected on this host\n\n");
+		return;
+	}
+
+	printf("\nPerformance counters (user space, all threads):");
+	for (int m = 0; m < NMODES; m++)
+	{
+		if (processed_bytes[m] == 0)
+			continue;
+
+		double kbytes = processed_bytes[m] / 1024.0;
+		unsigned long long * t = totals[m];
+
+		if (event_available[perf_cycles])
+			snprintf(cycles, sizeof(cycles), "%.2f", (double)t[perf_cycles] / processed_bytes[m]);
+		else
+			snprintf(cycles, sizeof(cycles), "n/a");
+
+		if (event_available[perf_cycles] && event_available[perf_instructions] && t[perf_cycles] > 0)
+			snprintf(ipc, sizeof(ipc), "%.2f", (double)t[perf_instructions] / t[perf_cycles]);
+		else
+			snprintf(ipc, sizeof(ipc), "n/a");
+
+		for (int i = perf_l1d_misses; i <= perf_branch_misses; i++)
+		{
+			if (event_available[i])
+				snprintf(misses[i - perf_l1d_misses], sizeof(misses[0]), "%.2f", t[i] / kbytes);
+			else
+				snprintf(misses[i - perf_l1d_misses], sizeof(misses[0]), "n/a");
+		}
+
+		printf("\n%s: %s cycles/byte, IPC %s, per KB: %s L1D misses, %s LLC misses, %s branch misses",
+			mode_names[m], cycles, ipc, misses[0], misses[1], misses[2]);
+	}
+	printf("\n\n");
+}
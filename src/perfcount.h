@@ -0,0 +1,15 @@
+//Hardware performance counters, enabled with --perf-counters
+enum perf_event_id{perf_cycles, perf_instructions, perf_l1d_misses, perf_llc_misses, perf_branch_misses, perf_nevents};
+
+//snapshot of the counters of a single thread taken when entering a kernel section
+typedef struct perf_sample {
+    bool active;
+    unsigned long long values[perf_nevents];
+}perf_sample;
+
+extern bool perf_counters_enabled;
+
+void perf_section_begin(perf_sample * sample);
+void perf_section_end(perf_sample * sample, enum mode chosen);
+void perf_account_bytes(enum mode chosen, unsigned long bytes);
+void perf_report(void);
@@ -0,0 +1,1027 @@
+//This module contains the processing of a single file: header and key check, trailers and the loop over its chunks.
+//Everything that has to be carried from one chunk of a file to the next (the chaining state of the mode of operation,
+//authentication tags and chunk digests) lives in a file_context, so that many files can be processed at the same time.
+//With --compress, every chunk that's read is compressed first and the compressed stream is what goes through the
+//chunk processing, in chunks of BUFSIZE bytes as well (see compress.c).
+//With dec --verify the plaintext goes to a SHA-256 digest instead of the output file, see open_digest_sink.
+
+#define _GNU_SOURCE
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "common.h"
+#include "utils.h"
+#include "block.h"
+#include "opmodes.h"
+#include "stats.h"
+#include "auth.h"
+#include "merkle.h"
+#include "compress.h"
+#include "checkpoint.h"
+#include "bufpool.h"
+#include "pipeline.h"
+#include "unistd.h"
+#include "sys/time.h"
+#include "openssl/evp.h"
+
+char * rekey_key = NULL;
+enum mode rekey_mode = DEFAULT_MODE;
+char ** fanout_keys = NULL;
+char ** fanout_outfiles = NULL;
+int fanout_count = 0;
+bool verify_plaintext = false;
+
+typedef struct file_context {
+	FILE * read_file;
+	FILE * write_file;
+	//where the output goes: a path, or a file descriptor that's already open if outfile is NULL
+	const char * outfile;
+	int out_fd;
+	//header that will contain key derivation salt, IV and key check block
+	block header[HEADER_BLOCKS];
+	//size of the header in the input file, it's shorter in files written before the key check block was introduced
+	unsigned long header_size;
+	mode_state mode;
+	auth_state auth;
+	merkle_state merkle;
+	//the plaintext is compressed (FLAG_COMPRESSED in the header)
+	bool compressed;
+	compress_state compress;
+	//checkpoint of the run, its path is NULL if checkpoints are disabled
+	checkpoint_state checkpoint;
+	//digest of the plaintext, with dec --verify
+	EVP_MD_CTX * digest;
+}file_context;
+
+//Closes the files of a file that couldn't be processed and frees its trailers, then prints message. Always returns -1.
+static int abort_file(file_context * file, const char * message)
+{
+	if (file->read_file != NULL)
+		fclose(file->read_file);
+	if (file->write_file != NULL)
+		fclose(file->write_file);
+	else if (file->out_fd >= 0)
+		close(file->out_fd);
+	auth_release(&file->auth);
+	merkle_release(&file->merkle);
+	compress_release(&file->compress);
+	//the checkpoint file is kept, so that the run can be resumed
+	checkpoint_release(&file->checkpoint);
+	EVP_MD_CTX_free(file->digest);
+
+	exit_message(1, message);
+	return -1;
+}
+
+//Writes len bytes of output to the output file, decompressing them first if the plaintext was compressed.
+//Returns -1 if the output can't be written, or if the decrypted data is not a valid compressed stream.
+static int write_output(file_context * file, const unsigned char * output, const unsigned long len, const enum operation op)
+{
+	if (op == dec && file->compressed)
+		return decompress_output(&file->compress, output, len, file->write_file);
+
+	double write_start = stats_clock();
+	if (len > 0 && fwrite(output, len, 1, file->write_file) != 1)
+		return -1;
+	stats_record(stage_write, write_start);
+	return 0;
+}
+
+static ssize_t digest_write(void * cookie, const char * buf, size_t size)
+{
+	double mac_start = stats_clock();
+	EVP_DigestUpdate(cookie, buf, size);
+	stats_record(stage_mac, mac_start);
+	return size;
+}
+
+//Opens a FILE that feeds what's written to it to the SHA-256 digest of the file instead of writing it anywhere, so the
+//plaintext (decompressed, if the file was compressed) is hashed as it's produced and dec --verify never writes to disk.
+//The digest is the one sha256sum gives on the original file.
+static FILE * open_digest_sink(file_context * file)
+{
+	cookie_io_functions_t sink = { NULL, digest_write, NULL, NULL };
+	FILE * stream;
+
+	file->digest = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(file->digest, EVP_sha256(), NULL);
+	stream = fopencookie(file->digest, "wb", sink);
+	//writes of whole chunks go straight to the digest, without being copied in a stdio buffer
+	if (stream != NULL)
+		setvbuf(stream, NULL, _IONBF, 0);
+	return stream;
+}
+
+//Prints the digest of the plaintext, once the whole of it has been written to the sink
+static void print_digest(file_context * file)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int len;
+	char hex[2 * EVP_MAX_MD_SIZE + 1];
+
+	fflush(file->write_file);
+	EVP_DigestFinal_ex(file->digest, digest, &len);
+	for (unsigned int i = 0; i < len; i++)
+		snprintf(&hex[2 * i], 3, "%02x", digest[i]);
+	//the digest goes on the line of the progress display
+	if (progress_enabled)
+		printf("\r%*s\r", 100, "");
+	printf("Plaintext SHA-256: %s\n", hex);
+}
+
+//Returns the size of the ciphertext of a chunk of chunk_size bytes in the padded modes, padding and accounting block included
+static unsigned long padded_size(const unsigned long chunk_size, const bool final_chunk)
+{
+	unsigned long padded_chunk_size = 0;
+
+	calculate_final_size(&padded_chunk_size, chunk_size);
+
+	//Fringe case: we'll write an extra block in case data ended inside the last block of the chunk
+	//and we need the last chunk to exceptionally go one block over the BUFSIZE to keep the accounting block
+	if (final_chunk && chunk_size > BUFSIZE - BLOCKSIZE)
+		padded_chunk_size += BLOCKSIZE;
+
+	return padded_chunk_size;
+}
+
+//This function handles the processing of a single chunk in the case of purely block-oriented modes of operation
+//It takes all necessary data and populates result after the processing, returns -1 if the output couldn't be written
+static int handle_padded_chunk(file_context * file, unsigned char * result, unsigned char * data, bool final_chunk, unsigned long chunk_size,
+	enum mode opmode, enum operation op, const char * key, int nchunk, unsigned long payload_size)
+{
+	unsigned long padded_chunk_size = 0;
+	bool acc_only_chunk = false;
+	int num_blocks;
+
+	//If we read exactly BLOCKSIZE bytes, then the current chunk only contains the accounting block for the previous one
+	//This only occurs when the actual data size falls within BLOCKSIZE bytes of a BUFSIZE multiple
+	if (op == dec && nchunk > 0 && chunk_size == BLOCKSIZE) acc_only_chunk = true;
+
+	//Modifying the chunk size in case there's padding and accounting to add (the output buffer already has room for it)
+	if (op == enc)
+		padded_chunk_size = padded_size(chunk_size, final_chunk);
+
+	//starting the correct operation and returning -1 in case there's an error
+	if (op == enc)
+		encrypt_blocks(result, data, chunk_size, nchunk, key, file->header, opmode, &file->mode);
+	else if (op == dec)
+		decrypt_blocks(result, data, chunk_size, nchunk, key, file->header, opmode, &file->mode);
+
+	if (auth_enabled && op == enc)
+		auth_tag_output(&file->auth, result, padded_chunk_size, final_chunk);
+	if (merkle_enabled && op == enc)
+		merkle_add_output(&file->merkle, result, padded_chunk_size);
+
+	//In case we're decrypting the last chunk we use the size written in the last block (returned by remove_padding) to determine how much text to write,
+	//and if there's no size written in the last block, it means that the specified decryption key was invalid.
+	if (op == dec && final_chunk)
+	{
+		//padding has not been removed yet in decryption
+		//so BLOCKSIZE should be a perfect divisor of chunk_size
+		num_blocks = chunk_size/BLOCKSIZE;
+
+		//Removing padding from this chunk
+		double padding_start = stats_clock();
+		chunk_size = remove_padding(result, num_blocks, opmode, payload_size);
+		stats_record(stage_padding, padding_start);
+
+		//if the last chunk only contains an accounting block saying the chunk has 0 bytes, it means that the last chunk was
+		//completely full and feistel_decrypt didn't detect it as "last chunk". In this case we can just use BUFSIZE as size.
+		//In the same way, if chunk_size was set to -1 by remove_padding it means there was no accounting block, and that means
+		//that the input file's size was a perfect multiple of BUFSIZE
+		if (chunk_size == 0 || chunk_size == -1) chunk_size = BUFSIZE;
+	}
+
+	//Writing the result to file
+	if (write_output(file, result, op == enc ? padded_chunk_size : chunk_size, op) == -1)
+		return -1;
+
+	if (final_chunk) //it was the last chunk of data, we're done
+	{
+		//This is needed when we are processing a chunk that only contains an accounting block
+		//In this case we can't directly remove the padding using the chunk size, because the chunk size we have is
+		//relative to the previous block, so we have to do some maths and truncate the whole file at the correct point
+		//(a compressed stream needs no truncation: decompression ignores everything after its final frame)
+		if (acc_only_chunk && op == dec && !file->compressed)
+		{
+			fseek(file->write_file, 0, SEEK_SET);
+			ftruncate(fileno(file->write_file), chunk_size + ((nchunk - 2) * BUFSIZE));
+		}
+	}
+
+	return 0;
+}
+
+//Encrypts or decrypts a chunk of data and writes it, returns -1 if the output couldn't be written
+static int process_chunk(file_context * file, unsigned char * result, unsigned char * data, bool final_chunk, unsigned long chunk_size,
+	enum mode opmode, enum operation op, const char * key, int nchunk, unsigned long payload_size)
+{
+	//Things are a bit more convoluted in case we're using a mode of operation that needs padding and an accounting block
+	//so the whole charade deserved its own function to improve readability
+	if (!is_stream_mode(opmode))
+		return handle_padded_chunk(file, result, data, final_chunk, chunk_size, opmode, op, key, nchunk, payload_size);
+
+	//starting the correct operation and returning -1 in case there's an error
+	if (op == enc)
+		encrypt_blocks(result, data, chunk_size, nchunk, key, file->header, opmode, &file->mode);
+	else if (op == dec)
+		decrypt_blocks(result, data, chunk_size, nchunk, key, file->header, opmode, &file->mode);
+
+	if (auth_enabled && op == enc)
+		auth_tag_output(&file->auth, result, chunk_size, final_chunk);
+	if (merkle_enabled && op == enc)
+		merkle_add_output(&file->merkle, result, chunk_size);
+
+	//Writing the result to file
+	return write_output(file, result, chunk_size, op);
+}
+
+//Returns the size that the data and result buffers need to process an input file of input_size bytes
+unsigned long pipeline_buffer_size(const unsigned long input_size)
+{
+	unsigned long chunk = input_size < BUFSIZE ? input_size : BUFSIZE;
+
+	//the compressed stream of a small input can be a bit bigger than the input itself
+	if (compress_enabled)
+		chunk = (chunk + COMPRESS_OVERHEAD(chunk) < BUFSIZE) ? chunk + COMPRESS_OVERHEAD(chunk) : BUFSIZE;
+
+	return chunk + PIPELINE_SLACK;
+}
+
+//Processes the file whose input is already open in file->read_file, the output (file->outfile, or file->out_fd if there's
+//no path) is only opened once the key has been checked. See process_file for the parameters.
+static int process_opened(file_context * file, const enum operation op, const enum mode opmode, const char * key,
+	const block * salt, unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	//nchunk will contain the number of chunks that have currently been processed
+	int nchunk = 0;
+	//chunk_size stores the size of the current chunk of data
+	unsigned long chunk_size = 0;
+	//payload_size is the size of the ciphertext (or plaintext), excluding the header and the trailers
+	unsigned long payload_size = 0;
+	//payload_left stores how much of the payload is still to be read
+	unsigned long payload_left = 0;
+	bool final_chunk = false;
+
+	file->header_size = HEADER_BLOCKS * BLOCKSIZE;
+	init_mode_state(&file->mode);
+	compress_init(&file->compress);
+	*processed = 0;
+
+	if (file->read_file == NULL)
+		return abort_file(file, "Error in opening files!");
+
+	//The checkpoint is saved next to the output, so there's none for outputs that are only a file descriptor
+	if (checkpoint_enabled && file->outfile != NULL)
+	{
+		checkpoint_init(&file->checkpoint, file->outfile);
+		if (resume_enabled && checkpoint_load(&file->checkpoint, op, opmode, file->read_file) == -1)
+			return abort_file(file, "The checkpoint doesn't match the input file, the operation or the mode of operation!");
+	}
+
+	if (op == enc && file->checkpoint.resumed) //The header was already written by the interrupted run
+	{
+		memcpy(file->header, file->checkpoint.saved.header, sizeof(file->header));
+		if (verify_key_check(file->header, key) == -1)
+			return abort_file(file, "Wrong key!");
+		file->compressed = (file->header[2].right[HEADER_FLAGS] & FLAG_COMPRESSED) != 0;
+	}
+	else if (op == enc) //We need to generate the header, it will be prepended to the ciphertext
+	{
+		if (salt != NULL)
+			memcpy(&file->header[0], salt, BLOCKSIZE);
+		else
+			create_nonce(&file->header[0]);
+		create_nonce(&file->header[1]);
+		create_key_check(&file->header[2], key, &file->header[0]);
+
+		//decryption finds out from the header whether the plaintext has to be decompressed
+		file->compressed = compress_enabled;
+		if (file->compressed)
+			file->header[2].right[HEADER_FLAGS] |= FLAG_COMPRESSED;
+		//the trailers are recorded too, so that decryption doesn't mistake them for ciphertext
+		if (auth_enabled)
+			file->header[2].right[HEADER_FLAGS] |= FLAG_AUTH;
+		if (merkle_enabled)
+			file->header[2].right[HEADER_FLAGS] |= FLAG_MERKLE;
+	}
+	else //We need to populate the header with the first blocks of the ciphertext
+	{
+		fread(&file->header[0], BLOCKSIZE, HEADER_BLOCKS, file->read_file);
+
+		if (!has_key_check(&file->header[2]))
+			file->header_size = 2 * BLOCKSIZE;
+		//A wrong key is rejected right away, without reading the ciphertext
+		else if (op == dec && verify_key_check(file->header, key) == -1)
+			return abort_file(file, "Wrong key!");
+		else if (file->header[2].right[HEADER_FLAGS] & FLAG_SECTOR)
+			return abort_file(file, "The file is a sector volume, it's read with -m xts!");
+		else if (file->header[2].right[HEADER_FLAGS] & FLAG_ARCHIVE)
+			return abort_file(file, "The file is an archive, it's read with unpack!");
+		else if (file->header[2].right[HEADER_FLAGS] & FLAG_SPARSE)
+			return abort_file(file, "The file is sparse, it's decrypted with --sparse!");
+		else if (op == dec && (file->header[2].right[HEADER_FLAGS] & FLAG_AUTH) && !auth_enabled)
+			return abort_file(file, "The file has authentication tags, it's decrypted with --auth!");
+		else if (op == dec && (file->header[2].right[HEADER_FLAGS] & FLAG_MERKLE) && !merkle_enabled)
+			return abort_file(file, "The file has an integrity trailer, it's decrypted with --merkle!");
+		else
+			file->compressed = (file->header[2].right[HEADER_FLAGS] & FLAG_COMPRESSED) != 0;
+
+		if (file->checkpoint.resumed && memcmp(file->header, file->checkpoint.saved.header, file->header_size) != 0)
+			return abort_file(file, "The checkpoint doesn't match the input file, the operation or the mode of operation!");
+	}
+
+	//The compressed stream doesn't line up with the chunks of the input, so there's no point where the run could be resumed
+	if (file->checkpoint.path != NULL && file->compressed)
+		return abort_file(file, "Checkpoints are not supported on compressed files!");
+
+	//verification doesn't write anything
+	if (op != verify)
+	{
+		if (file->checkpoint.resumed)
+		{
+			//the partial output is kept up to the last committed chunk
+			file->write_file = fopen(file->outfile, "r+b");
+			if (file->write_file != NULL && checkpoint_check_output(&file->checkpoint, file->write_file) == -1)
+				return abort_file(file, "The partial output doesn't match the checkpoint, it has to be processed from the beginning!");
+		}
+		else if (op == dec && verify_plaintext)
+			file->write_file = open_digest_sink(file);
+		else if (file->outfile != NULL)
+		{
+			file->write_file = fopen(file->outfile, "wb"); //clears the file to avoid appending to an already written file
+			if (file->write_file != NULL)
+				file->write_file = freopen(file->outfile, "ab", file->write_file);
+		}
+		else if ((file->write_file = fdopen(file->out_fd, "wb")) != NULL)
+			file->out_fd = -1;
+		if (file->write_file == NULL)
+			return abort_file(file, "Error in opening files!");
+
+		if (op == enc && !file->checkpoint.resumed)
+			fwrite(&file->header, BLOCKSIZE, HEADER_BLOCKS, file->write_file);
+	}
+
+	//calculating the payload size
+	fseek(file->read_file, 0, SEEK_END);
+	payload_size = ftell(file->read_file);
+	if (op != enc) //In decryption, we have to ignore the header
+	{
+		if (payload_size <= file->header_size)
+			return abort_file(file, "The input file is too short to be a ciphertext!");
+		payload_size -= file->header_size;
+	}
+
+	//The trailers are not part of the ciphertext: they are read starting from the outermost one,
+	//since the Merkle tree is appended after the authentication tags
+	if (merkle_enabled && op != enc && merkle_read_trailer(&file->merkle, file->read_file, file->header_size, &payload_size) == -1)
+		return abort_file(file, "No valid integrity trailer found, was the file encrypted with --merkle?");
+
+	if (op == verify) //Only the chunks in the requested range are hashed, nothing is decrypted
+	{
+		unsigned long verified = 0;
+		char chunks[100];
+		int ret;
+
+		//the authentication tags, if there are any, are skipped: checking them would need the key
+		auth_read_trailer(&file->auth, file->read_file, file->header_size, &payload_size);
+		ret = merkle_verify_range(&file->merkle, file->read_file, file->header_size, payload_size, &verified);
+
+		snprintf(chunks, sizeof(chunks), "Chunks verified: %lu", verified);
+		if (ret == -1)
+		{
+			abort_file(file, "Integrity check failed!");
+			exit_message(1, chunks);
+			return -1;
+		}
+
+		fclose(file->read_file);
+		if (file->out_fd >= 0)
+			close(file->out_fd);
+		exit_message(2, "Integrity check passed!", chunks);
+		//the trailer is only as trustworthy as the root, which has to be compared with the one printed by enc
+		merkle_print_root(&file->merkle, NULL);
+		auth_release(&file->auth);
+		merkle_release(&file->merkle);
+		*processed = payload_size;
+		return 0;
+	}
+
+	if (auth_enabled)
+	{
+		auth_init(&file->auth, key, file->header);
+
+		//In decryption the tags are loaded from the trailer
+		if (op == dec && auth_read_trailer(&file->auth, file->read_file, file->header_size, &payload_size) == -1)
+			return abort_file(file, "No valid authentication trailer found, was the file encrypted with --auth?");
+	}
+	fseek(file->read_file, op == enc ? 0 : file->header_size, SEEK_SET);
+	payload_left = payload_size;
+
+	//Continuing from the chunk after the last committed one, with the chaining state it left
+	if (file->checkpoint.resumed)
+	{
+		checkpoint_restore(&file->checkpoint, &file->auth, &file->merkle);
+		file->mode = file->checkpoint.saved.mode;
+		nchunk = file->checkpoint.saved.nchunk;
+		fseek(file->read_file, file->checkpoint.saved.input_offset, SEEK_CUR);
+		payload_left -= file->checkpoint.saved.input_offset;
+	}
+	else if (file->checkpoint.path != NULL)
+		checkpoint_start(&file->checkpoint, op, opmode, file->header, file->header_size, file->read_file);
+
+	//The progress display only makes sense when one file at a time is being processed
+	if (progress_enabled)
+	{
+		total_file_size = payload_size;
+		gettimeofday(&start_time, NULL);
+	}
+
+	//This loop will continue reading from read_file, processing data in chunks of BUFSIZE bytes and writing them to write_file,
+	//until it reaches the last chunk of readable data
+	while (1)
+	{
+		//Trying to read BUFSIZE characters, saving the number of read characters in chunk_size
+		//(the digest can't be truncated like a file: an accounting block left after the last full chunk is read with it,
+		//like in rekey_file, so that the last chunk of plaintext is never written before its padding is known)
+		unsigned long to_read = payload_left < BUFSIZE ? payload_left : BUFSIZE;
+		if (file->digest != NULL && !is_stream_mode(opmode) && payload_left == BUFSIZE + BLOCKSIZE)
+			to_read = payload_left;
+		double read_start = stats_clock();
+		chunk_size = fread(data, sizeof(unsigned char), to_read, file->read_file);
+		stats_record(stage_read, read_start);
+		stats_add_bytes(chunk_size);
+		payload_left -= chunk_size;
+
+		if (chunk_size == 0)
+			return abort_file(file, "Reading/memory error!");
+
+		//if we read less than BUFSIZE bytes or there's nothing left after the last full block
+		//it means that we are processing the last chunk of data
+		final_chunk = (chunk_size < BUFSIZE || payload_left == 0);
+
+		//The ciphertext is authenticated before being decrypted, so that only verified chunks reach the output
+		if (auth_enabled && op == dec && auth_verify_chunk(&file->auth, data, chunk_size, final_chunk) == -1)
+			return abort_file(file, "Authentication failed: the ciphertext was modified or the key is wrong, output stops at the last verified chunk");
+		if (merkle_enabled && op == dec && merkle_verify_chunk(&file->merkle, data, chunk_size, final_chunk) == -1)
+			return abort_file(file, "Integrity check failed: the ciphertext is corrupted, output stops at the last verified chunk");
+
+		if (op == enc && file->compressed)
+		{
+			unsigned long compressed_size;
+			bool final_compressed = false;
+
+			//the chunk is compressed, then the compressed stream is encrypted one full chunk at a time
+			//(the data buffer is free again once the chunk has been compressed)
+			compress_chunk(&file->compress, data, chunk_size, final_chunk);
+			while ((compressed_size = compress_take(&file->compress, data, final_chunk, &final_compressed)) > 0)
+			{
+				if (process_chunk(file, result, data, final_compressed, compressed_size, opmode, op, key, nchunk, payload_size) == -1)
+					return abort_file(file, "Error in writing the output file!");
+				nchunk++;
+			}
+		}
+		else
+		{
+			//a failed write leaves the error flag of the output set, otherwise the compressed stream is not valid
+			if (process_chunk(file, result, data, final_chunk, chunk_size, opmode, op, key, nchunk, payload_size) == -1)
+				return abort_file(file, ferror(file->write_file) ? "Error in writing the output file!"
+					: "Decompression failed: the plaintext is corrupted, output stops at the last valid frame");
+			nchunk++;
+
+			//The last chunk is followed by the trailers, the checkpoint is only needed until then
+			if (file->checkpoint.path != NULL && !final_chunk)
+			{
+				file->checkpoint.saved.nchunk = nchunk;
+				file->checkpoint.saved.input_offset = payload_size - payload_left;
+				file->checkpoint.saved.mode = file->mode;
+				file->checkpoint.saved.last_size = chunk_size;
+				if (checkpoint_commit(&file->checkpoint, file->write_file, result, &file->auth, &file->merkle) == -1)
+					return abort_file(file, "Error in writing the checkpoint!");
+			}
+		}
+
+		if (final_chunk)
+			break;
+	}
+
+	//The tags of all the chunks go at the end of the ciphertext
+	if (auth_enabled && op == enc && auth_write_trailer(&file->auth, file->write_file) == -1)
+		return abort_file(file, "Error in writing the authentication trailer!");
+	if (merkle_enabled && op == enc && merkle_write_trailer(&file->merkle, file->write_file) == -1)
+		return abort_file(file, "Error in writing the integrity trailer!");
+	if (merkle_enabled && op == enc)
+		merkle_print_root(&file->merkle, file->outfile);
+	if (op == dec && file->compressed && !file->compress.finished)
+		return abort_file(file, "Decompression failed: the compressed stream is truncated");
+	//short outputs are still in the buffer of the stream, the error of writing them only shows up here
+	if (fflush(file->write_file) != 0 || ferror(file->write_file))
+		return abort_file(file, "Error in writing the output file!");
+	if (file->digest != NULL)
+		print_digest(file);
+
+	fclose(file->read_file);
+	fclose(file->write_file);
+	auth_release(&file->auth);
+	merkle_release(&file->merkle);
+	compress_release(&file->compress);
+	EVP_MD_CTX_free(file->digest);
+	if (file->checkpoint.path != NULL)
+		checkpoint_finish(&file->checkpoint);
+
+	*processed = payload_size;
+	return 0;
+}
+
+//Encrypts, decrypts or verifies infile, writing the result to outfile (verification doesn't write anything).
+//In encryption salt is used as the key derivation salt, a new one is generated if it's NULL.
+//data and result must be at least pipeline_buffer_size(size of infile) bytes long.
+//Saves in processed the size of the plaintext/ciphertext that was processed, returns -1 in case of error.
+int process_file(const char * infile, const char * outfile, const enum operation op, const enum mode opmode, const char * key,
+	const block * salt, unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	file_context file;
+
+	memset(&file, 0, sizeof(file_context));
+	file.read_file = fopen(infile, "rb");
+	file.outfile = outfile;
+	file.out_fd = -1;
+
+	return process_opened(&file, op, opmode, key, salt, data, result, processed);
+}
+
+//Same as process_file, on already open file descriptors (the input must be seekable). Both are closed before returning.
+int process_fds(const int in_fd, const int out_fd, const enum operation op, const enum mode opmode, const char * key,
+	const block * salt, unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	file_context file;
+
+	memset(&file, 0, sizeof(file_context));
+	file.read_file = fdopen(in_fd, "rb");
+	if (file.read_file == NULL)
+		close(in_fd);
+	file.out_fd = out_fd;
+
+	return process_opened(&file, op, opmode, key, salt, data, result, processed);
+}
+
+//Processes one shard of infile (see shard.c): the chunks from index * nchunks / count to (index + 1) * nchunks / count,
+//written straight to their place in outfile, which has been prepared by the coordinator (in encryption it already holds
+//the header shared by all the shards). Only for the modes without chaining, ECB and CTR.
+//Saves in processed the size of the payload of the shard, returns -1 in case of error.
+int process_shard(const char * infile, const char * outfile, const enum operation op, const enum mode opmode, const char * key,
+	const unsigned long index, const unsigned long count, unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	file_context file;
+	unsigned long payload_size, nchunks, split_chunks, first, last;
+	unsigned long chunk_size, expected;
+	bool final_chunk;
+
+	memset(&file, 0, sizeof(file_context));
+	file.out_fd = -1;
+	file.header_size = HEADER_BLOCKS * BLOCKSIZE;
+	*processed = 0;
+
+	file.read_file = fopen(infile, "rb");
+	file.write_file = fopen(outfile, "r+b");
+	if (file.read_file == NULL || file.write_file == NULL)
+		return abort_file(&file, "Error in opening files!");
+
+	fread(&file.header[0], BLOCKSIZE, HEADER_BLOCKS, op == enc ? file.write_file : file.read_file);
+	if (!has_key_check(&file.header[2]))
+	{
+		if (op == enc)
+			return abort_file(&file, "The output file has not been prepared by the shard coordinator!");
+		file.header_size = 2 * BLOCKSIZE;
+	}
+	//every shard checks the key, a shard started with a different one would corrupt its range of the output
+	else if (verify_key_check(file.header, key) == -1)
+		return abort_file(&file, "Wrong key!");
+	else if (file.header[2].right[HEADER_FLAGS] & FLAG_COMPRESSED)
+		return abort_file(&file, "Compressed files can't be processed in shards!");
+	else if (file.header[2].right[HEADER_FLAGS] & (FLAG_AUTH | FLAG_MERKLE))
+		return abort_file(&file, "Files with trailers can't be processed in shards!");
+	else if (file.header[2].right[HEADER_FLAGS] & FLAG_SECTOR)
+		return abort_file(&file, "The file is a sector volume, it's read with -m xts!");
+	else if (file.header[2].right[HEADER_FLAGS] & FLAG_ARCHIVE)
+		return abort_file(&file, "The file is an archive, it's read with unpack!");
+	else if (file.header[2].right[HEADER_FLAGS] & FLAG_SPARSE)
+		return abort_file(&file, "The file is sparse, it's decrypted with --sparse!");
+
+	fseek(file.read_file, 0, SEEK_END);
+	payload_size = ftell(file.read_file);
+	if (op == dec)
+	{
+		if (payload_size <= file.header_size)
+			return abort_file(&file, "The input file is too short to be a ciphertext!");
+		payload_size -= file.header_size;
+	}
+
+	//A last chunk that only holds the accounting block goes to the same shard as the chunk it describes,
+	//which is the one that truncates the output where the plaintext ends
+	nchunks = (payload_size + BUFSIZE - 1) / BUFSIZE;
+	split_chunks = nchunks;
+	if (op == dec && !is_stream_mode(opmode) && nchunks > 1 && payload_size % BUFSIZE == BLOCKSIZE)
+		split_chunks--;
+	first = index * split_chunks / count;
+	last = (index == count - 1) ? nchunks : (index + 1) * split_chunks / count;
+
+	seek_mode_state(&file.mode, &file.header[1], first * (BUFSIZE / BLOCKSIZE));
+	fseek(file.read_file, (op == enc ? 0 : file.header_size) + first * BUFSIZE, SEEK_SET);
+	fseek(file.write_file, (op == enc ? file.header_size : 0) + first * BUFSIZE, SEEK_SET);
+
+	for (unsigned long nchunk = first; nchunk < last; nchunk++)
+	{
+		expected = (payload_size - nchunk * BUFSIZE < BUFSIZE) ? payload_size - nchunk * BUFSIZE : BUFSIZE;
+
+		double read_start = stats_clock();
+		chunk_size = fread(data, sizeof(unsigned char), expected, file.read_file);
+		stats_record(stage_read, read_start);
+		stats_add_bytes(chunk_size);
+
+		if (chunk_size != expected)
+			return abort_file(&file, "Reading/memory error!");
+
+		final_chunk = (nchunk == nchunks - 1);
+		if (process_chunk(&file, result, data, final_chunk, chunk_size, opmode, op, key, nchunk, payload_size) == -1)
+			return abort_file(&file, "Error in writing the output file!");
+		*processed += chunk_size;
+	}
+
+	//The coordinator sized the output for the whole ciphertext, the padding is only known to the last shard
+	//(when the last chunk only holds the accounting block, handle_padded_chunk has already truncated the output)
+	if (op == dec && last == nchunks && last > first && split_chunks == nchunks)
+	{
+		fflush(file.write_file);
+		ftruncate(fileno(file.write_file), ftell(file.write_file));
+	}
+
+	fclose(file.read_file);
+	fclose(file.write_file);
+
+	return 0;
+}
+
+
+//Aborts a rekey operation, closing the input and freeing the trailers of both sides. Always returns -1.
+static int abort_rekey(file_context * source, file_context * target, const char * message)
+{
+	if (source->read_file != NULL)
+		fclose(source->read_file);
+	auth_release(&source->auth);
+	merkle_release(&source->merkle);
+
+	return abort_file(target, message);
+}
+
+//Re-encrypts infile, encrypted under key in opmode, under rekey_key in rekey_mode (see the rekey operation).
+//Every chunk of ciphertext is decrypted and encrypted again right away, while it's still in cache, so the plaintext
+//never reaches the disk and the data is read and written once. The output gets a new salt, IV and key check block;
+//a compressed plaintext is re-encrypted as it is, so the compression flag is carried over. With --auth and --merkle
+//the trailers of the input are checked before every chunk is decrypted, and new ones are written.
+//data and result must be at least pipeline_buffer_size(BUFSIZE) bytes long.
+//Saves in processed the size of the plaintext, returns -1 in case of error.
+int rekey_file(const char * infile, const char * outfile, const enum mode opmode, const char * key,
+	unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	file_context source;
+	file_context target;
+	unsigned long payload_size, payload_left;
+	unsigned long chunk_size, plain_size, output_size;
+	bool final_chunk;
+	int nchunk = 0;
+
+	memset(&source, 0, sizeof(file_context));
+	memset(&target, 0, sizeof(file_context));
+	source.out_fd = target.out_fd = -1;
+	source.header_size = HEADER_BLOCKS * BLOCKSIZE;
+	init_mode_state(&source.mode);
+	init_mode_state(&target.mode);
+	*processed = 0;
+
+	source.read_file = fopen(infile, "rb");
+	if (source.read_file == NULL)
+		return abort_rekey(&source, &target, "Error in opening files!");
+
+	//The old key is checked right away, like in decryption
+	fread(&source.header[0], BLOCKSIZE, HEADER_BLOCKS, source.read_file);
+	if (!has_key_check(&source.header[2]))
+		source.header_size = 2 * BLOCKSIZE;
+	else if (verify_key_check(source.header, key) == -1)
+		return abort_rekey(&source, &target, "Wrong key!");
+	else if (source.header[2].right[HEADER_FLAGS] & FLAG_SECTOR)
+		return abort_rekey(&source, &target, "Sector volumes can't be re-encrypted!");
+	else if (source.header[2].right[HEADER_FLAGS] & FLAG_ARCHIVE)
+		return abort_rekey(&source, &target, "Archives can't be re-encrypted!");
+	else if (source.header[2].right[HEADER_FLAGS] & FLAG_SPARSE)
+		return abort_rekey(&source, &target, "Sparse files can't be re-encrypted!");
+	else if ((source.header[2].right[HEADER_FLAGS] & FLAG_AUTH) && !auth_enabled)
+		return abort_rekey(&source, &target, "The file has authentication tags, it's re-encrypted with --auth!");
+	else if ((source.header[2].right[HEADER_FLAGS] & FLAG_MERKLE) && !merkle_enabled)
+		return abort_rekey(&source, &target, "The file has an integrity trailer, it's re-encrypted with --merkle!");
+
+	create_nonce(&target.header[0]);
+	create_nonce(&target.header[1]);
+	create_key_check(&target.header[2], rekey_key, &target.header[0]);
+	if (source.header_size == HEADER_BLOCKS * BLOCKSIZE && (source.header[2].right[HEADER_FLAGS] & FLAG_COMPRESSED))
+		target.header[2].right[HEADER_FLAGS] |= FLAG_COMPRESSED;
+	if (auth_enabled)
+		target.header[2].right[HEADER_FLAGS] |= FLAG_AUTH;
+	if (merkle_enabled)
+		target.header[2].right[HEADER_FLAGS] |= FLAG_MERKLE;
+
+	fseek(source.read_file, 0, SEEK_END);
+	payload_size = ftell(source.read_file);
+	if (payload_size <= source.header_size)
+		return abort_rekey(&source, &target, "The input file is too short to be a ciphertext!");
+	payload_size -= source.header_size;
+
+	if (merkle_enabled && merkle_read_trailer(&source.merkle, source.read_file, source.header_size, &payload_size) == -1)
+		return abort_rekey(&source, &target, "No valid integrity trailer found, was the file encrypted with --merkle?");
+	if (auth_enabled)
+	{
+		auth_init(&source.auth, key, source.header);
+		auth_init(&target.auth, rekey_key, target.header);
+		if (auth_read_trailer(&source.auth, source.read_file, source.header_size, &payload_size) == -1)
+			return abort_rekey(&source, &target, "No valid authentication trailer found, was the file encrypted with --auth?");
+	}
+	fseek(source.read_file, source.header_size, SEEK_SET);
+	payload_left = payload_size;
+
+	target.write_file = fopen(outfile, "wb");
+	if (target.write_file == NULL)
+		return abort_rekey(&source, &target, "Error in opening files!");
+	fwrite(&target.header, BLOCKSIZE, HEADER_BLOCKS, target.write_file);
+
+	if (progress_enabled)
+	{
+		total_file_size = payload_size;
+		gettimeofday(&start_time, NULL);
+	}
+
+	while (payload_left > 0)
+	{
+		//An accounting block that was pushed past the last full chunk (see padded_size) is read together with that chunk,
+		//so that the last chunk of ciphertext always holds the whole padding
+		chunk_size = payload_left < BUFSIZE ? payload_left : BUFSIZE;
+		if (!is_stream_mode(opmode) && payload_left == BUFSIZE + BLOCKSIZE)
+			chunk_size = payload_left;
+
+		double read_start = stats_clock();
+		if (fread(data, sizeof(unsigned char), chunk_size, source.read_file) != chunk_size)
+			return abort_rekey(&source, &target, "Reading/memory error!");
+		stats_record(stage_read, read_start);
+		stats_add_bytes(chunk_size);
+		payload_left -= chunk_size;
+		final_chunk = (payload_left == 0);
+
+		if (auth_enabled && auth_verify_chunk(&source.auth, data, chunk_size, final_chunk) == -1)
+			return abort_rekey(&source, &target, "Authentication failed: the ciphertext was modified or the key is wrong, output stops at the last verified chunk");
+		if (merkle_enabled && merkle_verify_chunk(&source.merkle, data, chunk_size, final_chunk) == -1)
+			return abort_rekey(&source, &target, "Integrity check failed: the ciphertext is corrupted, output stops at the last verified chunk");
+		if (!is_stream_mode(opmode) && chunk_size % BLOCKSIZE != 0)
+			return abort_rekey(&source, &target, "The input file is not a ciphertext of this mode of operation!");
+
+		decrypt_blocks(result, data, chunk_size, nchunk, key, source.header, opmode, &source.mode);
+
+		//The accounting block of the last chunk says how much of it is plaintext, a last chunk that's full has none
+		plain_size = chunk_size;
+		if (final_chunk && !is_stream_mode(opmode) && chunk_size != BUFSIZE)
+		{
+			double padding_start = stats_clock();
+			plain_size = remove_padding(result, chunk_size / BLOCKSIZE, opmode, payload_size);
+			stats_record(stage_padding, padding_start);
+			if (plain_size == -1 || plain_size > chunk_size - BLOCKSIZE)
+				return abort_rekey(&source, &target, "No valid accounting block found, the input is corrupted!");
+		}
+
+		//The plaintext chunks have the same sizes they have in encryption, so the chunk goes back to the data buffer
+		//just like a chunk that has been read from a plaintext file
+		encrypt_blocks(data, result, plain_size, nchunk, rekey_key, target.header, rekey_mode, &target.mode);
+		output_size = is_stream_mode(rekey_mode) ? plain_size : padded_size(plain_size, final_chunk);
+
+		if (auth_enabled)
+			auth_tag_output(&target.auth, data, output_size, final_chunk);
+		if (merkle_enabled)
+			merkle_add_output(&target.merkle, data, output_size);
+
+		double write_start = stats_clock();
+		fwrite(data, output_size, 1, target.write_file);
+		stats_record(stage_write, write_start);
+
+		*processed += plain_size;
+		nchunk++;
+	}
+
+	if (auth_enabled && auth_write_trailer(&target.auth, target.write_file) == -1)
+		return abort_rekey(&source, &target, "Error in writing the authentication trailer!");
+	if (merkle_enabled && merkle_write_trailer(&target.merkle, target.write_file) == -1)
+		return abort_rekey(&source, &target, "Error in writing the integrity trailer!");
+	if (merkle_enabled)
+		merkle_print_root(&target.merkle, outfile);
+
+	fclose(source.read_file);
+	fclose(target.write_file);
+	auth_release(&source.auth);
+	auth_release(&target.auth);
+	merkle_release(&source.merkle);
+	merkle_release(&target.merkle);
+
+	return 0;
+}
+//Closes the outputs of a fan-out that couldn't be completed and the input, then prints message. Always returns -1.
+static int abort_fanout(file_context * recipients, FILE * read_file, compress_state * compress, const char * message)
+{
+	for (int r = 1; r < fanout_count; r++)
+	{
+		if (recipients[r].write_file != NULL)
+			fclose(recipients[r].write_file);
+		auth_release(&recipients[r].auth);
+		merkle_release(&recipients[r].merkle);
+	}
+	recipients[0].read_file = read_file;
+	compress_release(compress);
+
+	return abort_file(&recipients[0], message);
+}
+
+//Encrypts the blocks of a chunk (already padded by pad_chunk) for every recipient and writes them to their outputs.
+//Returns -1 if an output couldn't be written.
+static int fanout_chunk(file_context * recipients, unsigned char (*round_keys)[NROUND][KEYSIZE], unsigned char ** results,
+	unsigned char * data, const unsigned long chunk_size, const unsigned long bcount, const bool final_chunk, const enum mode opmode)
+{
+	unsigned long output_size = is_stream_mode(opmode) ? chunk_size : padded_size(chunk_size, final_chunk);
+	//ctr and ecb already use all the threads on a single recipient, the other modes encrypt on one thread
+	bool parallel = opmode != ctr && opmode != ecb;
+	int failed = 0;
+
+	#pragma omp parallel for schedule(dynamic) if (parallel) reduction(|:failed)
+	for (int r = 0; r < fanout_count; r++)
+	{
+		file_context * recipient = &recipients[r];
+		unsigned char * result = results[parallel ? r : 0];
+
+		encrypt_scheduled(result, (block *)data, bcount, chunk_size, round_keys[r], recipient->header[1], opmode, &recipient->mode);
+		if (auth_enabled)
+			auth_tag_output(&recipient->auth, result, output_size, final_chunk);
+		if (merkle_enabled)
+			merkle_add_output(&recipient->merkle, result, output_size);
+
+		double write_start = stats_clock();
+		if (fwrite(result, output_size, 1, recipient->write_file) != 1)
+			failed = 1;
+		stats_record(stage_write, write_start);
+	}
+
+	return failed ? -1 : 0;
+}
+
+//Returns how many buffers a fan-out run needs in the buffer pool beyond the three of a single file: in the modes whose
+//recipients are encrypted at the same time, every recipient but the first has a result buffer of its own and, in cfb,
+//the kernel of every recipient checks out a keystream at the same time
+unsigned int fanout_pool_buffers(const enum mode opmode)
+{
+	if (fanout_count < 2 || opmode == ctr || opmode == ecb)
+		return 0;
+	return (fanout_count - 1) * (opmode == cfb ? 2 : 1);
+}
+
+//Encrypts infile under every key of fanout_keys, each time with its own salt, IV and header, into the matching output of
+//fanout_outfiles. Every chunk is read (and compressed) once, padded once and then encrypted for all the recipients while
+//it's still in memory, so the input is read once whatever the number of recipients. In ctr and ecb, where the kernels
+//spread a chunk across all the threads, the recipients are encrypted one after the other into result; in the other modes,
+//whose encryption is sequential, they're encrypted at the same time, one per thread, each into a buffer of its own.
+//data and result must be at least pipeline_buffer_size(BUFSIZE) bytes long.
+//Saves in processed the size of the plaintext, returns -1 in case of error.
+int fanout_file(const char * infile, const enum mode opmode, unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	file_context * recipients = calloc(fanout_count, sizeof(file_context));
+	unsigned char (*round_keys)[NROUND][KEYSIZE] = malloc(fanout_count * sizeof(*round_keys));
+	unsigned char ** results = calloc(fanout_count, sizeof(unsigned char *));
+	bool parallel = opmode != ctr && opmode != ecb;
+	compress_state compress;
+	FILE * read_file;
+	unsigned long payload_size, payload_left, chunk_size;
+	bool final_chunk;
+	int ret = 0;
+
+	compress_init(&compress);
+	*processed = 0;
+	//the progress of every recipient is counted on its own, the display would add them up
+	progress_enabled = false;
+	gettimeofday(&start_time, NULL);
+	for (int r = 0; r < fanout_count; r++)
+		recipients[r].out_fd = -1;
+
+	read_file = fopen(infile, "rb");
+	if (read_file == NULL)
+		ret = abort_fanout(recipients, read_file, &compress, "Error in opening files!");
+
+	//Every recipient gets its own header and round keys, scheduled once for the whole file
+	for (int r = 0; r < fanout_count && ret == 0; r++)
+	{
+		file_context * recipient = &recipients[r];
+
+		create_nonce(&recipient->header[0]);
+		create_nonce(&recipient->header[1]);
+		create_key_check(&recipient->header[2], fanout_keys[r], &recipient->header[0]);
+		if (compress_enabled)
+			recipient->header[2].right[HEADER_FLAGS] |= FLAG_COMPRESSED;
+		if (auth_enabled)
+			recipient->header[2].right[HEADER_FLAGS] |= FLAG_AUTH;
+		if (merkle_enabled)
+			recipient->header[2].right[HEADER_FLAGS] |= FLAG_MERKLE;
+		init_mode_state(&recipient->mode);
+
+		double kdf_start = stats_clock();
+		schedule_key(round_keys[r], fanout_keys[r], (unsigned char *)&recipient->header[0], header_iterations(recipient->header));
+		stats_record(stage_kdf, kdf_start);
+		if (auth_enabled)
+			auth_init(&recipient->auth, fanout_keys[r], recipient->header);
+
+		recipient->write_file = fopen(fanout_outfiles[r], "wb");
+		if (recipient->write_file == NULL)
+			ret = abort_fanout(recipients, read_file, &compress, "Error in opening files!");
+		else
+			fwrite(&recipient->header, BLOCKSIZE, HEADER_BLOCKS, recipient->write_file);
+	}
+
+	if (ret == 0)
+	{
+		results[0] = result;
+		for (int r = 1; r < fanout_count && parallel; r++)
+			results[r] = bufpool_get(pipeline_buffer_size(BUFSIZE));
+
+		fseek(read_file, 0, SEEK_END);
+		payload_size = payload_left = ftell(read_file);
+		fseek(read_file, 0, SEEK_SET);
+	}
+
+	while (ret == 0)
+	{
+		double read_start = stats_clock();
+		chunk_size = fread(data, sizeof(unsigned char), payload_left < BUFSIZE ? payload_left : BUFSIZE, read_file);
+		stats_record(stage_read, read_start);
+		stats_add_bytes(chunk_size);
+		payload_left -= chunk_size;
+
+		if (chunk_size == 0)
+		{
+			ret = abort_fanout(recipients, read_file, &compress, "Reading/memory error!");
+			break;
+		}
+		final_chunk = (chunk_size < BUFSIZE || payload_left == 0);
+
+		if (compress_enabled)
+		{
+			unsigned long compressed_size;
+			bool final_compressed = false;
+
+			//like in single-file encryption, the compressed stream is encrypted one full chunk at a time
+			compress_chunk(&compress, data, chunk_size, final_chunk);
+			while (ret == 0 && (compressed_size = compress_take(&compress, data, final_chunk, &final_compressed)) > 0)
+				if (fanout_chunk(recipients, round_keys, results, data, compressed_size, pad_chunk((block *)data, compressed_size, opmode),
+					final_compressed, opmode) == -1)
+					ret = abort_fanout(recipients, read_file, &compress, "Error in writing the output!");
+		}
+		else if (fanout_chunk(recipients, round_keys, results, data, chunk_size, pad_chunk((block *)data, chunk_size, opmode),
+			final_chunk, opmode) == -1)
+			ret = abort_fanout(recipients, read_file, &compress, "Error in writing the output!");
+
+		if (final_chunk)
+			break;
+	}
+
+	for (int r = 0; r < fanout_count && ret == 0; r++)
+	{
+		if (auth_enabled && auth_write_trailer(&recipients[r].auth, recipients[r].write_file) == -1)
+			ret = abort_fanout(recipients, read_file, &compress, "Error in writing the authentication trailer!");
+		else if (merkle_enabled && merkle_write_trailer(&recipients[r].merkle, recipients[r].write_file) == -1)
+			ret = abort_fanout(recipients, read_file, &compress, "Error in writing the integrity trailer!");
+		else if (merkle_enabled)
+			merkle_print_root(&recipients[r].merkle, fanout_outfiles[r]);
+	}
+
+	if (ret == 0)
+	{
+		fclose(read_file);
+		for (int r = 0; r < fanout_count; r++)
+		{
+			fclose(recipients[r].write_file);
+			auth_release(&recipients[r].auth);
+			merkle_release(&recipients[r].merkle);
+		}
+		compress_release(&compress);
+		*processed = payload_size;
+	}
+
+	for (int r = 1; r < fanout_count; r++)
+		if (results[r] != NULL)
+			bufpool_put(results[r]);
+	memset(round_keys, 0, fanout_count * sizeof(*round_keys));
+	free(round_keys);
+	free(results);
+	free(recipients);
+	return ret;
+}
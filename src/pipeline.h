@@ -0,0 +1,25 @@
+//Processing of a single file, shared by the single-file mode and the batch workers
+//The data and result buffers must have room for a chunk (or the whole input, if smaller) plus PIPELINE_SLACK bytes
+#define PIPELINE_SLACK (4 * BLOCKSIZE)
+
+//new key and mode of operation of the rekey operation
+extern char * rekey_key;
+extern enum mode rekey_mode;
+//keys and outputs of the recipients of a fan-out encryption, given as -k/-o pairs
+extern char ** fanout_keys;
+extern char ** fanout_outfiles;
+extern int fanout_count;
+//dec --verify: the plaintext is hashed instead of written
+extern bool verify_plaintext;
+
+unsigned long pipeline_buffer_size(const unsigned long input_size);
+int process_file(const char * infile, const char * outfile, const enum operation op, const enum mode opmode, const char * key,
+	const block * salt, unsigned char * data, unsigned char * result, unsigned long * processed);
+int process_fds(const int in_fd, const int out_fd, const enum operation op, const enum mode opmode, const char * key,
+	const block * salt, unsigned char * data, unsigned char * result, unsigned long * processed);
+int process_shard(const char * infile, const char * outfile, const enum operation op, const enum mode opmode, const char * key,
+	const unsigned long index, const unsigned long count, unsigned char * data, unsigned char * result, unsigned long * processed);
+int rekey_file(const char * infile, const char * outfile, const enum mode opmode, const char * key,
+	unsigned char * data, unsigned char * result, unsigned long * processed);
+unsigned int fanout_pool_buffers(const enum mode opmode);
+int fanout_file(const char * infile, const enum mode opmode, unsigned char * data, unsigned char * result, unsigned long * processed);
@@ -0,0 +1,96 @@
+//This module encrypts batches of small records, like the values of a database, without the costs that the file
+//interface pays once per call: the round keys are scheduled once in a record_key and reused by every call, there's no
+//header, padding or accounting block, and nothing is allocated.
+//All the blocks of all the records of a call are numbered one after the other, and this sequence is split across the
+//threads like the blocks of a chunk in the file kernels, so the work is balanced however the lengths of the records
+//are spread, and a thread goes from the end of one record to the beginning of the next without stopping. Block i of a
+//record is xored with the encryption of the counter block made of i in the left half and the nonce in the right half,
+//so the counters of two different nonces can never meet.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "common.h"
+#include "block.h"
+#include "feistel.h"
+#include "kdf.h"
+#include "tiling.h"
+#include "record.h"
+#include "omp.h"
+
+//below this number of blocks in a call, starting the threads costs more than encrypting the records on one thread
+#define RECORD_PARALLEL_BLOCKS 4096
+
+//Schedules the round keys of ctx from the key and the salt, with iterations rounds of PBKDF2 (kdf_iterations if 0).
+//The salt has to be stored by the caller, the same one gives the same keys.
+void record_key_init(record_key * ctx, const char * key, const block * salt, const unsigned long iterations)
+{
+	schedule_key(ctx->round_keys, key, (const unsigned char *)salt, iterations > 0 ? iterations : kdf_iterations);
+}
+
+void record_key_clear(record_key * ctx)
+{
+	memset(ctx, 0, sizeof(record_key));
+}
+
+//XORs len bytes of data (len up to BLOCKSIZE) with the keystream of block n of a record, 8 bytes at a time
+static void crypt_block(const record_key * ctx, const unsigned char * nonce, unsigned char * data, const unsigned long n, const unsigned long len)
+{
+	block counter;
+	unsigned char keystream[BLOCKSIZE];
+	unsigned long i = 0;
+	uint64_t k, d;
+
+	for (int j = 0; j < BLOCKSIZE/2; j++)
+		counter.left[j] = (n >> (8 * j)) & 0xff;
+	memcpy(counter.right, nonce, BLOCKSIZE/2);
+	process_block(keystream, counter.left, counter.right, ctx->round_keys);
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+	{
+		memcpy(&k, &keystream[i], sizeof(uint64_t));
+		memcpy(&d, &data[i], sizeof(uint64_t));
+		d ^= k;
+		memcpy(&data[i], &d, sizeof(uint64_t));
+	}
+	for (; i < len; i++)
+		data[i] ^= keystream[i];
+}
+
+//Encrypts (or decrypts, it's the same operation) in place the count records, in parallel when there are enough blocks
+void record_crypt(const record_key * ctx, record * records, const unsigned long count)
+{
+	unsigned long total = 0;
+
+	for (unsigned long r = 0; r < count; r++)
+		total += (records[r].len + BLOCKSIZE - 1) / BLOCKSIZE;
+
+	#pragma omp parallel if (total >= RECORD_PARALLEL_BLOCKS)
+	{
+		unsigned long begin, end;
+		unsigned long r = 0;
+		unsigned long first = 0;
+
+		tile_thread_range(total, &begin, &end);
+
+		//finding the record holding block begin of the sequence, first being the number of its first block
+		while (r < count && first + (records[r].len + BLOCKSIZE - 1) / BLOCKSIZE <= begin)
+			first += (records[r++].len + BLOCKSIZE - 1) / BLOCKSIZE;
+
+		for (unsigned long i = begin; i < end; r++)
+		{
+			unsigned long nblocks = (records[r].len + BLOCKSIZE - 1) / BLOCKSIZE;
+			unsigned long last = (first + nblocks < end) ? first + nblocks : end;
+
+			for (; i < last; i++)
+			{
+				unsigned long n = i - first;
+				unsigned long len = (records[r].len - n * BLOCKSIZE < BLOCKSIZE) ? records[r].len - n * BLOCKSIZE : BLOCKSIZE;
+				crypt_block(ctx, records[r].nonce, records[r].data + n * BLOCKSIZE, n, len);
+			}
+			first += nblocks;
+		}
+	}
+}
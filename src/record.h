@@ -0,0 +1,19 @@
+//Encryption of many small records in one call, for databases that keep every row or value encrypted, see record.c
+//Every record is encrypted in place in CTR mode under its own nonce: the ciphertext has the size of the plaintext, and
+//the same call decrypts it. The nonce of a record is 64 bits wide and must never be reused with the same key (a row id
+//with a version number, or 8 random bytes kept next to the value); a record has at most 2^64 blocks.
+
+typedef struct record_key {
+	unsigned char round_keys[NROUND][KEYSIZE];
+}record_key;
+
+typedef struct record {
+	unsigned char * data;
+	unsigned long len;
+	//the right half of the counter block, the left half holding the number of the block in the record
+	unsigned char nonce[BLOCKSIZE/2];
+}record;
+
+void record_key_init(record_key * ctx, const char * key, const block * salt, const unsigned long iterations);
+void record_key_clear(record_key * ctx);
+void record_crypt(const record_key * ctx, record * records, const unsigned long count);
@@ -0,0 +1,170 @@
+//This module keeps a reservoir of keystream for the CTR and OFB streams of stream.c, for services where the latency of
+//encrypting a message matters more than the throughput: a worker thread generates the keystream of the blocks that come
+//next into a ring of bounded size while the caller waits for data, so when a message arrives it's only XORed with
+//keystream that's already there. The worker goes on from where the kernels of opmodes.c would: the CTR counter derived
+//from the IV (the initial_counter of operate_ctr_mode) or the last OFB keystream block (current_iv in operate_ofb_mode),
+//so the output is the same as the one of the kernels.
+//The worker fills the ring up to its capacity and sleeps until some of it is consumed; a message bigger than what's
+//ready waits for the worker, a piece at a time.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "common.h"
+#include "utils.h"
+#include "feistel.h"
+#include "reservoir.h"
+
+//blocks the worker generates between two updates of the shared counters
+#define RESERVOIR_BATCH 256
+
+//Generates the next block of keystream into target: the encryption of the counter in CTR,
+//the encryption of the previous keystream block in OFB
+static void generate_block(keystream_reservoir * reservoir, unsigned char * target)
+{
+	if (reservoir->opmode == ctr)
+	{
+		block counter_block;
+		derive_block_from_number(reservoir->counter++, &counter_block);
+		process_block(target, counter_block.left, counter_block.right, reservoir->round_keys);
+	}
+	else
+	{
+		process_block(target, reservoir->chain.left, reservoir->chain.right, reservoir->round_keys);
+		memcpy(&reservoir->chain, target, BLOCKSIZE);
+	}
+}
+
+//Keeps the ring full until the reservoir is stopped. Only the worker writes the blocks past produced, the consumer
+//only reads the ones before it, so the keystream is generated without holding the lock.
+static void * fill_reservoir(void * arg)
+{
+	keystream_reservoir * reservoir = arg;
+
+	pthread_mutex_lock(&reservoir->lock);
+	while (!reservoir->stopping)
+	{
+		unsigned long room = reservoir->capacity - (reservoir->produced - reservoir->consumed);
+		unsigned long next = reservoir->produced;
+
+		if (room == 0)
+		{
+			pthread_cond_wait(&reservoir->drained, &reservoir->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&reservoir->lock);
+
+		if (room > RESERVOIR_BATCH)
+			room = RESERVOIR_BATCH;
+		for (unsigned long i = 0; i < room; i++)
+			generate_block(reservoir, &reservoir->ring[((next + i) % reservoir->capacity) * BLOCKSIZE]);
+
+		pthread_mutex_lock(&reservoir->lock);
+		reservoir->produced += room;
+		pthread_cond_signal(&reservoir->filled);
+	}
+	pthread_mutex_unlock(&reservoir->lock);
+
+	return NULL;
+}
+
+//Starts the worker of a reservoir of budget bytes (at least one block) for a CTR or OFB stream, going on from the
+//chaining state of the stream. Returns -1 if the mode is not CTR or OFB or if the worker can't be started.
+int reservoir_start(keystream_reservoir * reservoir, const enum mode opmode, const unsigned char round_keys[NROUND][KEYSIZE],
+	const block iv, const mode_state * state, const unsigned long budget)
+{
+	memset(reservoir, 0, sizeof(keystream_reservoir));
+	if (opmode != ctr && opmode != ofb)
+		return -1;
+
+	reservoir->opmode = opmode;
+	memcpy(reservoir->round_keys, round_keys, sizeof(reservoir->round_keys));
+	reservoir->capacity = budget >= BLOCKSIZE ? budget / BLOCKSIZE : 1;
+	reservoir->ring = malloc(reservoir->capacity * BLOCKSIZE);
+	if (reservoir->ring == NULL)
+		return -1;
+
+	//like the kernels, the first chunk starts from the IV
+	reservoir->counter = state->first_chunk ? derive_number_from_block(&iv) : state->counter;
+	reservoir->chain = state->first_chunk ? iv : state->chain;
+
+	pthread_mutex_init(&reservoir->lock, NULL);
+	pthread_cond_init(&reservoir->filled, NULL);
+	pthread_cond_init(&reservoir->drained, NULL);
+	if (pthread_create(&reservoir->worker, NULL, fill_reservoir, reservoir) != 0)
+	{
+		pthread_mutex_destroy(&reservoir->lock);
+		pthread_cond_destroy(&reservoir->filled);
+		pthread_cond_destroy(&reservoir->drained);
+		free(reservoir->ring);
+		return -1;
+	}
+
+	return 0;
+}
+
+//XORs len bytes of in with the next keystream of the reservoir into out, waiting for the worker if there's not enough
+//of it ready. A partial last block consumes a whole block of keystream, like in the kernels, so it must be the last one.
+void reservoir_xor(keystream_reservoir * reservoir, unsigned char * out, const unsigned char * in, const unsigned long len)
+{
+	unsigned long done = 0;
+
+	while (done < len)
+	{
+		unsigned long ready, first, n, stop;
+
+		pthread_mutex_lock(&reservoir->lock);
+		while (reservoir->produced == reservoir->consumed)
+			pthread_cond_wait(&reservoir->filled, &reservoir->lock);
+		ready = reservoir->produced - reservoir->consumed;
+		first = reservoir->consumed;
+		pthread_mutex_unlock(&reservoir->lock);
+
+		//the blocks ready up to the end of the message, or up to the end of the ring
+		n = (len - done + BLOCKSIZE - 1) / BLOCKSIZE;
+		if (n > ready)
+			n = ready;
+		if (n > reservoir->capacity - first % reservoir->capacity)
+			n = reservoir->capacity - first % reservoir->capacity;
+
+		const unsigned char * keystream = &reservoir->ring[(first % reservoir->capacity) * BLOCKSIZE];
+		unsigned long i = 0;
+		uint64_t k, d;
+
+		stop = (n * BLOCKSIZE < len - done) ? n * BLOCKSIZE : len - done;
+		for (; i + sizeof(uint64_t) <= stop; i += sizeof(uint64_t))
+		{
+			memcpy(&k, &keystream[i], sizeof(uint64_t));
+			memcpy(&d, &in[done + i], sizeof(uint64_t));
+			d ^= k;
+			memcpy(&out[done + i], &d, sizeof(uint64_t));
+		}
+		for (; i < stop; i++)
+			out[done + i] = keystream[i] ^ in[done + i];
+		done += stop;
+
+		pthread_mutex_lock(&reservoir->lock);
+		reservoir->consumed += n;
+		pthread_cond_signal(&reservoir->drained);
+		pthread_mutex_unlock(&reservoir->lock);
+	}
+}
+
+//Stops the worker and frees the ring, clearing the keystream and the round keys
+void reservoir_stop(keystream_reservoir * reservoir)
+{
+	pthread_mutex_lock(&reservoir->lock);
+	reservoir->stopping = true;
+	pthread_cond_signal(&reservoir->drained);
+	pthread_mutex_unlock(&reservoir->lock);
+	pthread_join(reservoir->worker, NULL);
+
+	pthread_mutex_destroy(&reservoir->lock);
+	pthread_cond_destroy(&reservoir->filled);
+	pthread_cond_destroy(&reservoir->drained);
+	memset(reservoir->ring, 0, reservoir->capacity * BLOCKSIZE);
+	free(reservoir->ring);
+	memset(reservoir, 0, sizeof(keystream_reservoir));
+}
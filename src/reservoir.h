@@ -0,0 +1,28 @@
+//Keystream generated ahead of time for the CTR and OFB streams, see reservoir.c
+//The keystream only depends on the key, the IV and the position, so a worker thread can produce it before the data
+//arrives, and encrypting a message then costs an XOR.
+#include "pthread.h"
+
+typedef struct keystream_reservoir {
+	enum mode opmode;
+	unsigned char round_keys[NROUND][KEYSIZE];
+	//ring of capacity blocks of keystream, the ones from consumed to produced are ready
+	unsigned char * ring;
+	unsigned long capacity;
+	unsigned long produced;
+	unsigned long consumed;
+	//counter of the next CTR block, last OFB keystream block: where the worker goes on from
+	unsigned long counter;
+	block chain;
+	bool stopping;
+	pthread_t worker;
+	pthread_mutex_t lock;
+	//signaled when keystream is produced, and when it's consumed
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+}keystream_reservoir;
+
+int reservoir_start(keystream_reservoir * reservoir, const enum mode opmode, const unsigned char round_keys[NROUND][KEYSIZE],
+	const block iv, const mode_state * state, const unsigned long budget);
+void reservoir_xor(keystream_reservoir * reservoir, unsigned char * out, const unsigned char * in, const unsigned long len);
+void reservoir_stop(keystream_reservoir * reservoir);
@@ -0,0 +1,427 @@
+//This module implements sector volumes, the -m xts mode: files like VM images and databases that are kept encrypted
+//and are read and updated in place at any offset. The volume is split in sectors of SECTOR_SIZE bytes that are
+//encrypted independently of each other, following the XTS construction: every sector has a tweak, the encryption of
+//the sector number (mixed with the IV of the volume) under a second set of round keys, and every block of the sector
+//is xored with the tweak before and after going through process_block, the tweak being multiplied by x in GF(2^128)
+//from one block to the next. Equal plaintext blocks give different ciphertexts in different positions (unlike ECB),
+//and there's no chaining (unlike CBC, PCBC, CFB and OFB), so rewriting a sector never touches its neighbours and
+//sectors can be processed in parallel.
+//The ciphertext has the size of the plaintext: a partial last block, which only the last sector can have, is handled
+//with the ciphertext stealing of XTS. A last sector shorter than a block has nothing to steal from, and is xored with
+//the encryption of its tweak instead, which is weaker (it's a stream cipher with a fixed keystream for that sector).
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/stat.h"
+#include "sys/time.h"
+#include "common.h"
+#include "utils.h"
+#include "block.h"
+#include "feistel.h"
+#include "stats.h"
+#include "sector.h"
+#include "omp.h"
+
+#define VOLUME_HEADER_SIZE (HEADER_BLOCKS * BLOCKSIZE)
+
+unsigned long sector_offset = 0;
+unsigned long sector_length = 0;
+
+//Parses the argument of --at, <offset>[:<length>]
+//Returns -1 if it's not valid
+int sector_configure_at(const char * spec)
+{
+	char * end;
+
+	sector_offset = strtoul(spec, &end, 10);
+	if (end == spec || (*end != ':' && *end != '\0'))
+		return -1;
+	if (*end == '\0')
+		return 0;
+
+	spec = end + 1;
+	sector_length = strtoul(spec, &end, 10);
+	if (end == spec || *end != '\0' || sector_length == 0)
+		return -1;
+
+	return 0;
+}
+
+//Derives the round keys of the volume from the key and the header
+static void sector_schedule(sector_volume * volume, const char * key)
+{
+	unsigned char tweak_salt[BLOCKSIZE];
+
+	memcpy(tweak_salt, &volume->header[0], BLOCKSIZE);
+	for (int i = 0; i < BLOCKSIZE; i++)
+		tweak_salt[i] ^= 0x36;
+
+	double kdf_start = stats_clock();
+	schedule_key(volume->round_keys, key, (unsigned char *)&volume->header[0], header_iterations(volume->header));
+	schedule_key(volume->tweak_keys, key, tweak_salt, header_iterations(volume->header));
+	stats_record(stage_kdf, kdf_start);
+
+	memcpy(volume->inverse_keys, volume->round_keys, sizeof(volume->inverse_keys));
+	invert_round_keys(volume->inverse_keys);
+}
+
+//Creates an empty volume at path (an existing file is replaced). Returns -1 if the file can't be written.
+int sector_create(sector_volume * volume, const char * path, const char * key)
+{
+	memset(volume, 0, sizeof(sector_volume));
+	create_nonce(&volume->header[0]);
+	create_nonce(&volume->header[1]);
+	create_key_check(&volume->header[2], key, &volume->header[0]);
+	volume->header[2].right[HEADER_FLAGS] |= FLAG_SECTOR;
+
+	volume->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (volume->fd == -1)
+		return -1;
+	if (pwrite(volume->fd, volume->header, VOLUME_HEADER_SIZE, 0) != VOLUME_HEADER_SIZE)
+	{
+		close(volume->fd);
+		return -1;
+	}
+
+	sector_schedule(volume, key);
+	return 0;
+}
+
+//Opens the volume at path, for reading and writing if writable is true.
+//Returns -1 if it can't be opened, -2 if it's not a sector volume and -3 if the key is wrong.
+int sector_open(sector_volume * volume, const char * path, const char * key, const bool writable)
+{
+	memset(volume, 0, sizeof(sector_volume));
+	volume->fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (volume->fd == -1)
+		return -1;
+
+	if (pread(volume->fd, volume->header, VOLUME_HEADER_SIZE, 0) != VOLUME_HEADER_SIZE || !has_key_check(&volume->header[2])
+		|| !(volume->header[2].right[HEADER_FLAGS] & FLAG_SECTOR))
+	{
+		close(volume->fd);
+		return -2;
+	}
+	if (verify_key_check(volume->header, key) == -1)
+	{
+		close(volume->fd);
+		return -3;
+	}
+
+	sector_schedule(volume, key);
+	return 0;
+}
+
+//Closes the volume, clearing the round keys
+void sector_close(sector_volume * volume)
+{
+	close(volume->fd);
+	memset(volume, 0, sizeof(sector_volume));
+}
+
+//Returns the size of the plaintext held by the volume
+unsigned long sector_volume_size(const sector_volume * volume)
+{
+	struct stat info;
+
+	if (fstat(volume->fd, &info) == -1 || info.st_size < VOLUME_HEADER_SIZE)
+		return 0;
+	return info.st_size - VOLUME_HEADER_SIZE;
+}
+
+//Computes the tweak of the first block of a sector: the IV of the volume, with the sector number xored in its left half,
+//encrypted with the tweak keys
+static void sector_tweak(const sector_volume * volume, const unsigned long sector, unsigned char tweak[BLOCKSIZE])
+{
+	block input = volume->header[1];
+
+	for (int i = 0; i < BLOCKSIZE/2; i++)
+		input.left[i] ^= (sector >> (8 * i)) & 0xff;
+	process_block(tweak, input.left, input.right, volume->tweak_keys);
+}
+
+//Multiplies the tweak by x in GF(2^128) (little endian, as in XTS), which gives the tweak of the next block
+static void next_tweak(unsigned char tweak[BLOCKSIZE])
+{
+	unsigned char carry = tweak[BLOCKSIZE - 1] >> 7;
+
+	for (int i = BLOCKSIZE - 1; i > 0; i--)
+		tweak[i] = (tweak[i] << 1) | (tweak[i - 1] >> 7);
+	tweak[0] = (tweak[0] << 1) ^ (carry ? 0x87 : 0);
+}
+
+//Encrypts (or decrypts, with the inverse keys) one block from in to out, xoring it with tweak before and after
+static void tweak_block(const unsigned char (* keys)[KEYSIZE], unsigned char * out, const unsigned char * in,
+	const unsigned char tweak[BLOCKSIZE])
+{
+	unsigned char mixed[BLOCKSIZE];
+
+	for (int j = 0; j < BLOCKSIZE; j++)
+		mixed[j] = in[j] ^ tweak[j];
+	process_block(out, mixed, mixed + BLOCKSIZE/2, keys);
+	for (int j = 0; j < BLOCKSIZE; j++)
+		out[j] ^= tweak[j];
+}
+
+//Encrypts (or decrypts) the first len bytes of a sector from in to out, which can be the same buffer
+static void sector_transform(const sector_volume * volume, unsigned char * out, const unsigned char * in, const unsigned long len,
+	const unsigned long sector, const enum operation op)
+{
+	const unsigned char (* keys)[KEYSIZE] = (op == enc) ? volume->round_keys : volume->inverse_keys;
+	unsigned long tail = len % BLOCKSIZE;
+	//with a partial last block, the last whole block is left to the ciphertext stealing
+	unsigned long whole = (tail > 0 && len > BLOCKSIZE) ? len - tail - BLOCKSIZE : len - tail;
+	unsigned char tweak[BLOCKSIZE];
+	unsigned char stolen[BLOCKSIZE];
+	unsigned long i;
+
+	sector_tweak(volume, sector, tweak);
+	for (i = 0; i < whole; i += BLOCKSIZE)
+	{
+		tweak_block(keys, &out[i], &in[i], tweak);
+		next_tweak(tweak);
+	}
+	if (tail == 0)
+		return;
+
+	//partial last block of a volume shorter than a block
+	if (len < BLOCKSIZE)
+	{
+		process_block(stolen, tweak, tweak + BLOCKSIZE/2, volume->round_keys);
+		for (unsigned long j = 0; j < len; j++)
+			out[j] = in[j] ^ stolen[j];
+		return;
+	}
+
+	//ciphertext stealing: the last whole block is processed with the tweak of the partial one in decryption, and the
+	//other way around in encryption. Its head becomes the partial block, and its tail fills the partial one up.
+	unsigned char last_tweak[BLOCKSIZE];
+	unsigned char head[BLOCKSIZE];
+
+	memcpy(last_tweak, tweak, BLOCKSIZE);
+	next_tweak(last_tweak);
+	tweak_block(keys, head, &in[i], op == enc ? tweak : last_tweak);
+	memcpy(stolen, &in[i + BLOCKSIZE], tail);
+	memcpy(stolen + tail, head + tail, BLOCKSIZE - tail);
+	memcpy(&out[i + BLOCKSIZE], head, tail);
+	tweak_block(keys, &out[i], stolen, op == enc ? last_tweak : tweak);
+}
+
+//Reads and decrypts up to len bytes of plaintext starting at offset, like pread. The sectors are processed in parallel,
+//and the ones that are read whole are decrypted straight into buf. Returns the number of bytes read, -1 in case of error.
+long sector_pread(const sector_volume * volume, unsigned char * buf, unsigned long len, const unsigned long offset)
+{
+	unsigned long size = sector_volume_size(volume);
+	unsigned long first, last;
+	bool failed = false;
+
+	if (offset >= size || len == 0)
+		return 0;
+	if (len > size - offset)
+		len = size - offset;
+
+	first = offset / SECTOR_SIZE;
+	last = (offset + len - 1) / SECTOR_SIZE;
+
+	double kernel_start = stats_clock();
+	#pragma omp parallel for schedule(static)
+	for (unsigned long sector = first; sector <= last; sector++)
+	{
+		unsigned char piece[SECTOR_SIZE];
+		unsigned long start = sector * SECTOR_SIZE;
+		unsigned long n = (size - start < SECTOR_SIZE) ? size - start : SECTOR_SIZE;
+		unsigned long lo = start > offset ? start : offset;
+		unsigned long hi = (start + n < offset + len) ? start + n : offset + len;
+		//a sector that's read whole goes straight to its place in buf
+		unsigned char * target = (lo == start && hi == start + n) ? buf + (start - offset) : piece;
+
+		if (pread(volume->fd, target, n, VOLUME_HEADER_SIZE + start) != n)
+		{
+			failed = true;
+			continue;
+		}
+		sector_transform(volume, target, target, n, sector, dec);
+		if (target == piece)
+			memcpy(buf + (lo - offset), piece + (lo - start), hi - lo);
+	}
+	stats_record(stage_kernel, kernel_start);
+
+	return failed ? -1 : len;
+}
+
+//Encrypts and writes len bytes of plaintext at offset, like pwrite. Sectors that are only partly written are read and
+//decrypted first to keep the rest of their content; a write past the end of the volume fills the gap with zeros.
+//The sectors are processed in parallel. Returns len, or -1 in case of error.
+long sector_pwrite(const sector_volume * volume, const unsigned char * buf, const unsigned long len, const unsigned long offset)
+{
+	unsigned long size = sector_volume_size(volume);
+	unsigned long new_size, first, last;
+	bool failed = false;
+
+	if (len == 0)
+		return 0;
+
+	if (offset > size)
+	{
+		unsigned char * zeros = calloc(BUFSIZE / 4, 1);
+
+		for (unsigned long pos = size; pos < offset && !failed; pos += BUFSIZE / 4)
+			failed = sector_pwrite(volume, zeros, (offset - pos < BUFSIZE / 4) ? offset - pos : BUFSIZE / 4, pos) == -1;
+		free(zeros);
+		if (failed)
+			return -1;
+		size = offset;
+	}
+
+	new_size = (offset + len > size) ? offset + len : size;
+	first = offset / SECTOR_SIZE;
+	last = (offset + len - 1) / SECTOR_SIZE;
+
+	double kernel_start = stats_clock();
+	#pragma omp parallel for schedule(static)
+	for (unsigned long sector = first; sector <= last; sector++)
+	{
+		unsigned char plain[SECTOR_SIZE];
+		unsigned char cipher[SECTOR_SIZE];
+		unsigned long start = sector * SECTOR_SIZE;
+		unsigned long n = (new_size - start < SECTOR_SIZE) ? new_size - start : SECTOR_SIZE;
+		unsigned long lo = start > offset ? start : offset;
+		unsigned long hi = (start + n < offset + len) ? start + n : offset + len;
+
+		//the part of the sector that isn't written keeps its old content
+		if (lo > start || hi < start + n)
+		{
+			unsigned long old = (size > start) ? ((size - start < SECTOR_SIZE) ? size - start : SECTOR_SIZE) : 0;
+
+			memset(plain, 0, SECTOR_SIZE);
+			if (old > 0 && pread(volume->fd, cipher, old, VOLUME_HEADER_SIZE + start) != old)
+			{
+				failed = true;
+				continue;
+			}
+			sector_transform(volume, plain, cipher, old, sector, dec);
+		}
+		memcpy(plain + (lo - start), buf + (lo - offset), hi - lo);
+
+		sector_transform(volume, cipher, plain, n, sector, enc);
+		if (pwrite(volume->fd, cipher, n, VOLUME_HEADER_SIZE + start) != n)
+			failed = true;
+	}
+	stats_record(stage_kernel, kernel_start);
+
+	return failed ? -1 : len;
+}
+
+//Opens the volume, printing the reason if it can't be opened. Returns -1 in case of error.
+static int open_volume(sector_volume * volume, const char * path, const char * key, const bool writable)
+{
+	switch (sector_open(volume, path, key, writable))
+	{
+		case -1:
+			exit_message(1, "Error in opening files!");
+			return -1;
+		case -2:
+			exit_message(1, "The file is not a sector volume, was it encrypted with -m xts?");
+			return -1;
+		case -3:
+			exit_message(1, "Wrong key!");
+			return -1;
+	}
+	return 0;
+}
+
+//Runs op on a sector volume: enc writes infile to a new volume at outfile, dec writes the whole plaintext of the volume
+//infile to outfile, read_range writes the plaintext at sector_offset (sector_length bytes of it, or up to the end) to
+//outfile, write_range writes infile to the volume outfile at sector_offset, creating the volume if it doesn't exist.
+//data must be at least BUFSIZE bytes long. Saves in processed the size of the plaintext, returns -1 in case of error.
+int sector_process(const char * infile, const char * outfile, const enum operation op, const char * key,
+	unsigned char * data, unsigned long * processed)
+{
+	sector_volume volume;
+	FILE * plain_file;
+	unsigned long offset = (op == read_range || op == write_range) ? sector_offset : 0;
+	unsigned long end = 0;
+	unsigned long chunk_size;
+	int opened;
+	int ret = 0;
+
+	*processed = 0;
+	gettimeofday(&start_time, NULL);
+
+	if (op == enc || op == write_range) //plaintext in, volume out
+	{
+		plain_file = fopen(infile, "rb");
+		if (plain_file == NULL)
+		{
+			exit_message(1, "Error in opening files!");
+			return -1;
+		}
+		//writes go to the existing volume, if there's one
+		if (op == write_range && access(outfile, F_OK) == 0)
+			opened = open_volume(&volume, outfile, key, true);
+		else if ((opened = sector_create(&volume, outfile, key)) == -1)
+			exit_message(1, "Error in opening files!");
+		if (opened == -1)
+		{
+			fclose(plain_file);
+			return -1;
+		}
+
+		while ((chunk_size = fread(data, 1, BUFSIZE, plain_file)) > 0)
+		{
+			stats_add_bytes(chunk_size);
+			if (sector_pwrite(&volume, data, chunk_size, offset) == -1)
+			{
+				exit_message(1, "Error in writing the volume!");
+				ret = -1;
+				break;
+			}
+			offset += chunk_size;
+			*processed += chunk_size;
+		}
+		fclose(plain_file);
+		sector_close(&volume);
+		return ret;
+	}
+
+	//volume in, plaintext out
+	if (open_volume(&volume, infile, key, false) == -1)
+		return -1;
+	plain_file = fopen(outfile, "wb");
+	if (plain_file == NULL)
+	{
+		sector_close(&volume);
+		exit_message(1, "Error in opening files!");
+		return -1;
+	}
+
+	end = sector_volume_size(&volume);
+	if (op == read_range && sector_length > 0 && offset + sector_length < end)
+		end = offset + sector_length;
+
+	while (offset < end)
+	{
+		long got = sector_pread(&volume, data, (end - offset < BUFSIZE) ? end - offset : BUFSIZE, offset);
+		if (got <= 0)
+		{
+			exit_message(1, "Reading/memory error!");
+			ret = -1;
+			break;
+		}
+		stats_add_bytes(got);
+
+		double write_start = stats_clock();
+		fwrite(data, got, 1, plain_file);
+		stats_record(stage_write, write_start);
+		offset += got;
+		*processed += got;
+	}
+
+	fclose(plain_file);
+	sector_close(&volume);
+	return ret;
+}
@@ -0,0 +1,28 @@
+//Sector volumes (-m xts): random access encryption for disk images and database files, see sector.c
+//A volume is the header (with FLAG_SECTOR set) followed by the ciphertext, which has the same size as the plaintext:
+//sector n is at offset header + n * SECTOR_SIZE and is encrypted on its own, with a tweak derived from n.
+#define SECTOR_SIZE 4096
+
+//offset and length given with --at, for the read and write operations (a length of 0 reaches the end of the volume)
+extern unsigned long sector_offset;
+extern unsigned long sector_length;
+
+typedef struct sector_volume {
+	int fd;
+	block header[HEADER_BLOCKS];
+	unsigned char round_keys[NROUND][KEYSIZE];
+	//inverted round keys, for decryption
+	unsigned char inverse_keys[NROUND][KEYSIZE];
+	//round keys of the sector tweaks, derived with a separate salt
+	unsigned char tweak_keys[NROUND][KEYSIZE];
+}sector_volume;
+
+int sector_configure_at(const char * spec);
+int sector_create(sector_volume * volume, const char * path, const char * key);
+int sector_open(sector_volume * volume, const char * path, const char * key, const bool writable);
+void sector_close(sector_volume * volume);
+unsigned long sector_volume_size(const sector_volume * volume);
+long sector_pread(const sector_volume * volume, unsigned char * buf, unsigned long len, const unsigned long offset);
+long sector_pwrite(const sector_volume * volume, const unsigned char * buf, const unsigned long len, const unsigned long offset);
+int sector_process(const char * infile, const char * outfile, const enum operation op, const char * key,
+	unsigned char * data, unsigned long * processed);
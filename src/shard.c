@@ -0,0 +1,196 @@
+//This module splits the encryption or decryption of a single file across several processes, for the modes without
+//chaining (CTR and ECB) where any range of chunks can be processed on its own given the header and its position.
+//The coordinator (--shards=N) writes the header, sizes the output for the whole ciphertext (or plaintext) and starts
+//N worker processes, each running --shard=i/N on the same command line: a worker processes its own range of chunks
+//straight into the shared output at the right offset, see process_shard. The worker that owns the last chunk writes
+//the padding and accounting block in encryption, and cuts the output where the plaintext ends in decryption.
+//With --prepare the coordinator only prepares the output, so that the workers can be started somewhere else (in other
+//containers, or on other hosts that share the storage).
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "unistd.h"
+#include "sys/wait.h"
+#include "sys/time.h"
+#include "common.h"
+#include "utils.h"
+#include "block.h"
+#include "shard.h"
+#include "omp.h"
+
+unsigned long shard_index = 0;
+unsigned long shard_count = 0;
+unsigned long shards = 0;
+bool shard_prepare_only = false;
+
+//Parses the argument of --shard, i/N with i < N
+//Returns -1 if it's not valid
+int shard_configure(const char * spec)
+{
+	char * end;
+
+	shard_index = strtoul(spec, &end, 10);
+	if (end == spec || *end != '/')
+		return -1;
+
+	spec = end + 1;
+	shard_count = strtoul(spec, &end, 10);
+	if (end == spec || *end != '\0' || shard_count == 0 || shard_index >= shard_count)
+		return -1;
+
+	return 0;
+}
+
+//Returns the size of the ciphertext of a payload_size bytes plaintext in opmode, excluding header and trailers:
+//the last chunk gets the padding and accounting blocks of the padded modes
+static unsigned long ciphertext_size(const unsigned long payload_size, const enum mode opmode)
+{
+	unsigned long last = payload_size % BUFSIZE;
+	unsigned long padded = 0;
+
+	if (is_stream_mode(opmode))
+		return payload_size;
+	if (last == 0 && payload_size > 0)
+		last = BUFSIZE;
+
+	calculate_final_size(&padded, last);
+	if (last > BUFSIZE - BLOCKSIZE)
+		padded += BLOCKSIZE;
+
+	return payload_size - last + padded;
+}
+
+//Writes the header shared by all the workers and sizes the output. Returns -1 in case of error.
+static int prepare_output(const char * infile, const char * outfile, const enum operation op, const enum mode opmode,
+	const char * key, unsigned long * payload_size)
+{
+	FILE * read_file = fopen(infile, "rb");
+	FILE * write_file;
+	block header[HEADER_BLOCKS];
+	unsigned long header_size = HEADER_BLOCKS * BLOCKSIZE;
+	unsigned long output_size;
+
+	if (read_file == NULL)
+	{
+		exit_message(1, "Error in opening files!");
+		return -1;
+	}
+
+	fseek(read_file, 0, SEEK_END);
+	*payload_size = ftell(read_file);
+	fseek(read_file, 0, SEEK_SET);
+
+	if (op == enc)
+	{
+		create_nonce(&header[0]);
+		create_nonce(&header[1]);
+		create_key_check(&header[2], key, &header[0]);
+		output_size = header_size + ciphertext_size(*payload_size, opmode);
+	}
+	else
+	{
+		fread(&header[0], BLOCKSIZE, HEADER_BLOCKS, read_file);
+		if (!has_key_check(&header[2]))
+			header_size = 2 * BLOCKSIZE;
+		else if (verify_key_check(header, key) == -1)
+		{
+			fclose(read_file);
+			exit_message(1, "Wrong key!");
+			return -1;
+		}
+		if (*payload_size <= header_size)
+		{
+			fclose(read_file);
+			exit_message(1, "The input file is too short to be a ciphertext!");
+			return -1;
+		}
+		//the padding is removed by the last worker
+		*payload_size -= header_size;
+		output_size = *payload_size;
+	}
+	fclose(read_file);
+
+	write_file = fopen(outfile, "wb");
+	if (write_file == NULL)
+	{
+		exit_message(1, "Error in opening files!");
+		return -1;
+	}
+	if (op == enc)
+		fwrite(&header, BLOCKSIZE, HEADER_BLOCKS, write_file);
+	fflush(write_file);
+	if (ftruncate(fileno(write_file), output_size) == -1)
+	{
+		fclose(write_file);
+		exit_message(1, "Error in sizing the output file!");
+		return -1;
+	}
+	fclose(write_file);
+
+	return 0;
+}
+
+//Prepares the output, then runs the shards as worker processes with the same arguments as the coordinator plus
+//--shard=i/N, and waits for them. Every worker gets an equal share of the cpus unless OMP_NUM_THREADS says otherwise.
+//Saves in processed the size of the plaintext/ciphertext, returns -1 if any worker failed.
+int shard_run(int argc, char * argv[], const char * infile, const char * outfile, const enum operation op,
+	const enum mode opmode, const char * key, unsigned long * processed)
+{
+	char ** args = malloc((argc + 2) * sizeof(char *));
+	char shard_arg[64];
+	char threads[32];
+	pid_t * workers = malloc(shards * sizeof(pid_t));
+	int ret = 0;
+
+	if (prepare_output(infile, outfile, op, opmode, key, processed) == -1)
+	{
+		free(args);
+		free(workers);
+		return -1;
+	}
+
+	if (shard_prepare_only)
+	{
+		free(args);
+		free(workers);
+		exit_message(1, "Output prepared, the shards can be started with --shard=i/N");
+		return 0;
+	}
+
+	gettimeofday(&start_time, NULL);
+	memcpy(args, argv, argc * sizeof(char *));
+	args[argc] = shard_arg;
+	args[argc + 1] = NULL;
+	snprintf(threads, sizeof(threads), "%d", omp_get_num_procs() / (int)shards > 0 ? omp_get_num_procs() / (int)shards : 1);
+
+	fflush(stdout);
+	for (unsigned long i = 0; i < shards; i++)
+	{
+		snprintf(shard_arg, sizeof(shard_arg), "--shard=%lu/%lu", i, shards);
+		workers[i] = fork();
+		if (workers[i] == 0)
+		{
+			setenv("OMP_NUM_THREADS", threads, 0);
+			execv("/proc/self/exe", args);
+			_exit(127);
+		}
+		if (workers[i] == -1)
+			ret = -1;
+	}
+
+	for (unsigned long i = 0; i < shards; i++)
+	{
+		int status;
+		if (workers[i] > 0 && (waitpid(workers[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0))
+			ret = -1;
+	}
+
+	free(args);
+	free(workers);
+	if (ret == -1)
+		exit_message(1, "A shard failed, the output is not valid!");
+
+	return ret;
+}
@@ -0,0 +1,11 @@
+//Sharded processing of a single file by byte range, enabled with --shards=N (coordinator) and --shard=i/N (worker)
+//Only for the modes without chaining, ECB and CTR
+
+extern unsigned long shard_index;
+extern unsigned long shard_count;
+extern unsigned long shards;
+extern bool shard_prepare_only;
+
+int shard_configure(const char * spec);
+int shard_run(int argc, char * argv[], const char * infile, const char * outfile, const enum operation op,
+	const enum mode opmode, const char * key, unsigned long * processed);
@@ -0,0 +1,332 @@
+//This module implements the encryption of sparse files, like disk images that are mostly holes: instead of reading
+//the holes as zeros and encrypting them, the data extents of the plaintext are found with SEEK_DATA and SEEK_HOLE,
+//and only they are read, encrypted and written. The holes are recorded in the extent map at the end of the file
+//and left as holes in the output of the decryption, which is only written where the extents are.
+//Extents are encrypted in CTR mode at their position in the plaintext (the counter of the block at offset n is the one
+//that the block at offset n would have in cfeistel enc), so every extent is encrypted on its own, with a single seek.
+//The map is encrypted too, under a fresh IV kept in the footer.
+//On filesystems that don't keep track of holes, the whole file is a single extent.
+
+#define _GNU_SOURCE
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "errno.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/stat.h"
+#include "sys/time.h"
+#include "common.h"
+#include "utils.h"
+#include "block.h"
+#include "opmodes.h"
+#include "stats.h"
+#include "sparse.h"
+
+#define SPARSE_HEADER_SIZE (HEADER_BLOCKS * BLOCKSIZE)
+
+bool sparse_enabled = false;
+
+typedef struct sparse_file {
+	int in_fd;
+	int out_fd;
+	const char * outfile;
+	block header[HEADER_BLOCKS];
+	unsigned char round_keys[NROUND][KEYSIZE];
+	sparse_extent * extents;
+	unsigned long nextents;
+}sparse_file;
+
+//Closes the files of a sparse file that couldn't be processed, removing the incomplete output, then prints message.
+//Always returns -1.
+static int abort_sparse(sparse_file * file, const char * message)
+{
+	if (file->in_fd >= 0)
+		close(file->in_fd);
+	if (file->out_fd >= 0)
+	{
+		close(file->out_fd);
+		remove(file->outfile);
+	}
+	free(file->extents);
+
+	exit_message(1, message);
+	return -1;
+}
+
+//Derives the round keys from the key and the salt in the header (they're the same in encryption and decryption)
+static void schedule_sparse_keys(sparse_file * file, const char * key)
+{
+	double kdf_start = stats_clock();
+	schedule_key(file->round_keys, key, (unsigned char *)&file->header[0], header_iterations(file->header));
+	stats_record(stage_kdf, kdf_start);
+}
+
+//Lists the data extents of the input, which is size bytes long. Extents are widened to start on a block, so that each
+//one starts on a block of the keystream, and extents that end up touching are merged. Returns -1 in case of error.
+static int list_extents(sparse_file * file, const unsigned long size)
+{
+	unsigned long capacity = 16;
+	unsigned long pos = 0;
+
+	file->extents = malloc(capacity * sizeof(sparse_extent));
+	file->nextents = 0;
+
+	while (pos < size)
+	{
+		off_t start = lseek(file->in_fd, pos, SEEK_DATA);
+		off_t end;
+
+		//only a hole is left
+		if (start == -1 && errno == ENXIO)
+			break;
+		if (start == -1 || (end = lseek(file->in_fd, start, SEEK_HOLE)) == -1)
+			return -1;
+		if (end > size)
+			end = size;
+		if (end <= start)
+			break;
+
+		start -= start % BLOCKSIZE;
+		if (file->nextents > 0 && start <= file->extents[file->nextents - 1].offset + file->extents[file->nextents - 1].length)
+			file->extents[file->nextents - 1].length = end - file->extents[file->nextents - 1].offset;
+		else
+		{
+			//one slot is always left for the empty extent that closes the map
+			if (file->nextents + 2 > capacity)
+			{
+				capacity *= 2;
+				file->extents = realloc(file->extents, capacity * sizeof(sparse_extent));
+			}
+			file->extents[file->nextents].offset = start;
+			file->extents[file->nextents].length = end - start;
+			file->nextents++;
+		}
+		pos = end;
+	}
+
+	//the empty extent at the end keeps the size of the plaintext, and with it a hole at its end
+	file->extents[file->nextents].offset = size;
+	file->extents[file->nextents].length = 0;
+	file->nextents++;
+	return 0;
+}
+
+//Encrypts (or decrypts, it's the same operation) the extent map with the keystream of iv
+static void crypt_map(const sparse_file * file, unsigned char * out, const block iv)
+{
+	mode_state state;
+
+	init_mode_state(&state);
+	encrypt_scheduled(out, (block *)file->extents, file->nextents, file->nextents * sizeof(sparse_extent),
+		file->round_keys, iv, ctr, &state);
+}
+
+//Encrypts the data extents of infile into outfile, followed by the map and the footer
+static int sparse_encrypt(sparse_file * file, const char * infile, const char * key,
+	unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	struct stat info;
+	unsigned long pos = SPARSE_HEADER_SIZE;
+	unsigned char * map;
+	block footer[2];
+
+	file->in_fd = open(infile, O_RDONLY);
+	if (file->in_fd == -1 || fstat(file->in_fd, &info) == -1)
+		return abort_sparse(file, "Error in opening files!");
+	if (list_extents(file, info.st_size) == -1)
+		return abort_sparse(file, "Reading/memory error!");
+
+	file->out_fd = open(file->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file->out_fd == -1)
+		return abort_sparse(file, "Error in opening files!");
+
+	create_nonce(&file->header[0]);
+	create_nonce(&file->header[1]);
+	create_key_check(&file->header[2], key, &file->header[0]);
+	file->header[2].right[HEADER_FLAGS] |= FLAG_SPARSE;
+	if (pwrite(file->out_fd, file->header, SPARSE_HEADER_SIZE, 0) != SPARSE_HEADER_SIZE)
+		return abort_sparse(file, "Error in writing the output file!");
+	schedule_sparse_keys(file, key);
+
+	for (unsigned long e = 0; e < file->nextents; e++)
+	{
+		const sparse_extent * extent = &file->extents[e];
+		mode_state state;
+
+		seek_mode_state(&state, &file->header[1], extent->offset / BLOCKSIZE);
+		for (unsigned long done = 0; done < extent->length; )
+		{
+			unsigned long n = (extent->length - done < BUFSIZE) ? extent->length - done : BUFSIZE;
+
+			double read_start = stats_clock();
+			if (pread(file->in_fd, data, n, extent->offset + done) != n)
+				return abort_sparse(file, "Reading/memory error!");
+			stats_record(stage_read, read_start);
+
+			encrypt_scheduled(result, (block *)data, (n + BLOCKSIZE - 1) / BLOCKSIZE, n, file->round_keys, file->header[1], ctr, &state);
+
+			double write_start = stats_clock();
+			if (pwrite(file->out_fd, result, n, pos) != n)
+				return abort_sparse(file, "Error in writing the output file!");
+			stats_record(stage_write, write_start);
+
+			stats_add_bytes(n);
+			*processed += n;
+			pos += n;
+			done += n;
+		}
+	}
+
+	//the map goes after the last extent, under an IV of its own
+	create_nonce(&footer[0]);
+	for (int i = 0; i < BLOCKSIZE/2; i++)
+		footer[1].left[i] = (file->nextents >> (8 * i)) & 0xff;
+	memcpy(footer[1].right, SPARSE_MAGIC, BLOCKSIZE/2);
+
+	map = malloc(file->nextents * sizeof(sparse_extent));
+	crypt_map(file, map, footer[0]);
+	if (pwrite(file->out_fd, map, file->nextents * sizeof(sparse_extent), pos) != file->nextents * sizeof(sparse_extent)
+		|| pwrite(file->out_fd, footer, SPARSE_FOOTER_SIZE, pos + file->nextents * sizeof(sparse_extent)) != SPARSE_FOOTER_SIZE)
+	{
+		free(map);
+		return abort_sparse(file, "Error in writing the output file!");
+	}
+	free(map);
+
+	close(file->in_fd);
+	close(file->out_fd);
+	free(file->extents);
+	return 0;
+}
+
+//Reads and decrypts the extent map of the input, checking that it describes the ciphertext before it.
+//Returns -1 if the map is missing or damaged.
+static int read_map(sparse_file * file, const unsigned long file_size)
+{
+	block footer[2];
+	unsigned long map_size, map_offset, payload = 0, end = 0;
+	sparse_extent * map;
+
+	if (pread(file->in_fd, footer, SPARSE_FOOTER_SIZE, file_size - SPARSE_FOOTER_SIZE) != SPARSE_FOOTER_SIZE
+		|| memcmp(footer[1].right, SPARSE_MAGIC, BLOCKSIZE/2) != 0)
+		return -1;
+	for (int i = BLOCKSIZE/2 - 1; i >= 0; i--)
+		file->nextents = (file->nextents << 8) | footer[1].left[i];
+	if (file->nextents == 0 || file->nextents > (file_size - SPARSE_HEADER_SIZE - SPARSE_FOOTER_SIZE) / sizeof(sparse_extent))
+		return -1;
+
+	map_size = file->nextents * sizeof(sparse_extent);
+	map_offset = file_size - SPARSE_FOOTER_SIZE - map_size;
+	map = malloc(map_size);
+	file->extents = malloc(map_size);
+	if (pread(file->in_fd, file->extents, map_size, map_offset) != map_size)
+	{
+		free(map);
+		return -1;
+	}
+	crypt_map(file, (unsigned char *)map, footer[0]);
+	memcpy(file->extents, map, map_size);
+	free(map);
+
+	//the extents must be in order, start on a block and fill the ciphertext exactly, the last one being empty
+	for (unsigned long e = 0; e < file->nextents; e++)
+	{
+		const sparse_extent * extent = &file->extents[e];
+		bool last = e == file->nextents - 1;
+
+		if (extent->offset < end || (!last && (extent->offset % BLOCKSIZE != 0 || extent->length == 0))
+			|| (last && extent->length != 0) || extent->length > map_offset - SPARSE_HEADER_SIZE - payload)
+			return -1;
+		payload += extent->length;
+		end = extent->offset + extent->length;
+	}
+	return payload == map_offset - SPARSE_HEADER_SIZE ? 0 : -1;
+}
+
+//Decrypts the extents of infile into their place in outfile, which is left with holes where the plaintext had them
+static int sparse_decrypt(sparse_file * file, const char * infile, const char * key,
+	unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	struct stat info;
+	unsigned long pos = SPARSE_HEADER_SIZE;
+
+	file->in_fd = open(infile, O_RDONLY);
+	if (file->in_fd == -1 || fstat(file->in_fd, &info) == -1)
+		return abort_sparse(file, "Error in opening files!");
+
+	if (info.st_size < SPARSE_HEADER_SIZE + SPARSE_FOOTER_SIZE
+		|| pread(file->in_fd, file->header, SPARSE_HEADER_SIZE, 0) != SPARSE_HEADER_SIZE || !has_key_check(&file->header[2])
+		|| !(file->header[2].right[HEADER_FLAGS] & FLAG_SPARSE))
+		return abort_sparse(file, "The file is not sparse, it's decrypted without --sparse!");
+	if (verify_key_check(file->header, key) == -1)
+		return abort_sparse(file, "Wrong key!");
+	schedule_sparse_keys(file, key);
+
+	if (read_map(file, info.st_size) == -1)
+		return abort_sparse(file, "The extent map of the file is damaged!");
+
+	//the output starts as a single hole of the size of the plaintext, the extents are written into it
+	file->out_fd = open(file->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file->out_fd == -1)
+		return abort_sparse(file, "Error in opening files!");
+	if (ftruncate(file->out_fd, file->extents[file->nextents - 1].offset) == -1)
+		return abort_sparse(file, "Error in writing the output file!");
+
+	for (unsigned long e = 0; e < file->nextents; e++)
+	{
+		const sparse_extent * extent = &file->extents[e];
+		mode_state state;
+
+		seek_mode_state(&state, &file->header[1], extent->offset / BLOCKSIZE);
+		for (unsigned long done = 0; done < extent->length; )
+		{
+			unsigned long n = (extent->length - done < BUFSIZE) ? extent->length - done : BUFSIZE;
+
+			double read_start = stats_clock();
+			if (pread(file->in_fd, data, n, pos) != n)
+				return abort_sparse(file, "Reading/memory error!");
+			stats_record(stage_read, read_start);
+
+			decrypt_scheduled(result, (block *)data, (n + BLOCKSIZE - 1) / BLOCKSIZE, n, file->round_keys, file->header[1], ctr, &state);
+
+			double write_start = stats_clock();
+			if (pwrite(file->out_fd, result, n, extent->offset + done) != n)
+				return abort_sparse(file, "Error in writing the output file!");
+			stats_record(stage_write, write_start);
+
+			stats_add_bytes(n);
+			*processed += n;
+			pos += n;
+			done += n;
+		}
+	}
+
+	close(file->in_fd);
+	close(file->out_fd);
+	free(file->extents);
+	return 0;
+}
+
+//Encrypts or decrypts infile into outfile skipping the holes. Saves in processed the size of the data extents,
+//returns -1 in case of error.
+int sparse_process(const char * infile, const char * outfile, const enum operation op, const char * key,
+	unsigned char * data, unsigned char * result, unsigned long * processed)
+{
+	sparse_file file;
+
+	memset(&file, 0, sizeof(sparse_file));
+	file.in_fd = -1;
+	file.out_fd = -1;
+	file.outfile = outfile;
+	*processed = 0;
+
+	//the extents are not read in order of the output, the progress of the kernels would be meaningless
+	progress_enabled = false;
+	gettimeofday(&start_time, NULL);
+
+	if (op == enc)
+		return sparse_encrypt(&file, infile, key, data, result, processed);
+	return sparse_decrypt(&file, infile, key, data, result, processed);
+}
@@ -0,0 +1,16 @@
+//Sparse files (--sparse): only the data extents of the plaintext are encrypted, the holes are skipped, see sparse.c
+//A sparse file is the header (with FLAG_SPARSE set), the ciphertext of the extents one after the other, the encrypted
+//extent map and a footer: the IV of the map, then a block holding the number of extents and the magic.
+#define SPARSE_MAGIC "CFSPAR01"
+#define SPARSE_FOOTER_SIZE (2 * BLOCKSIZE)
+
+extern bool sparse_enabled;
+
+typedef struct sparse_extent {
+	//where the extent is in the plaintext, and its size. The map ends with an empty extent at the end of the plaintext.
+	unsigned long offset;
+	unsigned long length;
+}sparse_extent;
+
+int sparse_process(const char * infile, const char * outfile, const enum operation op, const char * key,
+	unsigned char * data, unsigned char * result, unsigned long * processed);
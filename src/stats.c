@@ -0,0 +1,176 @@
+//This module keeps a latency histogram for every stage of the processing (key derivation, read, padding,
+//cipher kernel, XOR, write, authentication, compression), with one sample for every chunk that goes through the stage.
+//At the end of the run the histograms are written as JSON or in the Prometheus text exposition format.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "time.h"
+#include "common.h"
+#include "stats.h"
+#include "omp.h"
+
+//bucket i counts the samples that took less than 2^i microseconds, the last one catches everything else
+#define NBUCKETS 26
+
+typedef struct histogram {
+    unsigned long count;
+    double sum;
+    double min;
+    double max;
+    unsigned long buckets[NBUCKETS];
+}histogram;
+
+enum stats_format stats_output = stats_none;
+
+static char * stats_file = NULL;
+static histogram histograms[nstages];
+static unsigned long stats_bytes = 0;
+static double stats_start = 0;
+
+static const char * stage_names[nstages] = {"key_derivation", "read", "padding", "kernel", "xor", "write", "mac", "compression"};
+
+//Parses the argument of --stats, which can be json or prom, optionally followed by :<file>
+//Returns -1 if the format is not recognized
+int stats_configure(const char * spec)
+{
+	const char * separator = strchr(spec, ':');
+	size_t format_len = separator == NULL ? strlen(spec) : (size_t)(separator - spec);
+
+	if (format_len == 4 && strncmp(spec, "json", 4) == 0)
+		stats_output = stats_json;
+	else if (format_len == 4 && strncmp(spec, "prom", 4) == 0)
+		stats_output = stats_prom;
+	else
+		return -1;
+
+	if (separator != NULL && separator[1] != '\0')
+	{
+		stats_file = malloc(strlen(separator + 1) + 1);
+		strcpy(stats_file, separator + 1);
+	}
+
+	stats_start = stats_clock();
+	return 0;
+}
+
+//Returns a monotonic timestamp in seconds, or 0 when statistics are disabled
+double stats_clock(void)
+{
+	struct timespec now;
+
+	if (stats_output == stats_none)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+//Adds a sample to the histogram of a stage, the duration is the time passed since start (taken with stats_clock)
+void stats_record(enum stage measured, double start)
+{
+	if (stats_output == stats_none)
+		return;
+
+	double elapsed = stats_clock() - start;
+	double micros = elapsed * 1000000.0;
+	int bucket = 0;
+	while (bucket < NBUCKETS - 1 && micros >= (double)(1UL << bucket))
+		bucket++;
+
+	#pragma omp critical(stats)
+	{
+		histogram * h = &histograms[measured];
+		if (h->count == 0 || elapsed < h->min) h->min = elapsed;
+		if (h->count == 0 || elapsed > h->max) h->max = elapsed;
+		h->count++;
+		h->sum += elapsed;
+		h->buckets[bucket]++;
+	}
+}
+
+//Keeps track of the amount of data read from the input
+void stats_add_bytes(unsigned long bytes)
+{
+	if (stats_output == stats_none)
+		return;
+
+	#pragma omp atomic
+	stats_bytes += bytes;
+}
+
+static void emit_json(FILE * out, double elapsed)
+{
+	fprintf(out, "{\n  \"bytes\": %lu,\n  \"elapsed_seconds\": %.6f,\n  \"stages\": {", stats_bytes, elapsed);
+	for (int s = 0; s < nstages; s++)
+	{
+		histogram * h = &histograms[s];
+		fprintf(out, "%s\n    \"%s\": {\"count\": %lu, \"sum_seconds\": %.6f, \"min_seconds\": %.6f, \"max_seconds\": %.6f, \"buckets\": [",
+			s == 0 ? "" : ",", stage_names[s], h->count, h->sum, h->min, h->max);
+
+		//buckets are cumulative and only printed up to the one containing the slowest sample
+		unsigned long cumulative = 0;
+		for (int b = 0; b < NBUCKETS - 1 && cumulative < h->count; b++)
+		{
+			cumulative += h->buckets[b];
+			fprintf(out, "{\"le\": %.6f, \"count\": %lu}, ", (1UL << b) / 1000000.0, cumulative);
+		}
+		fprintf(out, "{\"le\": \"+Inf\", \"count\": %lu}]}", h->count);
+	}
+	fprintf(out, "\n  }\n}\n");
+}
+
+static void emit_prom(FILE * out, double elapsed)
+{
+	fprintf(out, "# HELP cfeistel_stage_seconds Time spent per chunk in each processing stage.\n");
+	fprintf(out, "# TYPE cfeistel_stage_seconds histogram\n");
+	for (int s = 0; s < nstages; s++)
+	{
+		histogram * h = &histograms[s];
+		unsigned long cumulative = 0;
+		for (int b = 0; b < NBUCKETS - 1; b++)
+		{
+			cumulative += h->buckets[b];
+			fprintf(out, "cfeistel_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n", stage_names[s], (1UL << b) / 1000000.0, cumulative);
+		}
+		fprintf(out, "cfeistel_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", stage_names[s], h->count);
+		fprintf(out, "cfeistel_stage_seconds_sum{stage=\"%s\"} %.6f\n", stage_names[s], h->sum);
+		fprintf(out, "cfeistel_stage_seconds_count{stage=\"%s\"} %lu\n", stage_names[s], h->count);
+	}
+	fprintf(out, "# HELP cfeistel_processed_bytes Bytes read from the input file.\n");
+	fprintf(out, "# TYPE cfeistel_processed_bytes gauge\n");
+	fprintf(out, "cfeistel_processed_bytes %lu\n", stats_bytes);
+	fprintf(out, "# HELP cfeistel_elapsed_seconds Wall clock duration of the run.\n");
+	fprintf(out, "# TYPE cfeistel_elapsed_seconds gauge\n");
+	fprintf(out, "cfeistel_elapsed_seconds %.6f\n", elapsed);
+}
+
+//Writes the collected statistics to the file given with --stats, or to stdout if no file was given
+void stats_emit(void)
+{
+	FILE * out = stdout;
+
+	if (stats_output == stats_none)
+		return;
+
+	double elapsed = stats_clock() - stats_start;
+
+	if (stats_file != NULL)
+	{
+		out = fopen(stats_file, "w");
+		if (out == NULL)
+		{
+			perror("Error in opening the stats file");
+			return;
+		}
+	}
+
+	if (stats_output == stats_json)
+		emit_json(out, elapsed);
+	else
+		emit_prom(out, elapsed);
+
+	if (out != stdout)
+		fclose(out);
+}
@@ -0,0 +1,11 @@
+//Per-stage timing statistics, enabled with --stats
+enum stage{stage_kdf, stage_read, stage_padding, stage_kernel, stage_xor, stage_write, stage_mac, stage_compress, nstages};
+enum stats_format{stats_none, stats_json, stats_prom};
+
+extern enum stats_format stats_output;
+
+int stats_configure(const char * spec);
+double stats_clock(void);
+void stats_record(enum stage measured, double start);
+void stats_add_bytes(unsigned long bytes);
+void stats_emit(void);
@@ -0,0 +1,276 @@
+//This module implements incremental encryption and decryption for programs that embed cfeistel instead of running it
+//on files. Data is processed as soon as whole blocks of it are available, straight from the caller's input buffer to
+//the caller's output buffer, instead of being collected in BUFSIZE chunks; only a partial block of input (and in
+//decryption the last two blocks, which could be padding) is kept between calls. The round keys are scheduled once.
+//The ciphertext is the same that cfeistel enc would write, so streams and files can be decrypted by either.
+//Authentication and integrity trailers and compression are not supported.
+//CTR and OFB streams can have their keystream generated ahead of time by the worker of a reservoir, see reservoir.c.
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "common.h"
+#include "utils.h"
+#include "block.h"
+#include "opmodes.h"
+#include "reservoir.h"
+#include "stream.h"
+
+//Starts the keystream reservoir of the stream, from where the stream is. Returns -1 if it can't be started.
+static int start_reservoir(stream_state * state)
+{
+	state->reservoir = malloc(sizeof(keystream_reservoir));
+	if (reservoir_start(state->reservoir, state->opmode, state->round_keys, state->header[1], &state->mode, state->reservoir_budget) == -1)
+	{
+		free(state->reservoir);
+		state->reservoir = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+//Schedules the round keys once the header is known, and resets the chaining state
+static void schedule_stream_keys(stream_state * state)
+{
+	schedule_key(state->round_keys, state->key, (unsigned char *)&state->header[0], header_iterations(state->header));
+	//round keys sequence has to be inverted for decryption, except for stream-like modes
+	if (state->op == dec && !is_stream_mode(state->opmode))
+		invert_round_keys(state->round_keys);
+	init_mode_state(&state->mode);
+
+	//a reservoir asked for before the header was read starts now, without one the kernels are used
+	if (state->reservoir_budget > 0 && state->reservoir == NULL)
+		start_reservoir(state);
+}
+
+//Encrypts or decrypts nblocks whole blocks of in, writing them to out
+static void process_blocks(stream_state * state, unsigned char * out, const unsigned char * in, const unsigned long nblocks)
+{
+	if (state->reservoir != NULL)
+		reservoir_xor(state->reservoir, out, in, nblocks * BLOCKSIZE);
+	else if (state->op == enc)
+		encrypt_scheduled(out, (block *)in, nblocks, nblocks * BLOCKSIZE, state->round_keys, state->header[1], state->opmode, &state->mode);
+	else
+		decrypt_scheduled(out, (block *)in, nblocks, nblocks * BLOCKSIZE, state->round_keys, state->header[1], state->opmode, &state->mode);
+}
+
+//Processes nblocks whole blocks, returns the size of the output. In decryption of the padded modes the last two blocks
+//decrypted so far are held back, and written before the output of the next call.
+static unsigned long emit_blocks(stream_state * state, unsigned char * out, const unsigned char * in, const unsigned long nblocks)
+{
+	unsigned long produced, keep;
+
+	if (state->op == enc || is_stream_mode(state->opmode))
+	{
+		process_blocks(state, out, in, nblocks);
+		return nblocks * BLOCKSIZE;
+	}
+
+	memcpy(out, state->held, state->nheld);
+	process_blocks(state, out + state->nheld, in, nblocks);
+	produced = state->nheld + nblocks * BLOCKSIZE;
+
+	keep = produced < 2 * BLOCKSIZE ? produced : 2 * BLOCKSIZE;
+	memcpy(state->held, out + produced - keep, keep);
+	state->nheld = keep;
+
+	return produced - keep;
+}
+
+//Processes the whole blocks of the payload that are available, keeping the partial block that's left for the next call
+static unsigned long feed_payload(stream_state * state, unsigned char * out, const unsigned char * in, unsigned long len)
+{
+	unsigned long written = 0;
+	unsigned long nblocks;
+
+	state->total += len;
+
+	//completing the partial block left by the previous call
+	if (state->npartial > 0)
+	{
+		unsigned long missing = BLOCKSIZE - state->npartial;
+		unsigned long n = len < missing ? len : missing;
+
+		memcpy(state->partial + state->npartial, in, n);
+		state->npartial += n;
+		in += n;
+		len -= n;
+		if (state->npartial < BLOCKSIZE)
+			return 0;
+
+		written += emit_blocks(state, out, state->partial, 1);
+		state->npartial = 0;
+	}
+
+	nblocks = len / BLOCKSIZE;
+	if (nblocks > 0)
+		written += emit_blocks(state, out + written, in, nblocks);
+
+	state->npartial = len % BLOCKSIZE;
+	memcpy(state->partial, in + nblocks * BLOCKSIZE, state->npartial);
+
+	return written;
+}
+
+//Starts a stream. In encryption the header is generated right away (see stream_header), in decryption it's read
+//from the first bytes given to stream_update. Returns -1 if op is not enc or dec, or if opmode is xts.
+int stream_init(stream_state * state, const enum operation op, const enum mode opmode, const char * key)
+{
+	memset(state, 0, sizeof(stream_state));
+	//sector volumes are accessed at random offsets through sector.h
+	if ((op != enc && op != dec) || opmode == xts)
+		return -1;
+
+	state->op = op;
+	state->opmode = opmode;
+	state->key = strdup(key);
+	//the caller has no use for the progress display of the kernels
+	progress_enabled = false;
+
+	if (op == enc)
+	{
+		create_nonce(&state->header[0]);
+		create_nonce(&state->header[1]);
+		create_key_check(&state->header[2], key, &state->header[0]);
+		state->header_received = STREAM_HEADER_SIZE;
+		schedule_stream_keys(state);
+	}
+
+	return 0;
+}
+
+//Returns the STREAM_HEADER_SIZE bytes of header that go before the ciphertext, in encryption
+const unsigned char * stream_header(const stream_state * state)
+{
+	return (const unsigned char *)state->header;
+}
+
+//Encrypts or decrypts len bytes of in, writing the output to out, which must have room for len + STREAM_SLACK bytes.
+//Returns the size of the output, or -1 if the header says that the key is wrong, or that the file can't be streamed
+//(compressed, with trailers, a sector volume, an archive or a sparse file).
+long stream_update(stream_state * state, unsigned char * out, const unsigned char * in, const unsigned long len)
+{
+	unsigned long written = 0;
+	unsigned long consumed = 0;
+
+	//Decryption starts with the header, the round keys depend on it
+	if (state->header_received < STREAM_HEADER_SIZE)
+	{
+		consumed = STREAM_HEADER_SIZE - state->header_received;
+		if (consumed > len)
+			consumed = len;
+		memcpy((unsigned char *)state->header + state->header_received, in, consumed);
+		state->header_received += consumed;
+		if (state->header_received < STREAM_HEADER_SIZE)
+			return 0;
+
+		if (has_key_check(&state->header[2]) && verify_key_check(state->header, state->key) == -1)
+			return -1;
+		if (has_key_check(&state->header[2]) && (state->header[2].right[HEADER_FLAGS] & (FLAG_COMPRESSED | FLAG_SECTOR | FLAG_ARCHIVE | FLAG_SPARSE | FLAG_AUTH | FLAG_MERKLE)))
+			return -1;
+		schedule_stream_keys(state);
+
+		//files written before the key check block was introduced only have salt and IV in the header
+		if (!has_key_check(&state->header[2]))
+			written += feed_payload(state, out, (unsigned char *)&state->header[2], BLOCKSIZE);
+	}
+
+	return written + feed_payload(state, out + written, in + consumed, len - consumed);
+}
+
+//Ends the stream, writing what's left to out (which must have room for STREAM_SLACK bytes): the partial last block,
+//and in encryption of the padded modes the padding and accounting block. Returns the size of the output,
+//or -1 if the ciphertext ended before a valid last chunk.
+long stream_final(stream_state * state, unsigned char * out)
+{
+	block tail[2];
+	unsigned long nblocks;
+
+	if (state->header_received < STREAM_HEADER_SIZE)
+		return -1;
+
+	//the last block of the stream-like modes can be partial
+	if (is_stream_mode(state->opmode))
+	{
+		if (state->reservoir != NULL)
+			reservoir_xor(state->reservoir, out, state->partial, state->npartial);
+		else if (state->op == enc)
+			encrypt_scheduled(out, (block *)state->partial, 1, state->npartial, state->round_keys, state->header[1], state->opmode, &state->mode);
+		else
+			decrypt_scheduled(out, (block *)state->partial, 1, state->npartial, state->round_keys, state->header[1], state->opmode, &state->mode);
+		return state->npartial;
+	}
+
+	if (state->op == enc)
+	{
+		//the size written in the accounting block is the one of the last BUFSIZE chunk of the file,
+		//and a last chunk that fills BUFSIZE exactly gets no padding, like in encrypt_blocks
+		unsigned long chunk_size = state->total % BUFSIZE;
+		if (chunk_size == 0 && state->total > 0)
+			return 0;
+
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, state->partial, state->npartial);
+		pad_last_chunk(tail, chunk_size);
+		nblocks = state->npartial > 0 ? 2 : 1;
+		process_blocks(state, out, (unsigned char *)tail, nblocks);
+		return nblocks * BLOCKSIZE;
+	}
+
+	//In decryption the held back blocks end with the accounting block, which says how much of the block before it is data
+	char accounting[BLOCKSIZE + 1];
+	unsigned long size, data_len;
+
+	if (state->npartial > 0 || state->nheld == 0)
+		return -1;
+
+	memcpy(accounting, state->held + state->nheld - BLOCKSIZE, BLOCKSIZE);
+	accounting[BLOCKSIZE] = '\0';
+	if (sscanf(accounting, "%lu", &size) < 1) //no accounting block, the last chunk was a full one
+	{
+		memcpy(out, state->held, state->nheld);
+		return state->nheld;
+	}
+
+	data_len = state->nheld - BLOCKSIZE;
+	if (size % BLOCKSIZE > 0)
+	{
+		if (data_len < BLOCKSIZE)
+			return -1;
+		data_len = data_len - BLOCKSIZE + size % BLOCKSIZE;
+	}
+	memcpy(out, state->held, data_len);
+
+	return data_len;
+}
+
+//Has the keystream of a CTR or OFB stream generated ahead of time by a worker thread, keeping up to budget bytes of it
+//ready, so that stream_update only XORs the data with it. In decryption the worker starts once the header is read.
+//Returns -1 if the mode is not CTR or OFB, or if the worker can't be started.
+int stream_reserve(stream_state * state, const unsigned long budget)
+{
+	if ((state->opmode != ctr && state->opmode != ofb) || budget == 0 || state->reservoir != NULL)
+		return -1;
+
+	state->reservoir_budget = budget;
+	if (state->header_received < STREAM_HEADER_SIZE)
+		return 0;
+	return start_reservoir(state);
+}
+
+//Frees the stream, clearing the key and the round keys
+void stream_release(stream_state * state)
+{
+	if (state->reservoir != NULL)
+	{
+		reservoir_stop(state->reservoir);
+		free(state->reservoir);
+	}
+	if (state->key != NULL)
+	{
+		memset(state->key, 0, strlen(state->key));
+		free(state->key);
+	}
+	memset(state, 0, sizeof(stream_state));
+}
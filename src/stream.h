@@ -0,0 +1,35 @@
+//Incremental encryption and decryption of a byte stream, for programs that embed cfeistel (see cfeistel.hpp)
+//The output is the same as the one of cfeistel enc/dec on a file: header, ciphertext, and the padding and accounting
+//block of the last chunk for the modes that need them. Input and output buffers must not overlap.
+#define STREAM_HEADER_SIZE (HEADER_BLOCKS * BLOCKSIZE)
+//room that stream_update and stream_final need in their output beyond the size of their input
+#define STREAM_SLACK (3 * BLOCKSIZE)
+
+typedef struct stream_state {
+	enum operation op;
+	enum mode opmode;
+	char * key;
+	block header[HEADER_BLOCKS];
+	//bytes of the header received so far, in decryption
+	unsigned long header_received;
+	unsigned char round_keys[NROUND][KEYSIZE];
+	mode_state mode;
+	//bytes of payload received so far
+	unsigned long total;
+	//partial block of input waiting for the rest of it
+	unsigned char partial[BLOCKSIZE];
+	unsigned long npartial;
+	//last decrypted blocks of the padded modes, held back until we know if they're the padding of the last chunk
+	unsigned char held[2 * BLOCKSIZE];
+	unsigned long nheld;
+	//keystream generated ahead of time in CTR and OFB, see stream_reserve
+	struct keystream_reservoir * reservoir;
+	unsigned long reservoir_budget;
+}stream_state;
+
+int stream_init(stream_state * state, const enum operation op, const enum mode opmode, const char * key);
+const unsigned char * stream_header(const stream_state * state);
+long stream_update(stream_state * state, unsigned char * out, const unsigned char * in, const unsigned long len);
+int stream_reserve(stream_state * state, const unsigned long budget);
+long stream_final(stream_state * state, unsigned char * out);
+void stream_release(stream_state * state);
@@ -0,0 +1,60 @@
+//This module decides how the blocks of a chunk are handed out to the threads of the parallel kernels.
+//Every thread gets one contiguous run of blocks (inside the slice of its NUMA node) whose boundaries fall on
+//cache line boundaries, so no two threads ever write to the same cache line. The run is then walked in tiles
+//sized to fit the input and output of the tile in half of the L2 cache, which keeps the hardware prefetchers
+//on a linear stream and gives the kernels a natural point to update shared progress counters.
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "unistd.h"
+#include "common.h"
+#include "numa.h"
+#include "tiling.h"
+
+#define DEFAULT_LINESIZE 64
+#define DEFAULT_L2SIZE 262144
+
+//blocks in a cache line and in a tile, the defaults are overwritten by tiling_setup with the real cache sizes
+unsigned long line_blocks = DEFAULT_LINESIZE / BLOCKSIZE;
+unsigned long tile_blocks = (DEFAULT_L2SIZE / 2) / (2 * BLOCKSIZE);
+
+//Reads the cache geometry of the machine and sizes cache lines and tiles in blocks
+void tiling_setup(void)
+{
+	long linesize = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+	long l2size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+	if (linesize <= 0)
+		linesize = DEFAULT_LINESIZE;
+	if (l2size <= 0)
+		l2size = DEFAULT_L2SIZE;
+
+	line_blocks = linesize > BLOCKSIZE ? linesize / BLOCKSIZE : 1;
+
+	//a tile reads and writes one block per block index, and both streams should fit in half of the L2
+	tile_blocks = (l2size / 2) / (2 * BLOCKSIZE);
+	tile_blocks -= tile_blocks % line_blocks;
+	if (tile_blocks < line_blocks)
+		tile_blocks = line_blocks;
+}
+
+//Must be called from inside a parallel region: computes the run of blocks [begin, end) assigned to the calling thread.
+//The split is done on whole cache lines, so only the last thread can end on a partial line.
+void tile_thread_range(const unsigned long total, unsigned long * begin, unsigned long * end)
+{
+	unsigned long lines = (total + line_blocks - 1) / line_blocks;
+
+	numa_thread_range(lines, begin, end);
+	*begin *= line_blocks;
+	*end *= line_blocks;
+
+	if (*begin > total) *begin = total;
+	if (*end > total) *end = total;
+}
+
+//Returns the end of the tile starting at tile, without going past the end of the thread's run
+unsigned long tile_end(const unsigned long tile, const unsigned long end)
+{
+	return (tile + tile_blocks < end) ? tile + tile_blocks : end;
+}
@@ -0,0 +1,7 @@
+//Cache-aware tiling of the block ranges processed by the parallel kernels
+extern unsigned long tile_blocks;
+extern unsigned long line_blocks;
+
+void tiling_setup(void);
+void tile_thread_range(const unsigned long total, unsigned long * begin, unsigned long * end);
+unsigned long tile_end(const unsigned long tile, const unsigned long end);
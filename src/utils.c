@@ -16,6 +16,15 @@
 #define CRC_POLYNOMIAL 0xEDB88320UL
 #define CRC_INITIAL_VALUE 0xFFFFFFFFUL
 
+//These variables are used in opmodes.c exclusively for logging purposes
+//I decided to use them externally instead of passing them to avoid making inner functions' semantics
+//even heavier than they already are
+unsigned long total_file_size=0;
+struct timeval start_time;
+//Batch mode turns the progress display off, since it processes many files at the same time,
+//and so do programs that embed cfeistel through stream.h
+bool progress_enabled = true;
+
 //Does bitwise xor between two block halves
 int half_block_xor(unsigned char * result, const unsigned char * first, const unsigned char * second)
 {
@@ -149,6 +158,10 @@ void show_progress_data(const struct timeval current_time, const struct timeval
     	return;
 	#endif
 
+	//batch mode processes many files at the same time, so there's no single progress to show
+	if (!progress_enabled)
+		return;
+
 	unsigned long bnum = total_file_size / BLOCKSIZE;
 	int percentage = (100 * current_block)/bnum;
 
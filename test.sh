@@ -11,6 +11,7 @@ dec_key="secretkey"
 cflags=""
 create_text_file=false
 test_suite=false
+feature_tests=false
 suite_sizes=(16 1024 1234 52341 954321 8463014 104857592 104857600 104857608 154857600 209715196 209715200 209715205 259715200 314572793)
 
 # Converts megabytes to bytes
@@ -62,6 +63,238 @@ launch_test_suite() {
     echo "Tests completed. Succeeded: $tests_succeeded, Failed: $tests_failed"
 }
 
+# Flips the lowest bit of the byte at the given offset of a file
+flip_byte() {
+    local file="$1"
+    local offset="$2"
+    local byte
+    byte=$(od -An -tu1 -j "$offset" -N1 "$file" | tr -d ' ')
+    printf "$(printf '\\%03o' "$((byte ^ 1))")" | dd of="$file" bs=1 seek="$offset" conv=notrunc 2>/dev/null
+}
+
+# Kills the command started in the background with the given pid once the given file exists, after an optional delay
+kill_when_exists() {
+    local pid="$1"
+    local file="$2"
+    local delay="${3:-0}"
+    while kill -0 "$pid" 2>/dev/null && [ ! -f "$file" ]; do
+        sleep 0.1
+    done
+    sleep "$delay"
+    kill -9 "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+}
+
+# Every feature test works in $work_dir on the random file "in", and succeeds if its last command does
+test_perf_counters() {
+    # the counters can be unavailable (containers, no permission), the report says so and the run goes on
+    $cfeistel enc --perf-counters -k "$enc_key" -i in -o out > report 2>&1 && grep -q "Performance counters" report &&
+    $cfeistel dec -k "$enc_key" -i out -o dec && cmp -s in dec
+}
+
+test_stats() {
+    $cfeistel enc --stats=json -k "$enc_key" -i in -o out > stats.json && grep -q '"stages"' stats.json &&
+    $cfeistel dec --stats=prom:stats.prom -k "$enc_key" -i out -o dec && grep -q "^cfeistel_stage_seconds_count" stats.prom &&
+    cmp -s in dec
+}
+
+test_auth() {
+    $cfeistel enc --auth -k "$enc_key" -i in -o out && $cfeistel dec --auth -k "$enc_key" -i out -o dec && cmp -s in dec &&
+    # decrypting without --auth is refused, and so are a changed ciphertext and a changed IV in the header
+    ! $cfeistel dec -k "$enc_key" -i out -o dec2 &&
+    cp out tampered && flip_byte tampered 1000 && ! $cfeistel dec --auth -k "$enc_key" -i tampered -o dec2 &&
+    cp out tampered && flip_byte tampered 20 && ! $cfeistel dec --auth -k "$enc_key" -i tampered -o dec2
+}
+
+test_merkle() {
+    $cfeistel enc --merkle -k "$enc_key" -i in -o out && $cfeistel verify -i out && $cfeistel dec --merkle -k "$enc_key" -i out -o dec &&
+    cmp -s in dec && ! $cfeistel dec -k "$enc_key" -i out -o dec2 &&
+    # a changed ciphertext or trailer fails the check
+    cp out tampered && flip_byte tampered 1000 && ! $cfeistel verify -i tampered &&
+    ! $cfeistel dec --merkle -k "$enc_key" -i tampered -o dec2 &&
+    cp out tampered && flip_byte tampered "$(($(stat -c %s out) - 1))" && ! $cfeistel verify -i tampered
+}
+
+test_wrong_key() {
+    $cfeistel enc -k "$enc_key" -i in -o out &&
+    ! $cfeistel dec -k "wrong$enc_key" -i out -o dec && [ ! -f dec ]
+}
+
+test_batch() {
+    mkdir -p plain encrypted decrypted && cp in plain/first && head -c 1234 /dev/urandom > plain/second &&
+    $cfeistel enc --batch plain --outdir encrypted -k "$enc_key" &&
+    $cfeistel dec --batch encrypted --outdir decrypted -k "$enc_key" &&
+    cmp -s plain/first decrypted/first && cmp -s plain/second decrypted/second &&
+    ! $cfeistel dec --batch encrypted --outdir decrypted -k "wrong$enc_key" &&
+    # an output directory that doesn't exist fails every file, and the batch goes on to report all of them
+    ! $cfeistel enc --batch plain --outdir missing -k "$enc_key" > report 2>&1 &&
+    grep -q "plain/first" report && grep -q "plain/second" report
+}
+
+test_daemon() {
+    local pid
+    local status
+    $cfeistel daemon --socket="$PWD/daemon.sock" &
+    pid="$!"
+    while kill -0 "$pid" 2>/dev/null && [ ! -S daemon.sock ]; do
+        sleep 0.1
+    done
+    # a round trip through the client, then malformed requests, after which the daemon must still serve the client
+    $client enc -k "$enc_key" -i in -o out --socket="$PWD/daemon.sock" && $cfeistel dec -k "$enc_key" -i out -o dec && cmp -s in dec &&
+    "$tests_dir/daemon_test" "$PWD/daemon.sock" in out2 && $cfeistel dec -k daemonkey -i out2 -o dec2 && cmp -s in dec2 &&
+    $client dec -k "$enc_key" -i out -o dec3 --socket="$PWD/daemon.sock" && cmp -s in dec3
+    status="$?"
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+    return "$status"
+}
+
+test_compress() {
+    yes "$enc_key" | head -c 3000000 > text && $cfeistel enc --compress -k "$enc_key" -i text -o out &&
+    [ "$(stat -c %s out)" -lt 1000000 ] && $cfeistel dec -k "$enc_key" -i out -o dec && cmp -s text dec &&
+    $cfeistel enc --compress -k "$enc_key" -i in -o out && $cfeistel dec -k "$enc_key" -i out -o dec && cmp -s in dec
+}
+
+test_checkpoint() {
+    # two chunks, the run is killed once the first one is committed and continued with --resume
+    head -c 125829120 /dev/urandom > big
+    $cfeistel enc --checkpoint -k "$enc_key" -i big -o out &
+    kill_when_exists "$!" out.ckpt
+    [ -f out.ckpt ] && $cfeistel enc --checkpoint --resume -k "$enc_key" -i big -o out && [ ! -f out.ckpt ] &&
+    $cfeistel dec -k "$enc_key" -i out -o dec && cmp -s big dec
+}
+
+test_shards() {
+    $cfeistel enc --shards=2 -k "$enc_key" -i in -o out && $cfeistel dec -k "$enc_key" -i out -o dec && cmp -s in dec &&
+    $cfeistel dec --shards=2 -k "$enc_key" -i out -o dec2 && cmp -s in dec2 &&
+    ! $cfeistel enc --shards=2 --auth -k "$enc_key" -i in -o out2
+}
+
+test_stream() {
+    local mode
+    "$tests_dir/stream_test" in "$enc_key" || return 1
+    # what cipherbuf wrote must be a file that cfeistel decrypts
+    for mode in cbc ecb ctr ofb pcbc cfb; do
+        $cfeistel dec -m "$mode" -k "$enc_key" -i "out.$mode" -o "dec.$mode" && cmp -s in "dec.$mode" || return 1
+    done
+}
+
+test_async() {
+    "$tests_dir/async_test" in "$enc_key" && $cfeistel dec -m pcbc -k "$enc_key" -i out.fd -o dec && cmp -s in dec
+}
+
+test_rekey() {
+    $cfeistel enc -m cbc -k "$enc_key" -i in -o out &&
+    $cfeistel rekey -m cbc -k "$enc_key" --new-key="new$enc_key" --new-mode=ctr -i out -o rekeyed &&
+    $cfeistel dec -m ctr -k "new$enc_key" -i rekeyed -o dec && cmp -s in dec &&
+    ! $cfeistel dec -m ctr -k "$enc_key" -i rekeyed -o dec2
+}
+
+test_xts() {
+    $cfeistel enc -m xts -k "$enc_key" -i in -o volume && $cfeistel dec -m xts -k "$enc_key" -i volume -o dec && cmp -s in dec &&
+    # a write across sectors, then reads of the written range and of the whole volume
+    head -c 10000 /dev/urandom > patch && $cfeistel write -k "$enc_key" -i patch -o volume --at=5000 &&
+    $cfeistel read -k "$enc_key" -i volume -o range --at=5000:10000 && cmp -s patch range &&
+    cp in expected && dd if=patch of=expected bs=5000 seek=1 conv=notrunc 2>/dev/null &&
+    $cfeistel read -k "$enc_key" -i volume -o whole --at=0 && cmp -s expected whole &&
+    ! $cfeistel read -k "wrong$enc_key" -i volume -o range2 --at=0:100
+}
+
+test_archive() {
+    mkdir -p members extracted && head -c 1234 /dev/urandom > members/first && cp in members/second &&
+    $cfeistel pack -k "$enc_key" -o archive members/first members/second &&
+    $cfeistel unpack -k "$enc_key" -i archive --outdir extracted &&
+    cmp -s members/first extracted/first && cmp -s members/second extracted/second &&
+    ! $cfeistel unpack -k "wrong$enc_key" -i archive --outdir extracted
+}
+
+test_records() {
+    "$tests_dir/record_test"
+}
+
+test_reservoir() {
+    "$tests_dir/reservoir_test"
+}
+
+test_fanout() {
+    $cfeistel enc -i in -k "$enc_key" -o out1 -k "other$enc_key" -o out2 &&
+    $cfeistel dec -k "$enc_key" -i out1 -o dec1 && cmp -s in dec1 &&
+    $cfeistel dec -k "other$enc_key" -i out2 -o dec2 && cmp -s in dec2 &&
+    ! $cfeistel dec -k "$enc_key" -i out2 -o dec3
+}
+
+test_dec_verify() {
+    $cfeistel enc -k "$enc_key" -i in -o out && $cfeistel dec --verify -k "$enc_key" -i out -o dec > verify_output &&
+    grep -q "$(sha256sum in | awk '{print $1}')" verify_output && [ ! -f dec ] &&
+    ! $cfeistel dec --verify -k "wrong$enc_key" -i out
+}
+
+test_sparse() {
+    # 8MB with two extents of data, the rest is holes
+    truncate -s 8388608 holes && dd if=/dev/urandom of=holes bs=65536 count=1 conv=notrunc 2>/dev/null &&
+    dd if=/dev/urandom of=holes bs=65536 count=1 seek=64 conv=notrunc 2>/dev/null &&
+    $cfeistel enc --sparse -k "$enc_key" -i holes -o out && $cfeistel dec --sparse -k "$enc_key" -i out -o dec &&
+    cmp -s holes dec && [ "$(stat -c %b dec)" -le "$(stat -c %b holes)" ]
+}
+
+test_inplace() {
+    cp in target && $cfeistel enc --in-place -k "$enc_key" -i target && cat target.hdr target > out &&
+    $cfeistel dec -k "$enc_key" -i out -o dec && cmp -s in dec &&
+    $cfeistel dec --in-place -k "$enc_key" -i target && cmp -s in target && [ ! -f target.hdr ] && [ ! -f target.journal ] &&
+    ! $cfeistel enc --in-place -m cbc -k "$enc_key" -i target
+}
+
+test_inplace_journal() {
+    # the run is killed once the journal exists, then it's refused without --resume and continued with it
+    head -c 16777216 /dev/urandom > big && cp big target
+    $cfeistel enc --in-place -k "$enc_key" -i target &
+    kill_when_exists "$!" target.journal 2
+    [ -f target.journal ] && ! $cfeistel enc --in-place -k "$enc_key" -i target &&
+    $cfeistel enc --in-place --resume -k "$enc_key" -i target && [ ! -f target.journal ] &&
+    $cfeistel dec --in-place -k "$enc_key" -i target && cmp -s big target
+}
+
+# Runs the round-trip and negative tests of the features, each one in an empty directory with a random input file
+launch_feature_tests() {
+    local tests=(test_perf_counters test_stats test_auth test_merkle test_wrong_key test_batch test_daemon test_compress
+        test_checkpoint test_shards test_stream test_async test_rekey test_xts test_archive test_records
+        test_reservoir test_fanout test_dec_verify test_sparse test_inplace test_inplace_journal)
+    local make_output_file
+    tests_succeeded=0
+    tests_failed=0
+
+    # a floor that every test can work with, tampering changes bytes up to 1000 bytes into the files
+    if [ "$file_size" -lt 65536 ]; then
+        file_size=65536
+    fi
+
+    make_output_file=$(mktemp)
+    # the objects are removed once cfeistel is linked, so the library of the tests is built by a second make
+    { make CFLAGS="-DQUIET" && make CFLAGS="-DQUIET" tests; } > "$make_output_file" 2>&1
+    check_make_output "$make_output_file"
+    cfeistel="$(pwd)/cfeistel"
+    client="$(pwd)/cfeistel-client"
+    tests_dir="$(pwd)/tests"
+
+    for test_name in "${tests[@]}"; do
+        work_dir=$(mktemp -d)
+        dd if=/dev/urandom of="$work_dir/in" bs="$file_size" count=1 2>/dev/null
+
+        if (cd "$work_dir" && "$test_name" >/dev/null 2>&1); then
+            echo "${test_name#test_} succeeded."
+            ((tests_succeeded++))
+        else
+            echo -e "\e[31m${test_name#test_} failed.\e[0m"
+            ((tests_failed++))
+        fi
+        rm -rf "$work_dir"
+    done
+
+    echo "Tests completed. Succeeded: $tests_succeeded, Failed: $tests_failed"
+    rm "cfeistel"
+    [ "$tests_failed" -eq 0 ]
+}
+
 # Generates a file containing random text of a specified length
 generate_random_text() {
     # Base case: if the desired length is 0 or negative, return an empty string
@@ -138,6 +371,7 @@ function display_usage() {
     echo "  -dp, --debug-parallel   Enable parallel debug mode (size limit: 1MB)"
     echo "  -r, --repeat            Enable repeated block mode"
     echo "  -s, --suite             Enable test suite mode"
+    echo "  -f, --features          Run the round-trip and negative tests of the features, on files of <file_size>"
     echo "  <file_size>             File size in bytes (numeric argument)"
 }
 
@@ -188,6 +422,10 @@ while [ "$#" -gt 0 ]; do
             test_suite=true
             shift
             ;;
+        -f|--features)
+            feature_tests=true
+            shift
+            ;;
         -m|--mode)
             shift
             encryption_mode="$1"
@@ -296,6 +534,12 @@ if [ "$unit_flag" == "MB" ]; then
     file_size=$(convert_to_bytes "$file_size")
 fi
 
+# Launches the tests of the features on files of the chosen size, every other parameter but the key is ignored
+if [ "$feature_tests" = true ]; then
+    launch_feature_tests
+    exit "$?"
+fi
+
 # Creates a file, choosing whether it should be random or repeated, text or arbitrary data
 if [ "$create_text_file" = true ]; then
     if [ "$repeated_mode" = true ]; then
@@ -0,0 +1,148 @@
+//Tests of cfeistel_async.hpp: round trips of concurrent operations in every mode of operation on a shared executor,
+//cancellation before and during an operation, refusal of a wrong key, and transform_fd on a regular file and on a
+//non-blocking pipe that isn't ready yet. The file encrypted by transform_fd is kept in out.fd (pcbc), for the caller
+//to check that cfeistel dec decrypts it.
+//Usage: async_test <infile> <key>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fcntl.h"
+#include "cfeistel_async.hpp"
+
+using namespace cfeistel;
+
+//Encrypts and decrypts in with slices of different sizes, returns true if the plaintext comes back
+static task<bool> round_trip(executor & ex, enum mode opmode, std::string key, const std::vector<unsigned char> & in)
+{
+	std::vector<unsigned char> ciphertext(in.size() + cipher::header_size + cipher::slack);
+	std::vector<unsigned char> plaintext(ciphertext.size() + cipher::header_size + cipher::slack);
+
+	std::size_t encrypted = co_await encrypt(ex, opmode, key, in, ciphertext, {}, 4096);
+	std::size_t decrypted = co_await decrypt(ex, opmode, key, std::span<const unsigned char>(ciphertext.data(), encrypted),
+		plaintext, {}, 1000);
+	co_return decrypted == in.size() && std::equal(in.begin(), in.end(), plaintext.begin());
+}
+
+int main(int argc, char * argv[])
+{
+	if (argc != 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " <infile> <key>\n";
+		return 1;
+	}
+
+	std::ifstream input(argv[1], std::ios::binary);
+	const std::vector<unsigned char> plaintext((std::istreambuf_iterator<char>(input)), {});
+	const std::string key = argv[2];
+	executor ex(4);
+	bool ok = true;
+
+	//one operation per mode at the same time, from as many threads
+	std::vector<std::thread> callers;
+	std::atomic<int> passed{0};
+	for (int m = cbc; m <= cfb; m++)
+		callers.emplace_back([&, m] { passed += sync_wait(round_trip(ex, (enum mode)m, key, plaintext)); });
+	for (auto & caller : callers)
+		caller.join();
+	if (passed != cfb + 1)
+	{
+		std::cerr << "concurrent round trips: " << passed << " of " << cfb + 1 << " passed\n";
+		ok = false;
+	}
+
+	std::vector<unsigned char> ciphertext(plaintext.size() + cipher::header_size + cipher::slack);
+	std::vector<unsigned char> decrypted(ciphertext.size() + cipher::header_size + cipher::slack);
+
+	//a stop requested before the operation starts cancels it
+	std::stop_source stop;
+	stop.request_stop();
+	try
+	{
+		sync_wait(encrypt(ex, ctr, key, plaintext, ciphertext, stop.get_token(), 4096));
+		std::cerr << "a stopped operation wasn't cancelled\n";
+		ok = false;
+	}
+	catch (cancelled &) {}
+
+	//and a stop requested while it runs cancels it at the next slice, long before it would have finished
+	std::vector<unsigned char> large(1 << 24);
+	std::vector<unsigned char> large_out(large.size() + cipher::header_size + cipher::slack);
+	std::stop_source late_stop;
+	std::thread stopper([&] { std::this_thread::sleep_for(std::chrono::milliseconds(100)); late_stop.request_stop(); });
+	try
+	{
+		sync_wait(encrypt(ex, cbc, key, large, large_out, late_stop.get_token(), 4096));
+		std::cerr << "an operation stopped while running wasn't cancelled\n";
+		ok = false;
+	}
+	catch (cancelled &) {}
+	stopper.join();
+
+	try
+	{
+		std::size_t encrypted = sync_wait(encrypt(ex, cbc, key, plaintext, ciphertext));
+		sync_wait(decrypt(ex, cbc, "wrong" + key, std::span<const unsigned char>(ciphertext.data(), encrypted), decrypted));
+		std::cerr << "a wrong key was accepted\n";
+		ok = false;
+	}
+	catch (std::runtime_error &) {}
+
+	//regular files, which block the executor thread
+	int in_fd = open(argv[1], O_RDONLY);
+	int out_fd = open("out.fd", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (in_fd == -1 || out_fd == -1 || sync_wait(transform_fd(ex, enc, pcbc, key, in_fd, out_fd, {}, 3000)) == 0)
+	{
+		std::cerr << "transform_fd on a file failed\n";
+		ok = false;
+	}
+	close(in_fd);
+	close(out_fd);
+
+	//a pipe that stays empty for a while: on a single thread, the operation waiting for it must not hold up the others
+	{
+		executor single(1);
+		int pipe_fds[2];
+		int sink = open("/dev/null", O_WRONLY);
+		unsigned long piped = 0;
+
+		//only the end read by the executor is non-blocking
+		if (pipe(pipe_fds) == -1 || fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK) == -1 || sink == -1)
+			return 1;
+		std::thread waiting([&] { piped = sync_wait(transform_fd(single, enc, ctr, key, pipe_fds[0], sink, {}, 4096)); });
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+		auto start = std::chrono::steady_clock::now();
+		if (!sync_wait(round_trip(single, ctr, key, std::vector<unsigned char>(10000, 7)))
+			|| std::chrono::steady_clock::now() - start > std::chrono::seconds(5))
+		{
+			std::cerr << "an operation was held up by one waiting for a pipe\n";
+			ok = false;
+		}
+
+		for (std::size_t done = 0; done < plaintext.size(); )
+		{
+			long n = write(pipe_fds[1], plaintext.data() + done, std::min<std::size_t>(7000, plaintext.size() - done));
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		close(pipe_fds[1]);
+		waiting.join();
+		close(pipe_fds[0]);
+		close(sink);
+		if (piped < plaintext.size() + cipher::header_size)
+		{
+			std::cerr << "transform_fd on a pipe wrote " << piped << " bytes\n";
+			ok = false;
+		}
+	}
+
+	std::cout << (ok ? "Async tests passed.\n" : "Async tests failed.\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+//Sends malformed requests to a running daemon (cfeistel daemon) and checks that every one of them is refused, that the
+//descriptors attached to them are closed, and that the daemon still serves a valid request afterwards.
+//Usage: daemon_test <socket> <infile> <outfile>
+
+#define _GNU_SOURCE
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "signal.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+#include "common.h"
+#include "daemon.h"
+
+#define TEST_KEY "daemonkey"
+
+static const char * socket_path;
+
+static int connect_daemon(void)
+{
+	struct sockaddr_un address;
+	int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	if (conn == -1 || connect(conn, (struct sockaddr *)&address, sizeof(address)) == -1)
+		return -1;
+	return conn;
+}
+
+//Sends request with the nfds descriptors of fds attached (none if nfds is 0) followed by the key, and returns the
+//status of the response, or -2 if there's no response
+static int send_request(const daemon_request * request, const int * fds, const int nfds)
+{
+	union {
+		char buffer[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {(void *)request, sizeof(daemon_request)};
+	struct msghdr message;
+	struct cmsghdr * cmsg;
+	daemon_response response;
+	int conn = connect_daemon();
+
+	if (conn == -1)
+		return -2;
+
+	memset(&control, 0, sizeof(control));
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	if (nfds > 0)
+	{
+		message.msg_control = control.buffer;
+		message.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	if (sendmsg(conn, &message, 0) != sizeof(daemon_request))
+		response.status = -2;
+	else
+	{
+		//the daemon may refuse the request before reading the key, in which case sending it fails
+		write(conn, TEST_KEY, strlen(TEST_KEY));
+		if (read(conn, &response, sizeof(response)) != sizeof(response))
+			response.status = -2;
+	}
+
+	close(conn);
+	return response.status;
+}
+
+//Sends request with the write ends of nfds pipes attached, and checks that it's refused and that the daemon closed its
+//copies of them: once ours are closed too, the read ends must be at end of file. Returns false if the check fails.
+static bool refused(const char * name, const daemon_request * request, const int nfds)
+{
+	int pipes[3][2];
+	int fds[3];
+	bool ok = true;
+	char byte;
+
+	for (int i = 0; i < nfds; i++)
+	{
+		if (pipe2(pipes[i], O_NONBLOCK) == -1)
+			return false;
+		fds[i] = pipes[i][1];
+	}
+
+	int status = send_request(request, fds, nfds);
+	if (status != -1)
+	{
+		fprintf(stderr, "%s: the daemon answered %d instead of refusing the request\n", name, status);
+		ok = false;
+	}
+
+	for (int i = 0; i < nfds; i++)
+	{
+		close(pipes[i][1]);
+		if (read(pipes[i][0], &byte, 1) != 0)
+		{
+			fprintf(stderr, "%s: the daemon kept descriptor %d open\n", name, i);
+			ok = false;
+		}
+		close(pipes[i][0]);
+	}
+
+	return ok;
+}
+
+int main(int argc, char * argv[])
+{
+	daemon_request valid = {DAEMON_MAGIC, enc, ctr, strlen(TEST_KEY)};
+	daemon_request request;
+	bool ok = true;
+
+	if (argc != 4)
+	{
+		fprintf(stderr, "Usage: %s <socket> <infile> <outfile>\n", argv[0]);
+		return 1;
+	}
+	socket_path = argv[1];
+	signal(SIGPIPE, SIG_IGN);
+
+	request = valid;
+	request.magic ^= 1;
+	ok = refused("wrong magic", &request, 2) && ok;
+
+	request = valid;
+	request.mode = cfb + 1;
+	ok = refused("unknown mode", &request, 2) && ok;
+
+	ok = refused("no descriptors", &valid, 0) && ok;
+	ok = refused("one descriptor", &valid, 1) && ok;
+	ok = refused("three descriptors", &valid, 3) && ok;
+
+	//the daemon must still be there, and serve a valid request
+	int fds[2] = {open(argv[2], O_RDONLY), open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+	if (fds[0] == -1 || fds[1] == -1 || send_request(&valid, fds, 2) != 0)
+	{
+		fprintf(stderr, "the daemon didn't serve a valid request after the malformed ones\n");
+		ok = false;
+	}
+
+	printf(ok ? "Daemon tests passed.\n" : "Daemon tests failed.\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+//Tests of record.h: round trips of batches of records of mixed lengths (empty ones and lengths that aren't multiples of
+//BLOCKSIZE included) on the sequential and the parallel path, the same output for a batch and for its records one at a
+//time, no write past the end of a record, and different ciphertexts for the same plaintext under different nonces.
+//Usage: record_test
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "common.h"
+#include "record.h"
+
+#define SLOT_SIZE 600
+#define GUARD 0x5a
+
+static const unsigned long lengths[] = {0, 1, 15, 16, 17, 31, 32, 33, 100, 255, 512, 0, 7};
+
+//Fills count records with the plaintext, each in a slot of SLOT_SIZE bytes of buffer followed by guard bytes
+static void make_records(record * records, unsigned char * buffer, const unsigned char * plaintext, const unsigned long count)
+{
+	memset(buffer, GUARD, count * SLOT_SIZE);
+	for (unsigned long i = 0; i < count; i++)
+	{
+		records[i].data = buffer + i * SLOT_SIZE;
+		records[i].len = lengths[i % (sizeof(lengths) / sizeof(lengths[0]))];
+		memcpy(records[i].data, plaintext + i * SLOT_SIZE, records[i].len);
+		memset(records[i].nonce, 0, sizeof(records[i].nonce));
+		memcpy(records[i].nonce, &i, sizeof(i));
+	}
+}
+
+//Checks a batch of count records: encrypted, decrypted, and compared with the same records encrypted one at a time
+static bool check_batch(const record_key * ctx, const unsigned char * plaintext, const unsigned long count)
+{
+	record * batch = malloc(count * sizeof(record));
+	record * single = malloc(count * sizeof(record));
+	unsigned char * batch_buffer = malloc(count * SLOT_SIZE);
+	unsigned char * single_buffer = malloc(count * SLOT_SIZE);
+	bool ok = true;
+
+	make_records(batch, batch_buffer, plaintext, count);
+	make_records(single, single_buffer, plaintext, count);
+
+	record_crypt(ctx, batch, count);
+	for (unsigned long i = 0; i < count; i++)
+		record_crypt(ctx, &single[i], 1);
+	if (memcmp(batch_buffer, single_buffer, count * SLOT_SIZE) != 0)
+	{
+		fprintf(stderr, "%lu records: the batch differs from the records encrypted one at a time\n", count);
+		ok = false;
+	}
+
+	for (unsigned long i = 0; i < count && ok; i++)
+	{
+		if (batch[i].len >= BLOCKSIZE && memcmp(batch[i].data, plaintext + i * SLOT_SIZE, BLOCKSIZE) == 0)
+		{
+			fprintf(stderr, "%lu records: record %lu wasn't encrypted\n", count, i);
+			ok = false;
+		}
+		for (unsigned long j = batch[i].len; j < SLOT_SIZE && ok; j++)
+			if (batch[i].data[j] != GUARD)
+			{
+				fprintf(stderr, "%lu records: record %lu was written past its end\n", count, i);
+				ok = false;
+			}
+	}
+
+	record_crypt(ctx, batch, count);
+	for (unsigned long i = 0; i < count && ok; i++)
+		if (memcmp(batch[i].data, plaintext + i * SLOT_SIZE, batch[i].len) != 0)
+		{
+			fprintf(stderr, "%lu records: record %lu didn't decrypt\n", count, i);
+			ok = false;
+		}
+
+	free(batch);
+	free(single);
+	free(batch_buffer);
+	free(single_buffer);
+	return ok;
+}
+
+int main(void)
+{
+	const unsigned long count = 20000;
+	unsigned char * plaintext = malloc(count * SLOT_SIZE);
+	unsigned char first[100], second[100];
+	record_key ctx;
+	record pair[2];
+	block salt;
+	bool ok = true;
+
+	memset(&salt, 7, sizeof(salt));
+	record_key_init(&ctx, "recordkey", &salt, 10);
+	srand(1);
+	for (unsigned long i = 0; i < count * SLOT_SIZE; i++)
+		plaintext[i] = rand();
+
+	//a few records are processed on one thread, many of them by the whole team
+	ok = check_batch(&ctx, plaintext, 13) && ok;
+	ok = check_batch(&ctx, plaintext, count) && ok;
+	record_crypt(&ctx, NULL, 0);
+
+	//the same plaintext under two nonces
+	memcpy(first, plaintext, sizeof(first));
+	memcpy(second, plaintext, sizeof(second));
+	pair[0] = (record){first, sizeof(first), {1}};
+	pair[1] = (record){second, sizeof(second), {2}};
+	record_crypt(&ctx, pair, 2);
+	if (memcmp(first, second, sizeof(first)) == 0)
+	{
+		fprintf(stderr, "two nonces gave the same ciphertext\n");
+		ok = false;
+	}
+
+	record_key_clear(&ctx);
+	free(plaintext);
+
+	printf(ok ? "Record tests passed.\n" : "Record tests failed.\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+//Tests of the keystream reservoir behind stream_reserve: a CTR or OFB ciphertext decrypted with a reservoir, of a
+//single block or of many, must give byte for byte what it gives without one, and a stream encrypted with a reservoir
+//must decrypt without one. The stream is fed in slices of random sizes, so the reservoir runs dry and refills often.
+//Usage: reservoir_test
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "common.h"
+#include "stream.h"
+
+#define TEST_KEY "reservoirkey"
+#define TEST_SIZE 300001
+
+//Encrypts or decrypts len bytes of in into out through a stream, with a reservoir of budget bytes (none if 0).
+//Returns the size of the output, or -1 if the stream fails.
+static long run_stream(const enum operation op, const enum mode opmode, const unsigned long budget,
+	unsigned char * out, const unsigned char * in, const unsigned long len)
+{
+	stream_state state;
+	long written = 0;
+	long last;
+	unsigned long n;
+
+	if (stream_init(&state, op, opmode, TEST_KEY) == -1 || (budget > 0 && stream_reserve(&state, budget) == -1))
+		return -1;
+	if (op == enc)
+	{
+		memcpy(out, stream_header(&state), STREAM_HEADER_SIZE);
+		written = STREAM_HEADER_SIZE;
+	}
+
+	srand(budget);
+	for (unsigned long done = 0; done < len; done += n)
+	{
+		n = rand() % 700;
+		if (n > len - done)
+			n = len - done;
+		long produced = stream_update(&state, out + written, in + done, n);
+		if (produced == -1)
+		{
+			stream_release(&state);
+			return -1;
+		}
+		written += produced;
+	}
+
+	last = stream_final(&state, out + written);
+	stream_release(&state);
+	return last == -1 ? -1 : written + last;
+}
+
+int main(void)
+{
+	const enum mode modes[] = {ctr, ofb};
+	const unsigned long budgets[] = {BLOCKSIZE, 4096, 1 << 20};
+	unsigned char * plaintext = malloc(TEST_SIZE);
+	unsigned char * ciphertext = malloc(TEST_SIZE + STREAM_HEADER_SIZE + STREAM_SLACK);
+	unsigned char * reference = malloc(TEST_SIZE + STREAM_SLACK);
+	unsigned char * output = malloc(TEST_SIZE + STREAM_HEADER_SIZE + STREAM_SLACK);
+	stream_state state;
+	bool ok = true;
+
+	srand(1);
+	for (unsigned long i = 0; i < TEST_SIZE; i++)
+		plaintext[i] = rand();
+
+	for (int m = 0; m < 2; m++)
+	{
+		const char * name = modes[m] == ctr ? "ctr" : "ofb";
+		long encrypted = run_stream(enc, modes[m], 0, ciphertext, plaintext, TEST_SIZE);
+		long reference_len = run_stream(dec, modes[m], 0, reference, ciphertext, encrypted);
+
+		if (encrypted == -1 || reference_len != TEST_SIZE || memcmp(reference, plaintext, TEST_SIZE) != 0)
+		{
+			fprintf(stderr, "%s: the stream without a reservoir doesn't round-trip\n", name);
+			ok = false;
+			continue;
+		}
+
+		for (int b = 0; b < 3; b++)
+		{
+			long decrypted = run_stream(dec, modes[m], budgets[b], output, ciphertext, encrypted);
+			if (decrypted != reference_len || memcmp(output, reference, reference_len) != 0)
+			{
+				fprintf(stderr, "%s: decryption with a reservoir of %lu bytes differs from the one without\n", name, budgets[b]);
+				ok = false;
+			}
+
+			long reserved = run_stream(enc, modes[m], budgets[b], ciphertext, plaintext, TEST_SIZE);
+			if (reserved != encrypted || run_stream(dec, modes[m], 0, output, ciphertext, reserved) != TEST_SIZE ||
+				memcmp(output, plaintext, TEST_SIZE) != 0)
+			{
+				fprintf(stderr, "%s: encryption with a reservoir of %lu bytes doesn't decrypt without one\n", name, budgets[b]);
+				ok = false;
+			}
+		}
+	}
+
+	//only the modes whose keystream doesn't depend on the data can have one
+	stream_init(&state, enc, cbc, TEST_KEY);
+	if (stream_reserve(&state, 4096) != -1)
+	{
+		fprintf(stderr, "cbc: a reservoir was accepted\n");
+		ok = false;
+	}
+	stream_release(&state);
+
+	free(plaintext);
+	free(ciphertext);
+	free(reference);
+	free(output);
+
+	printf(ok ? "Reservoir tests passed.\n" : "Reservoir tests failed.\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+//Tests of cfeistel.hpp: round trips through cfeistel::cipher and cfeistel::cipherbuf in every mode of operation, with
+//writes and reads of mixed sizes, and refusal of a wrong key. The ciphertext written through cipherbuf is kept in
+//out.<mode>, for the caller to check that cfeistel dec decrypts it.
+//Usage: stream_test <infile> <key>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cfeistel.hpp"
+
+static const char * mode_names[] = { "cbc", "ecb", "ctr", "ofb", "pcbc", "cfb" };
+
+//Encrypts or decrypts in with cipher::update, in slices of random sizes
+static std::vector<unsigned char> transform_spans(enum operation op, enum mode opmode, const std::string & key,
+	const std::vector<unsigned char> & in, std::mt19937 & sizes)
+{
+	cfeistel::cipher engine(op, opmode, key);
+	std::vector<unsigned char> out;
+	std::vector<unsigned char> buffer;
+
+	if (op == enc)
+		out.assign(engine.header().begin(), engine.header().end());
+	for (std::size_t done = 0; done < in.size();)
+	{
+		std::size_t n = std::min<std::size_t>(in.size() - done, sizes() % 5000);
+		buffer.resize(n + cfeistel::cipher::slack);
+		std::size_t written = engine.update({ in.data() + done, n }, buffer);
+		out.insert(out.end(), buffer.begin(), buffer.begin() + written);
+		done += n;
+	}
+	buffer.resize(cfeistel::cipher::slack);
+	std::size_t written = engine.final(buffer);
+	out.insert(out.end(), buffer.begin(), buffer.begin() + written);
+	return out;
+}
+
+int main(int argc, char * argv[])
+{
+	if (argc != 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " <infile> <key>\n";
+		return 1;
+	}
+
+	std::ifstream input(argv[1], std::ios::binary);
+	const std::string data((std::istreambuf_iterator<char>(input)), {});
+	const std::vector<unsigned char> plaintext(data.begin(), data.end());
+	const std::string key = argv[2];
+	std::mt19937 sizes(1);
+	bool ok = true;
+
+	for (int m = cbc; m <= cfb; m++)
+	{
+		enum mode opmode = (enum mode)m;
+		std::string name = mode_names[m];
+
+		try
+		{
+			//spans: the ciphertext decrypts back to the plaintext
+			std::vector<unsigned char> ciphertext = transform_spans(enc, opmode, key, plaintext, sizes);
+			if (transform_spans(dec, opmode, key, ciphertext, sizes) != plaintext)
+			{
+				std::cerr << name << ": cipher round trip failed\n";
+				ok = false;
+			}
+
+			//writing through a cipherbuf, one byte, a few bytes and more than its buffer at a time
+			{
+				std::ofstream out("out." + name, std::ios::binary);
+				cfeistel::cipherbuf encrypting(out.rdbuf(), enc, opmode, key, 4096);
+				std::ostream stream(&encrypting);
+				for (std::size_t done = 0, k = 0; done < data.size(); k++)
+				{
+					std::size_t n = std::min<std::size_t>(data.size() - done, k % 3 == 0 ? 1 : k % 3 == 1 ? 37 : 10000);
+					stream.write(data.data() + done, n);
+					done += n;
+				}
+				stream.flush();
+				encrypting.finish();
+			}
+
+			//reading through a cipherbuf with a buffer that isn't a multiple of the block size
+			std::ifstream in("out." + name, std::ios::binary);
+			cfeistel::cipherbuf decrypting(in.rdbuf(), dec, opmode, key, 333);
+			std::istream stream(&decrypting);
+			std::ostringstream decrypted;
+			decrypted << stream.rdbuf();
+			if (decrypted.str() != data)
+			{
+				std::cerr << name << ": cipherbuf round trip failed\n";
+				ok = false;
+			}
+
+			//a wrong key is refused as soon as the header is read
+			try
+			{
+				transform_spans(dec, opmode, "wrong" + key, ciphertext, sizes);
+				std::cerr << name << ": a wrong key was accepted\n";
+				ok = false;
+			}
+			catch (std::runtime_error &) {}
+		}
+		catch (std::exception & e)
+		{
+			std::cerr << name << ": " << e.what() << "\n";
+			ok = false;
+		}
+	}
+
+	std::cout << (ok ? "Stream tests passed.\n" : "Stream tests failed.\n");
+	return ok ? 0 : 1;
+}